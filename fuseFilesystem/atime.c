@@ -0,0 +1,146 @@
+/**
+ * @file atime.c
+ *
+ * The atimes waiting to be written, see helpers/atime.h.
+ *
+ * Split into sets of ATIME_WAYS entries picked by inum, like the dcache.
+ * A set with no room asks for a write back instead of dropping anything.
+ * One mutex covers the table, and it is only taken when a read moves an
+ * atime or something is waiting: with none waiting, stat and inode_touch
+ * only load the count.
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "helpers/atime.h"
+
+// 1024 entries, four times ATIME_BATCH so a set is rarely full first.
+#define ATIME_SETS 256
+#define ATIME_WAYS 4
+
+typedef struct atime_entry {
+  int inum;      // -1 for an unused entry
+  int64_t atime; // what a read moved it to
+} atime_entry_t;
+
+static atime_entry_t entries[ATIME_SETS][ATIME_WAYS] = {
+    [0 ... ATIME_SETS - 1] = {[0 ... ATIME_WAYS - 1] = {-1, 0}}};
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic int count;
+static int64_t oldest; // when the first of those waiting was noted
+
+// Whether relatime moves an atime for a read at now.
+static int due(int64_t atime, inode_t *node, int64_t now) {
+  return atime <= node->mtime || atime <= node->ctime ||
+         now - atime >= ATIME_RELATIME;
+}
+
+// Whether a waiting atime still counts for the inode.
+static int valid(atime_entry_t *entry, inode_t *node) {
+  return entry->atime > node->atime && entry->atime > node->ctime;
+}
+
+static atime_entry_t *find(int inum) {
+  atime_entry_t *set = entries[inum % ATIME_SETS];
+  for (int i = 0; i < ATIME_WAYS; ++i) {
+    if (set[i].inum == inum) {
+      return &set[i];
+    }
+  }
+  return NULL;
+}
+
+int atime_note(int inum, inode_t *node, int64_t now) {
+  if (!due(node->atime, node, now)) {
+    return 0;
+  }
+  pthread_mutex_lock(&lock);
+  atime_entry_t *entry = find(inum);
+  if (entry == NULL) {
+    atime_entry_t *set = entries[inum % ATIME_SETS];
+    for (int i = 0; i < ATIME_WAYS && entry == NULL; ++i) {
+      if (set[i].inum == -1) {
+        entry = &set[i];
+        entry->inum = inum;
+        entry->atime = 0;
+        if (atomic_fetch_add(&count, 1) == 0) {
+          oldest = now;
+        }
+      }
+    }
+  }
+  int full = entry == NULL;
+  if (entry != NULL && (!valid(entry, node) || due(entry->atime, node, now))) {
+    entry->atime = now;
+  }
+  int write_back = full || atomic_load(&count) >= ATIME_BATCH ||
+                   now - oldest >= (int64_t) ATIME_INTERVAL * 1000000000;
+  pthread_mutex_unlock(&lock);
+  return write_back;
+}
+
+int64_t atime_get(int inum, inode_t *node) {
+  int64_t atime = node->atime;
+  if (atomic_load(&count) == 0) {
+    return atime;
+  }
+  pthread_mutex_lock(&lock);
+  atime_entry_t *entry = find(inum);
+  if (entry != NULL && valid(entry, node)) {
+    atime = entry->atime;
+  }
+  pthread_mutex_unlock(&lock);
+  return atime;
+}
+
+int64_t atime_forget(int inum, inode_t *node) {
+  int64_t atime = node->atime;
+  if (atomic_load(&count) == 0) {
+    return atime;
+  }
+  pthread_mutex_lock(&lock);
+  atime_entry_t *entry = find(inum);
+  if (entry != NULL) {
+    if (valid(entry, node)) {
+      atime = entry->atime;
+    }
+    entry->inum = -1;
+    atomic_fetch_sub(&count, 1);
+  }
+  pthread_mutex_unlock(&lock);
+  return atime;
+}
+
+int atime_take(int *inums, int64_t *times, int max) {
+  if (atomic_load(&count) == 0) {
+    return 0;
+  }
+  int taken = 0;
+  pthread_mutex_lock(&lock);
+  for (int s = 0; s < ATIME_SETS && taken < max; ++s) {
+    for (int i = 0; i < ATIME_WAYS && taken < max; ++i) {
+      atime_entry_t *entry = &entries[s][i];
+      if (entry->inum != -1) {
+        inums[taken] = entry->inum;
+        times[taken] = entry->atime;
+        ++taken;
+        entry->inum = -1;
+      }
+    }
+  }
+  atomic_fetch_sub(&count, taken);
+  pthread_mutex_unlock(&lock);
+  return taken;
+}
+
+void atime_clear() {
+  pthread_mutex_lock(&lock);
+  for (int s = 0; s < ATIME_SETS; ++s) {
+    for (int i = 0; i < ATIME_WAYS; ++i) {
+      entries[s][i].inum = -1;
+    }
+  }
+  atomic_store(&count, 0);
+  pthread_mutex_unlock(&lock);
+}
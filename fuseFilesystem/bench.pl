@@ -0,0 +1,293 @@
+#!/usr/bin/perl
+# Mounted benchmarks: runs workloads against a nufs mounted on a scratch
+# image, so what they time includes the trip through the kernel and FUSE.
+#
+# usage: perl bench.pl [--files n] [--entries n,...] [--size bytes]
+#                      [--ops n] [--clients n] [--out file]
+#
+# Mounts nufs_ll instead when NUFS_LL is set, like test.pl. Every op gets a
+# latency histogram (power of two buckets, in microseconds) along with its
+# median and 99th percentile, ops per second and, for reads and writes,
+# megabytes per second. Results are written as JSON, one per line, to
+# bench_mount.json unless --out says otherwise.
+use 5.16.0;
+use warnings FATAL => 'all';
+
+use Fcntl qw(O_CREAT O_RDONLY O_RDWR O_WRONLY SEEK_SET);
+use Getopt::Long;
+use List::Util qw(sum);
+use POSIX qw(_exit);
+use Time::HiRes qw(time);
+
+my $files = 2000;          # create/stat/unlink storm
+my $entries = "1000,10000"; # directory sizes listed like ls -l
+my $size = 64 << 20;       # the file read and written in order
+my $ops = 2000;            # random reads and writes, and ops per client
+my $clients = 4;
+my $out = "bench_mount.json";
+GetOptions("files=i" => \$files, "entries=s" => \$entries,
+           "size=i" => \$size, "ops=i" => \$ops, "clients=i" => \$clients,
+           "out=s" => \$out)
+    or die "usage: perl bench.pl [--files n] [--entries n,...] [--size bytes] " .
+           "[--ops n] [--clients n] [--out file]\n";
+
+my $image = "bench.nufs";
+my $chunk = 128 * 1024; # what FUSE sends per write
+my $nufs_pid;
+
+sub mount {
+    mkdir("mnt");
+    my $dev = (stat("mnt"))[0];
+    $nufs_pid = fork();
+    if ($nufs_pid == 0) {
+        open(STDOUT, ">>", "bench.log");
+        open(STDERR, ">&", \*STDOUT);
+        my @nufs = $ENV{NUFS_LL} ? ("./nufs_ll", "-f")
+                                 : ("./nufs", "-f", "-o", "hard_remove");
+        exec(@nufs, "mnt", $image) or _exit(1);
+    }
+    # Mounted once mnt is on another device.
+    for (1..100) {
+        return if (stat("mnt"))[0] != $dev;
+        select(undef, undef, undef, 0.05);
+    }
+    die "nufs didn't mount, see bench.log\n";
+}
+
+sub unmount {
+    system("fusermount -u mnt");
+    # The image is only free for the next mount once nufs is gone.
+    waitpid($nufs_pid, 0);
+}
+
+# Remounts, so reads come from nufs rather than the kernel's page cache.
+sub remount {
+    unmount();
+    mount();
+}
+
+# Latencies in seconds of each op, by op name, and how long and how many
+# bytes each op's workload took as a whole.
+my %times;
+my %wall;
+my %bytes;
+my @order;
+
+# Times one call of code as an op, returning what it returned.
+sub timed {
+    my ($op, $code) = @_;
+    push(@order, $op) unless $times{$op};
+    my $start = time();
+    my $rv = $code->();
+    push(@{$times{$op}}, time() - $start);
+    return $rv;
+}
+
+# Times a whole workload, so ops per second covers the gaps between ops.
+# Ops left out of every workload count only their own time.
+sub workload {
+    my ($ops, $code) = @_;
+    my $start = time();
+    $code->();
+    my $took = time() - $start;
+    $wall{$_} += $took for @$ops;
+}
+
+sub write_file {
+    my ($path, $data) = @_;
+    open(my $fh, ">", $path) or die "$path: $!\n";
+    print $fh $data;
+    close($fh);
+}
+
+sub percentile {
+    my ($sorted, $pct) = @_;
+    return $sorted->[int(@$sorted * $pct / 100)];
+}
+
+sub result {
+    my ($op) = @_;
+    my @sorted = sort { $a <=> $b } @{$times{$op}};
+    my $count = @sorted;
+    my $wall = $wall{$op} // sum(@sorted);
+    # Bucket b counts ops that took up to 2^b microseconds.
+    my @buckets;
+    for my $t (@sorted) {
+        my $us = $t * 1e6;
+        my $b = 0;
+        $b++ while (1 << $b) < $us;
+        $buckets[$b]++;
+    }
+    my @histogram = map { sprintf("[%d, %d]", 1 << $_, $buckets[$_] || 0) }
+                    grep { $buckets[$_] } 0..$#buckets;
+    my $line = sprintf("{\"op\": \"%s\", \"count\": %d, \"ops_per_sec\": %.1f, " .
+                       "\"p50_us\": %.1f, \"p99_us\": %.1f",
+                       $op, $count, $count / $wall,
+                       percentile(\@sorted, 50) * 1e6, percentile(\@sorted, 99) * 1e6);
+    $line .= sprintf(", \"mb_per_sec\": %.1f", $bytes{$op} / $wall / (1 << 20))
+        if $bytes{$op};
+    return $line . ", \"histogram_us\": [" . join(", ", @histogram) . "]}";
+}
+
+system("rm -f $image bench.log");
+system("(./mkfs.nufs -N 65536 $image 4G 2>&1) >> bench.log") == 0
+    or die "can't make $image, see bench.log\n";
+mount();
+
+say "# create/stat/unlink storm";
+
+mkdir("mnt/storm");
+workload(["create"], sub {
+    for my $ii (1..$files) {
+        timed("create", sub {
+            open(my $fh, ">", "mnt/storm/f$ii") or die "create: $!\n";
+            close($fh);
+        });
+    }
+});
+workload(["stat"], sub {
+    timed("stat", sub { stat("mnt/storm/f$_") }) for 1..$files;
+});
+workload(["unlink"], sub {
+    timed("unlink", sub { unlink("mnt/storm/f$_") }) for 1..$files;
+});
+
+say "# ls -l";
+
+for my $count (split(/,/, $entries)) {
+    my $dir = "mnt/ls$count";
+    mkdir($dir);
+    write_file("$dir/f$_", "") for 1..$count;
+    my $op = "ls_l_$count";
+    workload([$op], sub {
+        for (1..5) {
+            timed($op, sub {
+                opendir(my $dh, $dir) or die "$dir: $!\n";
+                lstat("$dir/$_") for readdir($dh);
+                closedir($dh);
+            });
+        }
+    });
+}
+
+say "# sequential";
+
+my $block = "x" x $chunk;
+workload(["seq_write"], sub {
+    sysopen(my $fh, "mnt/seq", O_WRONLY | O_CREAT) or die "seq: $!\n";
+    for (my $done = 0; $done < $size; $done += $chunk) {
+        my $len = $size - $done < $chunk ? $size - $done : $chunk;
+        timed("seq_write", sub { syswrite($fh, $block, $len) });
+    }
+    close($fh);
+});
+$bytes{seq_write} = $size;
+remount();
+workload(["seq_read"], sub {
+    sysopen(my $fh, "mnt/seq", O_RDONLY) or die "seq: $!\n";
+    my $buf;
+    while (timed("seq_read", sub { sysread($fh, $buf, $chunk) })) {}
+    close($fh);
+});
+$bytes{seq_read} = $size;
+
+say "# random";
+
+srand(1);
+my $page = "r" x 4096;
+my $pages = int($size / 4096);
+workload(["rand_write"], sub {
+    sysopen(my $fh, "mnt/seq", O_RDWR) or die "seq: $!\n";
+    for (1..$ops) {
+        my $at = int(rand($pages)) * 4096;
+        timed("rand_write", sub { sysseek($fh, $at, SEEK_SET); syswrite($fh, $page) });
+    }
+    close($fh);
+});
+$bytes{rand_write} = $ops * 4096;
+remount();
+workload(["rand_read"], sub {
+    sysopen(my $fh, "mnt/seq", O_RDONLY) or die "seq: $!\n";
+    my $buf;
+    for (1..$ops) {
+        my $at = int(rand($pages)) * 4096;
+        timed("rand_read", sub { sysseek($fh, $at, SEEK_SET); sysread($fh, $buf, 4096) });
+    }
+    close($fh);
+});
+$bytes{rand_read} = $ops * 4096;
+unlink("mnt/seq");
+
+say "# untar";
+
+# A source tree's worth of directories and small files, like unpacking one.
+srand(2);
+workload(["untar_file"], sub {
+    for my $aa (1..10) {
+        timed("untar_mkdir", sub { mkdir("mnt/tree$aa") });
+        for my $bb (1..10) {
+            my $dir = "mnt/tree$aa/sub$bb";
+            timed("untar_mkdir", sub { mkdir($dir) });
+            for my $cc (1..10) {
+                my $data = "t" x int(rand(16384));
+                timed("untar_file", sub { write_file("$dir/file$cc.c", $data) });
+                $bytes{untar_file} += length($data);
+            }
+        }
+    }
+});
+
+say "# concurrent clients";
+
+# Each client writes, reads back and deletes its own files, sending its
+# latencies back through a pipe.
+my @pipes;
+my $start = time();
+for my $ii (1..$clients) {
+    my $pid = open(my $from, "-|") // die "fork: $!\n";
+    if ($pid == 0) {
+        mkdir("mnt/client$ii");
+        my $data = "c" x 16384;
+        for my $jj (1..$ops) {
+            my $path = "mnt/client$ii/f$jj";
+            my $t = time();
+            write_file($path, $data);
+            say "client_write ", time() - $t;
+            $t = time();
+            open(my $fh, "<", $path) or die "$path: $!\n";
+            my $back = do { local $/; <$fh> };
+            close($fh);
+            say "client_read ", time() - $t;
+            $t = time();
+            unlink($path);
+            say "client_unlink ", time() - $t;
+        }
+        close(STDOUT);
+        _exit(0);
+    }
+    push(@pipes, $from);
+}
+for my $from (@pipes) {
+    while (my $line = <$from>) {
+        my ($op, $t) = split(" ", $line);
+        push(@order, $op) unless $times{$op};
+        push(@{$times{$op}}, $t);
+    }
+    close($from);
+}
+my $took = time() - $start;
+$wall{$_} = $took for qw(client_write client_read client_unlink);
+$bytes{$_} = $clients * $ops * 16384 for qw(client_write client_read);
+
+unmount();
+system("rm -f $image");
+
+open(my $json, ">", $out) or die "$out: $!\n";
+say $json "{";
+say $json "  \"front_end\": \"" . ($ENV{NUFS_LL} ? "nufs_ll" : "nufs") . "\",";
+say $json "  \"results\": [";
+say $json join(",\n", map { "    " . result($_) } @order);
+say $json "  ]";
+say $json "}";
+close($json);
+say "# results in $out";
@@ -6,6 +6,7 @@
  */
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "helpers/bitmap.h"
 
@@ -47,3 +48,186 @@ void bitmap_print(void *bm, int size) {
     }
   }
 }
+
+// Bits of a word at or above bit n.
+#define bits_from(n) (~0ULL << (n))
+
+// Word w of the bitmap with the bits past the end set.
+static uint64_t used_word(bitmap_alloc_t *ba, long w) {
+  uint64_t word = ba->words[w];
+  if (w == ba->nwords - 1 && ba->bits % 64 != 0) {
+    word |= bits_from(ba->bits % 64);
+  }
+  return word;
+}
+
+// Bring both summary levels up to date for word w of the bitmap.
+static void summarize(bitmap_alloc_t *ba, long w) {
+  long g = w / 64;
+  if (used_word(ba, w) != ~0ULL) {
+    ba->free_words[g] |= 1ULL << (w % 64);
+  } else {
+    ba->free_words[g] &= ~(1ULL << (w % 64));
+  }
+  if (ba->free_words[g] != 0) {
+    ba->free_groups[g / 64] |= 1ULL << (g % 64);
+  } else {
+    ba->free_groups[g / 64] &= ~(1ULL << (g % 64));
+  }
+}
+
+int bitmap_alloc_init(bitmap_alloc_t *ba, void *bm, long bits) {
+  ba->words = bm;
+  ba->bits = bits;
+  ba->nwords = (bits + 63) / 64;
+  long ngroups = (ba->nwords + 63) / 64;
+  ba->free_words = calloc(ngroups, sizeof(uint64_t));
+  ba->free_groups = calloc((ngroups + 63) / 64, sizeof(uint64_t));
+  ba->hint = 0;
+  ba->scanned = 0;
+  if (ba->free_words == NULL || ba->free_groups == NULL) {
+    bitmap_alloc_free(ba);
+    return -1;
+  }
+  ba->free = 0;
+  for (long w = 0; w < ba->nwords; ++w) {
+    summarize(ba, w);
+    ba->free += 64 - __builtin_popcountll(used_word(ba, w));
+  }
+  return 0;
+}
+
+void bitmap_alloc_free(bitmap_alloc_t *ba) {
+  free(ba->free_words);
+  free(ba->free_groups);
+  ba->free_words = NULL;
+  ba->free_groups = NULL;
+}
+
+void bitmap_alloc_put(bitmap_alloc_t *ba, long i, int v) {
+  if (bitmap_get(ba->words, i) != v) {
+    ba->free += v ? -1 : 1;
+  }
+  bitmap_put(ba->words, i, v);
+  summarize(ba, i / 64);
+}
+
+// First word at or after w with a clear bit, or -1.
+static long next_free_word(bitmap_alloc_t *ba, long w) {
+  if (w >= ba->nwords) {
+    return -1;
+  }
+  long g = w / 64;
+  uint64_t in_group = ba->free_words[g] & bits_from(w % 64);
+  if (in_group != 0) {
+    return g * 64 + __builtin_ctzll(in_group);
+  }
+  // Nothing left in this group, find the next group with a free word.
+  long ngroups = (ba->nwords + 63) / 64;
+  for (long next = g + 1; next < ngroups; next = (next | 63) + 1) {
+    ++ba->scanned;
+    uint64_t groups = ba->free_groups[next / 64] & bits_from(next % 64);
+    if (groups != 0) {
+      g = next / 64 * 64 + __builtin_ctzll(groups);
+      return g * 64 + __builtin_ctzll(ba->free_words[g]);
+    }
+  }
+  return -1;
+}
+
+// First clear bit in [from, bits), or -1.
+static long next_clear(bitmap_alloc_t *ba, long from) {
+  if (from >= ba->bits) {
+    return -1;
+  }
+  long w = from / 64;
+  ++ba->scanned;
+  uint64_t clear = ~used_word(ba, w) & bits_from(from % 64);
+  if (clear == 0) {
+    w = next_free_word(ba, w + 1);
+    if (w == -1) {
+      return -1;
+    }
+    clear = ~used_word(ba, w);
+  }
+  return w * 64 + __builtin_ctzll(clear);
+}
+
+// How many clear bits in a row start at from, looking no further than max.
+static long clear_run(bitmap_alloc_t *ba, long from, long max) {
+  long run = 0;
+  while (run < max && from + run < ba->bits) {
+    long at = from + run;
+    ++ba->scanned;
+    uint64_t used = used_word(ba, at / 64) >> (at % 64);
+    long here = used == 0 ? 64 - at % 64 : __builtin_ctzll(used);
+    run += here;
+    if (used != 0) {
+      break;
+    }
+  }
+  return run < max ? run : max;
+}
+
+// Set count clear bits starting at from, a word at a time.
+static void set_run(bitmap_alloc_t *ba, long from, long count) {
+  long end = from + count;
+  ba->free -= count;
+  while (from < end) {
+    long w = from / 64;
+    long last = end < (w + 1) * 64 ? end : (w + 1) * 64;
+    uint64_t mask = bits_from(from % 64);
+    if (last % 64 != 0) {
+      mask &= ~bits_from(last % 64);
+    }
+    ba->words[w] |= mask;
+    summarize(ba, w);
+    from = last;
+  }
+  ba->hint = end < ba->bits ? end : 0;
+}
+
+long bitmap_alloc_first(bitmap_alloc_t *ba, long goal, int max, int *got) {
+  if (goal < 0 || goal >= ba->bits) {
+    goal = ba->hint;
+  }
+  long first = next_clear(ba, goal);
+  if (first == -1) {
+    first = next_clear(ba, 0);
+  }
+  if (first == -1) {
+    if (got != NULL) {
+      *got = 0;
+    }
+    return -1;
+  }
+  long count = clear_run(ba, first, max);
+  set_run(ba, first, count);
+  if (got != NULL) {
+    *got = count;
+  }
+  return first;
+}
+
+long bitmap_alloc_run(bitmap_alloc_t *ba, long goal, int count) {
+  if (goal < 0 || goal >= ba->bits) {
+    goal = ba->hint;
+  }
+  // Look from goal to the end, then from the start back round to goal.
+  long from = goal;
+  long end = ba->bits;
+  for (int pass = 0; pass < 2; ++pass) {
+    for (long at = next_clear(ba, from); at != -1 && at < end;
+         at = next_clear(ba, from)) {
+      long run = clear_run(ba, at, count);
+      if (run == count) {
+        set_run(ba, at, count);
+        return at;
+      }
+      from = at + run;
+    }
+    from = 0;
+    end = goal;
+  }
+  return -1;
+}
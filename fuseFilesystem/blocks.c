@@ -10,8 +10,11 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/file.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -19,12 +22,47 @@
 
 #include "helpers/bitmap.h"
 #include "helpers/blocks.h"
+#include "helpers/extent.h"
+#include "helpers/journal.h"
+#include "helpers/snapshot.h"
+#include "helpers/stats.h"
+#include "helpers/trace.h"
 
 static int blocks_fd = -1;
+
+// Guards both bitmaps and the image size, see alloc_lock.
+static pthread_mutex_t alloc_mutex = PTHREAD_MUTEX_INITIALIZER;
 static void *blocks_base = 0;
+static size_t blocks_size = 0;     // bytes of the image that are mapped
+static size_t blocks_reserved = 0; // bytes of address space held for growing
+
+// Allocators over the two bitmaps, set up by blocks_init.
+static bitmap_alloc_t block_alloc;
+static bitmap_alloc_t inode_alloc;
+
+// Where the inodes are, the live ones unless a snapshot is mounted.
+static int inode_bitmap_at;
+static int inode_table_at;
+static int read_only = 0;
+
+// Guards the counts of shared blocks. free_block takes it, and so may
+// the tree of counts while blocks_share holds it.
+static pthread_mutex_t refs_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+// Blocks the dedup index may hand out, a bit each, or NULL when the image
+// doesn't deduplicate. Guarded by refs_mutex as well.
+static void *dedup_marks = NULL;
+
+// Owner counts kept in a block of them.
+#define REFS_PER_BLOCK (BLOCK_SIZE / (int) sizeof(uint16_t))
+
+// Most extra owners dedup gives a block. Each snapshot shares a block once
+// for every owner it has, so with every snapshot taken the count still
+// fits in 16 bits.
+#define DEDUP_MAX_OWNERS (UINT16_MAX / (SNAP_MAX + 1) - 1)
 
 // Get the number of blocks needed to store the given number of bytes.
-int bytes_to_blocks(int bytes) {
+int bytes_to_blocks(int64_t bytes) {
   int quo = bytes / BLOCK_SIZE;
   int rem = bytes % BLOCK_SIZE;
   if (rem == 0) {
@@ -34,64 +72,570 @@ int bytes_to_blocks(int bytes) {
   }
 }
 
-// Load and initialize the given disk image.
-void blocks_init(const char *image_path) {
-  blocks_fd = open(image_path, O_CREAT | O_RDWR, 0644);
-  assert(blocks_fd != -1);
+// Number of blocks needed for a bitmap with the given number of bits.
+static int bitmap_blocks(int bits, int block_size) {
+  int bytes = (bits + 7) / 8;
+  return (bytes + block_size - 1) / block_size;
+}
 
-  // make sure the disk image is exactly 1MB
-  int rv = ftruncate(blocks_fd, NUFS_SIZE);
-  assert(rv == 0);
+// Most blocks a growable image may ever have.
+static long max_blocks(superblock_t *sb) {
+  long most = MAX_GROW_SIZE / sb->block_size;
+  if (most > 0x7fffffff) {
+    most = 0x7fffffff;
+  }
+  if (sb->max_block_count > 0 && sb->max_block_count < most) {
+    most = sb->max_block_count;
+  }
+  return most < sb->block_count ? sb->block_count : most;
+}
+
+// Write a fresh superblock and empty bitmaps to the given disk image.
+int blocks_format(const char *image_path, int block_size, int block_count,
+                  int inode_count, int inode_blocks) {
+  // block sizes must be a power of two in range
+  if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE ||
+      (block_size & (block_size - 1)) != 0 || inode_count < 1) {
+    return -1;
+  }
+
+  superblock_t sb = {0};
+  sb.magic = NUFS_MAGIC;
+  sb.version = NUFS_VERSION;
+  sb.block_size = block_size;
+  sb.block_count = block_count;
+  sb.inode_count = inode_count;
+  sb.block_bitmap_start = 1;
+  sb.block_bitmap_blocks = bitmap_blocks(block_count, block_size);
+  sb.inode_bitmap_start = sb.block_bitmap_start + sb.block_bitmap_blocks;
+  sb.inode_table_start =
+      sb.inode_bitmap_start + bitmap_blocks(inode_count, block_size);
+  sb.journal_start = sb.inode_table_start + inode_blocks;
+  sb.journal_blocks = journal_blocks_for(block_count);
+  sb.data_start = sb.journal_start + sb.journal_blocks;
+  extent_init(&sb.block_refs);
+
+  // there has to be room for at least one data block
+  if (block_count < 0 || sb.data_start >= (uint32_t) block_count) {
+    return -1;
+  }
 
-  // map the image to memory
-  blocks_base =
-      mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, blocks_fd, 0);
+  int fd = open(image_path, O_CREAT | O_RDWR, 0644);
+  if (fd == -1) {
+    return -1;
+  }
+  // throw away old contents, leaving a sparse zero-filled image
+  int rv = ftruncate(fd, 0);
+  if (rv == 0) {
+    rv = ftruncate(fd, (off_t) block_size * block_count);
+  }
+  if (rv == 0 && pwrite(fd, &sb, sizeof(sb), 0) != sizeof(sb)) {
+    rv = -1;
+  }
+  close(fd);
+  if (rv != 0 || blocks_init(image_path) != 0) {
+    return -1;
+  }
+
+  // the superblock, bitmaps, inode table and journal are never handed out
+  journal_start();
+  alloc_lock();
+  for (uint32_t ii = 0; ii < sb.data_start; ++ii) {
+    bitmap_alloc_put(&block_alloc, ii, 1);
+  }
+  journal_dirty_bits(get_blocks_bitmap(), 0, sb.data_start);
+  alloc_unlock();
+  journal_stop();
+  blocks_free();
+  return 0;
+}
+
+// Load the given disk image, taking its geometry from the superblock.
+int blocks_init(const char *image_path) {
+  blocks_fd = open(image_path, O_RDWR);
+  if (blocks_fd == -1) {
+    return -1;
+  }
+  // wait for anyone else using the image to finish writing it back
+  flock(blocks_fd, LOCK_EX);
+
+  // the superblock itself may be in the journal
+  superblock_t sb;
+  struct stat st;
+  int ok = pread(blocks_fd, &sb, sizeof(sb), 0) == sizeof(sb) &&
+           sb.magic == NUFS_MAGIC && sb.version == NUFS_VERSION &&
+           (sb.features & ~SUPER_FEATURES) == 0 &&
+           journal_recover(blocks_fd, &sb) == 0;
+  if (!ok || pread(blocks_fd, &sb, sizeof(sb), 0) != sizeof(sb) ||
+      fstat(blocks_fd, &st) != 0 ||
+      st.st_size < (off_t) sb.block_size * sb.block_count) {
+    close(blocks_fd);
+    blocks_fd = -1;
+    return -1;
+  }
+
+  // map the image to memory, holding on to enough address space behind it
+  // that growing never has to move blocks that are in use. Changes stay in
+  // memory until the journal writes them back.
+  blocks_size = (size_t) sb.block_size * sb.block_count;
+  blocks_reserved = blocks_size;
+  if (sb.grow_blocks > 0) {
+    blocks_reserved = (size_t) sb.block_size * max_blocks(&sb);
+  }
+  blocks_base = mmap(0, blocks_reserved, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
   assert(blocks_base != MAP_FAILED);
+  void *base = mmap(blocks_base, blocks_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_FIXED, blocks_fd, 0);
+  assert(base == blocks_base);
+  int rv = journal_open(blocks_fd);
+  assert(rv == 0);
+  inode_bitmap_at = sb.inode_bitmap_start;
+  inode_table_at = sb.inode_table_start;
+  read_only = 0;
+
+  if (sb.features & SUPER_DEDUP) {
+    dedup_marks = calloc(blocks_reserved / sb.block_size / 8 + 1, 1);
+    assert(dedup_marks != NULL);
+  }
 
-  // block 0 stores the block bitmap and the inode bitmap
-  void *bbm = get_blocks_bitmap();
-  bitmap_put(bbm, 0, 1);
+  rv = bitmap_alloc_init(&block_alloc, get_blocks_bitmap(), sb.block_count);
+  assert(rv == 0);
+  rv = bitmap_alloc_init(&inode_alloc, get_inode_bitmap(), sb.inode_count);
+  assert(rv == 0);
+  // the counts were just taken from the bitmaps, which are always right
+  alloc_lock();
+  alloc_unlock();
+  return 0;
 }
 
-// Close the disk image.
+// Commit what's left in the journal and close the disk image.
 void blocks_free() {
-  int rv = munmap(blocks_base, NUFS_SIZE);
+  journal_close();
+  bitmap_alloc_free(&block_alloc);
+  bitmap_alloc_free(&inode_alloc);
+  free(dedup_marks);
+  dedup_marks = NULL;
+  int rv = munmap(blocks_base, blocks_reserved);
   assert(rv == 0);
+  close(blocks_fd);
+  blocks_fd = -1;
+  blocks_base = 0;
 }
 
+// Return a pointer to the superblock at the start of block 0.
+superblock_t *get_superblock() { return blocks_base; }
+
 // Get the given block, returning a pointer to its start.
-void *blocks_get_block(int bnum) { return blocks_base + BLOCK_SIZE * bnum; }
+void *blocks_get_block(int bnum) {
+  return blocks_base + (size_t) BLOCK_SIZE * bnum;
+}
+
+// Read file data from the image.
+int blocks_read(int bnum, size_t offset, void *buf, size_t size) {
+  off_t pos = (off_t) BLOCK_SIZE * bnum + offset;
+  for (size_t done = 0; done < size;) {
+    ssize_t got = pread(blocks_fd, (char *) buf + done, size - done, pos + done);
+    if (got <= 0) {
+      return -EIO;
+    }
+    done += got;
+  }
+  return 0;
+}
+
+// Write to the image at pos.
+static int write_at(off_t pos, const void *buf, size_t size) {
+  for (size_t done = 0; done < size;) {
+    ssize_t put = pwrite(blocks_fd, (const char *) buf + done, size - done, pos + done);
+    if (put <= 0) {
+      return put < 0 && errno == ENOSPC ? -ENOSPC : -EIO;
+    }
+    done += put;
+  }
+  return 0;
+}
+
+// Blocks touched by size bytes at offset into bnum, for fsync.
+static void data_dirty(int bnum, size_t offset, size_t size) {
+  if (size > 0) {
+    journal_dirty_data(bnum + offset / BLOCK_SIZE,
+                       (offset + size - 1) / BLOCK_SIZE - offset / BLOCK_SIZE + 1);
+  }
+}
+
+// Write file data to the image.
+int blocks_write(int bnum, size_t offset, const void *buf, size_t size) {
+  if (read_only) {
+    return -EROFS;
+  }
+  data_dirty(bnum, offset, size);
+  return write_at((off_t) BLOCK_SIZE * bnum + offset, buf, size);
+}
+
+// Zero file data, with a hole if the host file system can make one.
+int blocks_zero(int bnum, size_t offset, size_t size) {
+  static const char zeros[MAX_BLOCK_SIZE];
+  off_t pos = (off_t) BLOCK_SIZE * bnum + offset;
+  if (read_only) {
+    return -EROFS;
+  }
+  data_dirty(bnum, offset, size);
+  if (size == 0 ||
+      fallocate(blocks_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, size) == 0) {
+    return 0;
+  }
+  for (size_t done = 0; done < size;) {
+    size_t len = size - done < sizeof(zeros) ? size - done : sizeof(zeros);
+    int rv = write_at(pos + done, zeros, len);
+    if (rv < 0) {
+      return rv;
+    }
+    done += len;
+  }
+  return 0;
+}
+
+// Copy count blocks of file data, letting the host share it if it can.
+int blocks_copy(int to, int from, int count) {
+  if (read_only) {
+    return -EROFS;
+  }
+  off_t in = (off_t) BLOCK_SIZE * from;
+  off_t out = (off_t) BLOCK_SIZE * to;
+  size_t left = (size_t) BLOCK_SIZE * count;
+  data_dirty(to, 0, left);
+  while (left > 0) {
+    ssize_t done = copy_file_range(blocks_fd, &in, blocks_fd, &out, left, 0);
+    if (done <= 0) {
+      break;
+    }
+    left -= done;
+  }
+  // the host can't, or stopped part way
+  char buf[MAX_BLOCK_SIZE];
+  while (left > 0) {
+    size_t len = left < (size_t) BLOCK_SIZE ? left : (size_t) BLOCK_SIZE;
+    if (pread(blocks_fd, buf, len, in) != (ssize_t) len) {
+      return -EIO;
+    }
+    int rv = write_at(out, buf, len);
+    if (rv < 0) {
+      return rv;
+    }
+    in += len;
+    out += len;
+    left -= len;
+  }
+  return 0;
+}
 
 // Return a pointer to the beginning of the block bitmap.
-// The size is BLOCK_BITMAP_SIZE bytes.
-void *get_blocks_bitmap() { return blocks_get_block(0); }
+void *get_blocks_bitmap() {
+  return blocks_get_block(get_superblock()->block_bitmap_start);
+}
 
 // Return a pointer to the beginning of the inode table bitmap.
 void *get_inode_bitmap() {
-  uint8_t *block = blocks_get_block(0);
+  return blocks_get_block(inode_bitmap_at);
+}
 
-  // The inode bitmap is stored immediately after the block bitmap
-  return (void *) (block + BLOCK_BITMAP_SIZE);
+// Return a pointer to the first inode.
+void *get_inode_table() { return blocks_get_block(inode_table_at); }
+
+// Show a snapshot's inodes and stop writing to the image.
+void blocks_read_only(int inode_bitmap, int inode_table) {
+  journal_read_only();
+  alloc_lock();
+  read_only = 1;
+  inode_bitmap_at = inode_bitmap;
+  inode_table_at = inode_table;
+  bitmap_alloc_free(&inode_alloc);
+  int rv = bitmap_alloc_init(&inode_alloc, get_inode_bitmap(), INODE_COUNT);
+  assert(rv == 0);
+  alloc_unlock();
 }
 
 // Allocate a new block and return its index.
-int alloc_block() {
-  void *bbm = get_blocks_bitmap();
-
-  for (int ii = 1; ii < BLOCK_COUNT; ++ii) {
-    if (!bitmap_get(bbm, ii)) {
-      bitmap_put(bbm, ii, 1);
-      printf("+ alloc_block() -> %d\n", ii);
-      return ii;
+int alloc_block() { return alloc_block_near(0); }
+
+// Take the allocation lock.
+void alloc_lock() { pthread_mutex_lock(&alloc_mutex); }
+
+// Record the free counts in the superblock and release the allocation lock.
+void alloc_unlock() {
+  superblock_t *sb = get_superblock();
+  if (sb->free_blocks != block_alloc.free || sb->free_inodes != inode_alloc.free) {
+    sb->free_blocks = block_alloc.free;
+    sb->free_inodes = inode_alloc.free;
+    journal_dirty(sb, sizeof(superblock_t));
+  }
+  pthread_mutex_unlock(&alloc_mutex);
+}
+
+static int grow_image();
+
+// Allocate a new block, scanning forward from goal and wrapping around.
+int alloc_block_near(int goal) { return alloc_blocks_near(goal, 1, NULL); }
+
+// Allocate up to max blocks in a row at the first free block from goal.
+int alloc_blocks_near(int goal, int max, int *got) {
+  // metadata sits below data_start and is always in use, so a goal down
+  // there just means no preference
+  long start = goal < (int) get_superblock()->data_start ? -1 : goal;
+  int count = 0;
+  alloc_lock();
+  long scanned = block_alloc.scanned;
+  long bnum = bitmap_alloc_first(&block_alloc, start, max, &count);
+  // everything is taken, the new space is all free if we can get it
+  while (bnum == -1 && grow_image() == 0) {
+    bnum = bitmap_alloc_first(&block_alloc, -1, max, &count);
+  }
+  journal_dirty_bits(get_blocks_bitmap(), bnum, count);
+  scanned = block_alloc.scanned - scanned;
+  alloc_unlock();
+  stats_add(STATS_BLOCK_ALLOCS, count);
+  stats_add(STATS_BLOCK_SCANS, scanned);
+  if (got != NULL) {
+    *got = count;
+  }
+  TRACE_DEBUG(TRACE_ALLOC_BLOCK, -1, goal, count, bnum);
+  return bnum;
+}
+
+// Allocate count blocks in a row, growing the image if there is no room.
+int alloc_run(int goal, int count) {
+  long start = goal < (int) get_superblock()->data_start ? -1 : goal;
+  alloc_lock();
+  long scanned = block_alloc.scanned;
+  long bnum = bitmap_alloc_run(&block_alloc, start, count);
+  while (bnum == -1 && grow_image() == 0) {
+    bnum = bitmap_alloc_run(&block_alloc, -1, count);
+  }
+  if (bnum != -1) {
+    journal_dirty_bits(get_blocks_bitmap(), bnum, count);
+  }
+  scanned = block_alloc.scanned - scanned;
+  alloc_unlock();
+  stats_add(STATS_BLOCK_ALLOCS, bnum != -1 ? count : 0);
+  stats_add(STATS_BLOCK_SCANS, scanned);
+  TRACE_DEBUG(TRACE_ALLOC_BLOCK, -1, goal, count, bnum);
+  return bnum;
+}
+
+// Get the allocator for the inode bitmap.
+bitmap_alloc_t *get_inode_allocator() { return &inode_alloc; }
+
+// Extend the image by grow_blocks blocks.
+int blocks_grow() {
+  alloc_lock();
+  int rv = grow_image();
+  alloc_unlock();
+  return rv;
+}
+
+// Extend the image, with the allocation lock held.
+static int grow_image() {
+  superblock_t *sb = get_superblock();
+  long old_count = sb->block_count;
+  long new_count = old_count + sb->grow_blocks;
+  if (sb->grow_blocks == 0 || old_count == max_blocks(sb)) {
+    return -1;
+  }
+
+  // a bitmap that is out of bits moves to the start of the new space and
+  // gets room to double again before it has to move the next time
+  long bits = (long) sb->block_bitmap_blocks * sb->block_size * 8;
+  int moved_blocks = 0;
+  if (new_count > bits) {
+    moved_blocks = bitmap_blocks(2 * new_count, sb->block_size);
+    if (new_count < old_count + moved_blocks + 1) {
+      new_count = old_count + moved_blocks + 1;
+    }
+  }
+  if (new_count > max_blocks(sb)) {
+    new_count = max_blocks(sb);
+    if (new_count < old_count + moved_blocks + 1) {
+      return -1;
+    }
+  }
+
+  // lengthen the file and map the new part right after the old one, the
+  // last page of the old mapping already covers any partial page
+  size_t new_size = (size_t) sb->block_size * new_count;
+  if (ftruncate(blocks_fd, new_size) != 0) {
+    return -1;
+  }
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t mapped = (blocks_size + page - 1) / page * page;
+  if (new_size > mapped) {
+    void *tail = mmap(blocks_base + mapped, new_size - mapped,
+                      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                      blocks_fd, mapped);
+    assert(tail == blocks_base + mapped);
+  }
+  blocks_size = new_size;
+  journal_grow(new_count);
+  TRACE_DEBUG(TRACE_GROW_IMAGE, -1, old_count, new_count, 0);
+
+  if (moved_blocks > 0) {
+    void *old_bbm = get_blocks_bitmap();
+    long old_start = sb->block_bitmap_start;
+    long old_blocks = sb->block_bitmap_blocks;
+    memcpy(blocks_get_block(old_count), old_bbm, old_blocks * sb->block_size);
+    sb->block_bitmap_start = old_count;
+    sb->block_bitmap_blocks = moved_blocks;
+    void *bbm = get_blocks_bitmap();
+    for (int ii = 0; ii < moved_blocks; ++ii) {
+      bitmap_put(bbm, old_count + ii, 1);
     }
+    // a bitmap that had already moved once sits in data blocks we can reuse
+    // once the move is committed
+    if (old_start >= sb->data_start) {
+      for (int ii = 0; ii < old_blocks; ++ii) {
+        journal_free(old_start + ii);
+      }
+    }
+    journal_dirty(bbm, (size_t) moved_blocks * sb->block_size);
+  }
+  sb->block_count = new_count;
+  journal_dirty(sb, sizeof(superblock_t));
+
+  // the summaries and free count have to cover the new blocks, and maybe a
+  // moved bitmap
+  bitmap_alloc_free(&block_alloc);
+  int rv = bitmap_alloc_init(&block_alloc, get_blocks_bitmap(), new_count);
+  assert(rv == 0);
+  block_alloc.hint = old_count;
+  return 0;
+}
+
+// The owner count of bnum, or NULL if no block of counts covers it yet.
+// Called with refs_mutex held.
+static uint16_t *owners_of(int bnum) {
+  int at = extent_lookup(&get_superblock()->block_refs, bnum / REFS_PER_BLOCK, NULL);
+  if (at == -1) {
+    return NULL;
+  }
+  return (uint16_t *) blocks_get_block(at) + bnum % REFS_PER_BLOCK;
+}
+
+// Take away one of the extra owners of a shared block, returning 0 if it
+// only had the one. A block that is being freed loses its dedup mark.
+static int drop_owner(int bnum) {
+  pthread_mutex_lock(&refs_mutex);
+  uint16_t *owners = owners_of(bnum);
+  int shared = owners != NULL && *owners > 0;
+  if (shared) {
+    *owners -= 1;
+    journal_dirty(owners, sizeof(uint16_t));
+  } else if (dedup_marks != NULL) {
+    bitmap_put(dedup_marks, bnum, 0);
+  }
+  pthread_mutex_unlock(&refs_mutex);
+  return shared;
+}
+
+// Give count blocks from bnum another owner each.
+int blocks_share(int bnum, int count) {
+  superblock_t *sb = get_superblock();
+  pthread_mutex_lock(&refs_mutex);
+  // make room for all the counts first, so running out of space changes none
+  int last = (bnum + count - 1) / REFS_PER_BLOCK;
+  for (int index = bnum / REFS_PER_BLOCK; count > 0 && index <= last; ++index) {
+    if (extent_lookup(&sb->block_refs, index, NULL) != -1) {
+      continue;
+    }
+    int at = alloc_block();
+    if (at == -1) {
+      pthread_mutex_unlock(&refs_mutex);
+      return -ENOSPC;
+    }
+    memset(blocks_get_block(at), 0, BLOCK_SIZE);
+    journal_dirty(blocks_get_block(at), BLOCK_SIZE);
+    int rv = extent_insert(&sb->block_refs, index, at, 1);
+    if (rv < 0) {
+      free_block(at);
+      pthread_mutex_unlock(&refs_mutex);
+      return rv;
+    }
+  }
+  for (int ii = bnum; ii < bnum + count; ++ii) {
+    uint16_t *owners = owners_of(ii);
+    assert(*owners < UINT16_MAX);
+    *owners += 1;
+    journal_dirty(owners, sizeof(uint16_t));
   }
+  pthread_mutex_unlock(&refs_mutex);
+  return 0;
+}
+
+// Whether a block has more than one owner.
+int blocks_shared(int bnum) {
+  pthread_mutex_lock(&refs_mutex);
+  uint16_t *owners = owners_of(bnum);
+  int shared = owners != NULL && *owners > 0;
+  pthread_mutex_unlock(&refs_mutex);
+  return shared;
+}
+
+// Note that the dedup index points at bnum.
+void blocks_mark(int bnum) {
+  if (dedup_marks == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&refs_mutex);
+  bitmap_put(dedup_marks, bnum, 1);
+  pthread_mutex_unlock(&refs_mutex);
+}
+
+// Drop the dedup marks of blocks about to be written in place.
+void blocks_unmark(int bnum, int count) {
+  if (dedup_marks == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&refs_mutex);
+  for (int ii = bnum; ii < bnum + count; ++ii) {
+    bitmap_put(dedup_marks, ii, 0);
+  }
+  pthread_mutex_unlock(&refs_mutex);
+}
 
-  return -1;
+// Give a block another owner if it is still marked and has room for one.
+int blocks_share_marked(int bnum) {
+  if (dedup_marks == NULL || bnum < 0 || bnum >= BLOCK_COUNT) {
+    return -1;
+  }
+  pthread_mutex_lock(&refs_mutex);
+  uint16_t *owners = owners_of(bnum);
+  int full = owners != NULL && *owners >= DEDUP_MAX_OWNERS;
+  int rv = bitmap_get(dedup_marks, bnum) && !full ? blocks_share(bnum, 1) : -1;
+  pthread_mutex_unlock(&refs_mutex);
+  return rv;
 }
 
-// Deallocate the block with the given index.
+// Deallocate the block with the given index. It stays in use until the
+// journal commits the free, the copies it commits already have it free.
 void free_block(int bnum) {
-  printf("+ free_block(%d)\n", bnum);
-  void *bbm = get_blocks_bitmap();
-  bitmap_put(bbm, bnum, 0);
+  TRACE_DEBUG(TRACE_FREE_BLOCK, -1, bnum, 1, 0);
+  if (drop_owner(bnum)) {
+    return;
+  }
+  journal_free(bnum);
+  alloc_lock();
+  journal_dirty_bits(get_blocks_bitmap(), bnum, 1);
+  journal_dirty(get_superblock(), sizeof(superblock_t));
+  alloc_unlock();
+}
+
+// Hand out blocks freed by a transaction that is now home.
+void blocks_release(const int *bnums, long count) {
+  alloc_lock();
+  for (long ii = 0; ii < count; ++ii) {
+    bitmap_alloc_put(&block_alloc, bnums[ii], 0);
+  }
+  for (long ii = 0; ii < count; ++ii) {
+    journal_dirty_bits(get_blocks_bitmap(), bnums[ii], 1);
+  }
+  alloc_unlock();
 }
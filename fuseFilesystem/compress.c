@@ -0,0 +1,337 @@
+/**
+ * @file compress.c
+ *
+ * Clusters of compressed files, see helpers/compress.h.
+ *
+ * Decompressed clusters are cached in a fixed set of slots, a packed
+ * cluster's slot picked by its first disk block. Each slot has its own
+ * lock, taken after the inode's and never with another slot's. Compressing
+ * a cluster puts what it compressed in the slot for its new blocks, so a
+ * file written and then read back never decompresses anything.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "helpers/blocks.h"
+#include "helpers/compress.h"
+#include "helpers/extent.h"
+#include "helpers/inode.h"
+#include "helpers/lz.h"
+#include "helpers/stats.h"
+
+// Decompressed clusters kept, 4MB of them when they're all in use.
+#define CACHE_SLOTS 64
+
+// The length at the start of a packed cluster.
+#define HEADER_SIZE ((int) sizeof(uint32_t))
+
+typedef struct cache_slot {
+  pthread_mutex_t lock;
+  int bnum;   // first block of the packed cluster held, -1 for none
+  int length; // bytes it decompressed to, the rest of the cluster is zeros
+  char *data; // COMPRESS_CLUSTER_SIZE bytes, allocated when first used
+} cache_slot_t;
+
+static cache_slot_t cache[CACHE_SLOTS] = {
+    [0 ... CACHE_SLOTS - 1] = {PTHREAD_MUTEX_INITIALIZER, -1, 0, NULL}};
+
+void compress_cache_clear() {
+  for (int i = 0; i < CACHE_SLOTS; ++i) {
+    pthread_mutex_lock(&cache[i].lock);
+    cache[i].bnum = -1;
+    pthread_mutex_unlock(&cache[i].lock);
+  }
+}
+
+/**
+ * Find the blocks of a packed cluster.
+ *
+ * @param first The cluster's first block in the file.
+ * @param count Set to how many blocks it takes.
+ *
+ * @return The first of them on disk, or -1 if the cluster isn't packed.
+ */
+static int find_packed(inode_t *node, int first, int *count) {
+  int end = first + COMPRESS_CLUSTER_BLOCKS;
+  if ((node->flags & INODE_INLINE) || inode_get_bnum(node, first) != -1) {
+    return -1;
+  }
+  int next = inode_next_data(node, first);
+  if (next == -1 || next >= end) {
+    return -1;
+  }
+  *count = end - next;
+  return inode_get_bnum(node, next);
+}
+
+int compress_packed(inode_t *node, int fbnum) {
+  int count;
+  return find_packed(node, fbnum - fbnum % COMPRESS_CLUSTER_BLOCKS, &count) != -1;
+}
+
+// Lock the slot a packed cluster goes in, or return NULL if it has no
+// memory and can't get any.
+static cache_slot_t *slot_lock(int bnum) {
+  cache_slot_t *slot = &cache[bnum % CACHE_SLOTS];
+  pthread_mutex_lock(&slot->lock);
+  if (slot->data == NULL && (slot->data = malloc(COMPRESS_CLUSTER_SIZE)) == NULL) {
+    pthread_mutex_unlock(&slot->lock);
+    return NULL;
+  }
+  return slot;
+}
+
+/**
+ * Get a packed cluster decompressed, from the cache or from the image.
+ *
+ * @param first The cluster's first block in the file.
+ * @param rv Set to the error when there is one.
+ *
+ * @return The slot holding it, locked, or NULL on failure.
+ */
+static cache_slot_t *load(inode_t *node, int first, int *rv) {
+  int count;
+  int bnum = find_packed(node, first, &count);
+  int run;
+  if (bnum == -1 || inode_get_run(node, first + COMPRESS_CLUSTER_BLOCKS - count,
+                                  &run) != bnum || run < count) {
+    *rv = -EIO;
+    return NULL;
+  }
+  cache_slot_t *slot = slot_lock(bnum);
+  if (slot == NULL) {
+    *rv = -ENOMEM;
+    return NULL;
+  }
+  if (slot->bnum == bnum) {
+    stats_add(STATS_CLUSTER_HITS, 1);
+    return slot;
+  }
+  stats_add(STATS_CLUSTER_MISSES, 1);
+  char packed[COMPRESS_CLUSTER_SIZE];
+  int size = count * BLOCK_SIZE;
+  slot->bnum = -1;
+  *rv = blocks_read(bnum, 0, packed, size);
+  if (*rv == 0) {
+    uint32_t length;
+    memcpy(&length, packed, HEADER_SIZE);
+    slot->length = length > (uint32_t) (size - HEADER_SIZE)
+                       ? -1
+                       : lz_decompress(packed + HEADER_SIZE, length, slot->data,
+                                       COMPRESS_CLUSTER_SIZE);
+    *rv = slot->length < 0 ? -EIO : 0;
+  }
+  if (*rv < 0) {
+    pthread_mutex_unlock(&slot->lock);
+    return NULL;
+  }
+  slot->bnum = bnum;
+  return slot;
+}
+
+// Copy part of a decompressed cluster, zeros past what it holds.
+static void copy_out(cache_slot_t *slot, char *buf, int start, int size) {
+  int have = slot->length - start;
+  have = have < 0 ? 0 : have < size ? have : size;
+  memcpy(buf, slot->data + start, have);
+  memset(buf + have, 0, size - have);
+}
+
+int compress_read(inode_t *node, char *buf, size_t size, off_t offset) {
+  int start = offset % COMPRESS_CLUSTER_SIZE;
+  int rv;
+  cache_slot_t *slot = load(node, (offset - start) / BLOCK_SIZE, &rv);
+  if (slot == NULL) {
+    return rv;
+  }
+  copy_out(slot, buf, start, size);
+  pthread_mutex_unlock(&slot->lock);
+  return 0;
+}
+
+// Read the first size bytes of a raw cluster or a hole.
+static int read_raw(inode_t *node, int first, char *buf, int size) {
+  for (int done = 0; done < size;) {
+    int run;
+    int bnum = inode_get_run(node, first + done / BLOCK_SIZE, &run);
+    int len = bnum == -1 ? BLOCK_SIZE : run * BLOCK_SIZE;
+    len = len < size - done ? len : size - done;
+    if (bnum == -1) {
+      memset(buf + done, 0, len);
+    } else {
+      int rv = blocks_read(bnum, 0, buf + done, len);
+      if (rv < 0) {
+        return rv;
+      }
+    }
+    done += len;
+  }
+  return 0;
+}
+
+/**
+ * Put a cluster in a new run of blocks. The run is written before the
+ * cluster's old blocks are freed, so the cluster is left as it was if
+ * anything fails.
+ *
+ * @param first The cluster's first block in the file.
+ * @param at Block of the file the run starts at.
+ * @param data What to write into the run, from its start.
+ * @param size Bytes of data.
+ *
+ * @return The run's first block on disk, -ENOSPC if there is no run that
+ *         long free, or -EIO.
+ */
+static int replace(inode_t *node, int first, int at, const char *data, int size) {
+  int count = bytes_to_blocks(size);
+  int goal = first > 0 ? inode_get_bnum(node, first - 1) + 1 : 0;
+  int bnum = alloc_run(goal, count);
+  if (bnum == -1) {
+    return -ENOSPC;
+  }
+  int rv = blocks_write(bnum, 0, data, size);
+  if (rv == 0) {
+    rv = extent_remove(&node->extents, first, COMPRESS_CLUSTER_BLOCKS);
+  }
+  if (rv == 0) {
+    rv = extent_insert(&node->extents, at, bnum, count);
+  }
+  if (rv < 0) {
+    for (int i = 0; i < count; ++i) {
+      free_block(bnum + i);
+    }
+    return rv;
+  }
+  inode_dirty(node);
+  return bnum;
+}
+
+// Write a cluster as it is, over its own blocks and into its holes.
+static int write_raw(inode_t *node, int first, const char *plain, int blocks) {
+  int rv = inode_unshare(node, first, blocks);
+  for (int done = 0; rv == 0 && done < blocks;) {
+    int run;
+    int bnum = inode_get_run(node, first + done, &run);
+    if (bnum == -1) {
+      bnum = inode_fill_hole(node, first + done, blocks - done, &run);
+      if (bnum < 0) {
+        return bnum;
+      }
+    }
+    run = run < blocks - done ? run : blocks - done;
+    rv = blocks_write(bnum, 0, plain + (size_t) done * BLOCK_SIZE,
+                      (size_t) run * BLOCK_SIZE);
+    done += run;
+  }
+  return rv;
+}
+
+/**
+ * Store a whole cluster, packed if compressing it saves a block.
+ *
+ * @param first The cluster's first block in the file.
+ * @param packed Whether it is packed now.
+ * @param plain Its bytes, zeros from valid to the end of its last block.
+ * @param valid Bytes of it inside the file.
+ */
+static int store(inode_t *node, int first, int packed, const char *plain,
+                 int valid) {
+  int blocks = bytes_to_blocks(valid);
+  char out[COMPRESS_CLUSTER_SIZE];
+  int capacity = (blocks - 1) * BLOCK_SIZE - HEADER_SIZE;
+  uint32_t length = capacity <= 0 ? 0
+                                  : lz_compress(plain, valid, out + HEADER_SIZE,
+                                                capacity);
+  stats_add(STATS_CLUSTER_BYTES, valid);
+  if (length > 0) {
+    memcpy(out, &length, HEADER_SIZE);
+    int count = bytes_to_blocks(HEADER_SIZE + length);
+    int bnum = replace(node, first, first + COMPRESS_CLUSTER_BLOCKS - count, out,
+                       HEADER_SIZE + length);
+    if (bnum >= 0) {
+      stats_add(STATS_CLUSTER_DISK_BYTES, (uint64_t) count * BLOCK_SIZE);
+      // What a reader would decompress, so it doesn't have to.
+      cache_slot_t *slot = slot_lock(bnum);
+      if (slot != NULL) {
+        memcpy(slot->data, plain, valid);
+        slot->length = valid;
+        slot->bnum = bnum;
+        pthread_mutex_unlock(&slot->lock);
+      }
+      return 0;
+    }
+    if (bnum != -ENOSPC) {
+      return bnum;
+    }
+    // No run that long is free, the raw blocks needn't be in one.
+  }
+  stats_add(STATS_CLUSTER_DISK_BYTES, (uint64_t) blocks * BLOCK_SIZE);
+  if (packed) {
+    int bnum = replace(node, first, first, plain, blocks * BLOCK_SIZE);
+    if (bnum != -ENOSPC) {
+      return bnum < 0 ? bnum : 0;
+    }
+    // Too fragmented for that, the packed blocks have to go first.
+    extent_remove(&node->extents, first, COMPRESS_CLUSTER_BLOCKS);
+    inode_dirty(node);
+  }
+  return write_raw(node, first, plain, blocks);
+}
+
+int compress_write(inode_t *node, const char *buf, size_t size, off_t offset) {
+  int start = offset % COMPRESS_CLUSTER_SIZE;
+  off_t cluster = offset - start;
+  int first = cluster / BLOCK_SIZE;
+  // Zeros past the end of the file aren't stored.
+  int64_t valid = node->size - cluster;
+  if (buf != NULL && valid < start + (int64_t) size) {
+    valid = start + size;
+  }
+  valid = valid < COMPRESS_CLUSTER_SIZE ? valid : COMPRESS_CLUSTER_SIZE;
+  if (valid <= 0) {
+    return 0;
+  }
+  if (start + (int64_t) size > valid) {
+    size = valid > start ? valid - start : 0;
+  }
+
+  char plain[COMPRESS_CLUSTER_SIZE];
+  int count;
+  int packed = find_packed(node, first, &count) != -1;
+  if (buf == NULL && !packed && inode_get_bnum(node, first) == -1) {
+    // A hole is zero already.
+    return 0;
+  }
+  if (start > 0 || start + (int64_t) size < valid) {
+    int rv = 0;
+    if (packed) {
+      cache_slot_t *slot = load(node, first, &rv);
+      if (slot == NULL) {
+        return rv;
+      }
+      if (buf == NULL && slot->length <= start && slot->length <= valid) {
+        // Zero already, and nothing past the end to drop.
+        pthread_mutex_unlock(&slot->lock);
+        return 0;
+      }
+      copy_out(slot, plain, 0, valid);
+      pthread_mutex_unlock(&slot->lock);
+    } else {
+      rv = read_raw(node, first, plain, valid);
+    }
+    if (rv < 0) {
+      return rv;
+    }
+  }
+  if (buf != NULL) {
+    memcpy(plain + start, buf, size);
+  } else {
+    memset(plain + start, 0, size);
+  }
+  int blocks = bytes_to_blocks(valid);
+  memset(plain + valid, 0, (size_t) blocks * BLOCK_SIZE - valid);
+  return store(node, first, packed, plain, valid);
+}
@@ -0,0 +1,214 @@
+#include "helpers/dcache.h"
+#include "helpers/directory.h"
+#include <pthread.h>
+#include <string.h>
+#include <stdint.h>
+
+/**
+ * Both tables are split into sets of DCACHE_WAYS entries picked by the hash
+ * of the key. A set that is full replaces its entries round robin.
+ * Unused entries have an empty name or path, so empty keys are never cached.
+ * Lookups share a reader/writer lock, anything that changes a table takes it
+ * exclusively.
+*/
+
+#define DCACHE_SETS 1024
+#define DCACHE_WAYS 4
+
+typedef struct dcache_entry {
+  int dir;  // directory the name was looked up in
+  int inum; // what it resolved to, -1 if missing
+  char name[DIR_NAME_LENGTH];
+} dcache_entry_t;
+
+typedef struct dcache_path {
+  int inum; // what it resolved to, -1 if missing
+  char path[DCACHE_PATH_LENGTH];
+} dcache_path_t;
+
+static dcache_entry_t names[DCACHE_SETS][DCACHE_WAYS];
+static uint8_t names_next[DCACHE_SETS];
+static dcache_path_t paths[DCACHE_SETS][DCACHE_WAYS];
+static uint8_t paths_next[DCACHE_SETS];
+static int paths_used = 0; // whether paths may hold anything
+static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/**
+ * Hashes a string, mixing in a seed (32-bit FNV-1a).
+*/
+static uint32_t hash(uint32_t seed, const char* text) {
+  uint32_t hash = 2166136261u ^ seed;
+  for(; *text != 0; ++text) {
+    hash ^= (unsigned char)*text;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/**
+ * Forgets everything in the cache.
+*/
+void dcache_clear() {
+  pthread_rwlock_wrlock(&lock);
+  memset(names, 0, sizeof(names));
+  memset(paths, 0, sizeof(paths));
+  paths_used = 0;
+  pthread_rwlock_unlock(&lock);
+}
+
+/**
+ * Finds what the name resolved to in the given directory last time.
+ * 
+ * @param dir the inum of the directory.
+ * @param name the name within it.
+ * 
+ * @returns the inum, -1 if the name is known to be missing, or DCACHE_MISS.
+*/
+int dcache_lookup(int dir, const char *name) {
+  if(*name == 0) {
+    return DCACHE_MISS;
+  }
+  dcache_entry_t* set = names[hash(dir, name) % DCACHE_SETS];
+  int inum = DCACHE_MISS;
+  pthread_rwlock_rdlock(&lock);
+  for(int i = 0; i < DCACHE_WAYS && inum == DCACHE_MISS; ++i) {
+    if(set[i].dir == dir && strcmp(set[i].name, name) == 0) {
+      inum = set[i].inum;
+    }
+  }
+  pthread_rwlock_unlock(&lock);
+  return inum;
+}
+
+/**
+ * Records what a name resolves to in the given directory, replacing
+ * anything cached for it before.
+ * 
+ * @param dir the inum of the directory.
+ * @param name the name within it.
+ * @param inum what it resolves to, or -1 if it's missing.
+*/
+void dcache_insert(int dir, const char *name, int inum) {
+  if(*name == 0 || strlen(name) >= DIR_NAME_LENGTH) {
+    return;
+  }
+  uint32_t index = hash(dir, name) % DCACHE_SETS;
+  dcache_entry_t* set = names[index];
+  pthread_rwlock_wrlock(&lock);
+  int way = -1;
+  for(int i = 0; i < DCACHE_WAYS && way == -1; ++i) {
+    if(set[i].dir == dir && strcmp(set[i].name, name) == 0) {
+      way = i;
+    }
+  }
+  if(way == -1) {
+    way = names_next[index]++ % DCACHE_WAYS;
+  }
+  set[way].dir = dir;
+  set[way].inum = inum;
+  strcpy(set[way].name, name);
+  pthread_rwlock_unlock(&lock);
+}
+
+/**
+ * Finds what the whole path resolved to last time.
+ * 
+ * @param path the absolute path.
+ * 
+ * @returns the inum, -1 if the path is known to be missing, or DCACHE_MISS.
+*/
+int dcache_lookup_path(const char *path) {
+  if(*path == 0) {
+    return DCACHE_MISS;
+  }
+  dcache_path_t* set = paths[hash(0, path) % DCACHE_SETS];
+  int inum = DCACHE_MISS;
+  pthread_rwlock_rdlock(&lock);
+  for(int i = 0; i < DCACHE_WAYS && inum == DCACHE_MISS; ++i) {
+    if(strcmp(set[i].path, path) == 0) {
+      inum = set[i].inum;
+    }
+  }
+  pthread_rwlock_unlock(&lock);
+  return inum;
+}
+
+/**
+ * Records what a whole path resolves to. Paths that don't fit are skipped.
+ * 
+ * @param path the absolute path.
+ * @param inum what it resolves to, or -1 if it's missing.
+*/
+void dcache_insert_path(const char *path, int inum) {
+  if(*path == 0 || strlen(path) >= DCACHE_PATH_LENGTH) {
+    return;
+  }
+  uint32_t index = hash(0, path) % DCACHE_SETS;
+  dcache_path_t* set = paths[index];
+  pthread_rwlock_wrlock(&lock);
+  int way = -1;
+  for(int i = 0; i < DCACHE_WAYS && way == -1; ++i) {
+    if(strcmp(set[i].path, path) == 0) {
+      way = i;
+    }
+  }
+  if(way == -1) {
+    way = paths_next[index]++ % DCACHE_WAYS;
+  }
+  set[way].inum = inum;
+  strcpy(set[way].path, path);
+  paths_used = 1;
+  pthread_rwlock_unlock(&lock);
+}
+
+/**
+ * Drops every cached path. Changes made by inum don't know which paths
+ * they touch, but when everything goes by inum no paths get cached and
+ * this costs nothing.
+*/
+void dcache_invalidate_paths() {
+  pthread_rwlock_wrlock(&lock);
+  if(paths_used) {
+    memset(paths, 0, sizeof(paths));
+    paths_used = 0;
+  }
+  pthread_rwlock_unlock(&lock);
+}
+
+/**
+ * Drops a path whose name was just added or removed. When a directory
+ * comes or goes, paths below it change too, so subtree also drops
+ * every cached path that starts with it. That takes a pass over the
+ * whole table, plain files only need the one probe.
+ * 
+ * @param path the absolute path that changed.
+ * @param subtree whether the path is (or was) a directory.
+*/
+void dcache_invalidate_path(const char *path, int subtree) {
+  size_t length = strlen(path);
+  // The parent hands out paths like "/a/" for "/a", so ignore trailing /s
+  while(length > 1 && path[length - 1] == '/') {
+    --length;
+  }
+  pthread_rwlock_wrlock(&lock);
+  if(!subtree) {
+    dcache_path_t* set = paths[hash(0, path) % DCACHE_SETS];
+    for(int i = 0; i < DCACHE_WAYS; ++i) {
+      if(strcmp(set[i].path, path) == 0) {
+        set[i].path[0] = 0;
+      }
+    }
+    pthread_rwlock_unlock(&lock);
+    return;
+  }
+  for(int index = 0; index < DCACHE_SETS; ++index) {
+    for(int i = 0; i < DCACHE_WAYS; ++i) {
+      char* cached = paths[index][i].path;
+      if(strncmp(cached, path, length) == 0 &&
+         (cached[length] == 0 || cached[length] == '/')) {
+        cached[0] = 0;
+      }
+    }
+  }
+  pthread_rwlock_unlock(&lock);
+}
@@ -0,0 +1,113 @@
+/**
+ * @file dedup.c
+ *
+ * The dedup index, see helpers/dedup.h.
+ *
+ * Split into sets of DEDUP_WAYS entries picked by the block's hash, like
+ * the dcache, a full set replacing its entries round robin. Lookups share
+ * a reader/writer lock and inserts take it exclusively. The index only
+ * suggests a block: blocks_share_marked decides whether it may still be
+ * shared, and the bytes on disk are compared after it is.
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "helpers/blocks.h"
+#include "helpers/dedup.h"
+
+// 32K entries, enough for 128MB of 4K blocks.
+#define DEDUP_SETS 8192
+#define DEDUP_WAYS 4
+
+typedef struct dedup_entry {
+  uint64_t hash; // of the block's bytes when it was written
+  int bnum;      // -1 for an unused entry
+} dedup_entry_t;
+
+static dedup_entry_t entries[DEDUP_SETS][DEDUP_WAYS] = {
+    [0 ... DEDUP_SETS - 1] = {[0 ... DEDUP_WAYS - 1] = {0, -1}}};
+static uint8_t entries_next[DEDUP_SETS];
+static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/**
+ * Hash a block 8 bytes at a time in four independent lanes, so the
+ * multiplies overlap, then mix the lanes together.
+ */
+static uint64_t hash(const void *data) {
+  const char *bytes = data;
+  uint64_t lanes[4] = {0x9e3779b97f4a7c15u, 0xc2b2ae3d27d4eb4fu,
+                       0x165667b19e3779f9u, 0x85ebca77c2b2ae63u};
+  int size = BLOCK_SIZE;
+  for (int at = 0; at < size; at += sizeof(lanes)) {
+    for (int i = 0; i < 4; ++i) {
+      uint64_t word;
+      memcpy(&word, bytes + at + i * sizeof(word), sizeof(word));
+      lanes[i] = (lanes[i] ^ word) * 0x9fb21c651e98df25u;
+      lanes[i] ^= lanes[i] >> 29;
+    }
+  }
+  uint64_t h = lanes[0] ^ (lanes[1] << 16 | lanes[1] >> 48) ^
+               (lanes[2] << 32 | lanes[2] >> 32) ^ (lanes[3] << 48 | lanes[3] >> 16);
+  h = (h ^ h >> 32) * 0xd6e8feb86659fd93u;
+  return h ^ h >> 32;
+}
+
+void dedup_clear() {
+  pthread_rwlock_wrlock(&lock);
+  for (int s = 0; s < DEDUP_SETS; ++s) {
+    for (int i = 0; i < DEDUP_WAYS; ++i) {
+      entries[s][i].bnum = -1;
+    }
+  }
+  pthread_rwlock_unlock(&lock);
+}
+
+// Look a hash up, returning the block it was last seen in or -1.
+static int lookup(uint64_t h) {
+  dedup_entry_t *set = entries[h % DEDUP_SETS];
+  int bnum = -1;
+  pthread_rwlock_rdlock(&lock);
+  for (int i = 0; i < DEDUP_WAYS && bnum == -1; ++i) {
+    if (set[i].hash == h) {
+      bnum = set[i].bnum;
+    }
+  }
+  pthread_rwlock_unlock(&lock);
+  return bnum;
+}
+
+int dedup_lookup(const void *data) { return lookup(hash(data)); }
+
+int dedup_share(const void *data, int bnum) {
+  if (blocks_share_marked(bnum) != 0) {
+    return -1;
+  }
+  // Marked blocks aren't written in place, and now it has one more owner
+  // it can't be freed either.
+  char have[MAX_BLOCK_SIZE];
+  if (blocks_read(bnum, 0, have, BLOCK_SIZE) != 0 ||
+      memcmp(have, data, BLOCK_SIZE) != 0) {
+    free_block(bnum);
+    return -1;
+  }
+  return 0;
+}
+
+void dedup_insert(const void *data, int bnum) {
+  uint64_t h = hash(data);
+  dedup_entry_t *set = entries[h % DEDUP_SETS];
+  pthread_rwlock_wrlock(&lock);
+  int way = 0;
+  while (way < DEDUP_WAYS && set[way].hash != h && set[way].bnum != -1) {
+    ++way;
+  }
+  if (way == DEDUP_WAYS) {
+    way = entries_next[h % DEDUP_SETS];
+    entries_next[h % DEDUP_SETS] = (way + 1) % DEDUP_WAYS;
+  }
+  set[way].hash = h;
+  set[way].bnum = bnum;
+  pthread_rwlock_unlock(&lock);
+  blocks_mark(bnum);
+}
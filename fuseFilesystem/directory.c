@@ -1,6 +1,11 @@
 #include "helpers/directory.h"
 #include "helpers/inode.h"
 #include "helpers/bitmap.h"
+#include "helpers/dcache.h"
+#include "helpers/journal.h"
+#include "helpers/stats.h"
+#include "helpers/trace.h"
+#include "helpers/utilities.h"
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,25 +21,366 @@
 void directory_init() {
     // Assert it isn't allocated yet
     assert(bitmap_get(get_inode_bitmap(), ROOT_INODE) == 0);
-    printf("Making root directory\n");
     // Initialize root directory
-    bitmap_put(get_inode_bitmap(), ROOT_INODE, 1);
+    bitmap_alloc_put(get_inode_allocator(), ROOT_INODE, 1);
+    journal_dirty_bits(get_inode_bitmap(), ROOT_INODE, 1);
     inode_t* root = get_inode(ROOT_INODE);
     // Special initialization
-    root->block = alloc_block();
-    // Ensure it allocated properly
-    assert(root->block != -1);
-    root->size = 0;
+    root->flags = 0;
+    root->atime = root->mtime = root->ctime = inode_now();
+    inode_init_data(root);
     root->refs = 1;
     root->mode = 040755;
+    inode_dirty(root);
     // Put in basic information
-    directory_put(root, ".", ROOT_INODE);
-    directory_put(root, "..", ROOT_INODE);
+    int rv = directory_put(root, ".", ROOT_INODE);
+    // Ensure it allocated properly
+    assert(rv == 0);
+    rv = directory_put(root, "..", ROOT_INODE);
+    assert(rv == 0);
+}
+
+// One step of a walk from the index root down to a leaf.
+typedef struct dx_path {
+    dx_header_t* node;
+    int index; // entry followed down
+} dx_path_t;
+
+/**
+ * Hashes a name for the directory index (32-bit FNV-1a).
+ * 
+ * @param name the name to hash.
+ * 
+ * @returns the hash of the name.
+*/
+static uint32_t name_hash(const char* name) {
+    uint32_t hash = 2166136261u;
+    for(; *name != 0; ++name) {
+        hash ^= (unsigned char)*name;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Gets a pointer to the given block of a directory.
+ * 
+ * @param dd the directory inode.
+ * @param fbnum the block of the directory to get.
+*/
+static void* dir_block(inode_t* dd, int fbnum) {
+    // Short directories keep their dirents in the inode.
+    if(dd->flags & INODE_INLINE) {
+        assert(fbnum == 0);
+        return dd->data;
+    }
+    return blocks_get_block(inode_get_bnum(dd, fbnum));
+}
+
+/**
+ * Marks a block of an indexed directory as changed, for the journal.
+ * Their blocks are never inline, so this is always a whole block.
+*/
+static void block_dirty(void* block) {
+    journal_dirty(block, BLOCK_SIZE);
+}
+
+static dx_entry_t* dx_entries(dx_header_t* node) {
+    return (dx_entry_t*)(node + 1);
+}
+
+static dirent_t* leaf_entries(dir_leaf_t* leaf) {
+    return (dirent_t*)leaf + 1;
+}
+
+// Dirents that fit in a leaf after its header slot.
+static int leaf_max() {
+    return BLOCK_SIZE / SIZE_DIRENT - 1;
+}
+
+// Orders dirents by the hash of their names, for splitting leaves.
+static int compare_hash(const void* a, const void* b) {
+    uint32_t ha = name_hash(((const dirent_t*)a)->name);
+    uint32_t hb = name_hash(((const dirent_t*)b)->name);
+    return ha < hb ? -1 : ha > hb;
+}
+
+/**
+ * Sorts the dirents by hash and picks where to cut them in two so that
+ * names with the same hash stay together.
+ * 
+ * @param entries the dirents to sort.
+ * @param count how many there are.
+ * 
+ * @returns the index of the first dirent of the upper half, or -1 if
+ *          every name has the same hash.
+*/
+static int sort_and_split(dirent_t* entries, int count) {
+    qsort(entries, count, SIZE_DIRENT, compare_hash);
+    for(int step = 0; step <= count / 2; ++step) {
+        int up = count / 2 + step;
+        int down = count / 2 - step;
+        if(up < count && name_hash(entries[up].name) != name_hash(entries[up - 1].name)) {
+            return up;
+        }
+        if(down > 0 && name_hash(entries[down].name) != name_hash(entries[down - 1].name)) {
+            return down;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Walks the index from the root to the leaf that would hold the given hash.
+ * 
+ * @param dd the indexed directory.
+ * @param hash the hash to look for.
+ * @param path filled in with the index node and entry taken at each level.
+ * 
+ * @returns the level of the last index node, whose entry names the leaf.
+*/
+static int dx_find(inode_t* dd, uint32_t hash, dx_path_t* path) {
+    dx_header_t* node = dir_block(dd, 0);
+    int depth = node->depth;
+    for(int level = 0; level <= depth; ++level) {
+        // Binary search for the last entry whose hash is <= hash, the
+        // first entry of a node covers everything below it.
+        dx_entry_t* entries = dx_entries(node);
+        int lo = 1;
+        int hi = node->count - 1;
+        int found = 0;
+        while(lo <= hi) {
+            int mid = (lo + hi) / 2;
+            if(entries[mid].hash <= hash) {
+                found = mid;
+                lo = mid + 1;
+            }
+            else {
+                hi = mid - 1;
+            }
+        }
+        path[level].node = node;
+        path[level].index = found;
+        if(level < depth) {
+            node = dir_block(dd, entries[found].fbnum);
+        }
+    }
+    return depth;
+}
+
+/**
+ * Adds a new block to the end of the directory.
+ * 
+ * @param dd the directory to grow.
+ * 
+ * @returns the block number within the directory, or -ENOSPC.
+*/
+static int dir_append_block(inode_t* dd) {
+    int fbnum = bytes_to_blocks(dd->size);
+    int rv = grow_inode(dd, (int64_t)(fbnum + 1) * BLOCK_SIZE);
+    return rv < 0 ? rv : fbnum;
+}
+
+/**
+ * Adds an index entry right after path[level].index. The node must
+ * have room.
+*/
+static void dx_insert(dx_path_t* path, int level, uint32_t hash, int fbnum) {
+    dx_header_t* node = path[level].node;
+    dx_entry_t* entries = dx_entries(node);
+    int i = path[level].index + 1;
+    memmove(entries + i + 1, entries + i, (node->count - i) * sizeof(dx_entry_t));
+    block_dirty(node);
+    entries[i].hash = hash;
+    entries[i].fbnum = fbnum;
+    node->count += 1;
+}
+
+/**
+ * Makes room for one more entry in the full index node at path[level],
+ * either by splitting it or, for the root, by pushing its entries down
+ * into a new block. Callers walk the index again afterwards.
+ * 
+ * @returns 0 on success, -ENOSPC if the directory can't grow.
+*/
+static int dx_make_room(inode_t* dd, dx_path_t* path, int level) {
+    dx_header_t* node = path[level].node;
+    if(level == 0) {
+        if(node->depth + 1 >= DIR_MAX_DEPTH) {
+            return -ENOSPC;
+        }
+        int fbnum = dir_append_block(dd);
+        if(fbnum < 0) {
+            return fbnum;
+        }
+        dx_header_t* child = dir_block(dd, fbnum);
+        memcpy(child, node, BLOCK_SIZE);
+        child->entries = 0;
+        block_dirty(child);
+        block_dirty(node);
+        node->depth += 1;
+        node->count = 1;
+        dx_entries(node)[0].hash = 0;
+        dx_entries(node)[0].fbnum = fbnum;
+        return 0;
+    }
+    if(path[level - 1].node->count == path[level - 1].node->max) {
+        return dx_make_room(dd, path, level - 1);
+    }
+    int fbnum = dir_append_block(dd);
+    if(fbnum < 0) {
+        return fbnum;
+    }
+    dx_header_t* sibling = dir_block(dd, fbnum);
+    int at = node->count / 2;
+    sibling->kind = DIR_INDEX_KIND;
+    sibling->max = node->max;
+    sibling->depth = node->depth;
+    sibling->entries = 0;
+    sibling->count = node->count - at;
+    memcpy(dx_entries(sibling), dx_entries(node) + at, sibling->count * sizeof(dx_entry_t));
+    block_dirty(sibling);
+    block_dirty(node);
+    node->count = at;
+    dx_insert(path, level - 1, dx_entries(sibling)[0].hash, fbnum);
+    return 0;
+}
+
+/**
+ * Turns a full one-block directory into an indexed one: the dirents are
+ * split by hash across two new leaves and block 0 becomes the index root.
+ * 
+ * @param dd the directory to convert.
+ * 
+ * @returns 0 on success, -ENOSPC if the directory can't grow.
+*/
+static int dx_convert(inode_t* dd) {
+    int count = dd->size / SIZE_DIRENT;
+    dirent_t* entries = dir_block(dd, 0);
+    int split = sort_and_split(entries, count);
+    if(split < 0) {
+        return -ENOSPC;
+    }
+    int rv = grow_inode(dd, 3 * (int64_t)BLOCK_SIZE);
+    if(rv < 0) {
+        return rv;
+    }
+    dir_leaf_t* low = dir_block(dd, 1);
+    dir_leaf_t* high = dir_block(dd, 2);
+    low->kind = high->kind = DIR_LEAF_KIND;
+    low->count = split;
+    high->count = count - split;
+    memcpy(leaf_entries(low), entries, low->count * SIZE_DIRENT);
+    memcpy(leaf_entries(high), entries + split, high->count * SIZE_DIRENT);
+    block_dirty(low);
+    block_dirty(high);
+
+    dx_header_t* root = dir_block(dd, 0);
+    block_dirty(root);
+    root->kind = DIR_INDEX_KIND;
+    root->count = 2;
+    root->max = (BLOCK_SIZE - sizeof(dx_header_t)) / sizeof(dx_entry_t);
+    root->depth = 0;
+    root->entries = count;
+    dx_entries(root)[0].hash = 0;
+    dx_entries(root)[0].fbnum = 1;
+    dx_entries(root)[1].hash = name_hash(leaf_entries(high)[0].name);
+    dx_entries(root)[1].fbnum = 2;
+    dd->flags |= INODE_DIR_INDEX;
+    inode_dirty(dd);
+    return 0;
+}
+
+/**
+ * Adds a dirent to an indexed directory, splitting the leaf it belongs
+ * in (and index nodes above it) as needed.
+ * 
+ * @returns 0 on success, -ENOSPC if the directory can't grow.
+*/
+static int dx_put(inode_t* dd, const char* name, int inum) {
+    uint32_t hash = name_hash(name);
+    dx_path_t path[DIR_MAX_DEPTH];
+    for(;;) {
+        int depth = dx_find(dd, hash, path);
+        dir_leaf_t* leaf = dir_block(dd, dx_entries(path[depth].node)[path[depth].index].fbnum);
+        if(leaf->count < leaf_max()) {
+            dirent_t* new = leaf_entries(leaf) + leaf->count;
+            strcpy(new->name, name);
+            new->type = DIR_TYPE(get_inode(inum)->mode);
+            new->inum = inum;
+            leaf->count += 1;
+            ((dx_header_t*)dir_block(dd, 0))->entries += 1;
+            block_dirty(leaf);
+            block_dirty(dir_block(dd, 0));
+            return 0;
+        }
+        // The leaf is full, its index node needs room for a new sibling.
+        int rv;
+        if(path[depth].node->count == path[depth].node->max) {
+            rv = dx_make_room(dd, path, depth);
+        }
+        else {
+            int split = sort_and_split(leaf_entries(leaf), leaf->count);
+            block_dirty(leaf);
+            if(split < 0) {
+                return -ENOSPC;
+            }
+            rv = dir_append_block(dd);
+            if(rv >= 0) {
+                dir_leaf_t* sibling = dir_block(dd, rv);
+                sibling->kind = DIR_LEAF_KIND;
+                sibling->count = leaf->count - split;
+                memcpy(leaf_entries(sibling), leaf_entries(leaf) + split,
+                       sibling->count * SIZE_DIRENT);
+                block_dirty(sibling);
+                leaf->count = split;
+                dx_insert(path, depth, name_hash(leaf_entries(sibling)[0].name), rv);
+            }
+        }
+        if(rv < 0) {
+            return rv;
+        }
+    }
+}
+
+/**
+ * Finds the leaf of an indexed directory that would hold the name.
+*/
+static dir_leaf_t* dx_leaf(inode_t* dd, const char* name) {
+    dx_path_t path[DIR_MAX_DEPTH];
+    int depth = dx_find(dd, name_hash(name), path);
+    return dir_block(dd, dx_entries(path[depth].node)[path[depth].index].fbnum);
+}
+
+// The dirent for name in the directory, or NULL if there isn't one.
+static dirent_t* find_entry(inode_t* dd, const char* name) {
+    if(dd->size == 0) {
+        return NULL;
+    }
+    dirent_t* entry;
+    int count;
+    if(dd->flags & INODE_DIR_INDEX) {
+        dir_leaf_t* leaf = dx_leaf(dd, name);
+        entry = leaf_entries(leaf);
+        count = leaf->count;
+    }
+    else {
+        entry = dir_block(dd, 0);
+        count = dd->size / SIZE_DIRENT;
+    }
+    // Loop through all entries to find one that matches
+    for(int i = 0; i < count; ++i) {
+        if(strcmp((entry + i)->name, name) == 0) {
+            return entry + i;
+        }
+    }
+    return NULL;
 }
 
 /**
  * Looks for the given name on this directory and returns the inode
  * number associated with it. Returns -1 if not found or if not directory.
+ * Indexed directories only look through the one leaf the name hashes to.
  * 
  * @param dd the inode to the directory.
  * @param name the name to find in the directory
@@ -46,60 +392,123 @@ int directory_lookup(inode_t *dd, const char *name) {
     if(!is_directory(dd)) {
         return -1;
     }
-    printf("Searching for %s\n", name);
-    dirent_t* entry = blocks_get_block(dd->block);
-    // Loop through all entries to find one that matches
-    for(int i = 0; i < dd->size/SIZE_DIRENT; ++i) {
-        printf("Looking at directory entry %s\n", (entry + i)->name);
-        if(strcmp((entry + i)->name, name) == 0) {
-            printf("Found %s at %d\n", name, (entry + i)->inum);
-            return (entry + i)->inum;
-        }
+    dirent_t* entry = find_entry(dd, name);
+    return entry == NULL ? -1 : entry->inum;
+}
+
+/**
+ * Finds a name in the directory with the given inode number, going by the
+ * dcache when it knows the answer and caching it otherwise.
+ * 
+ * @param dir the inum of the directory to look in.
+ * @param name the name to look for.
+ * 
+ * @returns the inum the name refers to, or -1 if there isn't one.
+ */
+int tree_lookup_at(int dir, const char *name) {
+    stats_add(STATS_COMPONENTS, 1);
+    int inum = dcache_lookup(dir, name);
+    if(inum == DCACHE_MISS) {
+        inum = directory_lookup(get_inode(dir), name);
+        dcache_insert(dir, name, inum);
     }
-    return -1;
+    else {
+        stats_add(STATS_DCACHE_HITS, 1);
+    }
+    return inum;
 }
 
 /**
  * Finds the inode number at the given path, or -1 if there isn't one.
+ * Answers come from the dcache when it has them, and each name looked
+ * up along the way is cached for next time.
  * 
  * @param path: the absolute path to look for
  * 
  * @returns the inode at that path or -1 if there isn't one.
  */
 int tree_lookup(const char *path) {
-    printf("Looking for %s\n", path);
-    // Ignore the starting /
-    slist_t* jumps = s_explode(path + 1, '/');
-    slist_t* next = jumps;
-    int src = ROOT_INODE;
-    while(next != NULL && src != -1) {
-        printf("Looking for: %s\n", next->data);
-        src = directory_lookup(get_inode(src), next->data);
-        next = next->next;
+    stats_add(STATS_LOOKUPS, 1);
+    int src = dcache_lookup_path(path);
+    if(src != DCACHE_MISS) {
+        stats_add(STATS_PATH_HITS, 1);
+        TRACE_DEBUG(TRACE_LOOKUP, src, 1, 0, src);
+        TRACE_INUM(src);
+        return src;
+    }
+    path_iter_t iter;
+    path_iter_init(&iter, path);
+    // Paths through . or .. have other spellings, only cache plain ones
+    // so that invalidating a path catches every way it is cached.
+    int plain = 1;
+    src = ROOT_INODE;
+    while(src != -1 && path_iter_next(&iter)) {
+        // Nothing that long can be in a directory
+        if(iter.length >= DIR_NAME_LENGTH) {
+            src = -1;
+            break;
+        }
+        src = tree_lookup_at(src, iter.name);
+        if(strcmp(iter.name, ".") == 0 || strcmp(iter.name, "..") == 0) {
+            plain = 0;
+        }
+    }
+    if(plain) {
+        dcache_insert_path(path, src);
     }
-    s_free(jumps);
-    printf("Found at %d\n", src);
+    TRACE_DEBUG(TRACE_LOOKUP, src, 0, 0, src);
+    TRACE_INUM(src);
     return src;
 }
 /**
  * Adds a new inode to the directory under the given name.
- * Also increment references in inum by 1.
+ * Also increment references in inum by 1. The inode's mode must be set,
+ * its type is copied into the dirent.
  * 
  * @param dd the directory inode to add to
  * @param name the name of the new file to add to the directory
  * @param inum the inum of the file to add to directory.
+ * 
+ * @returns 0 on success, -ENAMETOOLONG if the name doesn't fit in a
+ *          dirent, or -ENOSPC if the directory can't grow.
 */
 int directory_put(inode_t *dd, const char *name, int inum) {
-    // We can add to it
-    printf("Putting %s, %d\n", name, inum);
-    if(dd->size + SIZE_DIRENT > BLOCK_SIZE) {
-        return -ENOSPC;
+    if(strlen(name) >= DIR_NAME_LENGTH) {
+        return -ENAMETOOLONG;
+    }
+    int rv;
+    if(!(dd->flags & INODE_DIR_INDEX) && dd->size + SIZE_DIRENT > BLOCK_SIZE) {
+        // Outgrew one block, switch over to a hash index.
+        rv = dx_convert(dd);
+        if(rv < 0) {
+            return rv;
+        }
     }
-    dirent_t* new = blocks_get_block(dd->block) + dd->size;
-    strcpy(new->name, name);
-    new->inum = inum;
-    get_inode(new->inum)->refs += 1;
-    grow_inode(dd, dd->size + SIZE_DIRENT);
+    if(dd->flags & INODE_DIR_INDEX) {
+        rv = dx_put(dd, name, inum);
+        if(rv < 0) {
+            return rv;
+        }
+    }
+    else {
+        // We can add to it
+        int64_t offset = dd->size;
+        rv = grow_inode(dd, dd->size + SIZE_DIRENT);
+        if(rv < 0) {
+            return rv;
+        }
+        dirent_t* new = dir_block(dd, 0) + offset;
+        strcpy(new->name, name);
+        new->type = DIR_TYPE(get_inode(inum)->mode);
+        new->inum = inum;
+        journal_dirty(new, SIZE_DIRENT);
+    }
+    // The size may not change, but its times do, and fsyncdir goes by the inode.
+    inode_touch(dd, 1);
+    get_inode(inum)->refs += 1;
+    inode_touch(get_inode(inum), 0);
+    dcache_insert(inode_get_inum(dd), name, inum);
+    TRACE_DEBUG(TRACE_DIR_PUT, inode_get_inum(dd), 0, 0, inum);
     return 0;
 }
 
@@ -110,29 +519,116 @@ int directory_put(inode_t *dd, const char *name, int inum) {
  * @param name the file name to delete from.
 */
 int directory_delete(inode_t *dd, const char *name) {
-    printf("Removing %s\n", name);
-    dirent_t* entry = blocks_get_block(dd->block);
+    if(dd->size == 0) {
+        return -ENOENT;
+    }
+    if(dd->flags & INODE_DIR_INDEX) {
+        // Fill the hole with the leaf's last entry, leaves stay unordered.
+        dir_leaf_t* leaf = dx_leaf(dd, name);
+        dirent_t* entry = leaf_entries(leaf);
+        for(int i = 0; i < leaf->count; ++i) {
+            if(strcmp((entry + i)->name, name) == 0) {
+                TRACE_DEBUG(TRACE_DIR_DELETE, inode_get_inum(dd), 0, 0,
+                            (entry + i)->inum);
+                decrement_references((entry + i)->inum);
+                dcache_insert(inode_get_inum(dd), name, -1);
+                leaf->count -= 1;
+                entry[i] = entry[leaf->count];
+                ((dx_header_t*)dir_block(dd, 0))->entries -= 1;
+                block_dirty(leaf);
+                block_dirty(dir_block(dd, 0));
+                inode_touch(dd, 1);
+                return 0;
+            }
+        }
+        return -ENOENT;
+    }
+    dirent_t* entry = dir_block(dd, 0);
     // Loop through all entries to find one that matches
     for(int i = 0; i < dd->size/SIZE_DIRENT; ++i) {
         if(strcmp((entry + i)->name, name) == 0) {
+            TRACE_DEBUG(TRACE_DIR_DELETE, inode_get_inum(dd), 0, 0,
+                        (entry + i)->inum);
             decrement_references((entry + i)->inum);
-            memcpy(entry + i, entry + i + 1, dd->size - ((i + 1) * SIZE_DIRENT));
+            dcache_insert(inode_get_inum(dd), name, -1);
+            memmove(entry + i, entry + i + 1, dd->size - ((i + 1) * SIZE_DIRENT));
+            journal_dirty(entry + i, dd->size - i * SIZE_DIRENT);
             shrink_inode(dd, dd->size - SIZE_DIRENT);
+            inode_touch(dd, 1);
             return 0;
         }
     }
     return -ENOENT;
 }
 
+/**
+ * Points a name already in the directory at another inode, as renaming
+ * over it does. The new inode gains a reference and the old one loses
+ * one. Nothing has to be allocated, so once the name is there this
+ * can't fail.
+ * 
+ * @param dd the directory inode
+ * @param name the name to change
+ * @param inum the inum it names from now on
+ * 
+ * @returns 0 on success, or -ENOENT if the name isn't there.
+*/
+int directory_set(inode_t *dd, const char *name, int inum) {
+    dirent_t* entry = find_entry(dd, name);
+    if(entry == NULL) {
+        return -ENOENT;
+    }
+    int old = entry->inum;
+    entry->type = DIR_TYPE(get_inode(inum)->mode);
+    entry->inum = inum;
+    journal_dirty(entry, SIZE_DIRENT);
+    inode_touch(dd, 1);
+    get_inode(inum)->refs += 1;
+    inode_touch(get_inode(inum), 0);
+    decrement_references(old);
+    dcache_insert(inode_get_inum(dd), name, inum);
+    TRACE_DEBUG(TRACE_DIR_PUT, inode_get_inum(dd), 0, 0, inum);
+    return 0;
+}
+
+/**
+ * Counts the entries in the directory, including . and ..
+ * 
+ * @param dd the directory inode to count.
+ * 
+ * @returns the number of entries.
+*/
+int directory_count(inode_t *dd) {
+    if(dd->flags & INODE_DIR_INDEX) {
+        return ((dx_header_t*)dir_block(dd, 0))->entries;
+    }
+    return dd->size / SIZE_DIRENT;
+}
+
 /**
  * Lists all the entries in this directory.
  * 
  * @param dd is the directory inode to list entries from.
 */
 slist_t *directory_list(inode_t* dd) {
-    printf("Getting entries\n");
-    dirent_t* entry = blocks_get_block(dd->block);
     slist_t* entries = NULL;
+    if(dd->size == 0) {
+        return entries;
+    }
+    if(dd->flags & INODE_DIR_INDEX) {
+        // Every block past the root is either an index node or a leaf.
+        for(int fbnum = 1; fbnum < bytes_to_blocks(dd->size); ++fbnum) {
+            dir_leaf_t* leaf = dir_block(dd, fbnum);
+            if(leaf->kind != DIR_LEAF_KIND) {
+                continue;
+            }
+            for(int i = 0; i < leaf->count; ++i) {
+                entries = s_cons(leaf_entries(leaf)[i].name, entries);
+            }
+        }
+        return entries;
+    }
+    dirent_t* entry = dir_block(dd, 0);
     // Loop through all entries
     for(int i = 0; i < dd->size/SIZE_DIRENT; ++i) {
         entries = s_cons((entry + i)->name, entries);
@@ -140,6 +636,123 @@ slist_t *directory_list(inode_t* dd) {
     return entries;
 }
 
+// A dirent with the hash of its name, for putting entries in readdir order.
+typedef struct dir_pos {
+    uint32_t hash;
+    dirent_t* entry;
+} dir_pos_t;
+
+// Orders dirents by hash, then by name among names with the same hash.
+static int compare_pos(const void* a, const void* b) {
+    const dir_pos_t* pa = a;
+    const dir_pos_t* pb = b;
+    if(pa->hash != pb->hash) {
+        return pa->hash < pb->hash ? -1 : 1;
+    }
+    return strcmp(pa->entry->name, pb->entry->name);
+}
+
+/**
+ * Moves a path from dx_find on to the next leaf in hash order.
+ * 
+ * @returns 1 if there is one, 0 after the last leaf.
+*/
+static int dx_next(inode_t* dd, dx_path_t* path, int depth) {
+    int level = depth;
+    while(level >= 0 && path[level].index + 1 >= path[level].node->count) {
+        level -= 1;
+    }
+    if(level < 0) {
+        return 0;
+    }
+    path[level].index += 1;
+    for(; level < depth; ++level) {
+        path[level + 1].node = dir_block(dd, dx_entries(path[level].node)[path[level].index].fbnum);
+        path[level + 1].index = 0;
+    }
+    return 1;
+}
+
+/**
+ * Passes the dirents of one block at or past the offset to fill, in hash
+ * order (see directory_read).
+ * 
+ * @param pos room for count entries to sort them in.
+ * 
+ * @returns 1 if fill stopped early, 0 otherwise.
+*/
+static int read_entries(dirent_t* entries, int count, off_t offset, dir_pos_t* pos,
+                        dir_filler_t fill, void* arg) {
+    uint32_t start = offset >> DIR_RANK_BITS;
+    int found = 0;
+    for(int i = 0; i < count; ++i) {
+        uint32_t hash = name_hash(entries[i].name);
+        if(hash >= start) {
+            pos[found].hash = hash;
+            pos[found].entry = entries + i;
+            found += 1;
+        }
+    }
+    qsort(pos, found, sizeof(dir_pos_t), compare_pos);
+    int rank = 0;
+    for(int i = 0; i < found; ++i) {
+        rank = i > 0 && pos[i].hash == pos[i - 1].hash ? rank + 1 : 0;
+        off_t at = ((off_t)pos[i].hash << DIR_RANK_BITS) + rank;
+        if(at < offset) {
+            continue;
+        }
+        dirent_t* entry = pos[i].entry;
+        if(fill(arg, entry->name, entry->inum, entry->type, at + 1)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Passes the entries of the directory to fill one at a time, starting at
+ * the given offset, until it runs out or fill asks to stop. Entries come
+ * in hash order, and the offset of an entry is the hash of its name with
+ * how many names of the same hash sort before it in the low DIR_RANK_BITS,
+ * like ext4's htree. Offsets don't change as other entries come and go or
+ * leaves split, so deleting entries while reading a page at a time never
+ * skips the ones left. An indexed directory only reads the leaves from the
+ * offset's hash on.
+ * 
+ * @param dd the directory inode to read.
+ * @param offset 0 to start at the beginning, otherwise the next offset
+ *               passed to fill with the last entry taken.
+ * @param fill called with each entry.
+ * @param arg passed on to fill.
+ * 
+ * @returns 0 once every entry was passed, 1 if fill stopped early, or
+ *          -ENOMEM.
+*/
+int directory_read(inode_t *dd, off_t offset, dir_filler_t fill, void *arg) {
+    if(dd->size == 0) {
+        return 0;
+    }
+    // A leaf or a whole unindexed directory is at most a block of dirents.
+    dir_pos_t* pos = malloc(BLOCK_SIZE / SIZE_DIRENT * sizeof(dir_pos_t));
+    if(pos == NULL) {
+        return -ENOMEM;
+    }
+    int rv = 0;
+    if(dd->flags & INODE_DIR_INDEX) {
+        dx_path_t path[DIR_MAX_DEPTH];
+        int depth = dx_find(dd, offset >> DIR_RANK_BITS, path);
+        do {
+            dir_leaf_t* leaf = dir_block(dd, dx_entries(path[depth].node)[path[depth].index].fbnum);
+            rv = read_entries(leaf_entries(leaf), leaf->count, offset, pos, fill, arg);
+        } while(rv == 0 && dx_next(dd, path, depth));
+    }
+    else {
+        rv = read_entries(dir_block(dd, 0), dd->size / SIZE_DIRENT, offset, pos, fill, arg);
+    }
+    free(pos);
+    return rv;
+}
+
 /**
  * Prints what the directory looks like.
  * 
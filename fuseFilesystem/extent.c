@@ -0,0 +1,454 @@
+/**
+ * @file extent.c
+ *
+ * Extent tree implementation. Lookups binary search one node per level, so
+ * finding the block behind any file offset is O(log n) in the number of
+ * extents. Appends that land right after the previous run on disk simply
+ * lengthen that run, so sequentially written files stay a handful of extents.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+
+#include "helpers/blocks.h"
+#include "helpers/extent.h"
+#include "helpers/journal.h"
+
+// One step of a root-to-leaf walk through the tree.
+typedef struct extent_path {
+  extent_header_t *node;
+  int index; // entry followed (interior) or found (leaf), -1 for none
+} extent_path_t;
+
+static extent_t *leaf_entries(extent_header_t *node) {
+  return (extent_t *) (node + 1);
+}
+
+static extent_index_t *index_entries(extent_header_t *node) {
+  return (extent_index_t *) (node + 1);
+}
+
+static int entry_size(int depth) {
+  return depth ? sizeof(extent_index_t) : sizeof(extent_t);
+}
+
+static int entry_key(extent_header_t *node, int i) {
+  return node->depth ? index_entries(node)[i].fbnum : leaf_entries(node)[i].fbnum;
+}
+
+static extent_header_t *child_node(extent_header_t *node, int i) {
+  return blocks_get_block(index_entries(node)[i].bnum);
+}
+
+// How many entries of the given depth fit in a block-sized node.
+static int block_node_max(int depth) {
+  return (BLOCK_SIZE - sizeof(extent_header_t)) / entry_size(depth);
+}
+
+// Mark a node as changed, for the journal.
+static void node_dirty(extent_header_t *node) {
+  journal_dirty(node, sizeof(extent_header_t) + node->max * entry_size(node->depth));
+}
+
+// Mark every node on a walk, ahead of changing any of them.
+static void path_dirty(extent_path_t *path, int depth) {
+  for (int level = 0; level <= depth; ++level) {
+    node_dirty(path[level].node);
+  }
+}
+
+// Index of the last entry whose key is <= fbnum, or -1 if there is none.
+static int node_search(extent_header_t *node, int fbnum) {
+  int lo = 0;
+  int hi = node->count - 1;
+  int found = -1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (entry_key(node, mid) <= fbnum) {
+      found = mid;
+      lo = mid + 1;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return found;
+}
+
+// Walk from the root to the leaf that would hold fbnum, returning the depth.
+static int find(extent_root_t *root, int fbnum, extent_path_t *path) {
+  extent_header_t *node = &root->header;
+  int depth = node->depth;
+  for (int level = 0; level <= depth; ++level) {
+    int i = node_search(node, fbnum);
+    path[level].node = node;
+    if (node->depth > 0) {
+      // Interior nodes are never empty, go left when fbnum is below them all.
+      i = i < 0 ? 0 : i;
+      path[level].index = i;
+      node = child_node(node, i);
+    } else {
+      path[level].index = i;
+    }
+  }
+  return depth;
+}
+
+// Move the leaf at path[depth] on to the next extent in file order.
+static int next_entry(extent_path_t *path, int depth) {
+  if (path[depth].index + 1 < path[depth].node->count) {
+    path[depth].index += 1;
+    return 1;
+  }
+  for (int level = depth - 1; level >= 0; --level) {
+    if (path[level].index + 1 < path[level].node->count) {
+      path[level].index += 1;
+      for (int down = level + 1; down <= depth; ++down) {
+        path[down].node = child_node(path[down - 1].node, path[down - 1].index);
+        path[down].index = 0;
+      }
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Lower the keys above a node whose first entry now starts at fbnum.
+static void fix_keys(extent_path_t *path, int level, int fbnum) {
+  for (int up = level - 1; up >= 0; --up) {
+    extent_index_t *index = &index_entries(path[up].node)[path[up].index];
+    if (index->fbnum <= fbnum) {
+      return;
+    }
+    index->fbnum = fbnum;
+    if (path[up].index != 0) {
+      return;
+    }
+  }
+}
+
+// Raise the keys above a node whose first entry moved up, so that nothing
+// inserted into the node before it can reach past its key.
+static void raise_keys(extent_path_t *path, int level) {
+  int fbnum = entry_key(path[level].node, 0);
+  for (int up = level - 1; up >= 0; --up) {
+    index_entries(path[up].node)[path[up].index].fbnum = fbnum;
+    if (path[up].index != 0) {
+      return;
+    }
+  }
+}
+
+// Push the contents of the root down into a new block, adding a level.
+static int grow_root(extent_root_t *root) {
+  int bnum = alloc_block();
+  if (bnum == -1) {
+    return -ENOSPC;
+  }
+  extent_header_t *node = blocks_get_block(bnum);
+  node->depth = root->header.depth;
+  node->count = root->header.count;
+  node->max = block_node_max(node->depth);
+  memcpy(node + 1, root->entries, node->count * entry_size(node->depth));
+  node_dirty(node);
+
+  root->header.depth += 1;
+  root->header.count = 1;
+  root->header.max = EXTENT_ROOT_SIZE / sizeof(extent_index_t);
+  index_entries(&root->header)[0].fbnum = entry_key(node, 0);
+  index_entries(&root->header)[0].bnum = bnum;
+  return 0;
+}
+
+// Split the full node at path[level] in two. Its parent must have room.
+static int split(extent_path_t *path, int level, int fbnum) {
+  extent_header_t *node = path[level].node;
+  extent_path_t *parent = &path[level - 1];
+
+  // Appends move nothing so that sequential files pack their nodes full.
+  // Interior nodes always keep an entry on each side.
+  int at = node->count / 2;
+  if (path[level].index == node->count - 1) {
+    at = node->depth ? node->count - 1 : node->count;
+  }
+
+  int bnum = alloc_block();
+  if (bnum == -1) {
+    return -ENOSPC;
+  }
+  extent_header_t *sibling = blocks_get_block(bnum);
+  int size = entry_size(node->depth);
+  sibling->depth = node->depth;
+  sibling->max = block_node_max(node->depth);
+  sibling->count = node->count - at;
+  memcpy(sibling + 1, (char *) (node + 1) + at * size, sibling->count * size);
+  node_dirty(sibling);
+  node->count = at;
+
+  extent_index_t *entries = index_entries(parent->node);
+  int i = parent->index + 1;
+  memmove(&entries[i + 1], &entries[i],
+          (parent->node->count - i) * sizeof(extent_index_t));
+  entries[i].fbnum = sibling->count ? entry_key(sibling, 0) : fbnum;
+  entries[i].bnum = bnum;
+  parent->node->count += 1;
+  return 0;
+}
+
+// Free up an entry in the full node at path[level].
+static int make_room(extent_root_t *root, extent_path_t *path, int level,
+                     int fbnum) {
+  if (level == 0) {
+    return grow_root(root);
+  }
+  extent_header_t *parent = path[level - 1].node;
+  if (parent->count == parent->max) {
+    return make_room(root, path, level - 1, fbnum);
+  }
+  return split(path, level, fbnum);
+}
+
+// Drop the entry at path[level], releasing nodes that become empty.
+static void delete_entry(extent_root_t *root, extent_path_t *path, int level) {
+  extent_header_t *node = path[level].node;
+  int i = path[level].index;
+  int size = entry_size(node->depth);
+  char *entries = (char *) (node + 1);
+  memmove(entries + i * size, entries + (i + 1) * size,
+          (node->count - i - 1) * size);
+  node->count -= 1;
+
+  if (node->count > 0) {
+    if (i == 0) {
+      raise_keys(path, level);
+    }
+    return;
+  }
+  if (level > 0) {
+    free_block(index_entries(path[level - 1].node)[path[level - 1].index].bnum);
+    delete_entry(root, path, level - 1);
+  } else {
+    extent_init(root);
+  }
+}
+
+// Pull a lone child back into the root while its entries fit there.
+static void shrink_root(extent_root_t *root) {
+  while (root->header.depth > 0 && root->header.count == 1) {
+    int bnum = index_entries(&root->header)[0].bnum;
+    extent_header_t *node = blocks_get_block(bnum);
+    int max = EXTENT_ROOT_SIZE / entry_size(node->depth);
+    if (node->count > max) {
+      return;
+    }
+    node_dirty(&root->header);
+    root->header.depth = node->depth;
+    root->header.count = node->count;
+    root->header.max = max;
+    memcpy(root->entries, node + 1, node->count * entry_size(node->depth));
+    free_block(bnum);
+  }
+}
+
+// Set up an empty tree.
+void extent_init(extent_root_t *root) {
+  root->header.count = 0;
+  root->header.depth = 0;
+  root->header.max = EXTENT_ROOT_SIZE / sizeof(extent_t);
+}
+
+// Find the disk block backing the given file block.
+int extent_lookup(extent_root_t *root, int fbnum, int *run) {
+  extent_path_t path[EXTENT_MAX_DEPTH + 1];
+  int depth = find(root, fbnum, path);
+  int i = path[depth].index;
+  if (run != NULL) {
+    *run = 0;
+  }
+  if (i < 0) {
+    return -1;
+  }
+  extent_t *ext = &leaf_entries(path[depth].node)[i];
+  if (fbnum >= ext->fbnum + ext->count) {
+    return -1;
+  }
+  if (run != NULL) {
+    *run = ext->count - (fbnum - ext->fbnum);
+  }
+  return ext->bnum + (fbnum - ext->fbnum);
+}
+
+// Find the first mapped file block at or after fbnum.
+int extent_next(extent_root_t *root, int fbnum) {
+  extent_path_t path[EXTENT_MAX_DEPTH + 1];
+  int depth = find(root, fbnum, path);
+  int i = path[depth].index;
+  extent_t *ext = i < 0 ? NULL : &leaf_entries(path[depth].node)[i];
+  if (ext != NULL && fbnum < ext->fbnum + ext->count) {
+    return fbnum;
+  }
+  if (!next_entry(path, depth)) {
+    return -1;
+  }
+  return leaf_entries(path[depth].node)[path[depth].index].fbnum;
+}
+
+// Map count file blocks starting at fbnum to disk blocks starting at bnum.
+int extent_insert(extent_root_t *root, int fbnum, int bnum, int count) {
+  extent_path_t path[EXTENT_MAX_DEPTH + 1];
+  for (;;) {
+    int depth = find(root, fbnum, path);
+    path_dirty(path, depth);
+    extent_header_t *leaf = path[depth].node;
+    extent_t *entries = leaf_entries(leaf);
+    int i = path[depth].index;
+
+    if (i >= 0 && entries[i].fbnum + entries[i].count == fbnum &&
+        entries[i].bnum + entries[i].count == bnum) {
+      entries[i].count += count;
+      return 0;
+    }
+
+    if (leaf->count < leaf->max) {
+      memmove(&entries[i + 2], &entries[i + 1],
+              (leaf->count - i - 1) * sizeof(extent_t));
+      entries[i + 1].fbnum = fbnum;
+      entries[i + 1].bnum = bnum;
+      entries[i + 1].count = count;
+      leaf->count += 1;
+      if (i + 1 == 0) {
+        fix_keys(path, depth, fbnum);
+      }
+      return 0;
+    }
+
+    assert(depth < EXTENT_MAX_DEPTH);
+    int rv = make_room(root, path, depth, fbnum);
+    if (rv < 0) {
+      return rv;
+    }
+  }
+}
+
+// Unmap count file blocks starting at fbnum and free their disk blocks.
+int extent_remove(extent_root_t *root, int fbnum, int count) {
+  extent_path_t path[EXTENT_MAX_DEPTH + 1];
+  long end = (long) fbnum + count;
+  for (;;) {
+    int depth = find(root, fbnum, path);
+    int i = path[depth].index;
+    extent_t *ext = i < 0 ? NULL : &leaf_entries(path[depth].node)[i];
+    if (ext == NULL || ext->fbnum + ext->count <= fbnum) {
+      if (!next_entry(path, depth)) {
+        break;
+      }
+      ext = &leaf_entries(path[depth].node)[path[depth].index];
+    }
+    if (ext->fbnum >= end) {
+      break;
+    }
+    path_dirty(path, depth);
+
+    long ext_end = (long) ext->fbnum + ext->count;
+    int first = ext->fbnum > fbnum ? ext->fbnum : fbnum;
+    int last = ext_end < end ? ext_end : end;
+
+    if (first > ext->fbnum && last < ext_end) {
+      // Punching out the middle leaves a tail that needs its own entry. Add
+      // it first so running out of space leaves the tree untouched, then cut
+      // the head down to meet it and let the next pass free the gap.
+      int head = ext->fbnum;
+      int rv = extent_insert(root, last, ext->bnum + (last - ext->fbnum),
+                             ext_end - last);
+      if (rv < 0) {
+        return rv;
+      }
+      depth = find(root, head, path);
+      path_dirty(path, depth);
+      ext = &leaf_entries(path[depth].node)[path[depth].index];
+      ext->count = last - head;
+      continue;
+    }
+
+    for (int b = first; b < last; ++b) {
+      free_block(ext->bnum + (b - ext->fbnum));
+    }
+    if (first == ext->fbnum && last == ext_end) {
+      delete_entry(root, path, depth);
+    } else if (first == ext->fbnum) {
+      ext->bnum += last - first;
+      ext->count -= last - first;
+      ext->fbnum = last;
+      if (path[depth].index == 0) {
+        raise_keys(path, depth);
+      }
+    } else {
+      ext->count = first - ext->fbnum;
+    }
+  }
+  shrink_root(root);
+  return 0;
+}
+
+// Make fbnum start an extent of its own, if it is inside one.
+static int split_at(extent_root_t *root, int fbnum) {
+  extent_path_t path[EXTENT_MAX_DEPTH + 1];
+  int depth = find(root, fbnum, path);
+  int i = path[depth].index;
+  extent_t *ext = i < 0 ? NULL : &leaf_entries(path[depth].node)[i];
+  if (ext == NULL || ext->fbnum == fbnum || ext->fbnum + ext->count <= fbnum) {
+    return 0;
+  }
+  // The same as punching out the middle in extent_remove.
+  int head = ext->fbnum;
+  int rv = extent_insert(root, fbnum, ext->bnum + (fbnum - head),
+                         ext->count - (fbnum - head));
+  if (rv < 0) {
+    return rv;
+  }
+  depth = find(root, head, path);
+  path_dirty(path, depth);
+  ext = &leaf_entries(path[depth].node)[path[depth].index];
+  ext->count = fbnum - head;
+  return 0;
+}
+
+// Move count mapped file blocks from fbnum over to the disk blocks at bnum.
+int extent_replace(extent_root_t *root, int fbnum, int bnum, int count) {
+  int rv = split_at(root, fbnum);
+  if (rv == 0) {
+    rv = split_at(root, fbnum + count);
+  }
+  if (rv < 0) {
+    return rv;
+  }
+  extent_path_t path[EXTENT_MAX_DEPTH + 1];
+  int depth = find(root, fbnum, path);
+  path_dirty(path, depth);
+  extent_t *entries = leaf_entries(path[depth].node);
+  int i = path[depth].index;
+  assert(i >= 0 && entries[i].fbnum == fbnum && entries[i].count == count);
+  for (int b = 0; b < count; ++b) {
+    free_block(entries[i].bnum + b);
+  }
+  entries[i].bnum = bnum;
+  // Rewriting a file a run at a time leaves one extent, not one per run.
+  if (i > 0 && entries[i - 1].fbnum + entries[i - 1].count == fbnum &&
+      entries[i - 1].bnum + entries[i - 1].count == bnum) {
+    entries[i - 1].count += count;
+    delete_entry(root, path, depth);
+  }
+  return 0;
+}
+
+// Get the file block just past the last mapped one.
+int extent_end(extent_root_t *root) {
+  extent_header_t *node = &root->header;
+  while (node->depth > 0) {
+    node = child_node(node, node->count - 1);
+  }
+  if (node->count == 0) {
+    return 0;
+  }
+  extent_t *last = &leaf_entries(node)[node->count - 1];
+  return last->fbnum + last->count;
+}
@@ -0,0 +1,97 @@
+// Open file handle table.
+//
+// Handles are allocated in chunks that are never moved or freed, so
+// handle_get is a plain array index without any locking. Free slots are
+// kept on a stack and reused before a new chunk is added.
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "helpers/handle.h"
+
+// Handles per chunk of the table.
+#define HANDLE_CHUNK 1024
+
+static handle_t *chunks[HANDLE_MAX / HANDLE_CHUNK];
+static int chunk_count = 0;
+
+// Slots given back by handle_free, ready for reuse.
+static int *free_slots = NULL;
+static int free_count = 0;
+
+// Guards everything above, but not the contents of the handles.
+static pthread_mutex_t handle_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Adds a chunk, putting all of its slots on the free stack.
+static int add_chunk() {
+  if(chunk_count == HANDLE_MAX / HANDLE_CHUNK) {
+    return -ENFILE;
+  }
+  // The stack only ever has to hold every slot there is.
+  int *slots = realloc(free_slots, (chunk_count + 1) * HANDLE_CHUNK * sizeof(int));
+  if(slots == NULL) {
+    return -ENFILE;
+  }
+  free_slots = slots;
+  handle_t *chunk = calloc(HANDLE_CHUNK, sizeof(handle_t));
+  if(chunk == NULL) {
+    return -ENFILE;
+  }
+  // Hand out the low slots of the chunk first.
+  int first = chunk_count * HANDLE_CHUNK;
+  for(int i = HANDLE_CHUNK - 1; i >= 0; --i) {
+    free_slots[free_count++] = first + i;
+  }
+  chunks[chunk_count++] = chunk;
+  return 0;
+}
+
+/**
+ * Opens a handle on an inode.
+ *
+ * @param node the file being opened.
+ * @param inum its inode number.
+ * @param flags what the handle may be used for, HANDLE_* flags.
+ *
+ * @returns the handle to put in fi->fh, or -ENFILE if there are too many
+ *          open files.
+ */
+int handle_alloc(inode_t *node, int inum, int flags) {
+  pthread_mutex_lock(&handle_mutex);
+  int rv = 0;
+  if(free_count == 0) {
+    rv = add_chunk();
+  }
+  if(rv == 0) {
+    rv = free_slots[--free_count];
+    handle_t *handle = &chunks[rv / HANDLE_CHUNK][rv % HANDLE_CHUNK];
+    handle->node = node;
+    handle->inum = inum;
+    handle->flags = flags;
+  }
+  pthread_mutex_unlock(&handle_mutex);
+  return rv;
+}
+
+/**
+ * Gets an open handle.
+ *
+ * @param fh a handle returned by handle_alloc and not yet freed.
+ *
+ * @returns the handle.
+ */
+handle_t *handle_get(uint64_t fh) {
+  return &chunks[fh / HANDLE_CHUNK][fh % HANDLE_CHUNK];
+}
+
+/**
+ * Closes a handle so that its slot can be reused.
+ *
+ * @param fh a handle returned by handle_alloc.
+ */
+void handle_free(uint64_t fh) {
+  pthread_mutex_lock(&handle_mutex);
+  free_slots[free_count++] = fh;
+  pthread_mutex_unlock(&handle_mutex);
+}
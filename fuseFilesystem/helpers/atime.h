@@ -0,0 +1,83 @@
+/**
+ * @file atime.h
+ *
+ * Lazy access times.
+ *
+ * Reads follow relatime: a read only moves an inode's atime when the atime
+ * is no later than its mtime or ctime, or is a day old. Even then the inode
+ * isn't changed. The new atime waits here, and stat reports it from here,
+ * until a batch of them is written back in one journal transaction: once
+ * ATIME_BATCH are waiting or the oldest has waited ATIME_INTERVAL seconds
+ * (checked as reads come in), on fsync, and when the image is closed. An
+ * inode journaled for any other reason takes its waiting atime along (see
+ * inode_touch). Like lazytime, a crash only loses the atimes still waiting.
+ *
+ * A waiting atime only counts while it is later than the inode's atime and
+ * ctime. An inode freed and allocated again was made after the read, so it
+ * never picks up the old inode's atime.
+ */
+#ifndef ATIME_H
+#define ATIME_H
+
+#include <stdint.h>
+
+#include "inode.h"
+
+// How old an atime gets before a read moves it anyway, in nanoseconds.
+#define ATIME_RELATIME ((int64_t) 24 * 60 * 60 * 1000000000)
+
+// Atimes waiting that start a write back.
+#define ATIME_BATCH 256
+
+// Seconds the oldest waits before a read starts a write back.
+#define ATIME_INTERVAL 60
+
+/**
+ * Record a read of an inode, if relatime says its atime should move.
+ *
+ * @param inum The inode.
+ * @param node It, locked for reading at least.
+ * @param now The time of the read, from inode_now.
+ *
+ * @return 1 if the atimes waiting should be written back (with atime_take)
+ *         once the lock is dropped, 0 if not.
+ */
+int atime_note(int inum, inode_t *node, int64_t now);
+
+/**
+ * Get an inode's atime, the waiting one if there is one.
+ *
+ * @param inum The inode.
+ * @param node It, locked for reading at least.
+ */
+int64_t atime_get(int inum, inode_t *node);
+
+/**
+ * Stop an atime from waiting, because the inode is being written anyway.
+ *
+ * @param inum The inode.
+ * @param node It, locked for writing, its ctime not yet changed.
+ *
+ * @return Its atime, the waiting one if there was one.
+ */
+int64_t atime_forget(int inum, inode_t *node);
+
+/**
+ * Take atimes to write back, leaving them no longer waiting.
+ *
+ * @param inums Set to the inodes.
+ * @param times Set to their atimes. Check that each is still later than
+ *              the inode's atime and ctime before writing it.
+ * @param max Room in both.
+ *
+ * @return How many were taken, 0 once none are waiting.
+ */
+int atime_take(int *inums, int64_t *times, int max);
+
+/**
+ * Forget every waiting atime without writing it, for when a new image is
+ * loaded.
+ */
+void atime_clear();
+
+#endif
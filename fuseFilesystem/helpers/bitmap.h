@@ -7,6 +7,8 @@
 #ifndef BITMAP_H
 #define BITMAP_H
 
+#include <stdint.h>
+
 /**
  * Get the given bit from the bitmap.
  *
@@ -34,4 +36,84 @@ void bitmap_put(void *bm, int i, int v);
  */
 void bitmap_print(void *bm, int size);
 
+/**
+ * An allocator over a bitmap where set bits are in use.
+ *
+ * The bitmap is scanned 64 bits at a time. Two summary levels sit on top of
+ * it: bit w of free_words is set when word w of the bitmap has a clear bit,
+ * and bit g of free_groups is set when word g of free_words is non-zero. A
+ * search skips full stretches 4096 words (262144 bits) at a time. Only the
+ * bitmap lives in the image, the summaries are rebuilt when it is loaded.
+ *
+ * Nothing here locks, so callers must serialize use of an allocator, and
+ * every change to the bitmap has to go through it to keep the summaries
+ * right.
+ */
+typedef struct bitmap_alloc {
+  uint64_t *words;        // the bitmap, bit i is bit i % 64 of word i / 64
+  long bits;              // bits in use, anything past them counts as set
+  long nwords;            // words covering bits
+  uint64_t *free_words;   // level 1 summary
+  uint64_t *free_groups;  // level 2 summary
+  long hint;              // where the last allocation ended (next fit)
+  long free;              // clear bits, counted once and then kept up to date
+  long scanned;           // words looked at by searches, only ever grows
+} bitmap_alloc_t;
+
+/**
+ * Set up an allocator over the given bitmap, building its summaries and
+ * counting its clear bits.
+ *
+ * @param ba The allocator to set up.
+ * @param bm The bitmap, which must be 8 byte aligned and a multiple of 8
+ *           bytes long.
+ * @param bits How many bits of the bitmap are used.
+ *
+ * @return 0 on success, -1 if the summaries could not be allocated.
+ */
+int bitmap_alloc_init(bitmap_alloc_t *ba, void *bm, long bits);
+
+/**
+ * Release the summaries of an allocator.
+ *
+ * @param ba The allocator to tear down.
+ */
+void bitmap_alloc_free(bitmap_alloc_t *ba);
+
+/**
+ * Set or clear a bit, keeping the summaries up to date.
+ *
+ * @param ba The allocator.
+ * @param i Bit index.
+ * @param v Value the bit should be set to (0 or 1).
+ */
+void bitmap_alloc_put(bitmap_alloc_t *ba, long i, int v);
+
+/**
+ * Find the first clear bit at or after goal (wrapping around) and set it,
+ * along with up to max - 1 clear bits right after it.
+ *
+ * @param ba The allocator.
+ * @param goal Where to start looking, or -1 to carry on from the last
+ *             allocation.
+ * @param max Most bits to take.
+ * @param got If not NULL, set to how many bits were taken.
+ *
+ * @return The first bit taken, or -1 if every bit is set.
+ */
+long bitmap_alloc_first(bitmap_alloc_t *ba, long goal, int max, int *got);
+
+/**
+ * Find count clear bits in a row, the first run at or after goal (wrapping
+ * around), and set them.
+ *
+ * @param ba The allocator.
+ * @param goal Where to start looking, or -1 to carry on from the last
+ *             allocation.
+ * @param count How many bits are needed.
+ *
+ * @return The first bit of the run, or -1 if there is no long enough run.
+ */
+long bitmap_alloc_run(bitmap_alloc_t *ba, long goal, int count);
+
 #endif
@@ -26,5 +26,21 @@ int main(int argc, char **argv) {
   bitmap_put(bm, 255, 1);
   bitmap_print(bm, SIZE);
 
+  bitmap_alloc_t ba;
+  bitmap_alloc_init(&ba, bm, SIZE);
+
+  printf("\nAllocating one bit: %ld\n", bitmap_alloc_first(&ba, -1, 1, NULL));
+  printf("Allocating the next one: %ld\n", bitmap_alloc_first(&ba, -1, 1, NULL));
+
+  int got;
+  long first = bitmap_alloc_first(&ba, 60, 10, &got);
+  printf("Allocating up to 10 from bit 60: %d from %ld\n", got, first);
+
+  printf("Allocating a run of 100: %ld\n", bitmap_alloc_run(&ba, -1, 100));
+  printf("Allocating a run of 100 more: %ld\n", bitmap_alloc_run(&ba, -1, 100));
+  bitmap_print(bm, SIZE);
+  printf("Bits still free: %ld\n", ba.free);
+
+  bitmap_alloc_free(&ba);
   return 0;
 }
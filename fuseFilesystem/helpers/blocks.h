@@ -5,17 +5,73 @@
  * A block-based abstraction over a disk image file.
  *
  * The disk image is mmapped, so block data is accessed using pointers.
+ * The mapping is private: metadata changed through it only reaches the image
+ * through the journal (see journal.h), and file data is read and written
+ * with blocks_read and blocks_write instead.
  */
 #ifndef BLOCKS_H
 #define BLOCKS_H
 
+#include <stdint.h>
 #include <stdio.h>
 
-#define BLOCK_COUNT 256 // we split the "disk" into blocks (default = 256)
-#define BLOCK_SIZE 4096  // default = 4K
-#define NUFS_SIZE BLOCK_SIZE * BLOCK_COUNT   // default = 1MB
+#include "bitmap.h"
+#include "extent.h"
 
-#define BLOCK_BITMAP_SIZE BLOCK_COUNT/8 // default = 256 / 8 = 32
+// Marks the first block of an image as a nufs superblock ("nufs").
+#define NUFS_MAGIC 0x7366756e
+#define NUFS_VERSION 6 // 2: 256 byte inodes with inline data, 3: typed dirents,
+                       // 4: metadata journal, 5: snapshots and shared blocks,
+                       // 6: timestamps
+
+// Set in features when new files are compressed (see compress.h).
+#define SUPER_COMPRESS 01
+// Set in features when identical blocks are stored once (see dedup.h).
+#define SUPER_DEDUP 02
+// Every feature this nufs knows, images with any other are refused.
+#define SUPER_FEATURES (SUPER_COMPRESS | SUPER_DEDUP)
+
+#define MIN_BLOCK_SIZE 1024
+#define MAX_BLOCK_SIZE 65536
+
+// Geometry of images made on the fly when mounting an empty file.
+#define DEFAULT_BLOCK_COUNT 256 // we split the "disk" into blocks (default = 256)
+#define DEFAULT_BLOCK_SIZE 4096  // default = 4K
+#define DEFAULT_INODE_COUNT 256
+
+// Largest size a growable image may reach when no limit was given.
+#define MAX_GROW_SIZE (1LL << 40) // 1TB
+
+/**
+ * Describes the layout of the image. Stored at the start of block 0 and
+ * read back by blocks_init, so one binary can mount any geometry.
+ */
+typedef struct superblock {
+  uint32_t magic;              // NUFS_MAGIC
+  uint32_t version;            // NUFS_VERSION
+  uint32_t block_size;         // bytes per block, a power of two
+  uint32_t block_count;        // blocks in the image, including this one
+  uint32_t inode_count;        // slots in the inode table
+  uint32_t block_bitmap_start; // first block of the free block bitmap
+  uint32_t block_bitmap_blocks; // blocks set aside for the block bitmap
+  uint32_t inode_bitmap_start; // first block of the free inode bitmap
+  uint32_t inode_table_start;  // first block of the inode table
+  uint32_t journal_start;      // first block of the journal, right after the inode table
+  uint32_t journal_blocks;     // blocks set aside for the journal
+  uint32_t data_start;         // first block handed out by alloc_block
+  uint32_t grow_blocks;        // blocks added when the image fills up (0 = never)
+  uint32_t max_block_count;    // most blocks growing may reach (0 = no limit)
+  uint32_t free_blocks;        // blocks not in use, kept current by the allocator
+  uint32_t free_inodes;        // inodes not in use, kept current by the allocator
+  uint32_t snapshots;          // block listing the snapshots, 0 before the first
+  uint32_t features;           // SUPER_* flags
+  extent_root_t block_refs;    // blocks of extra owner counts, see blocks_share
+} superblock_t;
+
+// Geometry of the mounted image.
+#define BLOCK_SIZE ((int) get_superblock()->block_size)
+#define BLOCK_COUNT ((int) get_superblock()->block_count)
+#define INODE_COUNT ((int) get_superblock()->inode_count)
 
 /** 
  * Compute the number of blocks needed to store the given number of bytes.
@@ -24,20 +80,51 @@
  *
  * @return Number of blocks needed to store the given number of bytes.
  */
-int bytes_to_blocks(int bytes);
+int bytes_to_blocks(int64_t bytes);
 
 /**
- * Load and initialize the given disk image.
+ * Write a fresh superblock and empty bitmaps to the given disk image,
+ * creating or resizing the file as needed. Any previous contents are lost.
+ * The blocks holding the superblock, bitmaps, inode table and journal are
+ * marked as used.
  *
  * @param image_path Path to the disk image file.
+ * @param block_size Bytes per block, a power of two from MIN_BLOCK_SIZE to
+ *                   MAX_BLOCK_SIZE.
+ * @param block_count Number of blocks in the image.
+ * @param inode_count Number of inodes the image can hold.
+ * @param inode_blocks Number of blocks to reserve for the inode table.
+ *
+ * @return 0 on success, -1 if the geometry is invalid or the image could
+ *         not be written.
  */
-void blocks_init(const char *image_path);
+int blocks_format(const char *image_path, int block_size, int block_count,
+                  int inode_count, int inode_blocks);
 
 /**
- * Close the disk image.
+ * Load the given disk image, taking its geometry from the superblock.
+ * The last transaction in the journal is replayed first, and the image is
+ * locked so that no other process can load it until blocks_free.
+ *
+ * @param image_path Path to the disk image file.
+ *
+ * @return 0 on success, -1 if the image can't be opened or has no valid
+ *         superblock.
+ */
+int blocks_init(const char *image_path);
+
+/**
+ * Commit any metadata changes still in the journal and close the disk image.
  */
 void blocks_free();
 
+/**
+ * Return a pointer to the superblock of the loaded image.
+ *
+ * @return A pointer to the superblock at the start of block 0.
+ */
+superblock_t *get_superblock();
+
 /**
  * Get the block with the given index, returning a pointer to its start.
  *
@@ -47,6 +134,45 @@ void blocks_free();
  */
 void *blocks_get_block(int bnum);
 
+/**
+ * Read file data from the image. Never read file data through the mapping,
+ * it may hold an old copy of a block that used to be metadata.
+ *
+ * @param bnum The block to start in.
+ * @param offset Where in the block to start, may run on into the next ones.
+ * @param buf Where to put the data.
+ * @param size How many bytes to read.
+ *
+ * @return 0 on success, -EIO if the image couldn't be read.
+ */
+int blocks_read(int bnum, size_t offset, void *buf, size_t size);
+
+/**
+ * Write file data to the image, see blocks_read.
+ *
+ * @return 0 on success, -EIO or -ENOSPC if the image couldn't be written.
+ */
+int blocks_write(int bnum, size_t offset, const void *buf, size_t size);
+
+/**
+ * Zero file data in the image, punching a hole where the host allows it.
+ *
+ * @return 0 on success, -EIO or -ENOSPC if the image couldn't be written.
+ */
+int blocks_zero(int bnum, size_t offset, size_t size);
+
+/**
+ * Copy file data from one run of blocks to another, see blocks_read. The
+ * host file system may share the data between them instead.
+ *
+ * @param to The first block to copy to.
+ * @param from The first block to copy from.
+ * @param count How many blocks to copy.
+ *
+ * @return 0 on success, -EIO or -ENOSPC if the image couldn't be written.
+ */
+int blocks_copy(int to, int from, int count);
+
 /**
  * Return a pointer to the beginning of the block bitmap.
  *
@@ -61,20 +187,175 @@ void *get_blocks_bitmap();
  */
 void *get_inode_bitmap();
 
+/**
+ * Return a pointer to the beginning of the inode table.
+ *
+ * @return A pointer to the first inode, a snapshot's once one is mounted.
+ */
+void *get_inode_table();
+
+/**
+ * Show a snapshot's inode bitmap and table in place of the live ones, for
+ * mounting it read only. Nothing reaches the image from then on, and
+ * writing file data fails with -EROFS.
+ *
+ * @param inode_bitmap The first block of the snapshot's inode bitmap.
+ * @param inode_table The first block of its inode table.
+ */
+void blocks_read_only(int inode_bitmap, int inode_table);
+
+/**
+ * Take the lock that guards both bitmaps and the size of the image.
+ *
+ * alloc_block, alloc_block_near, blocks_grow and free_block take it
+ * themselves. Hold it around any other use of the bitmaps.
+ */
+void alloc_lock();
+
+/**
+ * Release the lock taken by alloc_lock, first storing the free block and
+ * inode counts in the superblock.
+ */
+void alloc_unlock();
+
 /**
  * Allocate a new block and return its number.
  *
- * Grabs the first unused block and marks it as allocated.
+ * Grabs the next unused block after the last one handed out and marks it as
+ * allocated. If the image is full and was made growable, it is extended first (see blocks_grow).
  *
  * @return The index of the newly allocated block.
  */
 int alloc_block();
 
 /**
- * Deallocate the block with the given number.
+ * Allocate a new block, preferring the given one.
+ *
+ * Scans forward from goal (wrapping around) so that blocks allocated one
+ * after another for the same file end up next to each other on disk.
+ *
+ * @param goal The block number we would like to get.
+ *
+ * @return The index of the newly allocated block, or -1 if the disk is full.
+ */
+int alloc_block_near(int goal);
+
+/**
+ * Allocate a run of up to max blocks, preferring the given block.
+ *
+ * Takes the first free block at or after goal (wrapping around) and as many
+ * free blocks right after it as it can, up to max.
+ *
+ * @param goal The block number we would like to get.
+ * @param max The most blocks to take.
+ * @param got If not NULL, set to how many blocks were taken.
+ *
+ * @return The first block of the run, or -1 if the disk is full.
+ */
+int alloc_blocks_near(int goal, int max, int *got);
+
+/**
+ * Allocate exactly count blocks that are next to each other on disk.
+ *
+ * @param goal The block number we would like the run to start at.
+ * @param count How many blocks are needed.
+ *
+ * @return The first block of the run, or -1 if there is no room for one.
+ */
+int alloc_run(int goal, int count);
+
+/**
+ * Return the allocator over the inode bitmap. Hold the allocation lock while
+ * using it.
+ *
+ * @return The inode bitmap's allocator.
+ */
+bitmap_alloc_t *get_inode_allocator();
+
+/**
+ * Extend the image by grow_blocks blocks (but not past max_block_count).
+ *
+ * The file is lengthened and the new blocks mapped in place, so pointers to
+ * existing blocks stay valid. The block bitmap moves to a bigger spot in the
+ * new space when it runs out of bits. The inode table never grows.
+ *
+ * @return 0 if blocks were added, -1 if the image can't grow.
+ */
+int blocks_grow();
+
+/**
+ * Deallocate the block with the given number, or take away one of its
+ * owners if it is shared (see blocks_share).
+ *
+ * The block isn't handed out again until the journal has committed the
+ * free (see blocks_release).
  *
  * @param bnun The block number to deallocate.
  */
 void free_block(int bnum);
 
+/**
+ * Give count blocks starting at bnum one more owner each. A shared block
+ * is only freed once free_block has been called for every owner, and must
+ * not be written to (see inode_unshare).
+ *
+ * The counts live in blocks of their own, mapped by the superblock's
+ * block_refs tree and only made for the parts of the image that need them.
+ *
+ * @param bnum The first block to share.
+ * @param count How many blocks to share.
+ *
+ * @return 0 on success, -ENOSPC (sharing none of them) if there was no
+ *         room to keep count.
+ */
+int blocks_share(int bnum, int count);
+
+/**
+ * Check whether a block has more than one owner.
+ *
+ * @param bnum The block to check.
+ *
+ * @return nonzero if it does.
+ */
+int blocks_shared(int bnum);
+
+/**
+ * Mark a block of file data that the dedup index points at (see dedup.h).
+ * The mark is kept in memory only, and goes once the block is freed or
+ * blocks_unmark is called. Does nothing unless the image has SUPER_DEDUP.
+ *
+ * @param bnum The block to mark.
+ */
+void blocks_mark(int bnum);
+
+/**
+ * Drop the marks of blocks that are about to be written in place, so the
+ * dedup index can no longer share them (see inode_unshare).
+ *
+ * @param bnum The first block.
+ * @param count How many blocks.
+ */
+void blocks_unmark(int bnum, int count);
+
+/**
+ * Give a marked block one more owner, checking the mark and taking the
+ * owner as one step so the block can't be freed or written in between.
+ *
+ * @param bnum The block to share.
+ *
+ * @return 0 on success, -1 if the block isn't marked or already has as
+ *         many owners as dedup gives a block, or -ENOSPC if there was no
+ *         room to keep count.
+ */
+int blocks_share_marked(int bnum);
+
+/**
+ * Make blocks freed by a committed transaction available again. Called by
+ * the journal.
+ *
+ * @param bnums The blocks to release.
+ * @param count How many there are.
+ */
+void blocks_release(const int *bnums, long count);
+
 #endif
@@ -6,6 +6,8 @@
 #define TEST_NAME "block_test.img"
 
 int main(int argc, char **argv) {
+  blocks_format(TEST_NAME, DEFAULT_BLOCK_SIZE, DEFAULT_BLOCK_COUNT,
+                DEFAULT_INODE_COUNT, 1);
   blocks_init(TEST_NAME);
 
   printf("Block bitmap at the beginning:\n");
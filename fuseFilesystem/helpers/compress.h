@@ -0,0 +1,80 @@
+/**
+ * @file compress.h
+ *
+ * Transparent compression of file data.
+ *
+ * Regular files made on an image with SUPER_COMPRESS set (mkfs.nufs -z)
+ * carry INODE_COMPRESSED, and their blocks are grouped into clusters of
+ * COMPRESS_CLUSTER_SIZE bytes. A cluster is one of:
+ *  - a hole: none of its blocks are mapped, it reads as zeros.
+ *  - raw: its first block is mapped, and it is kept like the blocks of any
+ *    other file, holes and all.
+ *  - packed: its first block is a hole, and its last few blocks are a run
+ *    holding a 4 byte length and then the cluster compressed with lz.
+ *
+ * Writing a whole cluster, or the end of one, compresses it, and it is
+ * kept packed when that saves at least a block. Writing part of a packed
+ * cluster decompresses it, changes it and compresses it again. Packed
+ * blocks are never written in place: the new ones are written elsewhere
+ * before the old ones are freed, so snapshots share them like any other
+ * blocks and a decompressed copy cached by disk block can't go stale.
+ * Only the bytes up to the end of the file are compressed, whatever a
+ * packed cluster holds past the end is dropped when the file grows.
+ */
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <sys/types.h>
+
+#include "inode.h"
+
+#define COMPRESS_CLUSTER_SIZE (64 * 1024)
+#define COMPRESS_CLUSTER_BLOCKS (COMPRESS_CLUSTER_SIZE / BLOCK_SIZE)
+
+/**
+ * Check whether the cluster a block of a compressed file is in is packed.
+ *
+ * @param node The file.
+ * @param fbnum A block of the file.
+ *
+ * @return 1 if it is packed, 0 if it is raw or a hole.
+ */
+int compress_packed(inode_t *node, int fbnum);
+
+/**
+ * Read part of a packed cluster, decompressing it unless it is cached.
+ *
+ * @param node The file, locked for reading at least.
+ * @param buf Where to put the bytes.
+ * @param size How many, all within the cluster.
+ * @param offset Where in the file they start.
+ *
+ * @return 0 on success, -EIO if the image can't be read or the cluster is
+ *         corrupt, -ENOMEM if there's no memory for the cache.
+ */
+int compress_read(inode_t *node, char *buf, size_t size, off_t offset);
+
+/**
+ * Write part of a cluster of a compressed file, and store the cluster
+ * compressed if it saves space or raw if it doesn't. The rest of the
+ * cluster is read back first unless the write covers it.
+ *
+ * @param node The file, locked for writing, already as big as the write.
+ * @param buf The bytes to write, or NULL to zero them. Zeroing never
+ *            makes the file's last cluster longer.
+ * @param size How many, all within the cluster.
+ * @param offset Where in the file they go.
+ *
+ * @return 0 on success, -ENOSPC if the disk is full, -EIO if the image
+ *         can't be read or written, -ENOMEM if there's no memory for the
+ *         cache. The cluster is left as it was, unless a packed one had to
+ *         go raw and the disk was too full for that.
+ */
+int compress_write(inode_t *node, const char *buf, size_t size, off_t offset);
+
+/**
+ * Forget every decompressed cluster, for when a new image is loaded.
+ */
+void compress_cache_clear();
+
+#endif
@@ -0,0 +1,27 @@
+// Path resolution cache.
+//
+// Remembers what names resolved to, both per directory ((dir inum, name) ->
+// inum) and for whole paths (path -> inum), including names that were not
+// found. Everything lives in fixed-size set-associative tables, so nothing
+// is allocated and old entries are simply overwritten.
+
+#ifndef DCACHE_H
+#define DCACHE_H
+
+// Returned by lookups when the cache has nothing to say about a name.
+// Otherwise the answer is an inum, or -1 for a name known to be missing.
+#define DCACHE_MISS -2
+
+// Paths longer than this are resolved one name at a time.
+#define DCACHE_PATH_LENGTH 120
+
+void dcache_clear(); // Forgets everything, for when an image is mounted
+int dcache_lookup(int dir, const char *name);
+void dcache_insert(int dir, const char *name, int inum);
+int dcache_lookup_path(const char *path);
+void dcache_insert_path(const char *path, int inum);
+void dcache_invalidate_path(const char *path, int subtree); // Drops path and, when subtree
+                                                            // is set, everything below it
+void dcache_invalidate_paths(); // Drops every path, for changes made by inum
+
+#endif
@@ -0,0 +1,65 @@
+/**
+ * @file dedup.h
+ *
+ * Block-level deduplication of file data.
+ *
+ * On an image with SUPER_DEDUP set (mkfs.nufs -d), every whole block a
+ * file write covers is hashed. When the index already knows a block with
+ * the same bytes, the file maps that block as one more of its owners, the
+ * same way a snapshot shares blocks, instead of writing a new one. Writing
+ * to a shared block later copies it first, like any other. Compressed
+ * files and directories are never deduplicated.
+ *
+ * Sharing a block mustn't cost the file more in its extent tree than it
+ * saves, so a block is only shared where the file's extents stay whole:
+ * right after the block the file's previous block maps to, at the start of
+ * a run of shared blocks at least two long, or after a hole. A block
+ * repeated over and over in one file is written like any other.
+ *
+ * The index lives in memory only and starts empty at each mount, so only
+ * blocks written since then are found. It is a fixed size table of hashes
+ * that forgets the oldest entries of a set as it fills. A block is only
+ * handed out while the block layer still has it marked (see blocks_mark),
+ * and its bytes are compared before it is shared, so a stale entry or two
+ * blocks with the same hash never share anything they shouldn't.
+ */
+#ifndef DEDUP_H
+#define DEDUP_H
+
+/**
+ * Forget every block in the index, for when a new image is loaded.
+ */
+void dedup_clear();
+
+/**
+ * Find the block the index last saw the same bytes as a block of data in,
+ * without sharing it.
+ *
+ * @param data BLOCK_SIZE bytes.
+ *
+ * @return The block, which may no longer hold them, or -1 if there is none.
+ */
+int dedup_lookup(const void *data);
+
+/**
+ * Make the caller one more owner of a block, if it may still be handed
+ * out (see blocks_mark) and holds the same bytes as a block of data.
+ *
+ * @param data BLOCK_SIZE bytes.
+ * @param bnum The block, from dedup_lookup or the one right after a block
+ *             of the same file.
+ *
+ * @return 0 if it is now shared, -1 if it isn't.
+ */
+int dedup_share(const void *data, int bnum);
+
+/**
+ * Add a block that was just written to the index, and mark it so it can
+ * be shared.
+ *
+ * @param data Its BLOCK_SIZE bytes.
+ * @param bnum The block.
+ */
+void dedup_insert(const void *data, int bnum);
+
+#endif
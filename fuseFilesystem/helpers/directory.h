@@ -7,7 +7,9 @@
 #ifndef DIRECTORY_H
 #define DIRECTORY_H
 
-#define DIR_NAME_LENGTH 28
+#define DIR_NAME_LENGTH 27
+
+#include <sys/types.h>
 
 #include "blocks.h"
 #include "inode.h"
@@ -15,17 +17,63 @@
 
 typedef struct dirent {
   char name[DIR_NAME_LENGTH];
+  uint8_t type; // DIR_TYPE of the inode's mode, so listings needn't read it
   int inum;
 } dirent_t;
 
 #define SIZE_DIRENT sizeof(dirent_t)
 
+// The file type bits of a mode, as in a struct dirent's d_type.
+#define DIR_TYPE(mode) (((mode) >> 12) & 017)
+
+// Called by directory_read for each entry. next is the offset to read from
+// to carry on after this entry. Returns nonzero to stop reading.
+typedef int (*dir_filler_t)(void *arg, const char *name, int inum, int type,
+                            off_t next);
+
+// Bits of a directory_read offset below the name hash, counting names with
+// the same hash.
+#define DIR_RANK_BITS 16
+
+// Directories start out as a packed array of dirents in one block. Once
+// that block is full the directory switches to a hash index (INODE_DIR_INDEX)
+// like ext4's htree: block 0 holds the root of a tree of index nodes keyed on
+// the hash of the name, and the entries live in leaf blocks below it.
+#define DIR_INDEX_KIND 0x78646e69 // "indx"
+#define DIR_LEAF_KIND 0x6661656c  // "leaf"
+
+// Most index levels kept under the root (plenty for millions of entries).
+#define DIR_MAX_DEPTH 3
+
+typedef struct dx_header {
+  int kind;    // DIR_INDEX_KIND
+  int count;   // index entries in use
+  int max;     // index entries that fit in the block
+  int depth;   // index levels below this one, 0 if entries point at leaves
+  int entries; // dirents in the whole directory (only kept in the root)
+} dx_header_t;
+
+typedef struct dx_entry {
+  uint32_t hash; // lowest name hash that can be found below this entry
+  int fbnum;     // directory block holding the child
+} dx_entry_t;
+
+// Takes up the first dirent slot of every leaf block.
+typedef struct dir_leaf {
+  int kind;  // DIR_LEAF_KIND
+  int count; // dirents in use, packed right after this slot
+} dir_leaf_t;
+
 void directory_init();
 int directory_lookup(inode_t *dd, const char *name);
 int tree_lookup(const char *path);
+int tree_lookup_at(int dir, const char *name); // Like directory_lookup, through the dcache
 int directory_put(inode_t *dd, const char *name, int inum);
 int directory_delete(inode_t *dd, const char *name);
+int directory_set(inode_t *dd, const char *name, int inum); // Renames over a name
+int directory_count(inode_t *dd); // Number of entries, including . and ..
 slist_t *directory_list(inode_t* dd);
+int directory_read(inode_t *dd, off_t offset, dir_filler_t fill, void *arg);
 void print_directory(inode_t *dd);
 int is_directory(inode_t* node); // Checks if the inode is a directory.
 
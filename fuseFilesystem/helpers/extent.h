@@ -0,0 +1,110 @@
+/**
+ * @file extent.h
+ *
+ * An extent tree mapping file block numbers to disk blocks.
+ *
+ * Every node starts with an extent_header_t followed by `max` entries. Leaf
+ * nodes (depth 0) hold extent_t runs, interior nodes hold extent_index_t
+ * pointers to the node one level down. The root lives inside the inode and
+ * all other nodes take up a whole block.
+ */
+#ifndef EXTENT_H
+#define EXTENT_H
+
+// Bytes available for entries in the root stored inside the inode.
+#define EXTENT_ROOT_SIZE 48
+
+// Deepest tree we will ever build (a 4K block fans out ~340 ways).
+#define EXTENT_MAX_DEPTH 5
+
+typedef struct extent_header {
+  int count; // entries in use
+  int max;   // entries that fit in this node
+  int depth; // 0 for leaves, otherwise the height above the leaves
+} extent_header_t;
+
+typedef struct extent {
+  int fbnum; // first file block covered by this run
+  int bnum;  // disk block backing fbnum
+  int count; // number of contiguous blocks in the run
+} extent_t;
+
+typedef struct extent_index {
+  int fbnum; // lowest file block that can be found below this entry
+  int bnum;  // disk block holding the child node
+} extent_index_t;
+
+typedef struct extent_root {
+  extent_header_t header;
+  char entries[EXTENT_ROOT_SIZE];
+} extent_root_t;
+
+/**
+ * Set up an empty tree.
+ *
+ * @param root The root to initialize.
+ */
+void extent_init(extent_root_t *root);
+
+/**
+ * Find the disk block backing the given file block.
+ *
+ * @param root The tree to search.
+ * @param fbnum The file block to look for.
+ * @param run If not NULL, set to the number of blocks starting at fbnum that
+ *            are contiguous on disk (0 when fbnum is not mapped).
+ *
+ * @return The disk block number, or -1 if fbnum is not mapped.
+ */
+int extent_lookup(extent_root_t *root, int fbnum, int *run);
+
+/**
+ * Find the first mapped file block at or after fbnum, to skip over a hole.
+ *
+ * @param root The tree to search.
+ * @param fbnum Where to start looking.
+ *
+ * @return fbnum itself if it is mapped, the start of the next extent if it
+ *         is not, or -1 if nothing from fbnum on is mapped.
+ */
+int extent_next(extent_root_t *root, int fbnum);
+
+/**
+ * Map count file blocks starting at fbnum to the disk blocks starting at
+ * bnum. The file range must not already be mapped. Runs that continue the
+ * preceding extent on disk are merged into it.
+ *
+ * @return 0 on success, -ENOSPC if a tree block could not be allocated.
+ */
+int extent_insert(extent_root_t *root, int fbnum, int bnum, int count);
+
+/**
+ * Unmap count file blocks starting at fbnum, freeing their disk blocks and
+ * any tree nodes left empty.
+ *
+ * @return 0 on success, -ENOSPC if splitting an extent needed a tree block
+ *         that could not be allocated.
+ */
+int extent_remove(extent_root_t *root, int fbnum, int count);
+
+/**
+ * Map count file blocks starting at fbnum to the disk blocks starting at
+ * bnum instead of the ones they are mapped to now, which are freed. The
+ * range must be mapped by a single extent, as reported by extent_lookup.
+ *
+ * @return 0 on success, -ENOSPC (leaving the mapping as it was) if
+ *         splitting the extent needed a tree block that could not be
+ *         allocated.
+ */
+int extent_replace(extent_root_t *root, int fbnum, int bnum, int count);
+
+/**
+ * Get the file block just past the last mapped one.
+ *
+ * @param root The tree to inspect.
+ *
+ * @return The end of the last extent, or 0 for an empty tree.
+ */
+int extent_end(extent_root_t *root);
+
+#endif
@@ -0,0 +1,32 @@
+// Open file handles.
+//
+// open resolves a path once and keeps the inum, along with what the open
+// allowed, in a slot of the handle table. FUSE hands the slot number back
+// in fi->fh on every read and write, so those never walk the tree.
+
+#ifndef HANDLE_H
+#define HANDLE_H
+
+#include <stdint.h>
+
+#include "inode.h"
+
+// What an open allows, checked against the mode once when opening.
+#define HANDLE_READ 01
+#define HANDLE_WRITE 02
+
+// Most files that can be open at once.
+#define HANDLE_MAX (1 << 20)
+
+typedef struct handle {
+  inode_t *node; // the open file, the inode table never moves
+  int inum;      // its number
+  int flags;     // HANDLE_* flags
+} handle_t;
+
+int handle_alloc(inode_t *node, int inum, int flags); // A new handle, or -ENFILE
+                                                      // when all are in use
+handle_t *handle_get(uint64_t fh);     // The handle returned by handle_alloc
+void handle_free(uint64_t fh);
+
+#endif
@@ -7,30 +7,76 @@
 #ifndef INODE_H
 #define INODE_H
 
+#include <limits.h>
+#include <stdint.h>
+
 #include "blocks.h"
+#include "extent.h"
 
 // Location of root directory inode
 #define ROOT_INODE 0
 
+// Set on directories that have outgrown one block and use a hash index.
+#define INODE_DIR_INDEX 01
+// Set while the contents fit in the inode itself and it owns no blocks.
+#define INODE_INLINE 02
+// Set on files whose blocks are kept in compressed clusters (see compress.h).
+#define INODE_COMPRESSED 04
+
+// Bytes of file data that fit inside the inode (6 dirents for directories).
+#define INODE_INLINE_SIZE 208
+
 typedef struct inode {
   int refs;  // reference count
   int mode;  // permission & type
-  int size;  // bytes
-  int block; // single block pointer (if max file size <= 4K)
-
+  int64_t size; // bytes
+  int flags; // INODE_* flags
+  int opens; // open handles and front end pins, an unlinked inode lives on until they go
+  int64_t atime; // last read, nanoseconds since the epoch (lazily, see atime.h)
+  int64_t mtime; // last change to the contents
+  int64_t ctime; // last change to the contents or the inode
+  union {
+    extent_root_t extents; // file block -> disk block map
+    char data[INODE_INLINE_SIZE]; // the contents, with INODE_INLINE
+  };
 } inode_t;
 
 // Just to know how large our Inodes are (since that can change)
 #define INODE_SIZE sizeof(inode_t)
 
+// Largest file size, as far as extents can number its blocks.
+#define INODE_MAX_SIZE ((int64_t) INT_MAX * BLOCK_SIZE)
+
+void inode_lock(int inum, int write); // Locks an inode's contents, shared unless write
+void inode_unlock(int inum);
+void inode_lock_all(); // Locks every inode for writing, for taking a snapshot
+void inode_unlock_all();
 void print_inode(inode_t *node);
 inode_t *get_inode(int inum);
+void inode_dirty(inode_t *node); // Marks an inode as changed for the journal
+void inode_touch(inode_t *node, int contents); // The same for its times alone, setting
+                                               // its ctime (and mtime if contents) to now
+uint64_t inode_layout_id(int inum); // The transaction that last changed its size
+                                    // or blocks, for fdatasync
+int64_t inode_now(); // The time as the inodes keep it
+int inode_get_inum(inode_t *node); // The inum of an inode returned by get_inode
 int alloc_inode();
 void free_inode(int inum);
 void decrement_references(int inum); // Decreases the number of references an inode has 
                                      // and frees it if its out of references
-void grow_inode(inode_t *node, int size);
-void shrink_inode(inode_t *node, int size);
+int grow_inode(inode_t *node, int64_t size);
+void shrink_inode(inode_t *node, int64_t size);
 int inode_get_bnum(inode_t *node, int fbnum);
+int inode_get_run(inode_t *node, int fbnum, int *run); // Like inode_get_bnum, also reports
+                                                       // how many blocks follow contiguously
+void inode_init_data(inode_t *node); // Makes the inode empty, with no blocks
+int inode_unshare(inode_t *node, int fbnum, int count); // Copies blocks shared with
+                                                        // a snapshot before a write
+int inode_next_data(inode_t *node, int fbnum); // The first block from fbnum on that
+                                               // isn't a hole, -1 if there is none
+int inode_fill_hole(inode_t *node, int fbnum, int max, int *run); // Allocates blocks for
+                                               // a hole, like inode_get_run after
+int inode_preallocate(inode_t *node, int64_t offset, int64_t size);
+int inode_punch(inode_t *node, int64_t offset, int64_t size);
 
 #endif
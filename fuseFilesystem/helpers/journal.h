@@ -0,0 +1,90 @@
+// Write-ahead journal for metadata.
+//
+// The image is mapped privately, so nothing changed through the mapping
+// reaches the disk on its own. Code that changes metadata (the superblock,
+// bitmaps, inode table, directory blocks and extent nodes) marks what it
+// changed with journal_dirty, inside a journal_start/journal_stop pair. A
+// commit thread gathers everything marked since the last commit into one
+// transaction every JOURNAL_INTERVAL seconds, or sooner once it gets big,
+// so all the operations in between share its flushes. The transaction is
+// written to the journal area, then the commit block, and only then to the
+// blocks' home locations.
+//
+// The journal holds a single transaction at a time, so mounting replays at
+// most one. Replaying a transaction that already reached its home locations
+// changes nothing, so the last one is always replayed. A transaction too big
+// for the journal (a snapshot copies the whole inode table) is written the
+// same way to a run of free blocks, and committed by writing a block that
+// points at it to the journal. The run stays allocated until the next commit
+// replaces that block. With no room for the run, the image is left as of the
+// last commit and nothing more is written to it.
+//
+// File data never goes through the journal, it is written with pwrite and
+// reaches the disk no later than the commit that makes it part of a file.
+// Blocks can't be reused until the commit that frees them, so data is never
+// written over a block that a crash could give back to its old file.
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "blocks.h"
+
+// Marks journal blocks ("njnl").
+#define JOURNAL_MAGIC 0x6c6e6a6e
+#define JOURNAL_DESCRIPTOR 1 // followed by the home block numbers
+#define JOURNAL_COMMIT 2     // ends a transaction, after its block images
+#define JOURNAL_ELSEWHERE 3  // in place of a descriptor, the transaction
+                             // starts at block where instead
+
+// Seconds between commits when nothing asks for one sooner.
+#define JOURNAL_INTERVAL 5
+
+// Journal size picked by blocks_format, 1/64 of the image within these.
+#define JOURNAL_MIN_BLOCKS 16
+#define JOURNAL_MAX_BLOCKS 1024
+
+typedef struct journal_header {
+  uint32_t magic;    // JOURNAL_MAGIC
+  uint32_t kind;     // JOURNAL_DESCRIPTOR or JOURNAL_COMMIT
+  uint64_t seq;      // the transaction, the same in both blocks
+  uint32_t count;    // blocks in the transaction
+  uint32_t where;    // the run holding it, JOURNAL_ELSEWHERE only
+  uint64_t checksum; // of the block numbers and images, commit block only
+} journal_header_t;
+
+int journal_blocks_for(long block_count); // Journal size for a new image
+int journal_recover(int fd, superblock_t *sb); // Replays the last transaction, before
+                                               // mapping; -1 if it can't be read
+int journal_open(int fd);  // After mapping, the commit thread starts with
+                           // the first journal_start in each process
+void journal_close();      // Commits what's left and stops the thread
+void journal_grow(long block_count); // The image has grown, with the alloc lock held
+void journal_read_only(); // Commits what's left, then never writes again
+
+void journal_start(); // Starts changing metadata, waiting while a commit
+                      // freezes changes or the transaction is full
+void journal_stop();
+void journal_dirty(void *ptr, size_t size); // Marks mapped metadata as changed
+void journal_dirty_bits(void *bm, long first, long count); // The same for bits of a bitmap
+void journal_free(int bnum); // Frees a block once the running transaction is home
+int journal_freeing();        // Whether a commit would free some blocks
+void journal_flush(); // Commits everything so far and waits until it is home,
+                      // outside of journal_start
+
+// For fsync. These don't cost any I/O when there is nothing to make durable.
+void journal_dirty_data(int bnum, int count); // File data was written there
+int journal_write_back(int bnum, int count);  // Starts writing out the dirty data
+                                              // there, nonzero if there was any
+void journal_sync(void *ptr, size_t size, int data); // Waits until the metadata
+                                              // there, and the data written so far
+                                              // if data is set, is committed
+uint64_t journal_running(); // The running transaction, inside journal_start
+int journal_datasync(uint64_t id, int data); // Like journal_sync for a file last
+                                              // resized or remapped in transaction
+                                              // id, only flushing the data once
+                                              // that is home
+
+#endif
@@ -0,0 +1,43 @@
+// A small LZ77 codec for file data, in the LZ4 block format.
+//
+// Every sequence is a token byte whose high nibble is a count of literals
+// and low nibble a match length less LZ_MIN_MATCH, 15 in either meaning
+// more length bytes follow (each adding up to 255). Then come the literals,
+// then the match as a 2 byte little endian distance back into the output.
+// The last sequence is literals only. A hash of the next 4 bytes finds
+// match candidates, so compressing is a single pass with no searching, and
+// data that doesn't compress is skipped over faster the longer it goes on.
+
+#ifndef LZ_H
+#define LZ_H
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_DISTANCE 65535
+
+/**
+ * Compress size bytes of src into dst.
+ *
+ * @param src What to compress.
+ * @param size Bytes in src, at most 2^30.
+ * @param dst Where to put it.
+ * @param capacity Room in dst.
+ *
+ * @return The compressed size, or 0 if it doesn't fit in capacity.
+ */
+int lz_compress(const void *src, int size, void *dst, int capacity);
+
+/**
+ * Decompress what lz_compress made. Never reads or writes out of bounds,
+ * whatever src holds.
+ *
+ * @param src The compressed data.
+ * @param size Bytes in src.
+ * @param dst Where to put it.
+ * @param capacity Room in dst.
+ *
+ * @return The decompressed size, or -1 if src is corrupt or doesn't fit
+ *         in capacity.
+ */
+int lz_decompress(const void *src, int size, void *dst, int capacity);
+
+#endif
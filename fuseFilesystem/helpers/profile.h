@@ -0,0 +1,45 @@
+/**
+ * @file profile.h
+ *
+ * Mount profiles: how much of what nufs serves the kernel may cache, and
+ * how big the requests it sends may be. Both front ends pick one from
+ * $NUFS_PROFILE when they start, the first of these by default:
+ *  - cache: names, missing names and attributes are trusted for a minute,
+ *    a file's pages are kept from one open to the next, and writes come
+ *    in requests of up to 1MB.
+ *  - direct: the same, but file data bypasses the page cache, for streams
+ *    that are read or written once.
+ *  - plain: whatever FUSE does by default.
+ *
+ * Long timeouts are safe because nothing but the kernel changes a mounted
+ * image (it is locked while mounted), and the kernel forgets what it had
+ * cached of whatever it changes. /.nufs/stats is always direct. The one gap
+ * is in nufs, where each name of a file is a kernel inode of its own: a
+ * file with more than one name doesn't keep its pages between opens, and
+ * the attributes of its other names can lag behind a write by up to the
+ * attribute timeout. nufs_ll names files by inode and has no such gap.
+ */
+#ifndef PROFILE_H
+#define PROFILE_H
+
+typedef struct profile {
+  const char *name;
+  int defaults;           // leave FUSE's defaults alone, ignoring the rest
+  double entry_timeout;   // seconds names and missing names are trusted
+  double attr_timeout;    // seconds attributes are trusted
+  int keep_cache;         // keep a file's pages from one open to the next
+  int direct_io;          // read and write files around the page cache
+  unsigned max_write;     // biggest write request, FUSE may allow less
+  unsigned max_readahead; // most the kernel reads ahead, it may allow less
+} profile_t;
+
+/**
+ * Find a profile by name.
+ *
+ * @param name The profile, or NULL for the default.
+ *
+ * @return The profile, or NULL if there is none by that name.
+ */
+const profile_t *profile_find(const char *name);
+
+#endif
@@ -0,0 +1,51 @@
+// Whole file system snapshots.
+//
+// A snapshot is a copy of the inode bitmap and inode table, taken while
+// every inode is locked. Directories and extent trees are copied along
+// with the inodes, but file data is not: blocks_share gives each data
+// block the snapshot as another owner, and a file that writes to a shared
+// block gets its own copy of it first (inode_unshare). Taking one costs
+// time in the number of inodes and extents, never in the amount of data.
+//
+// The snapshots are listed in a single block. They are taken, listed and
+// deleted with the ioctls below on any file or directory of a mounted
+// nufs (see nufs_snap), and one can be mounted read only in place of the
+// live file system (see storage_mount_snapshot).
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+#define SNAP_NAME_LENGTH 32 // including the terminating zero
+#define SNAP_MAX 20         // the list has to fit in a 1K block
+
+typedef struct snapshot {
+  char name[SNAP_NAME_LENGTH];
+  int64_t made;   // when it was taken, in seconds since the epoch
+  uint32_t start; // first block of its inode bitmap, its inode table follows
+  uint32_t pad;
+} snapshot_t;
+
+typedef struct snap_list {
+  int count;
+  int pad;
+  snapshot_t snaps[SNAP_MAX];
+} snap_list_t;
+
+typedef struct snap_name {
+  char name[SNAP_NAME_LENGTH];
+} snap_name_t;
+
+#define NUFS_IOC_SNAP_CREATE _IOW('N', 1, snap_name_t)
+#define NUFS_IOC_SNAP_DELETE _IOW('N', 2, snap_name_t)
+#define NUFS_IOC_SNAP_LIST _IOR('N', 3, snap_list_t)
+
+// Taking and deleting them needs every inode locked, see inode_lock_all.
+int snapshot_create(const char *name); // -EINVAL for a bad name, -EEXIST, -ENOSPC
+int snapshot_delete(const char *name); // -ENOENT if there is no such snapshot
+void snapshot_list(snap_list_t *list);
+int snapshot_mount(const char *name);  // Shows its inodes instead, read only
+
+#endif
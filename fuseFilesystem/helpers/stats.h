@@ -0,0 +1,133 @@
+/**
+ * @file stats.h
+ *
+ * Live counters.
+ *
+ * Every FUSE callback counts its calls, its errors and how long it took, in
+ * a histogram with a power of two nanoseconds per bucket. The storage layer
+ * counts allocations with how far the allocator scanned for them, and
+ * lookups with how many names were walked and how many answers came from
+ * the dcache. Compressed files count how well their clusters compressed
+ * and how often the cluster cache had them, deduplicated images how many
+ * blocks were shared instead of written. Each thread counts into its
+ * own slot, so nothing is locked or shared while counting.
+ *
+ * The totals are read with NUFS_IOC_STATS on any file of a mounted nufs, or
+ * as text from /.nufs/stats, which both front ends serve without it being in
+ * the image. Counts only grow while nufs runs and start again from zero.
+ */
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+#define STATS_VERSION 1
+
+// Room in nufs_stats_t, more than there are ops and counters so that
+// adding some doesn't change the ioctl.
+#define STATS_MAX_OPS 40
+#define STATS_MAX_COUNTERS 16
+
+// Bucket b counts calls that took under 2^b ns, the last one any longer.
+#define STATS_BUCKETS 32
+
+// The virtual directory and file, and the handles they are open with.
+// Real handles are all below HANDLE_MAX.
+#define STATS_DIR_NAME ".nufs"
+#define STATS_FILE_NAME "stats"
+#define STATS_DIR_PATH "/" STATS_DIR_NAME
+#define STATS_FILE_PATH STATS_DIR_PATH "/" STATS_FILE_NAME
+#define STATS_DIR_FH ((uint64_t) 1 << 40)
+#define STATS_FILE_FH (STATS_DIR_FH + 1)
+
+// Longest the text of /.nufs/stats gets.
+#define STATS_TEXT_MAX (128 * 1024)
+
+typedef enum stats_counter {
+  STATS_BLOCK_ALLOCS,   // blocks handed out
+  STATS_BLOCK_SCANS,    // bitmap words looked at to find them
+  STATS_INODE_ALLOCS,   // inodes handed out
+  STATS_INODE_SCANS,    // bitmap words looked at to find them
+  STATS_LOOKUPS,        // paths looked up
+  STATS_PATH_HITS,      // paths found whole in the dcache
+  STATS_COMPONENTS,     // names looked up in a directory
+  STATS_DCACHE_HITS,    // names found in the dcache
+  STATS_CLUSTER_BYTES,  // bytes of clusters compressed files stored
+  STATS_CLUSTER_DISK_BYTES, // bytes of blocks they took
+  STATS_CLUSTER_HITS,   // packed clusters found in the cluster cache
+  STATS_CLUSTER_MISSES, // packed clusters decompressed
+  STATS_DEDUP_BLOCKS,   // blocks written as another owner of a same one
+  STATS_COUNTER_COUNT
+} stats_counter_t;
+
+// One op's totals, indexed by trace_op_t.
+typedef struct stats_op {
+  uint64_t count;
+  uint64_t errors;   // calls that returned a negative errno
+  uint64_t total_ns;
+  uint64_t buckets[STATS_BUCKETS];
+} stats_op_t;
+
+typedef struct nufs_stats {
+  uint32_t version;       // STATS_VERSION
+  uint32_t op_count;      // entries of ops in use, TRACE_OP_COUNT
+  uint32_t counter_count; // entries of counters in use, STATS_COUNTER_COUNT
+  uint32_t pad;
+  uint64_t free_blocks;
+  uint64_t total_blocks;
+  uint64_t free_inodes;
+  uint64_t total_inodes;
+  uint64_t counters[STATS_MAX_COUNTERS];
+  stats_op_t ops[STATS_MAX_OPS];
+} nufs_stats_t;
+
+#define NUFS_IOC_STATS _IOR('N', 4, nufs_stats_t)
+
+/**
+ * Get the time to pass to stats_op once the op is done.
+ *
+ * @return CLOCK_MONOTONIC nanoseconds.
+ */
+int64_t stats_now();
+
+/**
+ * Count a FUSE callback in the calling thread's slot.
+ *
+ * @param op A trace_op_t.
+ * @param start What stats_now returned when it started.
+ * @param result What it returned, negative errno on failure.
+ */
+void stats_op(int op, int64_t start, int64_t result);
+
+/**
+ * Add to a counter in the calling thread's slot.
+ *
+ * @param counter A stats_counter_t.
+ * @param by How much to add.
+ */
+void stats_add(int counter, uint64_t by);
+
+/**
+ * Sum every thread's slot. Threads may be counting while this runs, so a
+ * total can be missing their last few events, but no count is ever torn.
+ * Leaves the free and total fields for the caller.
+ *
+ * @param stats Where to put the totals.
+ */
+void stats_collect(nufs_stats_t *stats);
+
+/**
+ * Write out totals as text, in the Prometheus exposition format. Ops that
+ * were never called are left out.
+ *
+ * @param stats The totals.
+ * @param buf Where to write.
+ * @param size Bytes buf has room for.
+ *
+ * @return Bytes written, at most size - 1 as the text ends with a zero.
+ */
+int stats_format(const nufs_stats_t *stats, char *buf, size_t size);
+
+#endif
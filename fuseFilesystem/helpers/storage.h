@@ -8,6 +8,7 @@
 #define NUFS_STORAGE_H
 
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
@@ -19,20 +20,32 @@
 #include <math.h>
 #include <stdio.h>
 
-// Location of starting inode blocks, begins at first block
-#define INODE_BLOCK_BEGIN 1
+// Location of starting inode blocks, read from the superblock
+#define INODE_BLOCK_BEGIN ((int) get_superblock()->inode_table_start)
 
 // How many inodes are stored in one block
 #define INODES_PER_BLOCK (BLOCK_SIZE/INODE_SIZE)
 
 // Defines the number of blocks inodes will take up
-#define NUM_INODE_BLOCKS ceil((float)BLOCK_COUNT/INODES_PER_BLOCK)
+#define NUM_INODE_BLOCKS ((int) get_superblock()->journal_start - INODE_BLOCK_BEGIN)
 
-void storage_init(const char *path);
+int storage_format(const char *path, int block_size, int block_count, int inode_count);
+int storage_init(const char *path);
+void storage_close();
 int storage_stat(const char *path, struct stat *st);
 int storage_read(const char *path, char *buf, size_t size, off_t offset);
 int storage_write(const char *path, const char *buf, size_t size, off_t offset);
 int storage_truncate(const char *path, off_t size);
+int storage_chmod(const char *path, int mode);
+int storage_open(const char *path, int flags, uint64_t *fh);
+int storage_stat_handle(uint64_t fh, struct stat *st);
+int storage_read_handle(uint64_t fh, char *buf, size_t size, off_t offset);
+int storage_write_handle(uint64_t fh, const char *buf, size_t size, off_t offset);
+int storage_create(const char *path, int mode, int flags, uint64_t *fh);
+int storage_release(uint64_t fh);
+int storage_fallocate(uint64_t fh, int mode, off_t offset, off_t length);
+int storage_fsync(uint64_t fh, int datasync);
+int storage_flush(uint64_t fh);
 int storage_mknod(const char *path, int mode);
 int storage_unlink(const char *path);
 int storage_rmdir(const char *path);
@@ -41,4 +54,33 @@ int storage_rename(const char *from, const char *to);
 int storage_set_time(const char *path, const struct timespec ts[2]);
 slist_t *storage_list(const char *path);
 
+// Gets directory entries from storage_readdir, the same as fuse_fill_dir_t.
+typedef int (*storage_filler_t)(void *buf, const char *name,
+                                const struct stat *st, off_t next);
+int storage_opendir(const char *path, uint64_t *fh);
+int storage_readdir(uint64_t fh, off_t offset, storage_filler_t fill, void *buf);
+
+// The same by inode number, for front ends that resolve a name at a time.
+// Everything that fills in a stat pins the inode until storage_forget.
+int storage_lookup_at(int dir, const char *name, struct stat *st);
+void storage_forget(int inum, int count);
+int storage_stat_inum(int inum, struct stat *st);
+int storage_truncate_inum(int inum, off_t size);
+int storage_chmod_inum(int inum, int mode);
+int storage_set_time_inum(int inum, const struct timespec ts[2]);
+int storage_open_inum(int inum, int flags, uint64_t *fh);
+int storage_opendir_inum(int inum, uint64_t *fh);
+int storage_mknod_at(int dir, const char *name, int mode, struct stat *st);
+int storage_create_at(int dir, const char *name, int mode, int flags,
+                      struct stat *st, uint64_t *fh);
+int storage_link_at(int inum, int dir, const char *name, struct stat *st);
+int storage_unlink_at(int dir, const char *name);
+int storage_rmdir_at(int dir, const char *name);
+int storage_rename_at(int dir, const char *name, int new_dir, const char *new_name,
+                      int replace);
+int storage_statfs(struct statvfs *st);
+int storage_ioctl(unsigned int cmd, void *data);
+int storage_read_stats(char *buf, size_t size, off_t offset); // /.nufs/stats
+int storage_mount_snapshot(const char *name); // Read only, right after storage_init
+
 #endif
@@ -0,0 +1,151 @@
+/**
+ * @file trace.h
+ *
+ * Binary event tracing.
+ *
+ * Each thread records fixed-size events into its own ring buffer, so tracing
+ * takes no locks and never blocks. Once a ring is full the oldest events are
+ * overwritten. trace_dump writes every ring out to a file that nufs_trace
+ * decodes.
+ *
+ * How much gets recorded is picked at compile time with TRACE_LEVEL (see the
+ * Makefile's TRACE variable). Everything above it compiles to nothing, and the
+ * default records nothing at all.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_NONE 0   // record nothing (the default)
+#define TRACE_ERRORS 1 // FUSE callbacks that fail
+#define TRACE_OPS 2    // every FUSE callback
+#define TRACE_ALL 3    // storage internals as well
+
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL TRACE_NONE
+#endif
+
+// Dump files start with this ("ntrc") followed by a trace_header_t.
+#define TRACE_MAGIC 0x6372746e
+#define TRACE_VERSION 1
+
+// Events each thread keeps, a power of two.
+#define TRACE_RING_SIZE 8192
+
+// What an event records. Callbacks fill in offset and size from their
+// arguments; internal events say what the fields mean below.
+typedef enum trace_op {
+  TRACE_ACCESS,
+  TRACE_GETATTR,
+  TRACE_READDIR,
+  TRACE_MKNOD,
+  TRACE_MKDIR,
+  TRACE_UNLINK,
+  TRACE_LINK,
+  TRACE_RMDIR,
+  TRACE_RENAME,
+  TRACE_CHMOD,
+  TRACE_TRUNCATE,
+  TRACE_OPEN,
+  TRACE_READ,
+  TRACE_WRITE,
+  TRACE_UTIMENS,
+  TRACE_IOCTL,
+  TRACE_STATFS,
+  TRACE_CREATE,
+  TRACE_RELEASE,
+  TRACE_OPENDIR,
+  TRACE_RELEASEDIR,
+  TRACE_LL_LOOKUP,   // the callback in nufs_ll, not the path walk below
+  TRACE_FORGET,      // size the lookups dropped
+  TRACE_SETATTR,     // size the FUSE_SET_ATTR_* bits
+  TRACE_FSYNC,       // size the datasync flag
+  TRACE_FSYNCDIR,
+  TRACE_FLUSH,
+  TRACE_FALLOCATE,
+  TRACE_LOOKUP,      // offset 1 if the whole path was cached, result the inum
+  TRACE_DIR_PUT,     // inum the directory, result the inum added
+  TRACE_DIR_DELETE,  // inum the directory, result the inum removed
+  TRACE_ALLOC_INODE, // result the inum
+  TRACE_FREE_INODE,  // inum the inode
+  TRACE_RESIZE,      // inum the inode, offset the old size, size the new one
+  TRACE_ALLOC_BLOCK, // offset the goal, result the block
+  TRACE_FREE_BLOCK,  // offset the block
+  TRACE_GROW_IMAGE,  // offset the old block count, size the new one
+  TRACE_OP_COUNT
+} trace_op_t;
+
+typedef struct trace_event {
+  uint64_t time;   // CLOCK_MONOTONIC nanoseconds
+  uint16_t op;     // a trace_op_t
+  uint16_t thread; // numbered in the order threads first trace
+  int32_t inum;    // inode involved, -1 if none
+  int64_t offset;
+  int64_t size;
+  int64_t result;  // return value, negative errno on failure
+} trace_event_t;
+
+typedef struct trace_header {
+  uint32_t magic;      // TRACE_MAGIC
+  uint32_t version;    // TRACE_VERSION
+  uint32_t event_size; // sizeof(trace_event_t)
+  uint32_t count;      // events that follow
+} trace_header_t;
+
+// The inode the current thread last looked up, used by TRACE_OP.
+extern __thread int trace_inum;
+
+/**
+ * Record an event in the calling thread's ring. Use the macros below so
+ * that events above TRACE_LEVEL are compiled out.
+ */
+void trace_record(int op, int inum, int64_t offset, int64_t size,
+                  int64_t result);
+
+/**
+ * Write out every thread's ring, oldest events first. Only uses system
+ * calls, so it is safe to call from a signal handler. Rings that are being
+ * written to while they are dumped may have their newest events torn.
+ *
+ * @param path The file to write.
+ *
+ * @return 0 on success, -1 if the file could not be written.
+ */
+int trace_dump(const char *path);
+
+/**
+ * Get the printable name of an op.
+ *
+ * @param op A trace_op_t.
+ *
+ * @return The name, or "?" for anything unknown.
+ */
+const char *trace_op_name(int op);
+
+// A FUSE callback finished. The inode is whichever one it last looked up.
+#define TRACE_OP(op, offset, size, result)                                     \
+  do {                                                                         \
+    if (TRACE_LEVEL >= TRACE_OPS ||                                            \
+        (TRACE_LEVEL >= TRACE_ERRORS && (result) < 0)) {                       \
+      trace_record(op, trace_inum, offset, size, result);                      \
+    }                                                                          \
+  } while (0)
+
+// Something happened inside the storage layer.
+#define TRACE_DEBUG(op, inum, offset, size, result)                            \
+  do {                                                                         \
+    if (TRACE_LEVEL >= TRACE_ALL) {                                            \
+      trace_record(op, inum, offset, size, result);                            \
+    }                                                                          \
+  } while (0)
+
+// Remember the inode a lookup found for the callback's event.
+#define TRACE_INUM(inum)                                                       \
+  do {                                                                         \
+    if (TRACE_LEVEL >= TRACE_ERRORS) {                                         \
+      trace_inum = (inum);                                                     \
+    }                                                                          \
+  } while (0)
+
+#endif
@@ -1,11 +1,46 @@
 // This file is full of minor utility classes to be used by other classes
+//
+// Paths are handled in place or in buffers the caller provides (usually on
+// the stack), so nothing here allocates.
+
+#ifndef UTILITIES_H
+#define UTILITIES_H
+
+// Longest path component the iterator copies out (NAME_MAX on Linux).
+#define PATH_NAME_MAX 255
+
+// Walks the components of a path one at a time.
+typedef struct path_iter {
+  const char* rest;             // what is left of the path
+  int length;                   // full length of name, may be over PATH_NAME_MAX
+  char name[PATH_NAME_MAX + 1]; // the current component
+} path_iter_t;
 
 /**
- * Appends two strings together and returns the combined string.
+ * Starts iterating over the components of the given path.
 */
-char* append(const char*, const char*);
+void path_iter_init(path_iter_t* iter, const char* path);
 
 /**
- * Gets the path to the parent of the described path.
+ * Moves on to the next component, returning 0 when there are none left.
 */
-char* get_parent(const char*);
+int path_iter_next(path_iter_t* iter);
+
+/**
+ * Gets the last component of the path, pointing into the path itself.
+*/
+const char* path_child(const char* path);
+
+/**
+ * Copies the path to the parent of the described path into parent, which
+ * needs room for strlen(path) + 1 bytes.
+*/
+void path_parent(const char* path, char* parent);
+
+/**
+ * Joins a directory path and a name into out, which needs room for
+ * strlen(dir) + strlen(name) + 2 bytes.
+*/
+void path_join(char* out, const char* dir, const char* name);
+
+#endif
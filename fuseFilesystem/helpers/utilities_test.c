@@ -0,0 +1,34 @@
+
+#include <stdio.h>
+
+#include "utilities.h"
+
+void print_components(const char *path) {
+  path_iter_t iter;
+  path_iter_init(&iter, path);
+  printf("Components of \"%s\":\n", path);
+  while (path_iter_next(&iter)) {
+    printf("  %s (%d)\n", iter.name, iter.length);
+  }
+}
+
+int main(int argc, char **argv) {
+  print_components("/");
+  print_components("/one/two/three");
+  print_components("//doubled//and/trailing/");
+
+  const char *paths[] = {"/top", "/a/b/c"};
+  for (int i = 0; i < 2; ++i) {
+    char parent[64];
+    path_parent(paths[i], parent);
+    printf("\n\"%s\" has parent \"%s\" and child \"%s\"\n", paths[i], parent,
+           path_child(paths[i]));
+  }
+
+  char joined[64];
+  path_join(joined, "/", "file");
+  printf("\nJoined: %s\n", joined);
+  path_join(joined, "/dir", "file");
+  printf("Joined: %s\n", joined);
+  return 0;
+}
@@ -1,29 +1,115 @@
 #include "helpers/inode.h"
 #include "helpers/storage.h"
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include "helpers/atime.h"
 #include "helpers/blocks.h"
 #include "helpers/bitmap.h"
+#include "helpers/compress.h"
+#include "helpers/journal.h"
+#include "helpers/stats.h"
+#include "helpers/trace.h"
 
 /**
  * Implementation notes:
- * storage.c will be in charge of allocating the blocks for inodes before 
- * requesting any inodes. They should be the first NUM_INODE_BLOCKS blocks
- * in the storage system (besides the reserved one at slot 0)
- * at INODE_BLOCK_BEGIN.
+ * storage_format reserves the blocks for inodes when the image is made.
+ * They are the NUM_INODE_BLOCKS blocks starting at INODE_BLOCK_BEGIN,
+ * right after the superblock and the two bitmaps, with the journal
+ * after them. Inodes are metadata, so changes to them are marked with
+ * inode_dirty for the journal. So are directory contents, but a regular
+ * file's blocks are written straight to the image. A file's blocks may be
+ * shared with a snapshot, and get copied by inode_unshare before they are
+ * written to. Files are sparse: growing one only changes its size, and a
+ * block past the end or punched out is a hole that reads back as zeros
+ * until something is written there. Directories never have holes.
+ * Compressed files group their blocks into clusters, see compress.h.
  */
 
+// Inodes share this many locks, picked by inum.
+#define INODE_LOCKS 1024
+
+static pthread_rwlock_t inode_locks[INODE_LOCKS];
+static pthread_once_t inode_locks_once = PTHREAD_ONCE_INIT;
+
+// The transaction that last changed the size or mapping of the inodes
+// sharing each lock, for fdatasync. Only ever set inside a journal handle,
+// when every writer stores the same running transaction.
+static _Atomic uint64_t layout_ids[INODE_LOCKS];
+
+static void init_inode_locks() {
+  for(int i = 0; i < INODE_LOCKS; ++i) {
+    pthread_rwlock_init(&inode_locks[i], NULL);
+  }
+}
+
+/**
+ * Locks an inode's contents (size, extents and data) for reading or
+ * writing. Inodes share a fixed set of locks, so never hold two at once.
+ * 
+ * @param inum the inode to lock.
+ * @param write nonzero for exclusive access.
+ */
+void inode_lock(int inum, int write) {
+  pthread_once(&inode_locks_once, init_inode_locks);
+  if(write) {
+    pthread_rwlock_wrlock(&inode_locks[inum % INODE_LOCKS]);
+  }
+  else {
+    pthread_rwlock_rdlock(&inode_locks[inum % INODE_LOCKS]);
+  }
+}
+
+/**
+ * Releases the lock taken by inode_lock.
+ * 
+ * @param inum the inode to unlock.
+ */
+void inode_unlock(int inum) {
+  pthread_rwlock_unlock(&inode_locks[inum % INODE_LOCKS]);
+}
+
+/**
+ * Locks every inode for writing, holding everything still while a
+ * snapshot is taken. Caller holds the tree lock exclusively.
+ */
+void inode_lock_all() {
+  pthread_once(&inode_locks_once, init_inode_locks);
+  for(int i = 0; i < INODE_LOCKS; ++i) {
+    pthread_rwlock_wrlock(&inode_locks[i]);
+  }
+}
+
+/**
+ * Releases the locks taken by inode_lock_all.
+ */
+void inode_unlock_all() {
+  for(int i = 0; i < INODE_LOCKS; ++i) {
+    pthread_rwlock_unlock(&inode_locks[i]);
+  }
+}
+
 /**
  * Prints the inode to stdout.
  * 
  * @param node the node to print info about.
  */
 void print_inode(inode_t* node) {
-  printf("Size: %d\n", node->size);
+  printf("Size: %ld\n", node->size);
   printf("References: %d\n", node->refs);
   printf("Mode: %d\n", node->mode);
-  printf("Block: %d\n", node->block);
+  if(node->flags & INODE_INLINE) {
+    printf("Inline\n");
+  }
+  else {
+    printf("Extents: %d (depth %d)\n", node->extents.header.count,
+           node->extents.header.depth);
+  }
 }
 
 /**
@@ -33,7 +119,6 @@ void print_inode(inode_t* node) {
  */
 inode_t* get_inode(int inum) {
   assert(inum >= 0);
-  printf("Getting inode at %d\n", inum);
   // Gets the inode bitmap
   void* inode_map = get_inode_bitmap();
   // Check if the inode exists
@@ -41,101 +126,650 @@ inode_t* get_inode(int inum) {
   // It does exist, get the right block and offset
   int block_offset = inum / INODES_PER_BLOCK;
   int inode_offset = inum % INODES_PER_BLOCK;
-  printf("Found in block %d at entry %d\n", INODE_BLOCK_BEGIN + block_offset, inode_offset);
-  void* block = blocks_get_block(INODE_BLOCK_BEGIN + block_offset);
+  char* block = (char*)get_inode_table() + (size_t)block_offset * BLOCK_SIZE;
   // Get the inode from that block
   return (inode_t*)(block) + inode_offset;
 }
 
+/**
+ * Marks an inode as changed, for the journal. Call it after changing
+ * anything that has to outlast a remount (everything but opens), or
+ * inode_touch if only its times and mode changed.
+ * 
+ * @param node an inode returned by get_inode.
+*/
+void inode_dirty(inode_t* node) {
+  journal_dirty(node, INODE_SIZE);
+  atomic_store(&layout_ids[inode_get_inum(node) % INODE_LOCKS], journal_running());
+}
+
+/**
+ * Gets the transaction that last changed an inode's size or which blocks
+ * hold it, which fdatasync has to wait for (see journal_datasync).
+ * 
+ * @param inum the inode, locked for reading at least.
+*/
+uint64_t inode_layout_id(int inum) {
+  return atomic_load(&layout_ids[inum % INODE_LOCKS]);
+}
+
+/**
+ * Gets the time the way inodes keep it, in nanoseconds since the epoch.
+*/
+int64_t inode_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Marks an inode as changed now, for the journal. Its ctime is set, and
+ * its mtime too if its contents changed. An atime a read left waiting
+ * goes along with it (see atime.h). Changes to its size or blocks still
+ * need inode_dirty.
+ * 
+ * @param node an inode returned by get_inode, locked for writing.
+ * @param contents nonzero if its data or entries changed.
+*/
+void inode_touch(inode_t* node, int contents) {
+  int64_t now = inode_now();
+  node->atime = atime_forget(inode_get_inum(node), node);
+  node->ctime = now;
+  if(contents) {
+    node->mtime = now;
+  }
+  journal_dirty(node, INODE_SIZE);
+}
+
+/**
+ * Directories keep their contents in the mapping like the rest of the
+ * metadata, files go through blocks_read and blocks_write.
+*/
+static int is_metadata(inode_t* node) {
+  return node->mode / 010000 == 4;
+}
+
+/**
+ * Gets the inode number of an inode, the reverse of get_inode.
+ * 
+ * @param node an inode returned by get_inode.
+ * 
+ * @returns the inum of the inode.
+*/
+int inode_get_inum(inode_t* node) {
+  char* table = get_inode_table();
+  // Inodes never straddle blocks, so find the block then the slot in it.
+  size_t offset = (char*)node - table;
+  return offset / BLOCK_SIZE * INODES_PER_BLOCK + offset % BLOCK_SIZE / INODE_SIZE;
+}
+
 /**
  * Allocates a new inode and returns its index. Returns -1
- * if no free spots are available, or if we can't allocate a block.
+ * if no free spots are available. The inode starts out empty,
+ * with its contents inline until they outgrow the inode.
  * Caller is expected to set up inode properly.
  * 
  * @returns the inum of the allocated inode
 */
 int alloc_inode() {
-  // Find next open index
-  for(int i = 0; i < BLOCK_COUNT; ++i) {
-    if(bitmap_get(get_inode_bitmap(), i) == 0) {
-      int block_num = alloc_block();
-      if(block_num == -1) {
-        return -1;
-      }
-      else {
-        bitmap_put(get_inode_bitmap(), i, 1);
-        get_inode(i)->block = block_num;
-        printf("Allocating inode: %d\n", i);
-        return i;
-      }
-    }
+  alloc_lock();
+  long scanned = get_inode_allocator()->scanned;
+  // Take the next open index
+  int inum = bitmap_alloc_first(get_inode_allocator(), -1, 1, NULL);
+  if(inum != -1) {
+    journal_dirty_bits(get_inode_bitmap(), inum, 1);
   }
-  // Could not allocate.
-  return -1;
+  scanned = get_inode_allocator()->scanned - scanned;
+  alloc_unlock();
+  stats_add(STATS_INODE_ALLOCS, inum != -1);
+  stats_add(STATS_INODE_SCANS, scanned);
+  if(inum == -1) {
+    // Could not allocate.
+    return -1;
+  }
+  inode_t* node = get_inode(inum);
+  node->flags = 0;
+  node->atime = node->mtime = node->ctime = inode_now();
+  inode_init_data(node);
+  TRACE_DEBUG(TRACE_ALLOC_INODE, -1, 0, 0, inum);
+  return inum;
 }
 
 /**
- * Frees an inode and sets it as unoccupied. Always frees its
- * associated block.
+ * Frees an inode and sets it as unoccupied. Always frees all of its
+ * associated blocks.
  * 
  * @param inum the inode number to free.
 */
 void free_inode(int inum) {
-  free_block(get_inode(inum)->block);
-  bitmap_put(get_inode_bitmap(), inum, 0);
+  TRACE_DEBUG(TRACE_FREE_INODE, inum, 0, 0, 0);
+  // An atime a read left waiting has nothing to go to now.
+  atime_forget(inum, get_inode(inum));
+  shrink_inode(get_inode(inum), 0);
+  alloc_lock();
+  bitmap_alloc_put(get_inode_allocator(), inum, 0);
+  journal_dirty_bits(get_inode_bitmap(), inum, 1);
+  alloc_unlock();
 }
 
 /**
  * Reduces the number of references an inode has by 1.
- * If it is now 0, frees the inode.
+ * If it is now 0 and the inode isn't open, frees the inode.
+ * An open one is freed by the last close instead.
  * 
  * @param inum the inode number to decrement references from.
 */
 void decrement_references(int inum) {
   inode_t* node = get_inode(inum);
   node->refs -= 1;
-  if(node->refs == 0) {
+  inode_touch(node, 0);
+  if(node->refs == 0 && node->opens == 0) {
     free_inode(inum);
   }
 }
 /**
- * Grows the inode to the desired size.
- * Fails if size is smaller than current size or bigger than page.
+ * Empties an inode that has no blocks, leaving it inline with size 0.
+ * 
+ * @param node the node to reset.
+*/
+void inode_init_data(inode_t *node) {
+  node->size = 0;
+  node->flags |= INODE_INLINE;
+  memset(node->data, 0, INODE_INLINE_SIZE);
+  inode_dirty(node);
+}
+
+/**
+ * Moves the contents of an inline inode out to a block, once they
+ * no longer fit.
+ * 
+ * @param node the inline node to move out.
+ * @param size the size it is growing to, or its size now to only move it.
+ * 
+ * @returns 0 on success, or -ENOSPC (leaving the inode as it was)
+ *          if the disk is full.
+*/
+static int grow_inline(inode_t *node, int64_t size) {
+  int64_t old_size = node->size;
+  char saved[INODE_INLINE_SIZE];
+  memcpy(saved, node->data, old_size);
+  node->flags &= ~INODE_INLINE;
+  node->size = 0;
+  extent_init(&node->extents);
+  int rv = grow_inode(node, size);
+  if(rv == 0 && !is_metadata(node) && old_size > 0) {
+    // Files grow without blocks, the old contents need one.
+    int run;
+    int bnum = inode_fill_hole(node, 0, 1, &run);
+    rv = bnum < 0 ? bnum : blocks_zero(bnum, old_size, BLOCK_SIZE - old_size);
+    if(bnum >= 0 && rv < 0) {
+      extent_remove(&node->extents, 0, 1);
+    }
+  }
+  if(rv < 0) {
+    inode_init_data(node);
+    memcpy(node->data, saved, old_size);
+    node->size = old_size;
+    return rv;
+  }
+  if(old_size == 0) {
+    return 0;
+  }
+  int bnum = inode_get_bnum(node, 0);
+  if(is_metadata(node)) {
+    memcpy(blocks_get_block(bnum), saved, old_size);
+    journal_dirty(blocks_get_block(bnum), old_size);
+    return 0;
+  }
+  return blocks_write(bnum, 0, saved, old_size);
+}
+
+/**
+ * Grows the inode to the desired size. A directory gets zeroed blocks
+ * to cover the new bytes, taken right after its last block when possible
+ * so it stays in few extents. A file only gets a new size, the bytes
+ * past its old end are a hole. Contents stay inside the inode for as
+ * long as they fit.
+ * Fails if size is smaller than current size.
  * 
  * @param node the node to grow 
  * @param size the size to grow to.
+ * 
+ * @returns 0 on success, or -ENOSPC (leaving the inode as it was)
+ *          if the disk is full, -EIO if a file's last block couldn't be zeroed.
 */
-void grow_inode(inode_t *node, int size) {
+int grow_inode(inode_t *node, int64_t size) {
   assert(size >= node->size);
-  assert(size <= BLOCK_SIZE);
+  if(node->flags & INODE_INLINE) {
+    if(size > INODE_INLINE_SIZE) {
+      return grow_inline(node, size);
+    }
+    // Bytes past the end are always zero already.
+    TRACE_DEBUG(TRACE_RESIZE, inode_get_inum(node), node->size, size, 0);
+    node->size = size;
+    inode_dirty(node);
+    return 0;
+  }
+  int have = bytes_to_blocks(node->size);
+  int need = bytes_to_blocks(size);
+  // A file's last block is zeroed past the end here rather than when it
+  // shrinks, so a shrink that a crash takes back leaves the file whole.
+  // A packed last cluster is compressed again without what's past the end.
+  if((node->flags & INODE_COMPRESSED) && have > 0 && compress_packed(node, have - 1)) {
+    int rv = compress_write(node, NULL, 0, node->size);
+    if(rv < 0) {
+      return rv;
+    }
+  }
+  else if(!is_metadata(node) && node->size % BLOCK_SIZE != 0 &&
+          inode_get_bnum(node, have - 1) != -1) {
+    int tail = node->size % BLOCK_SIZE;
+    int rv = inode_unshare(node, have - 1, 1);
+    if(rv == 0) {
+      rv = blocks_zero(inode_get_bnum(node, have - 1), tail, BLOCK_SIZE - tail);
+    }
+    if(rv < 0) {
+      return rv;
+    }
+  }
+  if(!is_metadata(node)) {
+    TRACE_DEBUG(TRACE_RESIZE, inode_get_inum(node), node->size, size, 0);
+    node->size = size;
+    inode_dirty(node);
+    return 0;
+  }
+  int goal = have > 0 ? inode_get_bnum(node, have - 1) + 1 : 0;
+  for(int fbnum = have; fbnum < need; ) {
+    // Take as much of what's left in one run as the disk has free.
+    int got;
+    int bnum = alloc_blocks_near(goal, need - fbnum, &got);
+    if(bnum == -1 || extent_insert(&node->extents, fbnum, bnum, got) < 0) {
+      // Give back everything we took on the way.
+      for(int i = 0; bnum != -1 && i < got; ++i) {
+        free_block(bnum + i);
+      }
+      extent_remove(&node->extents, have, fbnum - have);
+      return -ENOSPC;
+    }
+    memset(blocks_get_block(bnum), 0, (size_t) BLOCK_SIZE * got);
+    journal_dirty(blocks_get_block(bnum), (size_t) BLOCK_SIZE * got);
+    goal = bnum + got;
+    fbnum += got;
+  }
+  TRACE_DEBUG(TRACE_RESIZE, inode_get_inum(node), node->size, size, 0);
   node->size = size;
-  printf("Updated size to %d\n", node->size);
+  inode_dirty(node);
+  return 0;
 }
 /**
- * Shrinks inode to the desired size.
+ * Shrinks inode to the desired size, freeing blocks past the new end.
+ * Bytes past the end in a directory's last kept block are zeroed so that
+ * growing it again reads back zeros, files get theirs zeroed when they
+ * grow (see grow_inode). Once the contents fit in the inode
+ * again they move back in and the last block is freed too.
  * Fails if size is bigger than current size or smaller than 0.
  * 
 * @param node the node to shrink 
  * @param size the size to shrink to.
 */
-void shrink_inode(inode_t *node, int size) {
+void shrink_inode(inode_t *node, int64_t size) {
   assert(size <= node->size);
   assert(size >= 0);
+  TRACE_DEBUG(TRACE_RESIZE, inode_get_inum(node), node->size, size, 0);
+  inode_dirty(node);
+  if(node->flags & INODE_INLINE) {
+    memset(node->data + size, 0, node->size - size);
+    node->size = size;
+    return;
+  }
+  if(size <= INODE_INLINE_SIZE) {
+    char saved[INODE_INLINE_SIZE];
+    int bnum = inode_get_bnum(node, 0);
+    if(size > 0 && (node->flags & INODE_COMPRESSED) && compress_packed(node, 0)) {
+      if(compress_read(node, saved, size, 0) < 0) {
+        return;
+      }
+    }
+    else if(size > 0 && bnum == -1) {
+      // A hole.
+      memset(saved, 0, size);
+    }
+    else if(size > 0 && is_metadata(node)) {
+      memcpy(saved, blocks_get_block(bnum), size);
+    }
+    else if(size > 0 && blocks_read(bnum, 0, saved, size) < 0) {
+      // Keep the file as it is rather than lose what's in it.
+      return;
+    }
+    // Dropping every extent never has to split one, so this can't fail.
+    extent_remove(&node->extents, 0, extent_end(&node->extents));
+    inode_init_data(node);
+    memcpy(node->data, saved, size);
+    node->size = size;
+    return;
+  }
+  int keep = bytes_to_blocks(size);
+  if((node->flags & INODE_COMPRESSED) && compress_packed(node, keep - 1)) {
+    // A packed cluster is kept whole, grow_inode drops what's past the end.
+    keep = ((keep - 1) / COMPRESS_CLUSTER_BLOCKS + 1) * COMPRESS_CLUSTER_BLOCKS;
+  }
+  extent_remove(&node->extents, keep, extent_end(&node->extents) - keep);
+  if(is_metadata(node) && size % BLOCK_SIZE != 0) {
+    int tail = size % BLOCK_SIZE;
+    int bnum = inode_get_bnum(node, keep - 1);
+    memset(blocks_get_block(bnum) + tail, 0, BLOCK_SIZE - tail);
+    journal_dirty(blocks_get_block(bnum) + tail, BLOCK_SIZE - tail);
+  }
   node->size = size;
-  printf("Updated size to %d\n", node->size);
 }
 
 /**
- * For compatibility reasons, this is made in case of larger files in the future.
- * For now should just return the only block and be used with 0.
+ * Gives a file its own copy of any blocks in a range that it shares with
+ * a snapshot or another file, so they can be written to. Copies a run of
+ * shared blocks at a time, into blocks next to the ones before them when
+ * possible.
+ * Caller holds the inode's lock for writing.
+ * 
+ * @param node the file
+ * @param fbnum the first block of the range
+ * @param count how many blocks it has.
+ * 
+ * @returns 0 on success, or -ENOSPC or -EIO (with the blocks not
+ *          copied yet still shared) if the disk is full or can't be
+ *          written.
+*/
+int inode_unshare(inode_t *node, int fbnum, int count) {
+  if(node->flags & INODE_INLINE) {
+    return 0;
+  }
+  int end = fbnum + count;
+  while(fbnum < end) {
+    int run;
+    int bnum = inode_get_run(node, fbnum, &run);
+    if(bnum == -1) {
+      fbnum = inode_next_data(node, fbnum);
+      if(fbnum == -1) {
+        break;
+      }
+      continue;
+    }
+    if(run > end - fbnum) {
+      run = end - fbnum;
+    }
+    // Written in place or copied, the dedup index can't hand these out.
+    blocks_unmark(bnum, run);
+    // Skip what's already the file's own, then take the shared stretch.
+    int own = 0;
+    while(own < run && !blocks_shared(bnum + own)) {
+      own += 1;
+    }
+    int shared = 0;
+    while(own + shared < run && blocks_shared(bnum + own + shared)) {
+      shared += 1;
+    }
+    fbnum += own;
+    bnum += own;
+    if(shared == 0) {
+      continue;
+    }
+    int goal = fbnum > 0 ? inode_get_bnum(node, fbnum - 1) + 1 : 0;
+    int got;
+    int copy = alloc_blocks_near(goal, shared, &got);
+    if(copy == -1) {
+      return -ENOSPC;
+    }
+    int rv = blocks_copy(copy, bnum, got);
+    if(rv == 0) {
+      rv = extent_replace(&node->extents, fbnum, copy, got);
+    }
+    if(rv == 0) {
+      inode_dirty(node);
+    }
+    if(rv < 0) {
+      for(int i = 0; i < got; ++i) {
+        free_block(copy + i);
+      }
+      return rv;
+    }
+    fbnum += got;
+  }
+  return 0;
+}
+
+/**
+ * Gets the disk block holding the given block of the file.
  * 
  * @param node the node to get the block from
  * @param fbnum the block to get from the node.
  * 
- * @returns the block number requested.
+ * @returns the block number requested, or -1 if the file has no such block.
 */
 int inode_get_bnum(inode_t *node, int fbnum) {
-  assert(fbnum == 0);
-  return node->block;
+  return inode_get_run(node, fbnum, NULL);
+}
+
+/**
+ * Gets the disk block holding the given block of the file along with
+ * the length of the contiguous run it starts, so callers can copy a
+ * whole extent at a time.
+ * 
+ * @param node the node to get the block from
+ * @param fbnum the block to get from the node.
+ * @param run set to the number of blocks from fbnum on that follow
+ *            one another on disk.
+ * 
+ * @returns the block number requested, or -1 if the file has no such block.
+*/
+int inode_get_run(inode_t *node, int fbnum, int *run) {
+  if(node->flags & INODE_INLINE) {
+    if(run != NULL) {
+      *run = 0;
+    }
+    return -1;
+  }
+  return extent_lookup(&node->extents, fbnum, run);
 }
 
+/**
+ * Finds where the data after a hole starts, so a hole can be skipped
+ * over in one go however big it is.
+ * 
+ * @param node the node to look in
+ * @param fbnum the block to start from.
+ * 
+ * @returns fbnum if it isn't a hole, otherwise the first block after it
+ *          that has one behind it, or -1 if there is none.
+*/
+int inode_next_data(inode_t *node, int fbnum) {
+  if(node->flags & INODE_INLINE) {
+    return -1;
+  }
+  return extent_next(&node->extents, fbnum);
+}
+
+/**
+ * Allocates blocks for a hole in a file, as many in one run as the disk
+ * has free up to max or the end of the hole. They are taken right after
+ * the block before the hole when possible, so a file written in order
+ * stays in few extents. The new blocks aren't zeroed, the caller writes
+ * over them or zeroes them.
+ * 
+ * @param node the file, which must not be inline
+ * @param fbnum the first block of the hole
+ * @param max most blocks to fill
+ * @param run set to how many were filled.
+ * 
+ * @returns the disk block now behind fbnum, or -ENOSPC (leaving the hole
+ *          as it was) if the disk is full.
+*/
+int inode_fill_hole(inode_t *node, int fbnum, int max, int *run) {
+  assert(!(node->flags & INODE_INLINE));
+  int next = extent_next(&node->extents, fbnum);
+  assert(next != fbnum);
+  if(next != -1 && next - fbnum < max) {
+    max = next - fbnum;
+  }
+  int goal = fbnum > 0 ? inode_get_bnum(node, fbnum - 1) + 1 : 0;
+  int bnum = alloc_blocks_near(goal, max, run);
+  if(bnum == -1) {
+    return -ENOSPC;
+  }
+  if(extent_insert(&node->extents, fbnum, bnum, *run) < 0) {
+    for(int i = 0; i < *run; ++i) {
+      free_block(bnum + i);
+    }
+    return -ENOSPC;
+  }
+  inode_dirty(node);
+  return bnum;
+}
+
+/**
+ * Allocates zeroed blocks for every hole in a range of a file, so that
+ * writing there later can't run out of space. Leaves the size alone, so
+ * blocks can be reserved past the end. Space inside the inode is always
+ * there already.
+ * 
+ * @param node the file
+ * @param offset where the range starts
+ * @param size how many bytes it has.
+ * 
+ * Compressed files have raw clusters filled in, writing to a
+ * packed one can still need new blocks.
+ * 
+ * @returns 0 on success, or -ENOSPC or -EIO, keeping the blocks
+ *          allocated so far, if the disk is full or can't be written.
+*/
+int inode_preallocate(inode_t *node, int64_t offset, int64_t size) {
+  int64_t end = offset + size;
+  if(node->flags & INODE_INLINE) {
+    if(end <= INODE_INLINE_SIZE) {
+      return 0;
+    }
+    int rv = grow_inline(node, node->size);
+    if(rv < 0) {
+      return rv;
+    }
+  }
+  int last = bytes_to_blocks(end);
+  int fbnum = offset / BLOCK_SIZE;
+  if(node->flags & INODE_COMPRESSED) {
+    // A cluster that is a hole is filled from its start, or it would look
+    // packed. One that is packed is left be.
+    fbnum -= fbnum % COMPRESS_CLUSTER_BLOCKS;
+  }
+  while(fbnum < last) {
+    int run;
+    int bnum = inode_get_run(node, fbnum, &run);
+    if(bnum == -1 && (node->flags & INODE_COMPRESSED) && compress_packed(node, fbnum)) {
+      fbnum += COMPRESS_CLUSTER_BLOCKS - fbnum % COMPRESS_CLUSTER_BLOCKS;
+      continue;
+    }
+    if(bnum == -1) {
+      int max = last - fbnum;
+      if((node->flags & INODE_COMPRESSED) &&
+         max > COMPRESS_CLUSTER_BLOCKS - fbnum % COMPRESS_CLUSTER_BLOCKS) {
+        // Not into the next cluster, which may be packed.
+        max = COMPRESS_CLUSTER_BLOCKS - fbnum % COMPRESS_CLUSTER_BLOCKS;
+      }
+      bnum = inode_fill_hole(node, fbnum, max, &run);
+      if(bnum < 0) {
+        return bnum;
+      }
+      int rv = blocks_zero(bnum, 0, (size_t) BLOCK_SIZE * run);
+      if(rv < 0) {
+        extent_remove(&node->extents, fbnum, run);
+        return rv;
+      }
+    }
+    fbnum += run;
+  }
+  return 0;
+}
+
+/**
+ * Zeroes part of one block of a file, copying it first if a snapshot
+ * shares it. Holes are zero already.
+ */
+static int zero_part(inode_t *node, int64_t offset, int64_t size) {
+  int fbnum = offset / BLOCK_SIZE;
+  if(size == 0 || inode_get_bnum(node, fbnum) == -1) {
+    return 0;
+  }
+  int rv = inode_unshare(node, fbnum, 1);
+  if(rv < 0) {
+    return rv;
+  }
+  return blocks_zero(inode_get_bnum(node, fbnum), offset % BLOCK_SIZE, size);
+}
+
+/**
+ * inode_punch for a compressed file. Clusters the range covers whole are
+ * dropped, the parts of clusters at either end are zeroed and compressed
+ * again.
+ */
+static int punch_clusters(inode_t *node, int64_t offset, int64_t size) {
+  int64_t end = offset + size;
+  int64_t first = (offset + COMPRESS_CLUSTER_SIZE - 1) / COMPRESS_CLUSTER_SIZE;
+  int64_t last = end / COMPRESS_CLUSTER_SIZE;
+  if(first > last) {
+    // All inside one cluster.
+    return compress_write(node, NULL, size, offset);
+  }
+  int rv = 0;
+  if(first * COMPRESS_CLUSTER_SIZE > offset) {
+    rv = compress_write(node, NULL, first * COMPRESS_CLUSTER_SIZE - offset, offset);
+  }
+  if(rv == 0 && end > last * COMPRESS_CLUSTER_SIZE) {
+    rv = compress_write(node, NULL, end - last * COMPRESS_CLUSTER_SIZE,
+                        last * COMPRESS_CLUSTER_SIZE);
+  }
+  if(rv == 0 && last > first) {
+    rv = extent_remove(&node->extents, first * COMPRESS_CLUSTER_BLOCKS,
+                       (last - first) * COMPRESS_CLUSTER_BLOCKS);
+    inode_dirty(node);
+  }
+  return rv;
+}
+
+/**
+ * Turns a range of a file into a hole, freeing the blocks it covers
+ * whole and zeroing the parts of blocks at either end. Leaves the size
+ * alone, blocks reserved past the end are freed as well.
+ * 
+ * @param node the file
+ * @param offset where the range starts
+ * @param size how many bytes it has.
+ * 
+ * @returns 0 on success, or -ENOSPC or -EIO if an extent had to be
+ *          split or a block copied and the disk is full or can't be
+ *          written.
+*/
+int inode_punch(inode_t *node, int64_t offset, int64_t size) {
+  int64_t end = offset + size;
+  if(node->flags & INODE_INLINE) {
+    if(offset < node->size) {
+      memset(node->data + offset, 0, (end < node->size ? end : node->size) - offset);
+      inode_dirty(node);
+    }
+    return 0;
+  }
+  if(node->flags & INODE_COMPRESSED) {
+    return punch_clusters(node, offset, size);
+  }
+  int first = bytes_to_blocks(offset);
+  int last = end / BLOCK_SIZE;
+  if(first > last) {
+    // All inside one block.
+    return zero_part(node, offset, size);
+  }
+  int rv = zero_part(node, offset, (int64_t) first * BLOCK_SIZE - offset);
+  if(rv == 0) {
+    rv = zero_part(node, (int64_t) last * BLOCK_SIZE, end - (int64_t) last * BLOCK_SIZE);
+  }
+  if(rv == 0 && last > first) {
+    rv = extent_remove(&node->extents, first, last - first);
+    inode_dirty(node);
+  }
+  return rv;
+}
@@ -0,0 +1,710 @@
+// Write-ahead metadata journal.
+//
+// The running transaction is a bitmap of dirty blocks plus a list of them
+// in the order they were first marked. A commit freezes changes just long
+// enough to copy the dirty blocks out of the mapping, then lets operations
+// go on while it writes the copies out.
+//
+// A freed block stays allocated in memory until the transaction that frees
+// it is home. File data is written straight away, so handing the block out
+// sooner would let a crash bring back its old owner holding the new data.
+// The copy of the block bitmap (and superblock) in the transaction already
+// has it free.
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "helpers/bitmap.h"
+#include "helpers/journal.h"
+
+static int journal_fd = -1;
+static pthread_t commit_thread;
+static pid_t thread_pid = 0; // the process commit_thread runs in, if any
+
+// Guards everything below. The commit thread waits on commit_cond,
+// everyone else on journal_cond.
+static pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;
+
+static int closing = 0;  // journal_close wants the thread to stop
+static int read_only = 0; // nothing is written, see journal_read_only
+static int active = 0;   // journal_start calls not yet stopped
+static int freezing = 0; // a commit is waiting for active to reach 0
+static __thread int depth = 0; // this thread's nested journal_start calls
+
+// The running transaction.
+static void *dirty = NULL;      // bit per block
+static int *dirty_list = NULL;  // may repeat blocks that were forgotten
+static long dirty_count = 0;
+static long dirty_space = 0;
+
+// File data written since the last commit froze changes, which the commit's
+// flush will make durable.
+static void *data_dirty = NULL; // bit per block
+static int *data_list = NULL;
+static long data_count = 0;
+static long data_space = 0;
+
+static long map_bytes = 0;      // size of both dirty bitmaps
+
+// Blocks freed by the running transaction, and how many are waiting on the
+// one being written.
+static int *freed_list = NULL;
+static long freed_count = 0;
+static long freed_space = 0;
+static long releasing = 0;
+
+static uint64_t next_seq = 1;   // sequence number of the next transaction
+static uint64_t running_id = 1; // what journal_flush waits for
+static uint64_t wanted_id = 0;  // flushes want everything up to this committed
+static uint64_t done_id = 0;    // everything up to this is home
+
+// Blocks taken by the descriptor of a transaction of count blocks, which
+// lists their home block numbers after its header.
+static long list_blocks(long block_size, long count) {
+  long bytes = sizeof(journal_header_t) + count * sizeof(uint32_t);
+  return (bytes + block_size - 1) / block_size;
+}
+
+// Most blocks one transaction can hold in a journal of the given geometry,
+// less the descriptor and commit blocks.
+static long capacity_of(long block_size, long journal_blocks) {
+  long most = journal_blocks - 2;
+  while (most > 0 && list_blocks(block_size, most) + most + 1 > journal_blocks) {
+    most -= 1;
+  }
+  return most;
+}
+
+static long capacity() {
+  superblock_t *sb = get_superblock();
+  return capacity_of(sb->block_size, sb->journal_blocks);
+}
+
+// Size of transaction that starts a commit (and holds up new operations
+// until it starts). Half the journal, leaving the rest for the operations
+// already under way.
+static long commit_limit() {
+  long limit = capacity() / 2;
+  return limit > 0 ? limit : 1;
+}
+
+// 64-bit FNV-1a, continuing from hash.
+static uint64_t checksum(uint64_t hash, const void *data, size_t size) {
+  const unsigned char *bytes = data;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= 1099511628211u;
+  }
+  return hash;
+}
+
+static uint64_t transaction_checksum(uint32_t *bnums, const char *images,
+                                     long count, size_t block_size) {
+  uint64_t hash = checksum(14695981039346656037u, bnums, count * sizeof(uint32_t));
+  return checksum(hash, images, count * block_size);
+}
+
+static int read_all(int fd, void *buf, size_t size, off_t offset) {
+  for (size_t done = 0; done < size;) {
+    ssize_t got = pread(fd, (char *) buf + done, size - done, offset + done);
+    if (got <= 0) {
+      return -1;
+    }
+    done += got;
+  }
+  return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t size, off_t offset) {
+  for (size_t done = 0; done < size;) {
+    ssize_t put = pwrite(fd, (const char *) buf + done, size - done, offset + done);
+    if (put <= 0) {
+      return -1;
+    }
+    done += put;
+  }
+  return 0;
+}
+
+// Pick a journal size for an image of block_count blocks.
+int journal_blocks_for(long block_count) {
+  long blocks = block_count / 64;
+  if (blocks < JOURNAL_MIN_BLOCKS) {
+    blocks = JOURNAL_MIN_BLOCKS;
+  }
+  if (blocks > JOURNAL_MAX_BLOCKS) {
+    blocks = JOURNAL_MAX_BLOCKS;
+  }
+  return blocks;
+}
+
+// Copy the last committed transaction to its home locations.
+int journal_recover(int fd, superblock_t *sb) {
+  size_t size = sb->block_size;
+  off_t start = (off_t) sb->journal_start * size;
+  long room = sb->journal_blocks;
+  journal_header_t head;
+  if (read_all(fd, &head, sizeof(head), start) != 0) {
+    return -1;
+  }
+  if (head.magic == JOURNAL_MAGIC && head.kind == JOURNAL_ELSEWHERE) {
+    // Too big for the journal, it is in the run of blocks pointed at.
+    struct stat st;
+    uint64_t seq = head.seq;
+    if (fstat(fd, &st) != 0) {
+      return -1;
+    }
+    start = (off_t) head.where * size;
+    room = start < st.st_size ? (st.st_size - start) / size : 0;
+    if (room > 0 && read_all(fd, &head, sizeof(head), start) != 0) {
+      return -1;
+    }
+    if (room == 0 || head.seq != seq) {
+      return 0;
+    }
+  }
+  if (head.magic != JOURNAL_MAGIC || head.kind != JOURNAL_DESCRIPTOR ||
+      head.count == 0 || list_blocks(size, head.count) + head.count + 1 > room) {
+    // Never used.
+    return 0;
+  }
+  next_seq = head.seq + 1;
+
+  long listed = list_blocks(size, head.count);
+  char *desc = malloc(listed * size);
+  char *images = malloc(head.count * size);
+  journal_header_t commit;
+  int rv = desc == NULL || images == NULL ? -1 : 0;
+  if (rv == 0) {
+    rv = read_all(fd, desc, listed * size, start);
+  }
+  if (rv == 0) {
+    rv = read_all(fd, images, head.count * size, start + listed * size);
+  }
+  if (rv == 0) {
+    rv = read_all(fd, &commit, sizeof(commit), start + (listed + head.count) * size);
+  }
+  // A transaction without its commit block never happened.
+  uint32_t *bnums = (uint32_t *) (desc + sizeof(journal_header_t));
+  int committed = rv == 0 && commit.magic == JOURNAL_MAGIC &&
+                  commit.kind == JOURNAL_COMMIT && commit.seq == head.seq &&
+                  commit.count == head.count &&
+                  commit.checksum == transaction_checksum(bnums, images, head.count, size);
+  for (uint32_t i = 0; committed && rv == 0 && i < head.count; ++i) {
+    rv = write_all(fd, images + i * size, size, (off_t) bnums[i] * size);
+  }
+  if (committed && rv == 0) {
+    rv = fdatasync(fd);
+  }
+  free(images);
+  free(desc);
+  return rv == 0 ? 0 : -1;
+}
+
+// Write out a transaction and then its blocks, without the lock held.
+// Returns -ENOSPC, having written nothing, if it is too big for the journal
+// and there is no run of free blocks to put it in instead.
+static int write_transaction(uint32_t *bnums, char *images, long count) {
+  superblock_t *sb = get_superblock();
+  size_t size = sb->block_size;
+  off_t journal = (off_t) sb->journal_start * size;
+  long listed = list_blocks(size, count);
+  long blocks = listed + count + 1;
+  int run = -1;
+  if (count > capacity()) {
+    run = alloc_run(0, blocks);
+    if (run == -1) {
+      return -ENOSPC;
+    }
+  }
+  off_t start = run == -1 ? journal : (off_t) run * size;
+  char *desc = calloc(listed, size);
+  if (desc == NULL) {
+    return -1;
+  }
+  journal_header_t head = {JOURNAL_MAGIC, JOURNAL_DESCRIPTOR, next_seq, count, 0, 0};
+  memcpy(desc, &head, sizeof(head));
+  memcpy(desc + sizeof(head), bnums, count * sizeof(uint32_t));
+  int rv = write_all(journal_fd, desc, listed * size, start);
+  if (rv == 0) {
+    rv = write_all(journal_fd, images, count * size, start + listed * size);
+  }
+  if (rv == 0) {
+    rv = fdatasync(journal_fd);
+  }
+  head.kind = JOURNAL_COMMIT;
+  head.checksum = transaction_checksum(bnums, images, count, size);
+  if (rv == 0) {
+    rv = write_all(journal_fd, &head, sizeof(head), start + (listed + count) * size);
+  }
+  if (rv == 0 && run != -1) {
+    // Not committed until the journal points at it, which can go out with
+    // the commit block: either one alone doesn't replay.
+    journal_header_t moved = {JOURNAL_MAGIC, JOURNAL_ELSEWHERE, next_seq, count, run, 0};
+    memset(desc, 0, size);
+    memcpy(desc, &moved, sizeof(moved));
+    rv = write_all(journal_fd, desc, size, journal);
+  }
+  if (rv == 0) {
+    rv = fdatasync(journal_fd);
+  }
+  next_seq += 1;
+  free(desc);
+
+  // Committed, the copies can go home.
+  for (long i = 0; rv == 0 && i < count; ++i) {
+    rv = write_all(journal_fd, images + i * size, size, (off_t) bnums[i] * size);
+  }
+  if (rv == 0) {
+    rv = fdatasync(journal_fd);
+  }
+  // The run is needed until the next commit stops the journal pointing at
+  // it, which is when freed blocks come back.
+  for (long i = 0; run != -1 && i < blocks; ++i) {
+    free_block(run + i);
+  }
+  return rv;
+}
+
+static int compare_bnums(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *) a;
+  uint32_t y = *(const uint32_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+// Where the copy of a block is in a transaction, or NULL.
+static char *image_of(uint32_t bnum, uint32_t *bnums, char *images, long count) {
+  uint32_t *found = bsearch(&bnum, bnums, count, sizeof(uint32_t), compare_bnums);
+  return found == NULL ? NULL : images + (found - bnums) * BLOCK_SIZE;
+}
+
+// Make the mapping keep its own copy of a block. Until a page of a private
+// mapping is written it still shows whatever is written to the file.
+static void keep_private(uint32_t bnum) {
+  volatile char *first = blocks_get_block(bnum);
+  *first = *first;
+}
+
+// Show the freed blocks as free in the copies of the block bitmap and the
+// superblock, which free_block marked. Memory still has them in use until
+// blocks_release, so it mustn't see these copies go home.
+static void free_in_images(int *freed, long nfreed, uint32_t *bnums, char *images,
+                           long count) {
+  if (nfreed == 0) {
+    return;
+  }
+  superblock_t *sb = (superblock_t *) image_of(0, bnums, images, count);
+  assert(sb != NULL);
+  keep_private(0);
+  long per_block = BLOCK_SIZE * 8;
+  for (long i = 0; i < nfreed; ++i) {
+    uint32_t bnum = get_superblock()->block_bitmap_start + freed[i] / per_block;
+    char *bm = image_of(bnum, bnums, images, count);
+    assert(bm != NULL);
+    keep_private(bnum);
+    bitmap_put(bm, freed[i] % per_block, 0);
+  }
+  sb->free_blocks += nfreed;
+}
+
+// Freeze changes, take the running transaction and write it out. Called
+// and returns with the lock held, which is let go during the writes.
+static void commit() {
+  freezing = 1;
+  while (active > 0) {
+    pthread_cond_wait(&commit_cond, &journal_mutex);
+  }
+  uint64_t id = running_id++;
+  uint32_t *bnums = malloc(dirty_count * sizeof(uint32_t) + 1);
+  assert(bnums != NULL);
+  long count = 0;
+  for (long i = 0; i < dirty_count; ++i) {
+    if (bitmap_get(dirty, dirty_list[i])) {
+      bitmap_put(dirty, dirty_list[i], 0);
+      bnums[count++] = dirty_list[i];
+    }
+  }
+  dirty_count = 0;
+  // The flushes below cover all the data written so far.
+  for (long i = 0; i < data_count; ++i) {
+    bitmap_put(data_dirty, data_list[i], 0);
+  }
+  data_count = 0;
+  // Home locations in order, so checkpointing sweeps the image once.
+  qsort(bnums, count, sizeof(uint32_t), compare_bnums);
+  size_t size = BLOCK_SIZE;
+  char *images = malloc(count * size + 1);
+  assert(images != NULL);
+  for (long i = 0; i < count; ++i) {
+    memcpy(images + i * size, blocks_get_block(bnums[i]), size);
+  }
+  int *freed = freed_list;
+  long nfreed = freed_count;
+  free_in_images(freed, nfreed, bnums, images, count);
+  freed_list = NULL;
+  freed_count = freed_space = 0;
+  releasing = nfreed;
+  freezing = 0;
+  pthread_cond_broadcast(&journal_cond);
+
+  pthread_mutex_unlock(&journal_mutex);
+  int rv = count > 0 ? write_transaction(bnums, images, count) : 0;
+  if (rv == -ENOSPC) {
+    fprintf(stderr, "nufs: no room to journal %ld blocks, leaving the image "
+                    "as it was at the last commit\n", count);
+  } else if (rv != 0) {
+    perror("nufs: journal commit");
+  }
+  // Home, the freed blocks can be handed out again. That goes in the next
+  // transaction, which can't freeze while this thread is here.
+  if (rv != -ENOSPC) {
+    blocks_release(freed, nfreed);
+  }
+  pthread_mutex_lock(&journal_mutex);
+
+  if (rv == -ENOSPC) {
+    // Changes made since then can't be committed without the ones lost
+    // here, and the blocks they freed stay in use on the image.
+    read_only = 1;
+    for (long i = 0; i < dirty_count; ++i) {
+      bitmap_put(dirty, dirty_list[i], 0);
+    }
+    dirty_count = 0;
+  }
+  releasing = 0;
+  done_id = id;
+  free(freed);
+  pthread_cond_broadcast(&journal_cond);
+  free(images);
+  free(bnums);
+}
+
+// Commit every JOURNAL_INTERVAL seconds, or when asked to.
+static void *commit_loop(void *arg) {
+  pthread_mutex_lock(&journal_mutex);
+  for (;;) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += JOURNAL_INTERVAL;
+    while (!closing && wanted_id < running_id && dirty_count < commit_limit()) {
+      if (pthread_cond_timedwait(&commit_cond, &journal_mutex, &deadline) == ETIMEDOUT) {
+        break;
+      }
+    }
+    int last = closing;
+    commit();
+    if (last) {
+      break;
+    }
+  }
+  pthread_mutex_unlock(&journal_mutex);
+  return NULL;
+}
+
+// Make both dirty bitmaps cover block_count blocks.
+static void size_maps(long block_count) {
+  long bytes = (block_count + 63) / 64 * 8;
+  if (bytes <= map_bytes) {
+    return;
+  }
+  dirty = realloc(dirty, bytes);
+  data_dirty = realloc(data_dirty, bytes);
+  assert(dirty != NULL && data_dirty != NULL);
+  memset((char *) dirty + map_bytes, 0, bytes - map_bytes);
+  memset((char *) data_dirty + map_bytes, 0, bytes - map_bytes);
+  map_bytes = bytes;
+}
+
+// Keep the lock usable in a child forked while another thread held it.
+static void fork_prepare() { pthread_mutex_lock(&journal_mutex); }
+static void fork_done() { pthread_mutex_unlock(&journal_mutex); }
+
+// Start the commit thread if this process doesn't have one yet. Front ends
+// may fork into the background after mounting, and threads don't come
+// along. Called with the lock held.
+static void start_thread() {
+  if (thread_pid == getpid()) {
+    return;
+  }
+  int rv = pthread_create(&commit_thread, NULL, commit_loop, NULL);
+  assert(rv == 0);
+  thread_pid = getpid();
+}
+
+// Get ready to journal the mapped image.
+int journal_open(int fd) {
+  static int registered = 0;
+  if (!registered) {
+    pthread_atfork(fork_prepare, fork_done, fork_done);
+    registered = 1;
+  }
+  journal_fd = fd;
+  closing = 0;
+  read_only = 0;
+  size_maps(get_superblock()->block_count);
+  return 0;
+}
+
+// Commit whatever is left and stop the commit thread.
+void journal_close() {
+  pthread_mutex_lock(&journal_mutex);
+  if (thread_pid == getpid()) {
+    closing = 1;
+    pthread_cond_signal(&commit_cond);
+    pthread_mutex_unlock(&journal_mutex);
+    pthread_join(commit_thread, NULL);
+  } else {
+    // never started, or started before a fork, commit here
+    closing = 1;
+    commit();
+    pthread_mutex_unlock(&journal_mutex);
+  }
+  thread_pid = 0;
+  // Only the run the last commit went to can be freed after it, and the
+  // image never had that in use.
+  free(freed_list);
+  freed_list = NULL;
+  freed_count = freed_space = 0;
+  free(dirty);
+  free(dirty_list);
+  free(data_dirty);
+  free(data_list);
+  dirty = data_dirty = NULL;
+  dirty_list = data_list = NULL;
+  map_bytes = dirty_space = dirty_count = 0;
+  data_space = data_count = 0;
+  journal_fd = -1;
+}
+
+// Commit what's left, then stop writing to the image for good.
+void journal_read_only() {
+  journal_flush();
+  pthread_mutex_lock(&journal_mutex);
+  read_only = 1;
+  for (long i = 0; i < dirty_count; ++i) {
+    bitmap_put(dirty, dirty_list[i], 0);
+  }
+  dirty_count = 0;
+  pthread_mutex_unlock(&journal_mutex);
+}
+
+// Cover the blocks added to the image.
+void journal_grow(long block_count) {
+  pthread_mutex_lock(&journal_mutex);
+  size_maps(block_count);
+  pthread_mutex_unlock(&journal_mutex);
+}
+
+// Start changing metadata.
+void journal_start() {
+  if (depth++ > 0) {
+    return;
+  }
+  pthread_mutex_lock(&journal_mutex);
+  start_thread();
+  while (freezing || dirty_count >= commit_limit()) {
+    pthread_cond_signal(&commit_cond);
+    pthread_cond_wait(&journal_cond, &journal_mutex);
+  }
+  active += 1;
+  pthread_mutex_unlock(&journal_mutex);
+}
+
+// Done changing metadata.
+void journal_stop() {
+  if (--depth > 0) {
+    return;
+  }
+  pthread_mutex_lock(&journal_mutex);
+  active -= 1;
+  if (active == 0 && freezing) {
+    pthread_cond_signal(&commit_cond);
+  }
+  pthread_mutex_unlock(&journal_mutex);
+}
+
+// Add the blocks under [ptr, ptr + size) to the running transaction.
+void journal_dirty(void *ptr, size_t size) {
+  if (size == 0 || read_only) {
+    return;
+  }
+  size_t offset = (char *) ptr - (char *) get_superblock();
+  long first = offset / BLOCK_SIZE;
+  long last = (offset + size - 1) / BLOCK_SIZE;
+  pthread_mutex_lock(&journal_mutex);
+  for (long bnum = first; bnum <= last; ++bnum) {
+    if (bitmap_get(dirty, bnum)) {
+      continue;
+    }
+    if (dirty_count == dirty_space) {
+      dirty_space = dirty_space ? 2 * dirty_space : 64;
+      dirty_list = realloc(dirty_list, dirty_space * sizeof(int));
+      assert(dirty_list != NULL);
+    }
+    bitmap_put(dirty, bnum, 1);
+    dirty_list[dirty_count++] = bnum;
+  }
+  if (dirty_count >= commit_limit()) {
+    pthread_cond_signal(&commit_cond);
+  }
+  pthread_mutex_unlock(&journal_mutex);
+}
+
+// Mark the words of a bitmap holding bits first to first + count - 1.
+void journal_dirty_bits(void *bm, long first, long count) {
+  if (count <= 0) {
+    return;
+  }
+  uint64_t *words = bm;
+  long from = first / 64;
+  long to = (first + count - 1) / 64;
+  journal_dirty(words + from, (to - from + 1) * sizeof(uint64_t));
+}
+
+// Free a block when the running transaction is home, and stop writing it.
+void journal_free(int bnum) {
+  if (read_only) {
+    return;
+  }
+  pthread_mutex_lock(&journal_mutex);
+  bitmap_put(dirty, bnum, 0);
+  if (freed_count == freed_space) {
+    freed_space = freed_space ? 2 * freed_space : 64;
+    freed_list = realloc(freed_list, freed_space * sizeof(int));
+    assert(freed_list != NULL);
+  }
+  freed_list[freed_count++] = bnum;
+  pthread_mutex_unlock(&journal_mutex);
+}
+
+// Whether a commit would free some blocks.
+int journal_freeing() {
+  pthread_mutex_lock(&journal_mutex);
+  int rv = freed_count > 0 || releasing > 0;
+  pthread_mutex_unlock(&journal_mutex);
+  return rv;
+}
+
+// Commit everything done so far and wait until it is home.
+void journal_flush() {
+  pthread_mutex_lock(&journal_mutex);
+  start_thread();
+  uint64_t id = running_id;
+  if (wanted_id < id) {
+    wanted_id = id;
+  }
+  pthread_cond_signal(&commit_cond);
+  while (done_id < id) {
+    pthread_cond_wait(&journal_cond, &journal_mutex);
+  }
+  pthread_mutex_unlock(&journal_mutex);
+}
+
+// Remember that file data was written to count blocks from bnum.
+void journal_dirty_data(int bnum, int count) {
+  pthread_mutex_lock(&journal_mutex);
+  for (int i = bnum; i < bnum + count; ++i) {
+    if (bitmap_get(data_dirty, i)) {
+      continue;
+    }
+    if (data_count == data_space) {
+      data_space = data_space ? 2 * data_space : 64;
+      data_list = realloc(data_list, data_space * sizeof(int));
+      assert(data_list != NULL);
+    }
+    bitmap_put(data_dirty, i, 1);
+    data_list[data_count++] = i;
+  }
+  pthread_mutex_unlock(&journal_mutex);
+}
+
+// Start writing out the dirty data in count blocks from bnum, a stretch of
+// them at a time. The commit that journal_sync waits for finishes the job.
+int journal_write_back(int bnum, int count) {
+  int found = 0;
+  int end = bnum + count;
+  while (bnum < end) {
+    pthread_mutex_lock(&journal_mutex);
+    while (bnum < end && !bitmap_get(data_dirty, bnum)) {
+      bnum += 1;
+    }
+    int first = bnum;
+    while (bnum < end && bitmap_get(data_dirty, bnum)) {
+      bnum += 1;
+    }
+    pthread_mutex_unlock(&journal_mutex);
+    if (bnum > first) {
+      found = 1;
+      sync_file_range(journal_fd, (off_t) first * BLOCK_SIZE,
+                      (off_t) (bnum - first) * BLOCK_SIZE, SYNC_FILE_RANGE_WRITE);
+    }
+  }
+  return found;
+}
+
+// Wait for the commit that covers the metadata under [ptr, ptr + size), and
+// everything written before now if data is set. Returns straight away if
+// it has already happened.
+void journal_sync(void *ptr, size_t size, int data) {
+  size_t offset = (char *) ptr - (char *) get_superblock();
+  long first = offset / BLOCK_SIZE;
+  long last = (offset + size - 1) / BLOCK_SIZE;
+  pthread_mutex_lock(&journal_mutex);
+  start_thread();
+  int running = data;
+  for (long bnum = first; !running && bnum <= last; ++bnum) {
+    running = bitmap_get(dirty, bnum);
+  }
+  // Otherwise it may still be in the commit being written.
+  uint64_t id = running ? running_id : running_id - 1;
+  if (wanted_id < id) {
+    wanted_id = id;
+    pthread_cond_signal(&commit_cond);
+  }
+  while (done_id < id) {
+    pthread_cond_wait(&journal_cond, &journal_mutex);
+  }
+  pthread_mutex_unlock(&journal_mutex);
+}
+
+// The running transaction, inside journal_start where no commit can start.
+uint64_t journal_running() { return running_id; }
+
+// fdatasync for a file whose size and mapping last changed in transaction
+// id. Once that is home the data written so far is flushed here rather than
+// waiting for a commit, otherwise it waits like journal_sync. Returns 0, or
+// the error from the flush.
+int journal_datasync(uint64_t id, int data) {
+  pthread_mutex_lock(&journal_mutex);
+  start_thread();
+  if (data && done_id >= id) {
+    pthread_mutex_unlock(&journal_mutex);
+    return fdatasync(journal_fd) < 0 ? -errno : 0;
+  }
+  if (data) {
+    id = running_id;
+  } else if (id < running_id - 1) {
+    // Data frozen into the commit being written goes out with it.
+    id = running_id - 1;
+  }
+  if (wanted_id < id) {
+    wanted_id = id;
+    pthread_cond_signal(&commit_cond);
+  }
+  while (done_id < id) {
+    pthread_cond_wait(&journal_cond, &journal_mutex);
+  }
+  pthread_mutex_unlock(&journal_mutex);
+  return 0;
+}
@@ -0,0 +1,159 @@
+// LZ codec, see helpers/lz.h.
+
+#include <stdint.h>
+#include <string.h>
+
+#include "helpers/lz.h"
+
+// Entries in the match finder's hash table.
+#define HASH_BITS 12
+
+// Misses in a row before compressing starts stepping over more than a byte.
+#define SKIP_SHIFT 6
+
+static uint32_t read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static int hash(uint32_t v) { return (v * 2654435761u) >> (32 - HASH_BITS); }
+
+// Bytes a length needs after the token when its nibble is full.
+static int length_bytes(int length) {
+  return length < 15 ? 0 : (length - 15) / 255 + 1;
+}
+
+static uint8_t *put_length(uint8_t *out, int length) {
+  if (length < 15) {
+    return out;
+  }
+  length -= 15;
+  while (length >= 255) {
+    *out++ = 255;
+    length -= 255;
+  }
+  *out++ = length;
+  return out;
+}
+
+/**
+ * Append a sequence of literals followed by a match, or with match 0 just
+ * literals.
+ *
+ * @return Where the next sequence goes, or NULL if this one doesn't fit.
+ */
+static uint8_t *put_sequence(uint8_t *out, uint8_t *end, const uint8_t *literals,
+                             int count, int distance, int match) {
+  int extra = match > 0 ? match - LZ_MIN_MATCH : 0;
+  long need = 1 + length_bytes(count) + count;
+  if (match > 0) {
+    need += 2 + length_bytes(extra);
+  }
+  if (end - out < need) {
+    return NULL;
+  }
+  *out++ = (count < 15 ? count : 15) << 4 | (extra < 15 ? extra : 15);
+  out = put_length(out, count);
+  memcpy(out, literals, count);
+  out += count;
+  if (match > 0) {
+    *out++ = distance & 0xff;
+    *out++ = distance >> 8;
+    out = put_length(out, extra);
+  }
+  return out;
+}
+
+int lz_compress(const void *src, int size, void *dst, int capacity) {
+  const uint8_t *in = src;
+  uint8_t *out = dst;
+  uint8_t *end = out + capacity;
+  int table[1 << HASH_BITS];
+  memset(table, 0xff, sizeof(table));
+
+  int anchor = 0; // start of the literals not yet written
+  int misses = 0;
+  for (int at = 0; at + LZ_MIN_MATCH <= size;) {
+    uint32_t next = read32(in + at);
+    int h = hash(next);
+    int candidate = table[h];
+    table[h] = at;
+    if (candidate < 0 || at - candidate > LZ_MAX_DISTANCE ||
+        read32(in + candidate) != next) {
+      at += 1 + (misses++ >> SKIP_SHIFT);
+      continue;
+    }
+    int match = LZ_MIN_MATCH;
+    while (at + match < size && in[candidate + match] == in[at + match]) {
+      ++match;
+    }
+    out = put_sequence(out, end, in + anchor, at - anchor, at - candidate, match);
+    if (out == NULL) {
+      return 0;
+    }
+    at += match;
+    anchor = at;
+    misses = 0;
+  }
+  out = put_sequence(out, end, in + anchor, size - anchor, 0, 0);
+  return out == NULL ? 0 : out - (uint8_t *) dst;
+}
+
+// Read the length bytes after a full nibble, or return -1 past the end.
+static long get_length(const uint8_t **in, const uint8_t *end, long length) {
+  if (length < 15) {
+    return length;
+  }
+  uint8_t more;
+  do {
+    if (*in == end) {
+      return -1;
+    }
+    more = *(*in)++;
+    length += more;
+  } while (more == 255);
+  return length;
+}
+
+int lz_decompress(const void *src, int size, void *dst, int capacity) {
+  const uint8_t *in = src;
+  const uint8_t *in_end = in + size;
+  uint8_t *out = dst;
+  uint8_t *out_end = out + capacity;
+  while (in < in_end) {
+    int token = *in++;
+    long count = get_length(&in, in_end, token >> 4);
+    if (count < 0 || count > in_end - in || count > out_end - out) {
+      return -1;
+    }
+    memcpy(out, in, count);
+    in += count;
+    out += count;
+    if (in == in_end) {
+      break;
+    }
+    if (in_end - in < 2) {
+      return -1;
+    }
+    long distance = in[0] | in[1] << 8;
+    in += 2;
+    long match = get_length(&in, in_end, token & 15);
+    if (match < 0 || distance == 0 || distance > out - (uint8_t *) dst ||
+        match + LZ_MIN_MATCH > out_end - out) {
+      return -1;
+    }
+    match += LZ_MIN_MATCH;
+    const uint8_t *from = out - distance;
+    if (distance >= match) {
+      memcpy(out, from, match);
+    } else {
+      // Overlapping, each byte may be one this match just wrote.
+      for (long i = 0; i < match; ++i) {
+        out[i] = from[i];
+      }
+    }
+    out += match;
+  }
+  return out - (uint8_t *) dst;
+}
@@ -0,0 +1,158 @@
+// mkfs.nufs: makes a new nufs image with the given geometry.
+//
+// usage: mkfs.nufs [-b block-size] [-N inodes] [-G grow-size [-M max-size]]
+//                  [-z] [-d] image size
+//
+// Sizes are in bytes and may end in K, M or G. The block size defaults to 4K
+// and must be a power of two from 1K to 64K. Without -N there is one inode
+// for every 16K of image, so pick a bigger -N for lots of small files and a
+// smaller one for a few big ones.
+//
+// With -G the image starts out at size and grows by grow-size whenever it
+// fills up, up to max-size (or 1TB). The inode table is sized for the
+// starting size, so give -N when the image is expected to grow a lot.
+//
+// With -z files are compressed, a 64K cluster at a time (see compress.h).
+// With -d blocks of files written with the same bytes are stored once
+// (see dedup.h), compressed files aside.
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "helpers/storage.h"
+#include "helpers/journal.h"
+
+// Bytes of image per inode when -N isn't given.
+#define BYTES_PER_INODE 16384
+
+/**
+ * Parses a size like "64G", "512K" or "1048576" into bytes.
+ * 
+ * @param text the size to parse.
+ * 
+ * @returns the size in bytes, or -1 if it can't be parsed.
+ */
+static long long parse_size(const char *text) {
+  char *end;
+  long long size = strtoll(text, &end, 10);
+  if(end == text || size <= 0) {
+    return -1;
+  }
+  switch(*end) {
+  case 'G': case 'g':
+    size *= 1024;
+    // fall through
+  case 'M': case 'm':
+    size *= 1024;
+    // fall through
+  case 'K': case 'k':
+    size *= 1024;
+    ++end;
+  }
+  return *end == 0 ? size : -1;
+}
+
+static void usage() {
+  fprintf(stderr, "usage: mkfs.nufs [-b block-size] [-N inodes] "
+          "[-G grow-size [-M max-size]] [-z] [-d] image size\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  long long block_size = DEFAULT_BLOCK_SIZE;
+  long long inode_count = 0;
+  long long grow_size = 0;
+  long long max_size = 0;
+  int features = 0;
+  int opt;
+  while((opt = getopt(argc, argv, "b:N:G:M:zd")) != -1) {
+    switch(opt) {
+    case 'b':
+      block_size = parse_size(optarg);
+      break;
+    case 'N':
+      inode_count = parse_size(optarg);
+      break;
+    case 'G':
+      grow_size = parse_size(optarg);
+      break;
+    case 'M':
+      max_size = parse_size(optarg);
+      break;
+    case 'z':
+      features |= SUPER_COMPRESS;
+      break;
+    case 'd':
+      features |= SUPER_DEDUP;
+      break;
+    default:
+      usage();
+    }
+  }
+  if(argc - optind != 2 || block_size <= 0 || inode_count < 0 ||
+     grow_size < 0 || max_size < 0 || (max_size > 0 && grow_size == 0)) {
+    usage();
+  }
+  const char *image = argv[optind];
+  long long size = parse_size(argv[optind + 1]);
+  if(size <= 0) {
+    usage();
+  }
+
+  long long block_count = size / block_size;
+  if(inode_count == 0) {
+    inode_count = size / BYTES_PER_INODE;
+    // Always leave room for the root and a handful of files.
+    if(inode_count < 16) {
+      inode_count = 16;
+    }
+  }
+  if(block_count > 0x7fffffff || inode_count > 0x7fffffff) {
+    fprintf(stderr, "mkfs.nufs: too many blocks or inodes, try a bigger block size\n");
+    return 1;
+  }
+  if(storage_format(image, block_size, block_count, inode_count) != 0) {
+    fprintf(stderr, "mkfs.nufs: can't make a %lld block image with %lld byte "
+            "blocks and %lld inodes in %s\n", block_count, block_size,
+            inode_count, image);
+    return 1;
+  }
+  printf("%s: %lld blocks of %lld bytes, %lld inodes\n", image, block_count,
+         block_size, inode_count);
+
+  if(grow_size > 0) {
+    long long grow_blocks = (grow_size + block_size - 1) / block_size;
+    long long max_blocks = max_size / block_size;
+    if(grow_blocks > 0x7fffffff || max_blocks > 0x7fffffff ||
+       (max_size > 0 && max_blocks < block_count)) {
+      fprintf(stderr, "mkfs.nufs: bad grow or max size\n");
+      return 1;
+    }
+    blocks_init(image);
+    journal_start();
+    get_superblock()->grow_blocks = grow_blocks;
+    get_superblock()->max_block_count = max_blocks;
+    journal_dirty(get_superblock(), sizeof(superblock_t));
+    journal_stop();
+    blocks_free();
+    printf("%s: grows by %lld blocks", image, grow_blocks);
+    if(max_blocks > 0) {
+      printf(" up to %lld blocks", max_blocks);
+    }
+    printf("\n");
+  }
+  if(features != 0) {
+    blocks_init(image);
+    journal_start();
+    get_superblock()->features |= features;
+    journal_dirty(get_superblock(), sizeof(superblock_t));
+    journal_stop();
+    blocks_free();
+  }
+  if(features & SUPER_COMPRESS) {
+    printf("%s: files are compressed\n", image);
+  }
+  if(features & SUPER_DEDUP) {
+    printf("%s: identical blocks are stored once\n", image);
+  }
+  return 0;
+}
@@ -3,6 +3,8 @@
 #include <assert.h>
 #include <bsd/string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -11,21 +13,62 @@
 #include "helpers/storage.h"
 #include "helpers/directory.h"
 #include "helpers/inode.h"
-#include "helpers/utilities.h"
+#include "helpers/profile.h"
+#include "helpers/stats.h"
+#include "helpers/trace.h"
 
 #define FUSE_USE_VERSION 26
 #include <fuse.h>
 
+// How much the kernel may cache, from $NUFS_PROFILE.
+static const profile_t *profile;
+
+// Whether path is /.nufs or in it. Those aren't in the image, nufs makes
+// them up (see stats.h), so nothing can change them. The path is NULL for
+// files that were unlinked while open.
+static int is_stats(const char *path) {
+  size_t length = strlen(STATS_DIR_PATH);
+  return path != NULL && strncmp(path, STATS_DIR_PATH, length) == 0 &&
+         (path[length] == 0 || path[length] == '/');
+}
+
+// Gets the attributes of /.nufs or /.nufs/stats, which belong to whoever
+// runs nufs. The file has no size, like those in /proc.
+static int stats_stat(const char *path, struct stat *st) {
+  memset(st, 0, sizeof(struct stat));
+  st->st_uid = getuid();
+  st->st_gid = getgid();
+  if(strcmp(path, STATS_DIR_PATH) == 0) {
+    st->st_mode = 040555;
+    st->st_nlink = 2;
+    return 0;
+  }
+  if(strcmp(path, STATS_FILE_PATH) == 0) {
+    st->st_mode = 0100444;
+    st->st_nlink = 1;
+    return 0;
+  }
+  return -ENOENT;
+}
+
 // implementation for: man 2 access
 // Checks if a file exists.
 int nufs_access(const char *path, int mask) {
-  int rv = 0;
-  
-  if(tree_lookup(path) == -1) {
-    rv = -ENOENT;
+  int64_t start = stats_now();
+  struct stat st;
+  int rv;
+  if(is_stats(path)) {
+    rv = stats_stat(path, &st);
+    if(rv == 0 && (mask & W_OK)) {
+      rv = -EACCES;
+    }
+  }
+  else {
+    rv = storage_stat(path, &st);
   }
 
-  printf("access(%s, %04o) -> %d\n", path, mask, rv);
+  stats_op(TRACE_ACCESS, start, rv);
+  TRACE_OP(TRACE_ACCESS, 0, mask, rv);
   return rv;
 }
 
@@ -33,44 +76,78 @@ int nufs_access(const char *path, int mask) {
 // Implementation for: man 2 stat
 // This is a crucial function.
 int nufs_getattr(const char *path, struct stat *st) {
-  int rv = storage_stat(path, st);
-  // Print out the information
-  printf("getattr(%s) -> (%d) {mode: %04o, size: %ld}\n", path, rv, st->st_mode,
-         st->st_size);
+  int64_t start = stats_now();
+  int rv = is_stats(path) ? stats_stat(path, st) : storage_stat(path, st);
+  stats_op(TRACE_GETATTR, start, rv);
+  TRACE_OP(TRACE_GETATTR, 0, 0, rv);
+  return rv;
+}
+
+// Gets the attributes of an open file, for fstat, without finding it by
+// path.
+int nufs_fgetattr(const char *path, struct stat *st, struct fuse_file_info *fi) {
+  int64_t start = stats_now();
+  int rv = fi->fh == STATS_FILE_FH ? stats_stat(STATS_FILE_PATH, st)
+                                   : storage_stat_handle(fi->fh, st);
+  stats_op(TRACE_GETATTR, start, rv);
+  TRACE_OP(TRACE_GETATTR, 0, 0, rv);
+  return rv;
+}
+
+// Opens a directory, leaving a handle in fi->fh for readdir.
+int nufs_opendir(const char *path, struct fuse_file_info *fi) {
+  int64_t start = stats_now();
+  int rv;
+  if(is_stats(path)) {
+    struct stat st;
+    rv = stats_stat(path, &st);
+    if(rv == 0 && !S_ISDIR(st.st_mode)) {
+      rv = -ENOTDIR;
+    }
+    fi->fh = STATS_DIR_FH;
+  }
+  else {
+    rv = storage_opendir(path, &fi->fh);
+  }
+  stats_op(TRACE_OPENDIR, start, rv);
+  TRACE_OP(TRACE_OPENDIR, 0, 0, rv);
   return rv;
 }
 
 // implementation for: man 2 readdir
-// lists the contents of a directory
+// lists the contents of a directory, as much as fits in buf at a time
 int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                  off_t offset, struct fuse_file_info *fi) {
-  struct stat st;
-  int rv;
-  // Get all entries
-  slist_t* entries = storage_list(path);
-  // If null, it wasn't a directory.
-  if(entries == NULL) {
-    rv = -ENOENT;
+  int64_t start = stats_now();
+  int rv = 0;
+  if(fi->fh == STATS_DIR_FH) {
+    filler(buf, ".", NULL, 0);
+    filler(buf, "..", NULL, 0);
+    filler(buf, STATS_FILE_NAME, NULL, 0);
   }
   else {
-    slist_t* next = entries;
-    // Loop through them, adding them to buffer
-    while(next != NULL) {
-      char* full_path = append(path, next->data);
-      // Assert is used because all these paths should be legal.
-      assert(0 == nufs_getattr(full_path, &st));
-      filler(buf, next->data, &st, 0);
-      free(full_path);
-      next = next->next;
-    }
-    // Free the entries
-    if(entries != NULL) {
-      s_free(entries);
-    }
-    rv = 0;
+    rv = storage_readdir(fi->fh, offset, filler, buf);
   }
+  stats_op(TRACE_READDIR, start, rv);
+  TRACE_OP(TRACE_READDIR, offset, 0, rv);
+  return rv;
+}
 
-  printf("readdir(%s) -> %d\n", path, rv);
+// Closes a directory opened by nufs_opendir.
+int nufs_releasedir(const char *path, struct fuse_file_info *fi) {
+  int64_t start = stats_now();
+  int rv = fi->fh == STATS_DIR_FH ? 0 : storage_release(fi->fh);
+  stats_op(TRACE_RELEASEDIR, start, rv);
+  TRACE_OP(TRACE_RELEASEDIR, 0, 0, rv);
+  return rv;
+}
+
+// Makes what was written to a directory durable.
+int nufs_fsyncdir(const char *path, int isdatasync, struct fuse_file_info *fi) {
+  int64_t start = stats_now();
+  int rv = fi->fh == STATS_DIR_FH ? 0 : storage_fsync(fi->fh, isdatasync);
+  stats_op(TRACE_FSYNCDIR, start, rv);
+  TRACE_OP(TRACE_FSYNCDIR, 0, isdatasync, rv);
   return rv;
 }
 
@@ -79,113 +156,239 @@ int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 // Note, for this assignment, you can alternatively implement the create
 // function.
 int nufs_mknod(const char *path, mode_t mode, dev_t rdev) {
-  int rv = storage_mknod(path, mode);
-  printf("mknod(%s, %04o) -> %d\n", path, mode, rv);
+  int64_t start = stats_now();
+  int rv = is_stats(path) ? -EACCES : storage_mknod(path, mode);
+  stats_op(TRACE_MKNOD, start, rv);
+  TRACE_OP(TRACE_MKNOD, 0, mode, rv);
   return rv;
 }
 
 // most of the following callbacks implement
 // another system call; see section 2 of the manual
 int nufs_mkdir(const char *path, mode_t mode) {
-  int rv = nufs_mknod(path, mode | 040000, 0);
-  printf("mkdir(%s) -> %d\n", path, rv);
+  int64_t start = stats_now();
+  int rv = is_stats(path) ? -EACCES : storage_mknod(path, mode | 040000);
+  stats_op(TRACE_MKDIR, start, rv);
+  TRACE_OP(TRACE_MKDIR, 0, mode, rv);
   return rv;
 }
 
 int nufs_unlink(const char *path) {
-  int rv = storage_unlink(path);
-  printf("unlink(%s) -> %d\n", path, rv);
+  int64_t start = stats_now();
+  int rv = is_stats(path) ? -EACCES : storage_unlink(path);
+  stats_op(TRACE_UNLINK, start, rv);
+  TRACE_OP(TRACE_UNLINK, 0, 0, rv);
   return rv;
 }
 
 int nufs_link(const char *from, const char *to) {
-  int rv = storage_link(from, to);
-  printf("link(%s => %s) -> %d\n", from, to, rv);
+  int64_t start = stats_now();
+  int rv = is_stats(from) || is_stats(to) ? -EACCES : storage_link(from, to);
+  stats_op(TRACE_LINK, start, rv);
+  TRACE_OP(TRACE_LINK, 0, 0, rv);
   return rv;
 }
 
 int nufs_rmdir(const char *path) {
-  int rv = storage_rmdir(path);
-  printf("rmdir(%s) -> %d\n", path, rv);
+  int64_t start = stats_now();
+  int rv = is_stats(path) ? -EACCES : storage_rmdir(path);
+  stats_op(TRACE_RMDIR, start, rv);
+  TRACE_OP(TRACE_RMDIR, 0, 0, rv);
   return rv;
 }
 
 // implements: man 2 rename
 // called to move a file within the same filesystem
 int nufs_rename(const char *from, const char *to) {
-  int rv = storage_rename(from, to);
-  printf("rename(%s => %s) -> %d\n", from, to, rv);
+  int64_t start = stats_now();
+  int rv = is_stats(from) || is_stats(to) ? -EACCES : storage_rename(from, to);
+  stats_op(TRACE_RENAME, start, rv);
+  TRACE_OP(TRACE_RENAME, 0, 0, rv);
   return rv;
 }
 
 int nufs_chmod(const char *path, mode_t mode) {
-  int rv = -1;
-  // Get inode
-  int inum = tree_lookup(path);
-  if(inum != -1) {
-    inode_t* node = get_inode(inum);
-    node->mode = mode;
-    rv = 0;
-  }
-  printf("chmod(%s, %04o) -> %d\n", path, mode, rv);
+  int64_t start = stats_now();
+  int rv = is_stats(path) ? -EACCES : storage_chmod(path, mode);
+  stats_op(TRACE_CHMOD, start, rv);
+  TRACE_OP(TRACE_CHMOD, 0, mode, rv);
   return rv;
 }
 
 int nufs_truncate(const char *path, off_t size) {
-  int rv = storage_truncate(path, size);
-  printf("truncate(%s, %ld bytes) -> %d\n", path, size, rv);
+  int64_t start = stats_now();
+  int rv = is_stats(path) ? -EACCES : storage_truncate(path, size);
+  stats_op(TRACE_TRUNCATE, start, rv);
+  TRACE_OP(TRACE_TRUNCATE, 0, size, rv);
   return rv;
 }
 
-// This is called on open, but doesn't need to do much
-// since FUSE doesn't assume you maintain state for
-// open files.
-// You can just check whether the file is accessible.
+// Tells the kernel how to cache a file that was just opened. The pages of
+// a file with other names are dropped on every open, since writes through
+// those names go to kernel inodes of their own (see profile.h).
+static void open_profile(struct fuse_file_info *fi) {
+  struct stat st;
+  fi->direct_io = profile->direct_io;
+  fi->keep_cache = profile->keep_cache && storage_stat_handle(fi->fh, &st) == 0 &&
+                   st.st_nlink == 1;
+}
+
+// Looks the file up and checks its permissions once, leaving a handle
+// in fi->fh for read, write and release. /.nufs/stats is read straight
+// from the counters, never from the page cache.
 int nufs_open(const char *path, struct fuse_file_info *fi) {
-  int rv = 0;
-  printf("open(%s) -> %d\n", path, rv);
+  int64_t start = stats_now();
+  int rv;
+  if(is_stats(path)) {
+    struct stat st;
+    rv = stats_stat(path, &st);
+    if(rv == 0 && S_ISDIR(st.st_mode)) {
+      rv = -EISDIR;
+    }
+    else if(rv == 0 && (fi->flags & O_ACCMODE) != O_RDONLY) {
+      rv = -EACCES;
+    }
+    fi->fh = STATS_FILE_FH;
+    fi->direct_io = 1;
+  }
+  else {
+    rv = storage_open(path, fi->flags, &fi->fh);
+    if(rv == 0) {
+      open_profile(fi);
+    }
+  }
+  stats_op(TRACE_OPEN, start, rv);
+  TRACE_OP(TRACE_OPEN, 0, fi->flags, rv);
+  return rv;
+}
+
+// Makes a new file and opens it, saving the kernel a separate mknod.
+int nufs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+  int64_t start = stats_now();
+  int rv = is_stats(path) ? -EACCES
+                          : storage_create(path, mode, fi->flags, &fi->fh);
+  if(rv == 0) {
+    open_profile(fi);
+  }
+  stats_op(TRACE_CREATE, start, rv);
+  TRACE_OP(TRACE_CREATE, 0, mode, rv);
+  return rv;
+}
+
+// Called once the last descriptor sharing an open is closed.
+int nufs_release(const char *path, struct fuse_file_info *fi) {
+  int64_t start = stats_now();
+  int rv = fi->fh == STATS_FILE_FH ? 0 : storage_release(fi->fh);
+  stats_op(TRACE_RELEASE, start, rv);
+  TRACE_OP(TRACE_RELEASE, 0, 0, rv);
+  return rv;
+}
+
+// Makes what was written to a file durable.
+int nufs_fsync(const char *path, int isdatasync, struct fuse_file_info *fi) {
+  int64_t start = stats_now();
+  int rv = fi->fh == STATS_FILE_FH ? 0 : storage_fsync(fi->fh, isdatasync);
+  stats_op(TRACE_FSYNC, start, rv);
+  TRACE_OP(TRACE_FSYNC, 0, isdatasync, rv);
+  return rv;
+}
+
+// Called on every close, starts writing out what was written.
+int nufs_flush(const char *path, struct fuse_file_info *fi) {
+  int64_t start = stats_now();
+  int rv = fi->fh == STATS_FILE_FH ? 0 : storage_flush(fi->fh);
+  stats_op(TRACE_FLUSH, start, rv);
+  TRACE_OP(TRACE_FLUSH, 0, 0, rv);
+  return rv;
+}
+
+// Reserves space in a file, or punches a hole in it.
+int nufs_fallocate(const char *path, int mode, off_t offset, off_t length,
+                   struct fuse_file_info *fi) {
+  int64_t start = stats_now();
+  int rv = storage_fallocate(fi->fh, mode, offset, length);
+  stats_op(TRACE_FALLOCATE, start, rv);
+  TRACE_OP(TRACE_FALLOCATE, offset, length, rv);
   return rv;
 }
 
 // Actually read data
 int nufs_read(const char *path, char *buf, size_t size, off_t offset,
               struct fuse_file_info *fi) {
-  int rv = storage_read(path, buf, size, offset);
-  printf("read(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+  int64_t start = stats_now();
+  int rv = fi->fh == STATS_FILE_FH ? storage_read_stats(buf, size, offset)
+                                   : storage_read_handle(fi->fh, buf, size, offset);
+  stats_op(TRACE_READ, start, rv);
+  TRACE_OP(TRACE_READ, offset, size, rv);
   return rv;
 }
 
 // Actually write data
 int nufs_write(const char *path, const char *buf, size_t size, off_t offset,
                struct fuse_file_info *fi) {
-  int rv = storage_write(path, buf, size, offset);
-  printf("write(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+  int64_t start = stats_now();
+  int rv = storage_write_handle(fi->fh, buf, size, offset);
+  stats_op(TRACE_WRITE, start, rv);
+  TRACE_OP(TRACE_WRITE, offset, size, rv);
   return rv;
 }
 
 // Update the timestamps on a file or directory.
 int nufs_utimens(const char *path, const struct timespec ts[2]) {
-  int rv = storage_set_time(path, ts);
-  printf("utimens(%s, [%ld, %ld; %ld %ld]) -> %d\n", path, ts[0].tv_sec,
-         ts[0].tv_nsec, ts[1].tv_sec, ts[1].tv_nsec, rv);
+  int64_t start = stats_now();
+  int rv = is_stats(path) ? -EACCES : storage_set_time(path, ts);
+  stats_op(TRACE_UTIMENS, start, rv);
+  TRACE_OP(TRACE_UTIMENS, 0, 0, rv);
   return rv;
 }
 
-// Extended operations
+// Extended operations: taking, listing and deleting snapshots, and
+// reading the counters
 int nufs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
                unsigned int flags, void *data) {
-  int rv = -1;
-  printf("ioctl(%s, %d, ...) -> %d\n", path, cmd, rv);
+  int64_t start = stats_now();
+  int rv = storage_ioctl(cmd, data);
+  stats_op(TRACE_IOCTL, start, rv);
+  TRACE_OP(TRACE_IOCTL, 0, cmd, rv);
   return rv;
 }
 
+// Report how big the file system is and how much of it is free.
+int nufs_statfs(const char *path, struct statvfs *st) {
+  int64_t start = stats_now();
+  int rv = storage_statfs(st);
+  stats_op(TRACE_STATFS, start, rv);
+  TRACE_OP(TRACE_STATFS, 0, 0, rv);
+  return rv;
+}
+
+// Asks for the request sizes the profile wants once the kernel says what
+// it allows.
+void *nufs_init(struct fuse_conn_info *conn) {
+  if(!profile->defaults) {
+    if(conn->capable & FUSE_CAP_BIG_WRITES) {
+      conn->want |= FUSE_CAP_BIG_WRITES;
+      conn->max_write = profile->max_write;
+    }
+    if(profile->max_readahead < conn->max_readahead) {
+      conn->max_readahead = profile->max_readahead;
+    }
+  }
+  return NULL;
+}
+
 void nufs_init_ops(struct fuse_operations *ops) {
   memset(ops, 0, sizeof(struct fuse_operations));
+  ops->init = nufs_init;
   ops->access = nufs_access;
   ops->getattr = nufs_getattr;
+  ops->fgetattr = nufs_fgetattr;
+  ops->opendir = nufs_opendir;
   ops->readdir = nufs_readdir;
+  ops->releasedir = nufs_releasedir;
+  ops->fsyncdir = nufs_fsyncdir;
   ops->mknod = nufs_mknod;
-  // ops->create   = nufs_create; // alternative to mknod
+  ops->create = nufs_create;
   ops->mkdir = nufs_mkdir;
   ops->link = nufs_link;
   ops->unlink = nufs_unlink;
@@ -194,17 +397,74 @@ void nufs_init_ops(struct fuse_operations *ops) {
   ops->chmod = nufs_chmod;
   ops->truncate = nufs_truncate;
   ops->open = nufs_open;
+  ops->release = nufs_release;
+  ops->fsync = nufs_fsync;
+  ops->flush = nufs_flush;
+  ops->fallocate = nufs_fallocate;
   ops->read = nufs_read;
   ops->write = nufs_write;
   ops->utimens = nufs_utimens;
   ops->ioctl = nufs_ioctl;
+  ops->statfs = nufs_statfs;
+  // everything given a fuse_file_info goes by fi->fh, so libfuse needn't
+  // find paths
+  ops->flag_nullpath_ok = 1;
+  ops->flag_nopath = 1;
 };
 
 struct fuse_operations nufs_ops;
 
+// Where to dump the trace, from $NUFS_TRACE.
+static const char *trace_path;
+
+// Dumps the trace so far, for kill -USR1.
+static void dump_trace(int sig) {
+  trace_dump(trace_path);
+}
+
+// Takes FUSE options, the mount point, then the image. Mounts the snapshot
+// named in $NUFS_SNAPSHOT instead, read only, if there is one, and caches
+// as $NUFS_PROFILE says (see profile.h).
 int main(int argc, char *argv[]) {
-  assert(argc > 2 && argc < 6);
-  storage_init(argv[--argc]);
+  assert(argc > 2);
+  profile = profile_find(getenv("NUFS_PROFILE"));
+  if(profile == NULL) {
+    fprintf(stderr, "nufs: NUFS_PROFILE must be cache, direct or plain\n");
+    return 1;
+  }
+  if(storage_init(argv[--argc]) != 0) {
+    fprintf(stderr, "nufs: %s is not a nufs image (see mkfs.nufs)\n", argv[argc]);
+    return 1;
+  }
+  const char *snapshot = getenv("NUFS_SNAPSHOT");
+  char *args[argc + 4];
+  memcpy(args, argv, argc * sizeof(char *));
+  if(snapshot != NULL) {
+    if(storage_mount_snapshot(snapshot) != 0) {
+      fprintf(stderr, "nufs: %s has no snapshot named %s\n", argv[argc], snapshot);
+      storage_close();
+      return 1;
+    }
+    args[argc++] = "-o";
+    args[argc++] = "ro";
+  }
+  char timeouts[128];
+  if(!profile->defaults) {
+    snprintf(timeouts, sizeof(timeouts),
+             "entry_timeout=%g,negative_timeout=%g,attr_timeout=%g",
+             profile->entry_timeout, profile->entry_timeout, profile->attr_timeout);
+    args[argc++] = "-o";
+    args[argc++] = timeouts;
+  }
+  trace_path = getenv("NUFS_TRACE");
+  if(TRACE_LEVEL > TRACE_NONE && trace_path != NULL) {
+    signal(SIGUSR1, dump_trace);
+  }
   nufs_init_ops(&nufs_ops);
-  return fuse_main(argc, argv, &nufs_ops, NULL);
+  int rv = fuse_main(argc, args, &nufs_ops, NULL);
+  storage_close();
+  if(TRACE_LEVEL > TRACE_NONE && trace_path != NULL) {
+    trace_dump(trace_path);
+  }
+  return rv;
 }
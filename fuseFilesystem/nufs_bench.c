@@ -0,0 +1,367 @@
+// nufs_bench: times the storage layer directly, without FUSE or a mount.
+//
+// usage: nufs_bench [-b block-size] [-d entries,...] [-D depths,...]
+//                   [-s sizes,...] [-n ops] [-o out.json] [image]
+//
+// For each directory size in -d it times storage_mknod for every entry,
+// tree_lookup of random entries, storage_list of the whole directory and
+// storage_unlink of every entry. For each depth in -D it times tree_lookup
+// of a file that many directories down. For each file size in -s it times
+// storage_write and storage_read of whole files, up to 128K (what FUSE
+// sends) per call. Each test gets a freshly formatted image, which is
+// deleted at the end.
+//
+// Every test reports its ops per second and its median and 99th percentile
+// latency, as JSON with one result per line so that runs of two builds can
+// be compared with diff. The JSON goes to stdout unless -o names a file,
+// and anything else goes to stderr.
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "helpers/storage.h"
+#include "helpers/directory.h"
+
+// Most values one of -d, -D or -s can list.
+#define MAX_VALUES 16
+
+// Bytes per storage_write or storage_read call.
+#define CHUNK_SIZE (128 * 1024)
+
+// Image room beyond what the biggest file needs.
+#define IMAGE_SLACK (256LL * 1024 * 1024)
+
+typedef struct bench {
+  const char *image;
+  int block_size;
+  int ops;         // lookups, and writes or reads, per test
+  FILE *out;
+  int reported;    // results written so far
+  int64_t *times;  // latency of each op in the running test, in ns
+  int count;
+  int space;
+} bench_t;
+
+/**
+ * Parses a size like "64G", "512K" or "1048576" into bytes, the same
+ * way mkfs.nufs does.
+ *
+ * @param text the size to parse.
+ *
+ * @returns the size in bytes, or -1 if it can't be parsed.
+ */
+static long long parse_size(const char *text) {
+  char *end;
+  long long size = strtoll(text, &end, 10);
+  if(end == text || size <= 0) {
+    return -1;
+  }
+  switch(*end) {
+  case 'G': case 'g':
+    size *= 1024;
+    // fall through
+  case 'M': case 'm':
+    size *= 1024;
+    // fall through
+  case 'K': case 'k':
+    size *= 1024;
+    ++end;
+  }
+  return *end == 0 ? size : -1;
+}
+
+/**
+ * Parses a comma separated list of sizes.
+ *
+ * @returns how many there were, or -1 if one can't be parsed or there
+ *          are more than MAX_VALUES.
+ */
+static int parse_list(const char *text, long long *values) {
+  char copy[256];
+  strncpy(copy, text, sizeof(copy) - 1);
+  copy[sizeof(copy) - 1] = 0;
+  int count = 0;
+  for(char *item = strtok(copy, ","); item != NULL; item = strtok(NULL, ",")) {
+    if(count == MAX_VALUES || (values[count] = parse_size(item)) < 0) {
+      return -1;
+    }
+    ++count;
+  }
+  return count;
+}
+
+static void usage() {
+  fprintf(stderr, "usage: nufs_bench [-b block-size] [-d entries,...] "
+          "[-D depths,...] [-s sizes,...] [-n ops] [-o out.json] [image]\n");
+  exit(1);
+}
+
+static int64_t now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Remember how long an op that started at start took.
+static void record(bench_t *b, int64_t start) {
+  int64_t took = now() - start;
+  if(b->count == b->space) {
+    b->space = b->space ? 2 * b->space : 1024;
+    b->times = realloc(b->times, b->space * sizeof(int64_t));
+    if(b->times == NULL) {
+      fprintf(stderr, "nufs_bench: out of memory\n");
+      exit(1);
+    }
+  }
+  b->times[b->count++] = took;
+}
+
+static int compare_times(const void *a, const void *b) {
+  int64_t x = *(const int64_t *) a;
+  int64_t y = *(const int64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Writes out the ops recorded since the last report as one result, then
+ * forgets them.
+ *
+ * @param op what was timed
+ * @param param the name of what the test varies
+ * @param value its value in this test.
+ */
+static void report(bench_t *b, const char *op, const char *param, long long value) {
+  if(b->count == 0) {
+    return;
+  }
+  int64_t total = 0;
+  for(int i = 0; i < b->count; ++i) {
+    total += b->times[i];
+  }
+  qsort(b->times, b->count, sizeof(int64_t), compare_times);
+  fprintf(b->out, "%s\n    {\"op\": \"%s\", \"%s\": %lld, \"count\": %d, "
+          "\"ops_per_sec\": %.1f, \"p50_ns\": %lld, \"p99_ns\": %lld}",
+          b->reported ? "," : "", op, param, value, b->count,
+          total > 0 ? b->count * 1e9 / total : 0.0,
+          (long long) b->times[b->count / 2],
+          (long long) b->times[(long long) b->count * 99 / 100]);
+  b->reported += 1;
+  b->count = 0;
+}
+
+/**
+ * Makes a new image big enough for the test and mounts it.
+ *
+ * @param inodes inodes the test needs
+ * @param bytes file data the test needs.
+ */
+static void start(bench_t *b, int inodes, long long bytes) {
+  long long blocks = (bytes + IMAGE_SLACK) / b->block_size;
+  unlink(b->image);
+  if(storage_format(b->image, b->block_size, blocks, inodes + 64) != 0 ||
+     storage_init(b->image) != 0) {
+    fprintf(stderr, "nufs_bench: can't make an image in %s\n", b->image);
+    exit(1);
+  }
+}
+
+static void fail(const char *what, const char *path, int rv) {
+  fprintf(stderr, "nufs_bench: %s %s failed (%d)\n", what, path, rv);
+  exit(1);
+}
+
+// mknod, lookup, list and unlink in a directory of the given size.
+static void bench_directory(bench_t *b, int entries) {
+  start(b, entries, 0);
+  storage_mknod("/dir", 040755);
+  char path[64];
+  for(int i = 0; i < entries; ++i) {
+    snprintf(path, sizeof(path), "/dir/file%d", i);
+    int64_t t = now();
+    int rv = storage_mknod(path, 0100644);
+    record(b, t);
+    if(rv < 0) {
+      fail("storage_mknod", path, rv);
+    }
+  }
+  report(b, "storage_mknod", "entries", entries);
+
+  srand(entries);
+  for(int i = 0; i < b->ops; ++i) {
+    snprintf(path, sizeof(path), "/dir/file%d", rand() % entries);
+    int64_t t = now();
+    int inum = tree_lookup(path);
+    record(b, t);
+    if(inum < 0) {
+      fail("tree_lookup", path, inum);
+    }
+  }
+  report(b, "tree_lookup", "entries", entries);
+
+  // Enough listings to take about as long as the lookups.
+  int lists = b->ops / entries;
+  lists = lists < 10 ? 10 : lists;
+  for(int i = 0; i < lists; ++i) {
+    int64_t t = now();
+    slist_t *names = storage_list("/dir");
+    record(b, t);
+    s_free(names);
+  }
+  report(b, "storage_list", "entries", entries);
+
+  for(int i = 0; i < entries; ++i) {
+    snprintf(path, sizeof(path), "/dir/file%d", i);
+    int64_t t = now();
+    int rv = storage_unlink(path);
+    record(b, t);
+    if(rv < 0) {
+      fail("storage_unlink", path, rv);
+    }
+  }
+  report(b, "storage_unlink", "entries", entries);
+  storage_close();
+}
+
+// lookup of a file the given number of directories down.
+static void bench_depth(bench_t *b, int depth) {
+  start(b, depth + 1, 0);
+  char path[4096] = "";
+  for(int i = 0; i < depth; ++i) {
+    size_t len = strlen(path);
+    snprintf(path + len, sizeof(path) - len, "/d%d", i);
+    storage_mknod(path, 040755);
+  }
+  size_t len = strlen(path);
+  snprintf(path + len, sizeof(path) - len, "/file");
+  storage_mknod(path, 0100644);
+  for(int i = 0; i < b->ops; ++i) {
+    int64_t t = now();
+    int inum = tree_lookup(path);
+    record(b, t);
+    if(inum < 0) {
+      fail("tree_lookup", path, inum);
+    }
+  }
+  report(b, "tree_lookup", "depth", depth);
+  storage_close();
+}
+
+// write and read of whole files of the given size.
+static void bench_file(bench_t *b, long long size) {
+  start(b, 1, size);
+  char *buf = malloc(CHUNK_SIZE);
+  if(buf == NULL) {
+    fail("malloc", "", 0);
+  }
+  memset(buf, 'x', CHUNK_SIZE);
+  long long calls = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+  int rounds = b->ops / calls;
+  rounds = rounds < 1 ? 1 : rounds;
+  // A new file each round, so every write allocates.
+  for(int round = 0; round < rounds; ++round) {
+    storage_unlink("/file");
+    storage_mknod("/file", 0100644);
+    for(long long offset = 0; offset < size; offset += CHUNK_SIZE) {
+      size_t len = size - offset < CHUNK_SIZE ? size - offset : CHUNK_SIZE;
+      int64_t t = now();
+      int rv = storage_write("/file", buf, len, offset);
+      record(b, t);
+      if(rv < 0) {
+        fail("storage_write", "/file", rv);
+      }
+    }
+  }
+  report(b, "storage_write", "file_size", size);
+
+  for(int round = 0; round < rounds; ++round) {
+    for(long long offset = 0; offset < size; offset += CHUNK_SIZE) {
+      size_t len = size - offset < CHUNK_SIZE ? size - offset : CHUNK_SIZE;
+      int64_t t = now();
+      int rv = storage_read("/file", buf, len, offset);
+      record(b, t);
+      if(rv < 0) {
+        fail("storage_read", "/file", rv);
+      }
+    }
+  }
+  report(b, "storage_read", "file_size", size);
+  free(buf);
+  storage_close();
+}
+
+int main(int argc, char *argv[]) {
+  bench_t b = {"bench.nufs", DEFAULT_BLOCK_SIZE, 10000, NULL, 0, NULL, 0, 0};
+  long long entries[MAX_VALUES] = {100, 1000, 10000};
+  long long depths[MAX_VALUES] = {1, 4, 16};
+  long long sizes[MAX_VALUES] = {4096, 65536, 1048576};
+  int entry_count = 3;
+  int depth_count = 3;
+  int size_count = 3;
+  const char *out = NULL;
+  int opt;
+  while((opt = getopt(argc, argv, "b:d:D:s:n:o:")) != -1) {
+    switch(opt) {
+    case 'b':
+      b.block_size = parse_size(optarg);
+      break;
+    case 'd':
+      entry_count = parse_list(optarg, entries);
+      break;
+    case 'D':
+      depth_count = parse_list(optarg, depths);
+      break;
+    case 's':
+      size_count = parse_list(optarg, sizes);
+      break;
+    case 'n':
+      b.ops = parse_size(optarg);
+      break;
+    case 'o':
+      out = optarg;
+      break;
+    default:
+      usage();
+    }
+  }
+  if(argc - optind > 1 || b.block_size <= 0 || b.ops <= 0 ||
+     entry_count < 0 || depth_count < 0 || size_count < 0) {
+    usage();
+  }
+  if(optind < argc) {
+    b.image = argv[optind];
+  }
+  for(int i = 0; i < depth_count; ++i) {
+    // Every name on the path takes up to 5 bytes.
+    if(depths[i] > 800) {
+      usage();
+    }
+  }
+
+  // The storage layer prints progress to stdout, keep it out of the JSON.
+  b.out = out != NULL ? fopen(out, "w") : fdopen(dup(STDOUT_FILENO), "w");
+  if(b.out == NULL) {
+    fprintf(stderr, "nufs_bench: can't write %s\n", out);
+    return 1;
+  }
+  dup2(STDERR_FILENO, STDOUT_FILENO);
+
+  fprintf(b.out, "{\n  \"block_size\": %d,\n  \"ops\": %d,\n  \"results\": [",
+          b.block_size, b.ops);
+  for(int i = 0; i < entry_count; ++i) {
+    bench_directory(&b, entries[i]);
+  }
+  for(int i = 0; i < depth_count; ++i) {
+    bench_depth(&b, depths[i]);
+  }
+  for(int i = 0; i < size_count; ++i) {
+    bench_file(&b, sizes[i]);
+  }
+  fprintf(b.out, "\n  ]\n}\n");
+  fclose(b.out);
+  unlink(b.image);
+  free(b.times);
+  return 0;
+}
@@ -0,0 +1,689 @@
+// Low-level FUSE front end, built on libfuse 3.
+//
+// The kernel names files by inode number here, so requests go straight to
+// the storage functions that take inums and nothing is looked up from the
+// root. FUSE numbers the root 1 and nufs numbers it 0, so a FUSE ino is
+// always the nufs inum plus one.
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "helpers/profile.h"
+#include "helpers/stats.h"
+#include "helpers/storage.h"
+#include "helpers/trace.h"
+
+#define FUSE_USE_VERSION 34
+#include <fuse_lowlevel.h>
+
+#define INUM(ino) ((int)(ino) - 1)
+#define INO(inum) ((fuse_ino_t)(inum) + 1)
+
+// How much the kernel may cache, from $NUFS_PROFILE.
+static const profile_t *profile;
+
+// Seconds the kernel may trust names and attributes we give it.
+#define ENTRY_TIMEOUT (profile->entry_timeout)
+#define ATTR_TIMEOUT (profile->attr_timeout)
+
+// /.nufs and /.nufs/stats, which aren't in the image (see stats.h). Every
+// inum fits in an int, so these never clash with a real ino.
+#define STATS_DIR_INO ((fuse_ino_t) 1 << 40)
+#define STATS_FILE_INO (STATS_DIR_INO + 1)
+#define IS_STATS(ino) ((ino) >= STATS_DIR_INO)
+
+// Gets the attributes of the stats directory or file, which belong to
+// whoever runs nufs_ll. The file has no size, like those in /proc.
+static void stats_attr(fuse_ino_t ino, struct stat *st) {
+  memset(st, 0, sizeof(struct stat));
+  st->st_ino = ino;
+  st->st_uid = getuid();
+  st->st_gid = getgid();
+  st->st_mode = ino == STATS_DIR_INO ? 040555 : 0100444;
+  st->st_nlink = ino == STATS_DIR_INO ? 2 : 1;
+}
+
+// Answers a lookup of one of them, which needn't be pinned.
+static void reply_stats_entry(fuse_req_t req, fuse_ino_t ino) {
+  struct fuse_entry_param e;
+  memset(&e, 0, sizeof(e));
+  e.ino = ino;
+  stats_attr(ino, &e.attr);
+  e.attr_timeout = ATTR_TIMEOUT;
+  e.entry_timeout = ENTRY_TIMEOUT;
+  fuse_reply_entry(req, &e);
+}
+
+// Answers a request that made or found an inode, which storage pinned.
+static void reply_entry(fuse_req_t req, int rv, struct stat *st) {
+  if(rv < 0) {
+    fuse_reply_err(req, -rv);
+    return;
+  }
+  struct fuse_entry_param e;
+  memset(&e, 0, sizeof(e));
+  int inum = st->st_ino;
+  e.ino = INO(inum);
+  e.attr = *st;
+  e.attr.st_ino = e.ino;
+  e.attr_timeout = ATTR_TIMEOUT;
+  e.entry_timeout = ENTRY_TIMEOUT;
+  // The kernel only counts the lookup if it got the answer.
+  if(fuse_reply_entry(req, &e) != 0) {
+    storage_forget(inum, 1);
+  }
+}
+
+// Finds a name in a directory.
+void nufs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  int64_t start = stats_now();
+  TRACE_INUM(INUM(parent));
+  fuse_ino_t stats_ino = 0;
+  if(parent == FUSE_ROOT_ID && strcmp(name, STATS_DIR_NAME) == 0) {
+    stats_ino = STATS_DIR_INO;
+  }
+  else if(parent == STATS_DIR_INO && strcmp(name, STATS_FILE_NAME) == 0) {
+    stats_ino = STATS_FILE_INO;
+  }
+  struct stat st;
+  int rv;
+  if(stats_ino != 0) {
+    rv = 0;
+  }
+  else if(IS_STATS(parent)) {
+    rv = -ENOENT;
+  }
+  else {
+    rv = storage_lookup_at(INUM(parent), name, &st);
+  }
+  stats_op(TRACE_LL_LOOKUP, start, rv);
+  TRACE_OP(TRACE_LL_LOOKUP, 0, 0, rv);
+  if(stats_ino != 0) {
+    reply_stats_entry(req, stats_ino);
+    return;
+  }
+  if(rv == -ENOENT) {
+    // Let the kernel remember that the name is missing.
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.entry_timeout = ENTRY_TIMEOUT;
+    fuse_reply_entry(req, &e);
+    return;
+  }
+  reply_entry(req, rv, &st);
+}
+
+// The kernel dropped nlookup of its references to an inode.
+void nufs_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+  int64_t start = stats_now();
+  TRACE_INUM(INUM(ino));
+  if(!IS_STATS(ino)) {
+    storage_forget(INUM(ino), nlookup);
+  }
+  stats_op(TRACE_FORGET, start, 0);
+  TRACE_OP(TRACE_FORGET, 0, nlookup, 0);
+  fuse_reply_none(req);
+}
+
+// The same for many inodes at once.
+void nufs_ll_forget_multi(fuse_req_t req, size_t count,
+                          struct fuse_forget_data *forgets) {
+  for(size_t i = 0; i < count; ++i) {
+    int64_t start = stats_now();
+    TRACE_INUM(INUM(forgets[i].ino));
+    if(!IS_STATS(forgets[i].ino)) {
+      storage_forget(INUM(forgets[i].ino), forgets[i].nlookup);
+    }
+    stats_op(TRACE_FORGET, start, 0);
+    TRACE_OP(TRACE_FORGET, 0, forgets[i].nlookup, 0);
+  }
+  fuse_reply_none(req);
+}
+
+// Gets an object's attributes (type, permissions, size, etc).
+void nufs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  int64_t start = stats_now();
+  TRACE_INUM(INUM(ino));
+  struct stat st;
+  int rv = 0;
+  if(IS_STATS(ino)) {
+    stats_attr(ino, &st);
+  }
+  else {
+    rv = storage_stat_inum(INUM(ino), &st);
+  }
+  stats_op(TRACE_GETATTR, start, rv);
+  TRACE_OP(TRACE_GETATTR, 0, 0, rv);
+  if(rv < 0) {
+    fuse_reply_err(req, -rv);
+    return;
+  }
+  st.st_ino = ino;
+  fuse_reply_attr(req, &st, ATTR_TIMEOUT);
+}
+
+// Changes the mode, size and/or times, answering with the new attributes.
+void nufs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                     int to_set, struct fuse_file_info *fi) {
+  int64_t start = stats_now();
+  TRACE_INUM(INUM(ino));
+  struct stat st;
+  int rv = IS_STATS(ino) ? -EACCES : storage_stat_inum(INUM(ino), &st);
+  if(rv == 0 && (to_set & FUSE_SET_ATTR_MODE)) {
+    // Only the permission bits can change, never the type.
+    rv = storage_chmod_inum(INUM(ino), (st.st_mode & S_IFMT) | (attr->st_mode & 07777));
+  }
+  if(rv == 0 && (to_set & FUSE_SET_ATTR_SIZE)) {
+    rv = storage_truncate_inum(INUM(ino), attr->st_size);
+  }
+  if(rv == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+    struct timespec ts[2] = { attr->st_atim, attr->st_mtim };
+    int now[2] = { FUSE_SET_ATTR_ATIME_NOW, FUSE_SET_ATTR_MTIME_NOW };
+    int set[2] = { FUSE_SET_ATTR_ATIME, FUSE_SET_ATTR_MTIME };
+    for(int i = 0; i < 2; ++i) {
+      if(!(to_set & set[i])) {
+        ts[i].tv_nsec = UTIME_OMIT;
+      }
+      else if(to_set & now[i]) {
+        ts[i].tv_nsec = UTIME_NOW;
+      }
+    }
+    rv = storage_set_time_inum(INUM(ino), ts);
+  }
+  stats_op(TRACE_SETATTR, start, rv);
+  TRACE_OP(TRACE_SETATTR, 0, to_set, rv);
+  if(rv < 0) {
+    fuse_reply_err(req, -rv);
+    return;
+  }
+  storage_stat_inum(INUM(ino), &st);
+  st.st_ino = ino;
+  fuse_reply_attr(req, &st, ATTR_TIMEOUT);
+}
+
+// Makes a file.
+void nufs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                   mode_t mode, dev_t rdev) {
+  int64_t start = stats_now();
+  TRACE_INUM(INUM(parent));
+  struct stat st;
+  int rv = IS_STATS(parent) ? -EACCES : storage_mknod_at(INUM(parent), name, mode, &st);
+  stats_op(TRACE_MKNOD, start, rv);
+  TRACE_OP(TRACE_MKNOD, 0, mode, rv);
+  reply_entry(req, rv, &st);
+}
+
+// Makes a directory.
+void nufs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                   mode_t mode) {
+  int64_t start = stats_now();
+  TRACE_INUM(INUM(parent));
+  struct stat st;
+  int rv = IS_STATS(parent) ? -EACCES : storage_mknod_at(INUM(parent), name, mode | S_IFDIR, &st);
+  stats_op(TRACE_MKDIR, start, rv);
+  TRACE_OP(TRACE_MKDIR, 0, mode, rv);
+  reply_entry(req, rv, &st);
+}
+
+// Removes a name.
+void nufs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  int64_t start = stats_now();
+  TRACE_INUM(INUM(parent));
+  int rv = IS_STATS(parent) ? -EACCES : storage_unlink_at(INUM(parent), name);
+  stats_op(TRACE_UNLINK, start, rv);
+  TRACE_OP(TRACE_UNLINK, 0, 0, rv);
+  fuse_reply_err(req, -rv);
+}
+
+// Removes an empty directory.
+void nufs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  int64_t start = stats_now();
+  TRACE_INUM(INUM(parent));
+  int rv = IS_STATS(parent) ? -EACCES : storage_rmdir_at(INUM(parent), name);
+  stats_op(TRACE_RMDIR, start, rv);
+  TRACE_OP(TRACE_RMDIR, 0, 0, rv);
+  fuse_reply_err(req, -rv);
+}
+
+// Moves a name, replacing the one it is moved to unless RENAME_NOREPLACE
+// is given. RENAME_EXCHANGE and RENAME_WHITEOUT aren't supported.
+void nufs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                    fuse_ino_t newparent, const char *newname,
+                    unsigned int flags) {
+  int64_t start = stats_now();
+  TRACE_INUM(INUM(parent));
+  int rv = -EINVAL;
+  if(IS_STATS(parent) || IS_STATS(newparent)) {
+    rv = -EACCES;
+  }
+  else if((flags & ~RENAME_NOREPLACE) == 0) {
+    rv = storage_rename_at(INUM(parent), name, INUM(newparent), newname,
+                           !(flags & RENAME_NOREPLACE));
+  }
+  stats_op(TRACE_RENAME, start, rv);
+  TRACE_OP(TRACE_RENAME, 0, flags, rv);
+  fuse_reply_err(req, -rv);
+}
+
+// Adds another name for a file.
+void nufs_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+                  const char *newname) {
+  int64_t start = stats_now();
+  TRACE_INUM(INUM(ino));
+  struct stat st;
+  int rv = IS_STATS(ino) || IS_STATS(newparent)
+               ? -EACCES
+               : storage_link_at(INUM(ino), INUM(newparent), newname, &st);
+  stats_op(TRACE_LINK, start, rv);
+  TRACE_OP(TRACE_LINK, 0, 0, rv);
+  reply_entry(req, rv, &st);
+}
+
+// Opens a file, leaving a handle in fi->fh. /.nufs/stats is read
+// straight from the counters, never from the page cache.
+void nufs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  int64_t start = stats_now();
+  TRACE_INUM(INUM(ino));
+  int rv;
+  if(ino == STATS_DIR_INO) {
+    rv = -EISDIR;
+  }
+  else if(ino == STATS_FILE_INO) {
+    rv = (fi->flags & O_ACCMODE) == O_RDONLY ? 0 : -EACCES;
+    fi->fh = STATS_FILE_FH;
+    fi->direct_io = 1;
+  }
+  else {
+    rv = storage_open_inum(INUM(ino), fi->flags, &fi->fh);
+    fi->keep_cache = profile->keep_cache;
+    fi->direct_io = profile->direct_io;
+  }
+  stats_op(TRACE_OPEN, start, rv);
+  TRACE_OP(TRACE_OPEN, 0, fi->flags, rv);
+  if(rv < 0) {
+    fuse_reply_err(req, -rv);
+  }
+  else if(fuse_reply_open(req, fi) != 0 && fi->fh != STATS_FILE_FH) {
+    storage_release(fi->fh);
+  }
+}
+
+// Makes a new file and opens it.
+void nufs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                    mode_t mode, struct fuse_file_info *fi) {
+  int64_t start = stats_now();
+  TRACE_INUM(INUM(parent));
+  struct stat st;
+  int rv = IS_STATS(parent)
+               ? -EACCES
+               : storage_create_at(INUM(parent), name, mode, fi->flags, &st, &fi->fh);
+  fi->keep_cache = profile->keep_cache;
+  fi->direct_io = profile->direct_io;
+  stats_op(TRACE_CREATE, start, rv);
+  TRACE_OP(TRACE_CREATE, 0, mode, rv);
+  if(rv < 0) {
+    fuse_reply_err(req, -rv);
+    return;
+  }
+  struct fuse_entry_param e;
+  memset(&e, 0, sizeof(e));
+  int inum = st.st_ino;
+  e.ino = INO(inum);
+  e.attr = st;
+  e.attr.st_ino = e.ino;
+  e.attr_timeout = ATTR_TIMEOUT;
+  e.entry_timeout = ENTRY_TIMEOUT;
+  if(fuse_reply_create(req, &e, fi) != 0) {
+    storage_release(fi->fh);
+    storage_forget(inum, 1);
+  }
+}
+
+// Actually read data
+void nufs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                  struct fuse_file_info *fi) {
+  int64_t start = stats_now();
+  char *buf = malloc(size);
+  if(buf == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  int rv = fi->fh == STATS_FILE_FH ? storage_read_stats(buf, size, offset)
+                                   : storage_read_handle(fi->fh, buf, size, offset);
+  stats_op(TRACE_READ, start, rv);
+  TRACE_OP(TRACE_READ, offset, size, rv);
+  if(rv < 0) {
+    fuse_reply_err(req, -rv);
+  }
+  else {
+    fuse_reply_buf(req, buf, rv);
+  }
+  free(buf);
+}
+
+// Actually write data
+void nufs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                   size_t size, off_t offset, struct fuse_file_info *fi) {
+  int64_t start = stats_now();
+  int rv = storage_write_handle(fi->fh, buf, size, offset);
+  stats_op(TRACE_WRITE, start, rv);
+  TRACE_OP(TRACE_WRITE, offset, size, rv);
+  if(rv < 0) {
+    fuse_reply_err(req, -rv);
+  }
+  else {
+    fuse_reply_write(req, rv);
+  }
+}
+
+// Called once the last descriptor sharing an open is closed.
+void nufs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  int64_t start = stats_now();
+  TRACE_INUM(INUM(ino));
+  int rv = fi->fh == STATS_FILE_FH ? 0 : storage_release(fi->fh);
+  stats_op(TRACE_RELEASE, start, rv);
+  TRACE_OP(TRACE_RELEASE, 0, 0, rv);
+  fuse_reply_err(req, -rv);
+}
+
+// Makes what was written to a file durable.
+void nufs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                   struct fuse_file_info *fi) {
+  int64_t start = stats_now();
+  TRACE_INUM(INUM(ino));
+  int rv = fi->fh == STATS_FILE_FH ? 0 : storage_fsync(fi->fh, datasync);
+  stats_op(TRACE_FSYNC, start, rv);
+  TRACE_OP(TRACE_FSYNC, 0, datasync, rv);
+  fuse_reply_err(req, -rv);
+}
+
+// Called on every close, starts writing out what was written.
+void nufs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  int64_t start = stats_now();
+  TRACE_INUM(INUM(ino));
+  int rv = fi->fh == STATS_FILE_FH ? 0 : storage_flush(fi->fh);
+  stats_op(TRACE_FLUSH, start, rv);
+  TRACE_OP(TRACE_FLUSH, 0, 0, rv);
+  fuse_reply_err(req, -rv);
+}
+
+// Reserves space in a file, or punches a hole in it.
+void nufs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset,
+                       off_t length, struct fuse_file_info *fi) {
+  int64_t start = stats_now();
+  TRACE_INUM(INUM(ino));
+  int rv = storage_fallocate(fi->fh, mode, offset, length);
+  stats_op(TRACE_FALLOCATE, start, rv);
+  TRACE_OP(TRACE_FALLOCATE, offset, length, rv);
+  fuse_reply_err(req, -rv);
+}
+
+// Opens a directory, leaving a handle in fi->fh for readdir.
+void nufs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  int64_t start = stats_now();
+  TRACE_INUM(INUM(ino));
+  int rv;
+  if(IS_STATS(ino)) {
+    rv = ino == STATS_DIR_INO ? 0 : -ENOTDIR;
+    fi->fh = STATS_DIR_FH;
+  }
+  else {
+    rv = storage_opendir_inum(INUM(ino), &fi->fh);
+  }
+  stats_op(TRACE_OPENDIR, start, rv);
+  TRACE_OP(TRACE_OPENDIR, 0, 0, rv);
+  if(rv < 0) {
+    fuse_reply_err(req, -rv);
+  }
+  else if(fuse_reply_open(req, fi) != 0 && fi->fh != STATS_DIR_FH) {
+    storage_release(fi->fh);
+  }
+}
+
+// The reply buffer readdir is filling.
+typedef struct ll_dir_buf {
+  fuse_req_t req;
+  char *buf;
+  size_t size; // bytes the kernel asked for
+  size_t used;
+} ll_dir_buf_t;
+
+// Adds an entry, with st_ino already an ino, to the reply, or says stop
+// once it is full.
+static int ll_add(ll_dir_buf_t *dir, const char *name, const struct stat *st, off_t next) {
+  size_t size = fuse_add_direntry(dir->req, dir->buf + dir->used,
+                                  dir->size - dir->used, name, st, next);
+  if(size > dir->size - dir->used) {
+    return 1;
+  }
+  dir->used += size;
+  return 0;
+}
+
+// Adds an entry storage_readdir found, numbered by inum.
+static int ll_fill(void *arg, const char *name, const struct stat *st, off_t next) {
+  struct stat entry = *st;
+  entry.st_ino = INO(st->st_ino);
+  return ll_add(arg, name, &entry, next);
+}
+
+// Lists the contents of a directory, as much as fits in size at a time.
+void nufs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                     struct fuse_file_info *fi) {
+  int64_t start = stats_now();
+  ll_dir_buf_t dir = { req, malloc(size), size, 0 };
+  if(dir.buf == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  int rv = 0;
+  if(fi->fh == STATS_DIR_FH) {
+    // Entry i is followed by offset i + 1.
+    const char *names[] = { ".", "..", STATS_FILE_NAME };
+    fuse_ino_t inos[] = { STATS_DIR_INO, FUSE_ROOT_ID, STATS_FILE_INO };
+    for(off_t i = offset; i < 3; ++i) {
+      // An entry only carries the ino and the type.
+      struct stat st;
+      memset(&st, 0, sizeof(st));
+      st.st_ino = inos[i];
+      st.st_mode = inos[i] == STATS_FILE_INO ? S_IFREG : S_IFDIR;
+      if(ll_add(&dir, names[i], &st, i + 1) != 0) {
+        break;
+      }
+    }
+  }
+  else {
+    rv = storage_readdir(fi->fh, offset, ll_fill, &dir);
+  }
+  stats_op(TRACE_READDIR, start, rv);
+  TRACE_OP(TRACE_READDIR, offset, size, rv);
+  if(rv < 0) {
+    fuse_reply_err(req, -rv);
+  }
+  else {
+    fuse_reply_buf(req, dir.buf, dir.used);
+  }
+  free(dir.buf);
+}
+
+// Closes a directory opened by nufs_ll_opendir.
+void nufs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  int64_t start = stats_now();
+  TRACE_INUM(INUM(ino));
+  int rv = fi->fh == STATS_DIR_FH ? 0 : storage_release(fi->fh);
+  stats_op(TRACE_RELEASEDIR, start, rv);
+  TRACE_OP(TRACE_RELEASEDIR, 0, 0, rv);
+  fuse_reply_err(req, -rv);
+}
+
+// Makes what was written to a directory durable.
+void nufs_ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync,
+                      struct fuse_file_info *fi) {
+  int64_t start = stats_now();
+  TRACE_INUM(INUM(ino));
+  int rv = fi->fh == STATS_DIR_FH ? 0 : storage_fsync(fi->fh, datasync);
+  stats_op(TRACE_FSYNCDIR, start, rv);
+  TRACE_OP(TRACE_FSYNCDIR, 0, datasync, rv);
+  fuse_reply_err(req, -rv);
+}
+
+// Extended operations: taking, listing and deleting snapshots, and
+// reading the counters. Only
+// ioctls that encode their size are sent, so the buffers are always big
+// enough for them.
+void nufs_ll_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
+                   struct fuse_file_info *fi, unsigned flags, const void *in_buf,
+                   size_t in_bufsz, size_t out_bufsz) {
+  int64_t start = stats_now();
+  TRACE_INUM(INUM(ino));
+  size_t size = in_bufsz > out_bufsz ? in_bufsz : out_bufsz;
+  char *data = calloc(1, size + 1);
+  if(data == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  memcpy(data, in_buf, in_bufsz);
+  int rv = storage_ioctl(cmd, data);
+  stats_op(TRACE_IOCTL, start, rv);
+  TRACE_OP(TRACE_IOCTL, 0, cmd, rv);
+  if(rv < 0) {
+    fuse_reply_err(req, -rv);
+  }
+  else {
+    fuse_reply_ioctl(req, rv, data, out_bufsz);
+  }
+  free(data);
+}
+
+// Report how big the file system is and how much of it is free.
+void nufs_ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+  int64_t start = stats_now();
+  struct statvfs st;
+  int rv = storage_statfs(&st);
+  stats_op(TRACE_STATFS, start, rv);
+  TRACE_OP(TRACE_STATFS, 0, 0, rv);
+  fuse_reply_statfs(req, &st);
+}
+
+// Asks for the request sizes the profile wants once the kernel says what
+// it allows. Every file has one kernel inode here, so nothing the kernel
+// caches goes stale behind its back (see profile.h).
+void nufs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+  if(!profile->defaults) {
+    conn->max_write = profile->max_write;
+    if(profile->max_readahead < conn->max_readahead) {
+      conn->max_readahead = profile->max_readahead;
+    }
+  }
+}
+
+void nufs_ll_init_ops(struct fuse_lowlevel_ops *ops) {
+  memset(ops, 0, sizeof(struct fuse_lowlevel_ops));
+  ops->init = nufs_ll_init;
+  ops->lookup = nufs_ll_lookup;
+  ops->forget = nufs_ll_forget;
+  ops->forget_multi = nufs_ll_forget_multi;
+  ops->getattr = nufs_ll_getattr;
+  ops->setattr = nufs_ll_setattr;
+  ops->mknod = nufs_ll_mknod;
+  ops->mkdir = nufs_ll_mkdir;
+  ops->unlink = nufs_ll_unlink;
+  ops->rmdir = nufs_ll_rmdir;
+  ops->rename = nufs_ll_rename;
+  ops->link = nufs_ll_link;
+  ops->open = nufs_ll_open;
+  ops->create = nufs_ll_create;
+  ops->read = nufs_ll_read;
+  ops->write = nufs_ll_write;
+  ops->release = nufs_ll_release;
+  ops->fsync = nufs_ll_fsync;
+  ops->flush = nufs_ll_flush;
+  ops->fallocate = nufs_ll_fallocate;
+  ops->opendir = nufs_ll_opendir;
+  ops->readdir = nufs_ll_readdir;
+  ops->releasedir = nufs_ll_releasedir;
+  ops->fsyncdir = nufs_ll_fsyncdir;
+  ops->statfs = nufs_ll_statfs;
+  ops->ioctl = nufs_ll_ioctl;
+}
+
+// Where to dump the trace, from $NUFS_TRACE.
+static const char *trace_path;
+
+// Dumps the trace so far, for kill -USR1.
+static void dump_trace(int sig) {
+  trace_dump(trace_path);
+}
+
+// Takes the same arguments as nufs: FUSE options, the mount point, then
+// the image. $NUFS_SNAPSHOT mounts a snapshot read only and $NUFS_PROFILE
+// picks how much is cached, as for nufs.
+int main(int argc, char *argv[]) {
+  assert(argc > 2);
+  profile = profile_find(getenv("NUFS_PROFILE"));
+  if(profile == NULL) {
+    fprintf(stderr, "nufs_ll: NUFS_PROFILE must be cache, direct or plain\n");
+    return 1;
+  }
+  if(storage_init(argv[--argc]) != 0) {
+    fprintf(stderr, "nufs_ll: %s is not a nufs image (see mkfs.nufs)\n", argv[argc]);
+    return 1;
+  }
+  const char *snapshot = getenv("NUFS_SNAPSHOT");
+  if(snapshot != NULL && storage_mount_snapshot(snapshot) != 0) {
+    fprintf(stderr, "nufs_ll: %s has no snapshot named %s\n", argv[argc], snapshot);
+    storage_close();
+    return 1;
+  }
+  trace_path = getenv("NUFS_TRACE");
+  if(TRACE_LEVEL > TRACE_NONE && trace_path != NULL) {
+    signal(SIGUSR1, dump_trace);
+  }
+
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  if(snapshot != NULL) {
+    fuse_opt_add_arg(&args, "-oro");
+  }
+  struct fuse_cmdline_opts opts;
+  if(fuse_parse_cmdline(&args, &opts) != 0 || opts.mountpoint == NULL) {
+    fprintf(stderr, "usage: %s [options] mountpoint image\n", argv[0]);
+    return 1;
+  }
+  struct fuse_lowlevel_ops ops;
+  nufs_ll_init_ops(&ops);
+  struct fuse_session *se = fuse_session_new(&args, &ops, sizeof(ops), NULL);
+  int rv = 1;
+  if(se != NULL && fuse_set_signal_handlers(se) == 0) {
+    if(fuse_session_mount(se, opts.mountpoint) == 0) {
+      fuse_daemonize(opts.foreground);
+      if(opts.singlethread) {
+        rv = fuse_session_loop(se);
+      }
+      else {
+        struct fuse_loop_config config;
+        config.clone_fd = opts.clone_fd;
+        config.max_idle_threads = opts.max_idle_threads;
+        rv = fuse_session_loop_mt(se, &config);
+      }
+      fuse_session_unmount(se);
+    }
+    fuse_remove_signal_handlers(se);
+  }
+  if(se != NULL) {
+    fuse_session_destroy(se);
+  }
+  free(opts.mountpoint);
+  fuse_opt_free_args(&args);
+  storage_close();
+  if(TRACE_LEVEL > TRACE_NONE && trace_path != NULL) {
+    trace_dump(trace_path);
+  }
+  return rv == 0 ? 0 : 1;
+}
@@ -0,0 +1,85 @@
+// nufs_snap: takes, lists and deletes snapshots of a mounted nufs.
+//
+// usage: nufs_snap create path name
+//        nufs_snap delete path name
+//        nufs_snap list path
+//
+// path is anything in the mounted file system, usually its mount point.
+// Taking a snapshot doesn't copy any file data, so it takes about as long
+// however big the files are. A snapshot is mounted read only in place of
+// the live file system by unmounting it and mounting the image again with
+// NUFS_SNAPSHOT=name in the environment.
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+#include "helpers/snapshot.h"
+
+static void usage() {
+  fprintf(stderr, "usage: nufs_snap create path name\n"
+                  "       nufs_snap delete path name\n"
+                  "       nufs_snap list path\n");
+  exit(1);
+}
+
+// Sends one of the name taking ioctls.
+static int by_name(int fd, unsigned long cmd, const char *name) {
+  snap_name_t arg;
+  if(strlen(name) >= SNAP_NAME_LENGTH) {
+    fprintf(stderr, "nufs_snap: names are at most %d bytes\n", SNAP_NAME_LENGTH - 1);
+    return 1;
+  }
+  memset(&arg, 0, sizeof(arg));
+  strcpy(arg.name, name);
+  if(ioctl(fd, cmd, &arg) != 0) {
+    fprintf(stderr, "nufs_snap: %s: %s\n", name, strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+// Prints the snapshots, oldest first.
+static int list(int fd) {
+  snap_list_t snaps;
+  if(ioctl(fd, NUFS_IOC_SNAP_LIST, &snaps) != 0) {
+    fprintf(stderr, "nufs_snap: %s\n", strerror(errno));
+    return 1;
+  }
+  for(int i = 0; i < snaps.count; ++i) {
+    time_t made = snaps.snaps[i].made;
+    char when[64];
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&made));
+    printf("%s  %s\n", when, snaps.snaps[i].name);
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if(argc < 3) {
+    usage();
+  }
+  int fd = open(argv[2], O_RDONLY);
+  if(fd == -1) {
+    fprintf(stderr, "nufs_snap: %s: %s\n", argv[2], strerror(errno));
+    return 1;
+  }
+  int rv;
+  if(strcmp(argv[1], "create") == 0 && argc == 4) {
+    rv = by_name(fd, NUFS_IOC_SNAP_CREATE, argv[3]);
+  }
+  else if(strcmp(argv[1], "delete") == 0 && argc == 4) {
+    rv = by_name(fd, NUFS_IOC_SNAP_DELETE, argv[3]);
+  }
+  else if(strcmp(argv[1], "list") == 0 && argc == 3) {
+    rv = list(fd);
+  }
+  else {
+    usage();
+  }
+  close(fd);
+  return rv;
+}
@@ -0,0 +1,94 @@
+// nufs_trace: prints a trace dumped by nufs.
+//
+// usage: nufs_trace [-t thread] [-o op] dump
+//
+// Events from every thread are merged and printed oldest first, one per
+// line: time since the first event, thread, op, inode, offset, size and
+// result. Ops starting with + come from inside the storage layer. -t and -o
+// only print events from one thread or of one op.
+//
+// nufs only records events when built with TRACE=1 (failed callbacks),
+// TRACE=2 (all callbacks) or TRACE=3 (internals too), and writes them to the
+// file named by $NUFS_TRACE on SIGUSR1 and when it is unmounted.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "helpers/trace.h"
+
+static void usage() {
+  fprintf(stderr, "usage: nufs_trace [-t thread] [-o op] dump\n");
+  exit(1);
+}
+
+// Orders events by time, keeping each thread's events in order on ties.
+static int compare_time(const void *a, const void *b) {
+  const trace_event_t *x = a;
+  const trace_event_t *y = b;
+  if(x->time != y->time) {
+    return x->time < y->time ? -1 : 1;
+  }
+  return (int) x->thread - (int) y->thread;
+}
+
+int main(int argc, char *argv[]) {
+  int thread = -1;
+  const char *op = NULL;
+  int opt;
+  while((opt = getopt(argc, argv, "t:o:")) != -1) {
+    switch(opt) {
+    case 't':
+      thread = atoi(optarg);
+      break;
+    case 'o':
+      op = optarg;
+      break;
+    default:
+      usage();
+    }
+  }
+  if(argc - optind != 1) {
+    usage();
+  }
+
+  FILE *dump = fopen(argv[optind], "rb");
+  if(dump == NULL) {
+    perror(argv[optind]);
+    return 1;
+  }
+  trace_header_t header;
+  if(fread(&header, sizeof(header), 1, dump) != 1 ||
+     header.magic != TRACE_MAGIC || header.version != TRACE_VERSION ||
+     header.event_size != sizeof(trace_event_t)) {
+    fprintf(stderr, "nufs_trace: %s is not a nufs trace\n", argv[optind]);
+    return 1;
+  }
+  trace_event_t *events = malloc((size_t) header.count * sizeof(trace_event_t));
+  if(events == NULL && header.count > 0) {
+    fprintf(stderr, "nufs_trace: out of memory\n");
+    return 1;
+  }
+  size_t count = fread(events, sizeof(trace_event_t), header.count, dump);
+  fclose(dump);
+  if(count != header.count) {
+    fprintf(stderr, "nufs_trace: %s is cut short, showing %zu of %u events\n",
+            argv[optind], count, header.count);
+  }
+  qsort(events, count, sizeof(trace_event_t), compare_time);
+
+  printf("%14s %6s %-13s %8s %14s %12s %10s\n", "usec", "thread", "op",
+         "inum", "offset", "size", "result");
+  for(size_t i = 0; i < count; ++i) {
+    trace_event_t *event = &events[i];
+    if((thread != -1 && event->thread != thread) ||
+       (op != NULL && strcmp(trace_op_name(event->op), op) != 0)) {
+      continue;
+    }
+    printf("%14.3f %6u %-13s %8d %14lld %12lld %10lld\n",
+           (event->time - events[0].time) / 1000.0, event->thread,
+           trace_op_name(event->op), event->inum, (long long) event->offset,
+           (long long) event->size, (long long) event->result);
+  }
+  free(events);
+  return 0;
+}
@@ -0,0 +1,25 @@
+// Mount profiles, see helpers/profile.h.
+
+#include <stddef.h>
+#include <string.h>
+
+#include "helpers/profile.h"
+
+static const profile_t profiles[] = {
+    {"cache", 0, 60.0, 60.0, 1, 0, 1 << 20, 1 << 20},
+    // Nothing is cached, so there is nothing to read ahead into.
+    {"direct", 0, 60.0, 60.0, 0, 1, 1 << 20, 0},
+    {"plain", 1, 1.0, 1.0, 0, 0, 0, 0},
+};
+
+const profile_t *profile_find(const char *name) {
+  if (name == NULL) {
+    return &profiles[0];
+  }
+  for (size_t i = 0; i < sizeof(profiles) / sizeof(profiles[0]); ++i) {
+    if (strcmp(profiles[i].name, name) == 0) {
+      return &profiles[i];
+    }
+  }
+  return NULL;
+}
@@ -0,0 +1,212 @@
+// Whole file system snapshots, see helpers/snapshot.h.
+//
+// A snapshot's inode bitmap and inode table sit together in one run of
+// blocks, laid out like the live ones so that mounting it only has to
+// point get_inode_bitmap and get_inode_table at them. Inodes that were
+// unlinked but still open are left out.
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "helpers/bitmap.h"
+#include "helpers/blocks.h"
+#include "helpers/directory.h"
+#include "helpers/inode.h"
+#include "helpers/journal.h"
+#include "helpers/snapshot.h"
+#include "helpers/storage.h"
+
+// Blocks of inode bitmap, ahead of the table in a snapshot.
+static int bitmap_blocks() {
+  superblock_t *sb = get_superblock();
+  return sb->inode_table_start - sb->inode_bitmap_start;
+}
+
+// The list of snapshots, NULL before the first one.
+static snap_list_t *get_list() {
+  int bnum = get_superblock()->snapshots;
+  return bnum == 0 ? NULL : blocks_get_block(bnum);
+}
+
+// Where the named snapshot is in the list, or -1.
+static int find(snap_list_t *list, const char *name) {
+  for (int i = 0; list != NULL && i < list->count; ++i) {
+    if (strncmp(list->snaps[i].name, name, SNAP_NAME_LENGTH) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// An inode in a snapshot's table, laid out like get_inode's.
+static inode_t *table_inode(char *table, int inum) {
+  char *block = table + (size_t) (inum / INODES_PER_BLOCK) * BLOCK_SIZE;
+  return (inode_t *) block + inum % INODES_PER_BLOCK;
+}
+
+// Fill in a snapshot's copy of a live inode. Directories are changed in
+// place, so they get blocks of their own. On failure the copy holds what
+// was done so far, for drop_inode.
+static int copy_inode(inode_t *node, inode_t *copy) {
+  *copy = *node;
+  copy->opens = 0;
+  if (node->flags & INODE_INLINE) {
+    return 0;
+  }
+  extent_init(&copy->extents);
+  int dir = is_directory(node);
+  int end = extent_end(&node->extents);
+  for (int fbnum = 0; fbnum < end;) {
+    int run;
+    int bnum = extent_lookup(&node->extents, fbnum, &run);
+    if (bnum == -1) {
+      fbnum = extent_next(&node->extents, fbnum);
+      continue;
+    }
+    int got = run;
+    int rv;
+    if (dir) {
+      int to = alloc_blocks_near(0, run, &got);
+      if (to == -1) {
+        return -ENOSPC;
+      }
+      memcpy(blocks_get_block(to), blocks_get_block(bnum), (size_t) got * BLOCK_SIZE);
+      journal_dirty(blocks_get_block(to), (size_t) got * BLOCK_SIZE);
+      bnum = to;
+    } else {
+      rv = blocks_share(bnum, run);
+      if (rv < 0) {
+        return rv;
+      }
+    }
+    rv = extent_insert(&copy->extents, fbnum, bnum, got);
+    if (rv < 0) {
+      for (int i = 0; i < got; ++i) {
+        free_block(bnum + i);
+      }
+      return rv;
+    }
+    fbnum += got;
+  }
+  return 0;
+}
+
+// Give up a snapshot's hold on an inode's blocks.
+static void drop_inode(inode_t *copy) {
+  if (!(copy->flags & INODE_INLINE)) {
+    // Whole extents, which never need a tree block.
+    extent_remove(&copy->extents, 0, extent_end(&copy->extents));
+  }
+}
+
+// Free a snapshot's inodes and the blocks holding them.
+static void drop_table(int start) {
+  void *bm = blocks_get_block(start);
+  char *table = blocks_get_block(start + bitmap_blocks());
+  for (int inum = 0; inum < INODE_COUNT; ++inum) {
+    if (bitmap_get(bm, inum)) {
+      drop_inode(table_inode(table, inum));
+    }
+  }
+  for (int i = 0; i < bitmap_blocks() + NUM_INODE_BLOCKS; ++i) {
+    free_block(start + i);
+  }
+}
+
+// Take a snapshot of everything as it is now.
+int snapshot_create(const char *name) {
+  size_t len = strnlen(name, SNAP_NAME_LENGTH);
+  if (len == 0 || len == SNAP_NAME_LENGTH || strchr(name, '/') != NULL) {
+    return -EINVAL;
+  }
+  if (find(get_list(), name) != -1) {
+    return -EEXIST;
+  }
+  superblock_t *sb = get_superblock();
+  if (sb->snapshots == 0) {
+    int bnum = alloc_block();
+    if (bnum == -1) {
+      return -ENOSPC;
+    }
+    memset(blocks_get_block(bnum), 0, BLOCK_SIZE);
+    journal_dirty(blocks_get_block(bnum), BLOCK_SIZE);
+    sb->snapshots = bnum;
+    journal_dirty(sb, sizeof(superblock_t));
+  }
+  snap_list_t *list = get_list();
+  if (list->count == SNAP_MAX) {
+    return -ENOSPC;
+  }
+
+  int blocks = bitmap_blocks() + NUM_INODE_BLOCKS;
+  int start = alloc_run(0, blocks);
+  if (start == -1) {
+    return -ENOSPC;
+  }
+  void *bm = blocks_get_block(start);
+  memset(bm, 0, (size_t) blocks * BLOCK_SIZE);
+  journal_dirty(bm, (size_t) blocks * BLOCK_SIZE);
+  char *table = blocks_get_block(start + bitmap_blocks());
+  void *live = get_inode_bitmap();
+  for (int inum = 0; inum < INODE_COUNT; ++inum) {
+    if (!bitmap_get(live, inum) || get_inode(inum)->refs == 0) {
+      continue;
+    }
+    // In the bitmap first, so that dropping a failed snapshot frees
+    // whatever this one got.
+    bitmap_put(bm, inum, 1);
+    int rv = copy_inode(get_inode(inum), table_inode(table, inum));
+    if (rv < 0) {
+      drop_table(start);
+      return rv;
+    }
+  }
+
+  snapshot_t *snap = &list->snaps[list->count];
+  memset(snap, 0, sizeof(snapshot_t));
+  memcpy(snap->name, name, len);
+  snap->made = time(NULL);
+  snap->start = start;
+  list->count += 1;
+  journal_dirty(list, sizeof(snap_list_t));
+  return 0;
+}
+
+// Delete a snapshot, freeing every block only it was holding on to.
+int snapshot_delete(const char *name) {
+  snap_list_t *list = get_list();
+  int i = find(list, name);
+  if (i == -1) {
+    return -ENOENT;
+  }
+  drop_table(list->snaps[i].start);
+  memmove(&list->snaps[i], &list->snaps[i + 1],
+          (list->count - i - 1) * sizeof(snapshot_t));
+  list->count -= 1;
+  journal_dirty(list, sizeof(snap_list_t));
+  return 0;
+}
+
+// Copy out the list of snapshots, oldest first.
+void snapshot_list(snap_list_t *list) {
+  snap_list_t *have = get_list();
+  if (have == NULL) {
+    memset(list, 0, sizeof(snap_list_t));
+  } else {
+    memcpy(list, have, sizeof(snap_list_t));
+  }
+}
+
+// Show the named snapshot's inodes in place of the live ones, read only.
+int snapshot_mount(const char *name) {
+  snap_list_t *list = get_list();
+  int i = find(list, name);
+  if (i == -1) {
+    return -ENOENT;
+  }
+  int start = list->snaps[i].start;
+  blocks_read_only(start, start + bitmap_blocks());
+  return 0;
+}
@@ -0,0 +1,192 @@
+/**
+ * @file stats.c
+ *
+ * Per-thread counter slots. A thread's first count allocates its slot and
+ * pushes it onto a global list with a compare and swap, the same as the
+ * trace rings. After that only the owning thread writes to the slot, so
+ * counting is a relaxed load and store with no read-modify-write.
+ */
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "helpers/stats.h"
+#include "helpers/trace.h"
+
+_Static_assert(TRACE_OP_COUNT <= STATS_MAX_OPS, "raise STATS_MAX_OPS");
+_Static_assert(STATS_COUNTER_COUNT <= STATS_MAX_COUNTERS,
+               "raise STATS_MAX_COUNTERS");
+// The size of an ioctl's argument has to fit in 14 bits.
+_Static_assert(sizeof(nufs_stats_t) < (1 << 14), "nufs_stats_t is too big");
+
+typedef struct stats_slot {
+  struct stats_slot *next;
+  _Atomic uint64_t counters[STATS_COUNTER_COUNT];
+  struct {
+    _Atomic uint64_t count;
+    _Atomic uint64_t errors;
+    _Atomic uint64_t total_ns;
+    _Atomic uint64_t buckets[STATS_BUCKETS];
+  } ops[TRACE_OP_COUNT];
+} stats_slot_t;
+
+static const char *counter_names[STATS_COUNTER_COUNT] = {
+    [STATS_BLOCK_ALLOCS] = "block_allocs",
+    [STATS_BLOCK_SCANS] = "block_scan_words",
+    [STATS_INODE_ALLOCS] = "inode_allocs",
+    [STATS_INODE_SCANS] = "inode_scan_words",
+    [STATS_LOOKUPS] = "lookups",
+    [STATS_PATH_HITS] = "lookup_path_hits",
+    [STATS_COMPONENTS] = "lookup_components",
+    [STATS_DCACHE_HITS] = "lookup_dcache_hits",
+    [STATS_CLUSTER_BYTES] = "cluster_bytes",
+    [STATS_CLUSTER_DISK_BYTES] = "cluster_disk_bytes",
+    [STATS_CLUSTER_HITS] = "cluster_cache_hits",
+    [STATS_CLUSTER_MISSES] = "cluster_cache_misses",
+    [STATS_DEDUP_BLOCKS] = "dedup_blocks",
+};
+
+static _Atomic(stats_slot_t *) slots;
+static __thread stats_slot_t *slot;
+
+// Set up the calling thread's slot, or return NULL if there's no memory.
+static stats_slot_t *slot_create() {
+  stats_slot_t *new_slot = calloc(1, sizeof(stats_slot_t));
+  if (new_slot == NULL) {
+    return NULL;
+  }
+  stats_slot_t *head = atomic_load(&slots);
+  do {
+    new_slot->next = head;
+  } while (!atomic_compare_exchange_weak(&slots, &head, new_slot));
+  return new_slot;
+}
+
+// Add to a count only this thread writes.
+static void bump(_Atomic uint64_t *count, uint64_t by) {
+  uint64_t now = atomic_load_explicit(count, memory_order_relaxed);
+  atomic_store_explicit(count, now + by, memory_order_relaxed);
+}
+
+int64_t stats_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void stats_op(int op, int64_t start, int64_t result) {
+  if (op < 0 || op >= TRACE_OP_COUNT ||
+      (slot == NULL && (slot = slot_create()) == NULL)) {
+    return;
+  }
+  int64_t took = stats_now() - start;
+  took = took < 0 ? 0 : took;
+  // Under 2^b ns for the smallest b, so 0 for 0 and 1 for 1.
+  int bucket = took == 0 ? 0 : 64 - __builtin_clzll(took);
+  bucket = bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1;
+  bump(&slot->ops[op].count, 1);
+  if (result < 0) {
+    bump(&slot->ops[op].errors, 1);
+  }
+  bump(&slot->ops[op].total_ns, took);
+  bump(&slot->ops[op].buckets[bucket], 1);
+}
+
+void stats_add(int counter, uint64_t by) {
+  if (counter < 0 || counter >= STATS_COUNTER_COUNT ||
+      (slot == NULL && (slot = slot_create()) == NULL)) {
+    return;
+  }
+  bump(&slot->counters[counter], by);
+}
+
+// Read a count another thread may be writing.
+static uint64_t get(_Atomic uint64_t *count) {
+  return atomic_load_explicit(count, memory_order_relaxed);
+}
+
+void stats_collect(nufs_stats_t *stats) {
+  memset(stats, 0, sizeof(nufs_stats_t));
+  stats->version = STATS_VERSION;
+  stats->op_count = TRACE_OP_COUNT;
+  stats->counter_count = STATS_COUNTER_COUNT;
+  for (stats_slot_t *s = atomic_load(&slots); s != NULL; s = s->next) {
+    for (int i = 0; i < STATS_COUNTER_COUNT; ++i) {
+      stats->counters[i] += get(&s->counters[i]);
+    }
+    for (int op = 0; op < TRACE_OP_COUNT; ++op) {
+      stats_op_t *total = &stats->ops[op];
+      total->count += get(&s->ops[op].count);
+      total->errors += get(&s->ops[op].errors);
+      total->total_ns += get(&s->ops[op].total_ns);
+      for (int b = 0; b < STATS_BUCKETS; ++b) {
+        total->buckets[b] += get(&s->ops[op].buckets[b]);
+      }
+    }
+  }
+}
+
+// Append to buf like snprintf, keeping track of how much is used.
+#define APPEND(...)                                                            \
+  do {                                                                         \
+    if (used < size) {                                                         \
+      used += snprintf(buf + used, size - used, __VA_ARGS__);                  \
+    }                                                                          \
+  } while (0)
+
+int stats_format(const nufs_stats_t *stats, char *buf, size_t size) {
+  size_t used = 0;
+  APPEND("# TYPE nufs_free_blocks gauge\nnufs_free_blocks %llu\n",
+         (unsigned long long) stats->free_blocks);
+  APPEND("# TYPE nufs_blocks gauge\nnufs_blocks %llu\n",
+         (unsigned long long) stats->total_blocks);
+  APPEND("# TYPE nufs_free_inodes gauge\nnufs_free_inodes %llu\n",
+         (unsigned long long) stats->free_inodes);
+  APPEND("# TYPE nufs_inodes gauge\nnufs_inodes %llu\n",
+         (unsigned long long) stats->total_inodes);
+  for (int i = 0; i < STATS_COUNTER_COUNT; ++i) {
+    APPEND("# TYPE nufs_%s_total counter\nnufs_%s_total %llu\n",
+           counter_names[i], counter_names[i],
+           (unsigned long long) stats->counters[i]);
+  }
+
+  APPEND("# TYPE nufs_op_errors_total counter\n");
+  for (int op = 0; op < TRACE_OP_COUNT; ++op) {
+    if (stats->ops[op].count > 0) {
+      APPEND("nufs_op_errors_total{op=\"%s\"} %llu\n", trace_op_name(op),
+             (unsigned long long) stats->ops[op].errors);
+    }
+  }
+  // Buckets are cumulative and in seconds. Only those from the first to
+  // the last that counted anything are written.
+  APPEND("# TYPE nufs_op_seconds histogram\n");
+  for (int op = 0; op < TRACE_OP_COUNT; ++op) {
+    const stats_op_t *s = &stats->ops[op];
+    if (s->count == 0) {
+      continue;
+    }
+    const char *name = trace_op_name(op);
+    int first = 0;
+    while (first < STATS_BUCKETS - 2 && s->buckets[first] == 0) {
+      ++first;
+    }
+    int last = STATS_BUCKETS - 2;
+    while (last > first && s->buckets[last] == 0) {
+      --last;
+    }
+    uint64_t below = 0;
+    for (int b = first; b <= last; ++b) {
+      below += s->buckets[b];
+      APPEND("nufs_op_seconds_bucket{op=\"%s\",le=\"%.9g\"} %llu\n", name,
+             (double) (1ULL << b) / 1e9, (unsigned long long) below);
+    }
+    APPEND("nufs_op_seconds_bucket{op=\"%s\",le=\"+Inf\"} %llu\n", name,
+           (unsigned long long) s->count);
+    APPEND("nufs_op_seconds_sum{op=\"%s\"} %.9f\n", name, s->total_ns / 1e9);
+    APPEND("nufs_op_seconds_count{op=\"%s\"} %llu\n", name,
+           (unsigned long long) s->count);
+  }
+  return used < size ? used : size - 1;
+}
@@ -1,10 +1,22 @@
 #include "helpers/storage.h"
+#include "helpers/atime.h"
 #include "helpers/blocks.h"
 #include "helpers/bitmap.h"
+#include "helpers/compress.h"
 #include "helpers/slist.h"
 #include "helpers/inode.h"
 #include "helpers/directory.h"
 #include "helpers/utilities.h"
+#include "helpers/dcache.h"
+#include "helpers/dedup.h"
+#include "helpers/handle.h"
+#include "helpers/journal.h"
+#include "helpers/snapshot.h"
+#include "helpers/stats.h"
+#include "helpers/trace.h"
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -15,38 +27,443 @@
 #include <string.h>
 #include <stdio.h>
 
+// Lookups and reads of the directory tree share this lock, anything that
+// adds or removes a name takes it exclusively. File contents are guarded
+// by their inode's lock as well. Anything that changes metadata (or the
+// open counts in the inodes) is a journal handle, started before taking
+// either lock so that a commit never waits on a lock holder.
+static pthread_rwlock_t tree_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Set once a snapshot is mounted in place of the live file system.
+static int read_only = 0;
+
+/**
+ * Makes a new empty file system in the image at path, with an inode table
+ * big enough for inode_count inodes and a root directory.
+ * 
+ * @param path the path to the image file to format.
+ * @param block_size bytes per block, a power of two between 1K and 64K.
+ * @param block_count number of blocks in the image.
+ * @param inode_count number of inodes the file system can hold.
+ * 
+ * @returns 0 on success, -1 if the geometry doesn't fit or the image
+ *          could not be written.
+ */
+int storage_format(const char *path, int block_size, int block_count, int inode_count) {
+  printf("Formatting %s: %d blocks of %d bytes, %d inodes.\n", path, block_count,
+         block_size, inode_count);
+  if(block_size < (int)INODE_SIZE) {
+    return -1;
+  }
+  int per_block = block_size / INODE_SIZE;
+  int inode_blocks = (inode_count + per_block - 1) / per_block;
+  if(blocks_format(path, block_size, block_count, inode_count, inode_blocks) != 0) {
+    return -1;
+  }
+  if(blocks_init(path) != 0) {
+    return -1;
+  }
+  // Makes the root "/" directory
+  journal_start();
+  directory_init();
+  journal_stop();
+  blocks_free();
+  return 0;
+}
+
 /**
- * This will initialize our file system by making the file and
- * mounting it to memory so that we can use it
+ * This will initialize our file system by opening the image and
+ * mounting it to memory so that we can use it. An image that doesn't
+ * exist yet or is empty gets formatted with the default geometry,
+ * otherwise the geometry comes from its superblock.
  * 
  * @param path the path to the file that we are mounting onto.
+ * 
+ * @returns 0 on success, -1 if the image isn't a nufs image.
  */
-void storage_init(const char *path) {
+int storage_init(const char *path) {
   printf("Initializing file system.\n");
+  struct stat st;
+  if(stat(path, &st) != 0 || st.st_size == 0) {
+    int rv = storage_format(path, DEFAULT_BLOCK_SIZE, DEFAULT_BLOCK_COUNT,
+                            DEFAULT_INODE_COUNT);
+    assert(rv == 0);
+  }
   // Initializes the file system
-  blocks_init(path);
-  // Check if our inode blocks already exist.
-  if(bitmap_get(get_blocks_bitmap(), 1) == 0) {
-    // We need to allocate the blocks for our storage system
-    for(int i = 0; i < NUM_INODE_BLOCKS; ++i) {
-      // If the blocks don't exist at the start in order, our file system is corrupted.
-      assert(i + INODE_BLOCK_BEGIN == alloc_block());
+  if(blocks_init(path) != 0) {
+    return -1;
+  }
+  read_only = 0;
+  dcache_clear();
+  compress_cache_clear();
+  dedup_clear();
+  atime_clear();
+  // Ensure all of our inode blocks are there
+  for(int i = 0; i < NUM_INODE_BLOCKS; ++i) {
+    // If not all our blocks exist, then we are missing an inode block and our 
+    // file system is corrupted.
+    assert(bitmap_get(get_blocks_bitmap(), i + INODE_BLOCK_BEGIN));
+  }
+  // Assert root directory exists
+  assert(bitmap_get(get_inode_bitmap(), ROOT_INODE));
+  inode_t* root = get_inode(ROOT_INODE);
+  assert((root->flags & INODE_INLINE) ||
+         bitmap_get(get_blocks_bitmap(), inode_get_bnum(root, 0)));
+  // Nothing is open yet. Files that were unlinked while open when the
+  // image was last used are freed now.
+  journal_start();
+  for(int i = 0; i < INODE_COUNT; ++i) {
+    if(bitmap_get(get_inode_bitmap(), i)) {
+      inode_t* node = get_inode(i);
+      node->opens = 0;
+      if(node->refs == 0) {
+        free_inode(i);
+      }
     }
-    // Makes the root "/" directory
-    directory_init();
   }
-  else {
-    // Blocks apparently do exist, ensure all of them are there
-    for(int i = 0; i < NUM_INODE_BLOCKS; ++i) {
-      // If not all our blocks exist, then we are missing an inode block and our 
-      // file system is corrupted.
-      assert(bitmap_get(get_blocks_bitmap(), i + INODE_BLOCK_BEGIN));
+  journal_stop();
+  // Front ends may fork into the background next, start them with nothing
+  // left to commit.
+  journal_flush();
+  return 0;
+}
+
+/**
+ * Writes back the atimes reads have left waiting (see atime.h), a batch
+ * to a journal transaction. Caller holds no locks.
+ */
+static void write_atimes() {
+  int inums[ATIME_BATCH];
+  int64_t times[ATIME_BATCH];
+  int count;
+  while((count = atime_take(inums, times, ATIME_BATCH)) > 0) {
+    journal_start();
+    pthread_rwlock_rdlock(&tree_lock);
+    for(int i = 0; i < count; ++i) {
+      inode_lock(inums[i], 1);
+      // Not if it was freed since it was taken.
+      if(!bitmap_get(get_inode_bitmap(), inums[i])) {
+        inode_unlock(inums[i]);
+        continue;
+      }
+      inode_t* node = get_inode(inums[i]);
+      // Nor if it was set or journaled with its atime since.
+      if(times[i] > node->atime && times[i] > node->ctime) {
+        node->atime = times[i];
+        journal_dirty(node, INODE_SIZE);
+      }
+      inode_unlock(inums[i]);
+    }
+    pthread_rwlock_unlock(&tree_lock);
+    journal_stop();
+  }
+}
+
+/**
+ * Records a read of an inode for its atime, caller holds its lock. Nothing
+ * is recorded on a snapshot, which is never written, or for an unlinked
+ * file, which is freed at its last close.
+ * 
+ * @returns nonzero if write_atimes should run once the lock is dropped.
+ */
+static int note_read(int inum, inode_t* node) {
+  return !read_only && node->refs > 0 && atime_note(inum, node, inode_now());
+}
+
+/**
+ * Commits everything still in the journal and closes the image.
+ */
+void storage_close() {
+  write_atimes();
+  blocks_free();
+}
+
+/**
+ * Copies size bytes of the file starting at offset into buf. The whole
+ * range must be inside the file. Reads a contiguous extent at a time,
+ * straight from the image since file data isn't kept in the mapping,
+ * and fills in zeros for a hole at a time. Packed clusters of compressed
+ * files are decompressed instead.
+ * 
+ * @param node the file to read from
+ * @param buf the buffer to read into
+ * @param size how many bytes to copy
+ * @param offset where in the file to start.
+ * 
+ * @returns 0 on success, -EIO if the image can't be read.
+ */
+static int read_blocks(inode_t* node, char* buf, size_t size, off_t offset) {
+  if(node->flags & INODE_INLINE) {
+    memcpy(buf, node->data + offset, size);
+    return 0;
+  }
+  size_t done = 0;
+  while(done < size) {
+    int fbnum = (offset + done) / BLOCK_SIZE;
+    int start = (offset + done) % BLOCK_SIZE;
+    int run;
+    int bnum = inode_get_run(node, fbnum, &run);
+    if((node->flags & INODE_COMPRESSED) && compress_packed(node, fbnum)) {
+      size_t len = COMPRESS_CLUSTER_SIZE - (offset + done) % COMPRESS_CLUSTER_SIZE;
+      if(len > size - done) {
+        len = size - done;
+      }
+      int rv = compress_read(node, buf + done, len, offset + done);
+      if(rv < 0) {
+        return rv;
+      }
+      done += len;
+      continue;
+    }
+    if(bnum == -1) {
+      int next = inode_next_data(node, fbnum);
+      if((node->flags & INODE_COMPRESSED) && next != -1 &&
+         next / COMPRESS_CLUSTER_BLOCKS != fbnum / COMPRESS_CLUSTER_BLOCKS) {
+        // Stop where the next cluster starts, in case it's packed.
+        next -= next % COMPRESS_CLUSTER_BLOCKS;
+      }
+      size_t len = size - done;
+      if(next != -1 && (size_t)(next - fbnum) * BLOCK_SIZE - start < len) {
+        len = (size_t)(next - fbnum) * BLOCK_SIZE - start;
+      }
+      memset(buf + done, 0, len);
+      done += len;
+      continue;
+    }
+    size_t len = (size_t)run * BLOCK_SIZE - start;
+    if(len > size - done) {
+      len = size - done;
+    }
+    int rv = blocks_read(bnum, start, buf + done, len);
+    if(rv < 0) {
+      return rv;
+    }
+    done += len;
+  }
+  return 0;
+}
+
+/**
+ * Whether writes to a file go through the dedup index.
+ */
+static int dedup_file(inode_t* node) {
+  return (get_superblock()->features & SUPER_DEDUP) && !(node->flags & INODE_COMPRESSED);
+}
+
+/**
+ * Whether the index has the whole blocks at data in a run of at least
+ * two, starting at bnum.
+ * 
+ * @param data the first of them
+ * @param left bytes from data to the end of the write
+ * @param bnum what dedup_lookup gave for the first.
+ */
+static int dedup_run(const char* data, size_t left, int bnum) {
+  return bnum != -1 && left >= 2 * (size_t)BLOCK_SIZE &&
+         dedup_lookup(data + BLOCK_SIZE) == bnum + 1;
+}
+
+/**
+ * Maps a block of a file to a block that already holds the same bytes,
+ * freeing the one it was mapped to. Only blocks that keep the file's
+ * extents whole are shared (see dedup.h): the one after the block the
+ * file's previous block maps to, or the first of a run the index has
+ * unless the previous block is a hole.
+ * 
+ * @param left bytes from data to the end of the write.
+ * 
+ * @returns 1 if it did, 0 if the block has to be written.
+ */
+static int share_block(inode_t* node, int fbnum, const char* data, size_t left) {
+  int prev = fbnum > 0 ? inode_get_bnum(node, fbnum - 1) : -1;
+  int bnum = prev + 1;
+  if(prev == -1 || dedup_share(data, bnum) != 0) {
+    // Where an extent starts anyway a run doesn't have to be seen first.
+    bnum = dedup_lookup(data);
+    if(bnum == -1 || bnum == prev + 1 ||
+       (prev != -1 && !dedup_run(data, left, bnum)) ||
+       dedup_share(data, bnum) != 0) {
+      return 0;
+    }
+  }
+  int rv = inode_get_bnum(node, fbnum) == -1
+               ? extent_insert(&node->extents, fbnum, bnum, 1)
+               : extent_replace(&node->extents, fbnum, bnum, 1);
+  if(rv < 0) {
+    free_block(bnum);
+    return 0;
+  }
+  inode_dirty(node);
+  stats_add(STATS_DEDUP_BLOCKS, 1);
+  return 1;
+}
+
+/**
+ * Copies size bytes from buf into the blocks of a file starting at
+ * offset. Writes a contiguous extent at a time, straight to the image.
+ * A hole gets blocks as it is written to, with the parts the write
+ * doesn't cover zeroed. On a deduplicated image whole blocks are shared
+ * with ones holding the same bytes where that keeps the extents whole, the
+ * rest are copied first if they are shared and added to the index once
+ * written.
+ * 
+ * @returns 0 on success, -EIO or -ENOSPC if the image can't be written.
+ */
+static int write_extents(inode_t* node, const char* buf, size_t size, off_t offset) {
+  int dedup = dedup_file(node);
+  size_t next_known = 0; // where the next run the index may have starts
+  size_t done = 0;
+  while(done < size) {
+    int fbnum = (offset + done) / BLOCK_SIZE;
+    int start = (offset + done) % BLOCK_SIZE;
+    if(dedup && start == 0 && size - done >= (size_t)BLOCK_SIZE &&
+       share_block(node, fbnum, buf + done, size - done)) {
+      done += BLOCK_SIZE;
+      continue;
+    }
+    size_t want = size - done;
+    if(dedup) {
+      // Stop at the next run of blocks that may be shared rather than
+      // write it.
+      if(next_known <= done) {
+        next_known = done + BLOCK_SIZE - start;
+        while(next_known + BLOCK_SIZE <= size &&
+              !dedup_run(buf + next_known, size - next_known,
+                         dedup_lookup(buf + next_known))) {
+          next_known += BLOCK_SIZE;
+        }
+        if(next_known + BLOCK_SIZE > size) {
+          next_known = size;
+        }
+        // Only what is written in place needs copying first.
+        int rv = inode_unshare(node, fbnum, bytes_to_blocks(offset + next_known) - fbnum);
+        if(rv < 0) {
+          return rv;
+        }
+      }
+      want = next_known - done;
+    }
+    int run;
+    int bnum = inode_get_run(node, fbnum, &run);
+    int hole = bnum == -1;
+    if(hole) {
+      bnum = inode_fill_hole(node, fbnum, bytes_to_blocks(offset + done + want) - fbnum, &run);
+      if(bnum < 0) {
+        return bnum;
+      }
+    }
+    size_t len = (size_t)run * BLOCK_SIZE - start;
+    if(len > want) {
+      len = want;
+    }
+    int rv = 0;
+    size_t end = start + len;
+    if(hole && start != 0) {
+      rv = blocks_zero(bnum, 0, start);
+    }
+    if(hole && rv == 0 && end % BLOCK_SIZE != 0) {
+      rv = blocks_zero(bnum, end, BLOCK_SIZE - end % BLOCK_SIZE);
+    }
+    if(rv == 0) {
+      rv = blocks_write(bnum, start, buf + done, len);
+    }
+    if(rv < 0) {
+      if(hole) {
+        // Don't leave whatever the blocks held before in the file.
+        extent_remove(&node->extents, fbnum, run);
+      }
+      return rv;
+    }
+    if(dedup) {
+      // The blocks written whole.
+      for(size_t at = start == 0 ? 0 : BLOCK_SIZE - start; at + BLOCK_SIZE <= len;
+          at += BLOCK_SIZE) {
+        dedup_insert(buf + done + at, bnum + (start + at) / BLOCK_SIZE);
+      }
+    }
+    done += len;
+  }
+  return 0;
+}
+
+/**
+ * Copies size bytes from buf into the file starting at offset. The whole
+ * range must be inside the file, and its blocks must not be shared with
+ * a snapshot unless the file is compressed or deduplicated. Inline data is part of the
+ * inode, so it goes through the journal. A compressed file is written a
+ * cluster at a time: only part of a raw cluster that doesn't reach its
+ * end is written in place, anything else compresses the whole cluster
+ * again.
+ * 
+ * @param node the file to write to
+ * @param buf the buffer to write from
+ * @param size how many bytes to copy
+ * @param offset where in the file to start.
+ * 
+ * @returns 0 on success, -EIO or -ENOSPC if the image can't be written.
+ */
+static int write_blocks(inode_t* node, const char* buf, size_t size, off_t offset) {
+  if(node->flags & INODE_INLINE) {
+    memcpy(node->data + offset, buf, size);
+    inode_dirty(node);
+    return 0;
+  }
+  if(!(node->flags & INODE_COMPRESSED)) {
+    return write_extents(node, buf, size, offset);
+  }
+  size_t done = 0;
+  while(done < size) {
+    off_t at = offset + done;
+    size_t len = COMPRESS_CLUSTER_SIZE - at % COMPRESS_CLUSTER_SIZE;
+    if(len > size - done) {
+      len = size - done;
+    }
+    int first = (at - at % COMPRESS_CLUSTER_SIZE) / BLOCK_SIZE;
+    int rv;
+    if((at + len) % COMPRESS_CLUSTER_SIZE != 0 && inode_get_bnum(node, first) != -1) {
+      int fbnum = at / BLOCK_SIZE;
+      rv = inode_unshare(node, fbnum, bytes_to_blocks(at + len) - fbnum);
+      if(rv == 0) {
+        rv = write_extents(node, buf + done, len, at);
+      }
+    }
+    else {
+      rv = compress_write(node, buf + done, len, at);
     }
-    // Assert root directory exists
-    assert(bitmap_get(get_inode_bitmap(), ROOT_INODE));
-    assert(bitmap_get(get_blocks_bitmap(), get_inode(ROOT_INODE)->block));
+    if(rv < 0) {
+      return rv;
+    }
+    done += len;
+  }
+  return 0;
+}
+
+/**
+ * Converts a time kept in an inode to a timespec.
+ */
+static struct timespec to_timespec(int64_t ns) {
+  int64_t sec = ns / 1000000000;
+  int64_t nsec = ns % 1000000000;
+  if(nsec < 0) {
+    // Before 1970, the nanoseconds still count up.
+    sec -= 1;
+    nsec += 1000000000;
   }
-  
+  return (struct timespec){ sec, nsec };
+}
+
+/**
+ * Fills in the stat struct from an inode. Caller holds the inode's lock.
+ */
+static void stat_inode(int inum, inode_t* node, struct stat* st) {
+  st->st_size = node->size;
+  st->st_mode = node->mode;
+  st->st_uid = getuid();
+  st->st_ino = inum;
+  st->st_nlink = node->refs;
+  st->st_atim = to_timespec(atime_get(inum, node));
+  st->st_mtim = to_timespec(node->mtime);
+  st->st_ctim = to_timespec(node->ctime);
 }
 
 /**
@@ -59,20 +476,61 @@ void storage_init(const char *path) {
  * @returns the status if it worked or not.
  */
 int storage_stat(const char* path, struct stat* st){
-  printf("Looking up info about %s\n", path);
+  pthread_rwlock_rdlock(&tree_lock);
   int inum = tree_lookup(path);
-  if(inum == -1) {
-    return -ENOENT;
+  int rv = -ENOENT;
+  if(inum != -1) {
+    inode_lock(inum, 0);
+    stat_inode(inum, get_inode(inum), st);
+    inode_unlock(inum);
+    rv = 0;
   }
-  inode_t* node = get_inode(inum);
-  st->st_size = node->size;
-  st->st_mode = node->mode;
-  st->st_uid = getuid();
-  st->st_ino = inum;
-  st->st_nlink = node->refs;
+  pthread_rwlock_unlock(&tree_lock);
+  return rv;
+}
+
+/**
+ * Gets the information from the inode of an open file, without looking
+ * up its path.
+ * 
+ * @param fh the handle from storage_open
+ * @param st the stat block to fill in.
+ * 
+ * @returns 0, an open file always exists.
+ */
+int storage_stat_handle(uint64_t fh, struct stat* st) {
+  handle_t* handle = handle_get(fh);
+  pthread_rwlock_rdlock(&tree_lock);
+  inode_lock(handle->inum, 0);
+  stat_inode(handle->inum, handle->node, st);
+  inode_unlock(handle->inum);
+  pthread_rwlock_unlock(&tree_lock);
   return 0;
 }
 
+/**
+ * Reads from a file inode, caller holds its lock for reading and has
+ * checked the permissions.
+ */
+static int read_inode(inode_t* node, char *buf, size_t size, off_t offset) {
+  // Check that it isn't a directory
+  if(node->mode / 010000 == 4) {
+    return -EISDIR;
+  }
+  // Check to ensure not trying to look past file
+  if(offset > node->size) {
+    return -ESPIPE;
+  }
+  // Ensure we only read to end of file and not past it
+  if(size > node->size - offset) {
+    size = node->size - offset;// Can only read to end.
+  }
+  // Copy from file to buffer.
+  int rv = read_blocks(node, buf, size, offset);
+  // Return how much read.
+  return rv < 0 ? rv : (int)size;
+}
+
 /**
  * Reads from the file into the buffer. Reads at most size bytes
  * 
@@ -84,38 +542,107 @@ int storage_stat(const char* path, struct stat* st){
  * @returns the status of success.
 */
 int storage_read(const char *path, char *buf, size_t size, off_t offset) {
-  printf("Reading from %s at %zu for at most %zu bytes.\n", path, offset, size);
+  pthread_rwlock_rdlock(&tree_lock);
   int inum = tree_lookup(path);
-  if(inum == -1) {
-    return -ENOENT;
+  int rv = -ENOENT;
+  int atimes = 0;
+  if(inum != -1) {
+    inode_lock(inum, 0);
+    inode_t* node = get_inode(inum);
+    // Check for read permissions
+    if((((node->mode - 010000) / 0100) & 04) == 04) {
+      rv = read_inode(node, buf, size, offset);
+    }
+    else {
+      rv = -EACCES;
+    }
+    atimes = rv >= 0 && note_read(inum, node);
+    inode_unlock(inum);
   }
-  inode_t* node = get_inode(inum);
+  pthread_rwlock_unlock(&tree_lock);
+  if(atimes) {
+    write_atimes();
+  }
+  return rv;
+}
+
+/**
+ * Writes to a file inode, caller holds its lock for writing and has
+ * checked the permissions.
+ */
+static int write_inode(inode_t* node, const char *buf, size_t size, off_t offset) {
   // Check that it isn't a directory
   if(node->mode / 010000 == 4) {
     return -EISDIR;
   }
-  // Check for read permissions
-  if((((node->mode - 010000) / 0100) & 04) == 04) {
-    // Check to ensure not trying to look past file
-    if(offset > node->size) {
-      return -ESPIPE;
-    }
-    // Ensure we only read to end of file and not past it
-    if(size > node->size - offset) {
-      size = node->size - offset;// Can only read to end.
+  if(offset + size > INODE_MAX_SIZE) {
+    return -EFBIG;
+  }
+  // grow the inode if writing past the end.
+  int64_t old_size = node->size;
+  if(offset + size > node->size) {
+    int rv = grow_inode(node, offset + size);
+    if(rv < 0) {
+      return rv;
     }
-    // Copy from file to buffer.
-    memcpy(buf, blocks_get_block(node->block) + offset, size);
-    // Return how much read.
-    return size;
   }
-  else {
-    return -EACCES;
+  // Blocks a snapshot still has are copied first, compressed files do
+  // that a cluster at a time and deduplicated ones an extent at a time.
+  int first = offset / BLOCK_SIZE;
+  int rv = size == 0 || (node->flags & INODE_COMPRESSED) || dedup_file(node) ? 0 :
+           inode_unshare(node, first, bytes_to_blocks(offset + size) - first);
+  if(rv == 0) {
+    rv = write_blocks(node, buf, size, offset);
+  }
+  if(rv < 0 && node->size > old_size) {
+    // Growing only made a hole, don't leave it there.
+    shrink_inode(node, old_size);
+  }
+  if(rv >= 0 && size > 0) {
+    inode_touch(node, 1);
+  }
+  return rv < 0 ? rv : (int)size;
+}
+
+/**
+ * Whether an operation that ran out of space should be tried once more.
+ * Blocks freed since the last commit aren't handed out until it's done, so
+ * this waits for one first. Call outside of journal_start.
+ */
+static int retry_nospc(int rv) {
+  if(rv != -ENOSPC || !journal_freeing()) {
+    return 0;
+  }
+  journal_flush();
+  return 1;
+}
+
+// One try at storage_write, see below.
+static int write_path(const char *path, const char *buf, size_t size, off_t offset) {
+  journal_start();
+  pthread_rwlock_rdlock(&tree_lock);
+  int inum = tree_lookup(path);
+  int rv = -ENOENT;
+  if(inum != -1) {
+    inode_lock(inum, 1);
+    inode_t* node = get_inode(inum);
+    // Check for write permissions
+    if((((node->mode - 010000) / 0100) & 02) == 02) {
+      rv = write_inode(node, buf, size, offset);
+    }
+    else {
+      rv = -EACCES;
+    }
+    inode_unlock(inum);
   }
+  pthread_rwlock_unlock(&tree_lock);
+  journal_stop();
+  return rv;
 }
+
 /**
- * Write from buffer into file. Fails if there is too much
- * in the buffer that can't be stored in the file.
+ * Write from buffer into file, growing it if the write goes past
+ * the end. Fails if there is no space left to grow the file.
  * 
  * @param path of the file to write into
  * @param buf the buffer to write from.
@@ -125,108 +652,454 @@ int storage_read(const char *path, char *buf, size_t size, off_t offset) {
  * @returns the status of the write.
 */
 int storage_write(const char *path, const char *buf, size_t size, off_t offset) {
-  printf("Writing from %s at %zu for %zu bytes.\n", path, offset, size);
-  // Find number of blocks required
-  int num_blocks = bytes_to_blocks(size + offset);
-  // Check if it exists
-  int inum = tree_lookup(path);
-  if(inum == -1) {
-    return -ENOENT;
-  }
-  // If need more than one block, we can't hold that so error.
-  if(num_blocks > 1) {
-    return -EFBIG;
-  }
-  inode_t* node = get_inode(inum);
+  int rv = write_path(path, buf, size, offset);
+  return retry_nospc(rv) ? write_path(path, buf, size, offset) : rv;
+}
+
+/**
+ * Resizes a file inode, caller holds its lock for writing.
+ */
+static int truncate_inode(inode_t* node, off_t size) {
   // Check that it isn't a directory
   if(node->mode / 010000 == 4) {
     return -EISDIR;
   }
+  if(size > INODE_MAX_SIZE) {
+    return -EFBIG;
+  }
   // Check for write permissions
   if((((node->mode - 010000) / 0100) & 02) == 02) {
-    // Already know wont write past end of file or we 
-    // would have needed more than 1 block
-    memcpy(blocks_get_block(node->block) + offset, buf, size);
-    // grow the inode.
-    grow_inode(node, offset + size);
-    return size;
+      // Truncate it, growing leaves a hole.
+      int rv = 0;
+      if(size < node->size) {
+        shrink_inode(node, size);
+      }
+      else {
+        rv = grow_inode(node, size);
+      }
+      if(rv == 0) {
+        inode_touch(node, 1);
+      }
+      return rv;
   }
   else {
     return -EACCES;
   }
 }
 
+// One try at storage_truncate, see below.
+static int truncate_path(const char *path, off_t size) {
+  journal_start();
+  pthread_rwlock_rdlock(&tree_lock);
+  int inum = tree_lookup(path);
+  int rv = -ENOENT;
+  if(inum != -1 && size < 0) {
+    // Must be a positive integer, can truncate back to 0 to erase everything.
+    rv = -EINVAL;
+  }
+  else if(inum != -1) {
+    inode_lock(inum, 1);
+    rv = truncate_inode(get_inode(inum), size);
+    inode_unlock(inum);
+  }
+  pthread_rwlock_unlock(&tree_lock);
+  journal_stop();
+  return rv;
+}
+
 /**
  * Truncates the file to a given size. Either larger or smaller
  * 
  * @param path the path of the file to truncate
- * @param size the size to truncate to must be between 0 and block size.
+ * @param size the size to truncate to, must not be negative.
  * 
  * @returns the status of the truncate.
 */
 int storage_truncate(const char *path, off_t size) {
-  printf("Truncating %s to %zu bytes\n", path, size);
-  // Check it exists
+  int rv = truncate_path(path, size);
+  return retry_nospc(rv) ? truncate_path(path, size) : rv;
+}
+
+/**
+ * Changes the permissions of a file or directory.
+ * 
+ * @param path the path of the file to change
+ * @param mode the new mode, including the file type bits.
+ * 
+ * @returns 0 on success, -ENOENT if there is no such file.
+*/
+int storage_chmod(const char *path, int mode) {
+  journal_start();
+  pthread_rwlock_rdlock(&tree_lock);
   int inum = tree_lookup(path);
-  if(inum == -1) {
-    return -ENOENT;
+  int rv = -ENOENT;
+  if(inum != -1) {
+    inode_lock(inum, 1);
+    get_inode(inum)->mode = mode;
+    inode_touch(get_inode(inum), 0);
+    inode_unlock(inum);
+    rv = 0;
   }
-  // Make sure not truncating to larger than a block
-  if(size > BLOCK_SIZE) {
-    return -EFBIG;
+  pthread_rwlock_unlock(&tree_lock);
+  journal_stop();
+  return rv;
+}
+
+/**
+ * Gets what an open with the given flags will be used for.
+ */
+static int handle_flags(int flags) {
+  int rv = 0;
+  if((flags & O_ACCMODE) != O_WRONLY) {
+    rv |= HANDLE_READ;
   }
-  else if(size < 0) {
-    // Must be a positive integer, can truncate back to 0 to erase everything.
-    return -EINVAL;
+  if((flags & O_ACCMODE) != O_RDONLY) {
+    rv |= HANDLE_WRITE;
+  }
+  return rv;
+}
+
+/**
+ * Gives out a handle on an inode, caller holds its lock for writing.
+ */
+static int open_inode(inode_t* node, int flags, uint64_t* fh) {
+  int rv = handle_alloc(node, inode_get_inum(node), flags);
+  if(rv < 0) {
+    return rv;
   }
+  node->opens += 1;
+  *fh = rv;
+  return 0;
+}
+
+/**
+ * Opens an inode if its mode allows the access asked for. Caller holds
+ * the tree lock.
+ */
+static int open_checked(int inum, int flags, uint64_t* fh) {
+  int want = handle_flags(flags);
+  inode_lock(inum, 1);
   inode_t* node = get_inode(inum);
-  // Check that it isn't a directory
-  if(node->mode / 010000 == 4) {
-    return -EISDIR;
+  int allowed = 0;
+  if((((node->mode - 010000) / 0100) & 04) == 04) {
+    allowed |= HANDLE_READ;
   }
-  // Check for write permissions
   if((((node->mode - 010000) / 0100) & 02) == 02) {
-      // Truncate it
-      shrink_inode(node, size);
-      // If it was larger set everything to 0.
-      if(size > node->size) {
-        memset(blocks_get_block(node->block) + node->size, 0, size - node->size);
-      }
+    allowed |= HANDLE_WRITE;
   }
-  else {
-    return -EACCES;
+  int rv = (want & allowed) == want ? open_inode(node, want, fh) : -EACCES;
+  inode_unlock(inum);
+  return rv;
+}
+
+/**
+ * Drops count of the things keeping an inode allocated (open handles and
+ * front end references), freeing it if it has no names and nothing else
+ * keeps it. Caller holds the tree lock, names only go away under the
+ * exclusive lock so refs holds still.
+ */
+static void unpin(int inum, inode_t* node, int count) {
+  inode_lock(inum, 1);
+  node->opens -= count;
+  int orphan = node->opens == 0 && node->refs == 0;
+  inode_unlock(inum);
+  if(orphan) {
+    free_inode(inum);
   }
 }
+
+static int mknod_path(const char *path, int mode);
+static int unlink_path(const char *path);
+
+/**
+ * Opens a file, checking its permissions once for all later reads and
+ * writes through the handle. The inode stays allocated while it is open,
+ * even if its last name is removed.
+ * 
+ * @param path the path of the file to open
+ * @param flags the open flags, only the access mode is looked at
+ * @param fh where to put the new handle
+ * 
+ * @returns 0 on success, -ENOENT if there is no such file, -EACCES if the
+ *          mode doesn't allow the access asked for.
+*/
+int storage_open(const char *path, int flags, uint64_t *fh) {
+  journal_start();
+  pthread_rwlock_rdlock(&tree_lock);
+  int inum = tree_lookup(path);
+  int rv = inum == -1 ? -ENOENT : open_checked(inum, flags, fh);
+  pthread_rwlock_unlock(&tree_lock);
+  journal_stop();
+  return rv;
+}
+
 /**
- * Creates a file or directory at the given path with the given mode.
+ * Makes a new file and opens it. The new file may be opened for writing
+ * even if its mode doesn't allow that, just like open(2) with O_CREAT.
  * 
  * @param path of the new file to make
  * @param mode mode of the new file to make
+ * @param flags the open flags, only the access mode is looked at
+ * @param fh where to put the new handle
  * 
- * @returns the status of creating the file.
+ * @returns 0 on success, otherwise the error from making the file.
 */
-int storage_mknod(const char *path, int mode) {
-  printf("Making file %s with mode %d\n", path, mode);
-  if(tree_lookup(path) != -1) {
-    return -EEXIST;
+int storage_create(const char *path, int mode, int flags, uint64_t *fh) {
+  journal_start();
+  pthread_rwlock_wrlock(&tree_lock);
+  int rv = mknod_path(path, mode);
+  if(rv == 0) {
+    int inum = tree_lookup(path);
+    inode_lock(inum, 1);
+    rv = open_inode(get_inode(inum), handle_flags(flags), fh);
+    inode_unlock(inum);
+    if(rv < 0) {
+      unlink_path(path);
+    }
   }
-  // Get parent location
-  char* parent = get_parent(path);
-  printf("Found parent directory %s\n", parent);
-  // Find the inum
-  int parent_num = tree_lookup(parent);
-  printf("Found parent inum %d\n", parent_num);
-  // Get childs name
-  char child[strlen(path) - strlen(parent) + 1];
-  // + 1 to avoid the /
-  strcpy(child, path + strlen(parent));
-  printf("Found childs name %s\n", child);
-  // Free the parent address
-  free(parent);
-  // If not found error out
-  if(parent_num == -1) {
-    return -ENOENT;
+  pthread_rwlock_unlock(&tree_lock);
+  journal_stop();
+  return rv;
+}
+
+/**
+ * Reads from an open file into the buffer. Reads at most size bytes.
+ * 
+ * @param fh the handle from storage_open
+ * @param buf the buffer to read into.
+ * @param size the maximum amount of bytes to read
+ * @param offset where in the file to read from.
+ * 
+ * @returns how much was read, -EBADF if the file wasn't opened for reading.
+*/
+int storage_read_handle(uint64_t fh, char *buf, size_t size, off_t offset) {
+  handle_t* handle = handle_get(fh);
+  TRACE_INUM(handle->inum);
+  if(!(handle->flags & HANDLE_READ)) {
+    return -EBADF;
+  }
+  inode_lock(handle->inum, 0);
+  int rv = read_inode(handle->node, buf, size, offset);
+  int atimes = rv >= 0 && note_read(handle->inum, handle->node);
+  inode_unlock(handle->inum);
+  if(atimes) {
+    write_atimes();
+  }
+  return rv;
+}
+
+/**
+ * Writes from the buffer into an open file, growing it if the write goes
+ * past the end.
+ * 
+ * @param fh the handle from storage_open
+ * @param buf the buffer to write from.
+ * @param size the size of the write
+ * @param offset the offset in the file to write from.
+ * 
+ * @returns how much was written, -EBADF if the file wasn't opened for
+ *          writing.
+*/
+int storage_write_handle(uint64_t fh, const char *buf, size_t size, off_t offset) {
+  handle_t* handle = handle_get(fh);
+  TRACE_INUM(handle->inum);
+  if(!(handle->flags & HANDLE_WRITE)) {
+    return -EBADF;
+  }
+  int rv;
+  int tries = 0;
+  do {
+    journal_start();
+    inode_lock(handle->inum, 1);
+    rv = write_inode(handle->node, buf, size, offset);
+    inode_unlock(handle->inum);
+    journal_stop();
+  } while(tries++ == 0 && retry_nospc(rv));
+  return rv;
+}
+
+/**
+ * Reserves or frees space in a file inode, caller holds its lock for
+ * writing.
+ */
+static int fallocate_inode(inode_t* node, int mode, off_t offset, off_t length) {
+  if(node->mode / 010000 == 4) {
+    return -EISDIR;
+  }
+  if(length > INODE_MAX_SIZE - offset) {
+    return -EFBIG;
+  }
+  int rv;
+  if(mode & FALLOC_FL_PUNCH_HOLE) {
+    rv = inode_punch(node, offset, length);
+  }
+  else {
+    rv = inode_preallocate(node, offset, length);
+    if(rv == 0 && !(mode & FALLOC_FL_KEEP_SIZE) && offset + length > node->size) {
+      rv = grow_inode(node, offset + length);
+    }
+  }
+  // Reserving space past the end changes nothing a reader could see.
+  if(rv == 0 && mode != FALLOC_FL_KEEP_SIZE) {
+    inode_touch(node, 1);
+  }
+  return rv;
+}
+
+/**
+ * Reserves space in an open file so writing there can't run out of it,
+ * or with FALLOC_FL_PUNCH_HOLE turns a range into a hole that gives its
+ * blocks back. Reserved blocks are zeroed, and are taken in as few runs
+ * as the free space allows.
+ * 
+ * @param fh the handle from storage_open
+ * @param mode 0 to grow the file over the range, FALLOC_FL_KEEP_SIZE not
+ *             to, or both that and FALLOC_FL_PUNCH_HOLE
+ * @param offset where the range starts
+ * @param length how many bytes it has.
+ * 
+ * @returns 0 on success, -EBADF if the file wasn't opened for writing,
+ *          -EOPNOTSUPP for any other mode, -ENOSPC if the disk is full.
+*/
+int storage_fallocate(uint64_t fh, int mode, off_t offset, off_t length) {
+  handle_t* handle = handle_get(fh);
+  TRACE_INUM(handle->inum);
+  if(!(handle->flags & HANDLE_WRITE)) {
+    return -EBADF;
+  }
+  if(offset < 0 || length <= 0) {
+    return -EINVAL;
   }
+  if((mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) != 0 ||
+     mode == FALLOC_FL_PUNCH_HOLE) {
+    return -EOPNOTSUPP;
+  }
+  int rv;
+  int tries = 0;
+  do {
+    journal_start();
+    inode_lock(handle->inum, 1);
+    rv = fallocate_inode(handle->node, mode, offset, length);
+    inode_unlock(handle->inum);
+    journal_stop();
+  } while(tries++ == 0 && retry_nospc(rv));
+  return rv;
+}
+
+/**
+ * Closes a handle from storage_open. Closing the last handle on a file
+ * that no longer has any names frees it.
+ * 
+ * @param fh the handle to close.
+ * 
+ * @returns 0, this can't fail.
+*/
+int storage_release(uint64_t fh) {
+  handle_t* handle = handle_get(fh);
+  int inum = handle->inum;
+  inode_t* node = handle->node;
+  handle_free(fh);
+  journal_start();
+  pthread_rwlock_rdlock(&tree_lock);
+  unpin(inum, node, 1);
+  pthread_rwlock_unlock(&tree_lock);
+  journal_stop();
+  return 0;
+}
+
+/**
+ * Starts writing out a file's dirty data, a run of blocks at a time.
+ * Caller holds its lock.
+ * 
+ * @returns nonzero if any of it was dirty.
+ */
+static int write_back(inode_t* node) {
+  if((node->flags & INODE_INLINE) || is_directory(node)) {
+    // All of it is metadata.
+    return 0;
+  }
+  int dirty = 0;
+  int blocks = (node->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  for(int fbnum = 0; fbnum < blocks; ) {
+    int run;
+    int bnum = inode_get_run(node, fbnum, &run);
+    if(bnum == -1) {
+      fbnum = inode_next_data(node, fbnum);
+      if(fbnum == -1) {
+        break;
+      }
+      continue;
+    }
+    if(run > blocks - fbnum) {
+      run = blocks - fbnum;
+    }
+    dirty |= journal_write_back(bnum, run);
+    fbnum += run;
+  }
+  return dirty;
+}
+
+/**
+ * Makes everything written to an open file or directory so far durable:
+ * its dirty data goes out a range at a time, then it waits for the journal
+ * commit that covers its inode. Nothing is written when there is nothing
+ * to make durable, and fsyncs at the same time share one commit.
+ * 
+ * @param fh the handle from storage_open or storage_opendir
+ * @param datasync nonzero to skip the commit for a file whose size and
+ *                 blocks haven't changed since the last one, only its data
+ *                 and times, flushing just the data
+ * 
+ * @returns 0, or the error from flushing the data without a commit. Write
+ *          errors in a commit are reported by the commit.
+*/
+int storage_fsync(uint64_t fh, int datasync) {
+  handle_t* handle = handle_get(fh);
+  TRACE_INUM(handle->inum);
+  datasync = datasync && handle->node->mode / 010000 != 4;
+  if(!datasync) {
+    write_atimes();
+  }
+  inode_lock(handle->inum, 0);
+  int dirty = write_back(handle->node);
+  uint64_t layout = inode_layout_id(handle->inum);
+  inode_unlock(handle->inum);
+  if(datasync) {
+    return journal_datasync(layout, dirty);
+  }
+  journal_sync(handle->node, INODE_SIZE, dirty);
+  return 0;
+}
+
+/**
+ * Starts writing out what was written through a handle as it is closed,
+ * without waiting for it.
+ * 
+ * @param fh the handle being closed.
+ * 
+ * @returns 0, this can't fail.
+*/
+int storage_flush(uint64_t fh) {
+  handle_t* handle = handle_get(fh);
+  if(handle->flags & HANDLE_WRITE) {
+    inode_lock(handle->inum, 0);
+    write_back(handle->node);
+    inode_unlock(handle->inum);
+  }
+  return 0;
+}
+
+/**
+ * Creates a file or directory named child in the given directory.
+ * Caller holds the tree lock exclusively.
+ * 
+ * @param parent_num the directory to make it in
+ * @param child the name of the new file
+ * @param mode mode of the new file to make
+ * 
+ * @returns the inum of the new file, or the error from making it.
+*/
+static int mknod_at(int parent_num, const char *child, int mode) {
   // Get actual inode
   inode_t* parent_node = get_inode(parent_num);
   // If its a directory error out
@@ -237,36 +1110,110 @@ int storage_mknod(const char *path, int mode) {
   if((((parent_node->mode - 040000) / 0100) & 02) != 02) {
     return -EACCES;
   }
-  // Check for free space
-  if(parent_node->size == BLOCK_SIZE) {
-    return -ENOSPC;
-  }
   // Check thatchild name is short enough
-  if(strlen(child) > DIR_NAME_LENGTH) {
-    return -EINVAL;
+  if(strlen(child) >= DIR_NAME_LENGTH) {
+    return -ENAMETOOLONG;
+  }
+  if(directory_lookup(parent_node, child) != -1) {
+    return -EEXIST;
   }
   // Make the new inode for the file.
   int child_num = alloc_inode();
-  printf("Child allocated inode %d\n", child_num);
+  TRACE_INUM(child_num);
   // Fails if can't make a new one
   if(child_num == -1) {
     return -ENOSPC;
   }
-  // Put new inode and child in directory
-  directory_put(parent_node, child, child_num);
-  // Set up inode to right mode
+  // Set up inode to right mode, the dirent records its type
   inode_t* child_node = get_inode(child_num);
-  child_node->size = 0;
   child_node->mode = mode;
-  child_node->refs = 1;
+  child_node->refs = 0;
+  // Regular files are compressed if the image was made that way.
+  if(mode / 010000 == 010 && (get_superblock()->features & SUPER_COMPRESS)) {
+    child_node->flags |= INODE_COMPRESSED;
+  }
+  // Put new inode and child in directory
+  int rv = directory_put(parent_node, child, child_num);
+  if(rv < 0) {
+    free_inode(child_num);
+    return rv;
+  }
   // If its a directory add the base files
   if(mode / 010000 == 4) {
-    directory_put(child_node, "..", parent_num);
-    directory_put(child_node, ".", child_num);
+    rv = directory_put(child_node, "..", parent_num);
+    if(rv == 0) {
+      rv = directory_put(child_node, ".", child_num);
+    }
+    if(rv < 0) {
+      // Out of space for the directory's block, back out.
+      if(child_node->size > 0) {
+        directory_delete(child_node, "..");
+      }
+      directory_delete(parent_node, child);
+      return rv;
+    }
   }
+  // Its names were added as it was made, so its times all match the
+  // directory's.
+  child_node->atime = child_node->mtime = child_node->ctime = parent_node->mtime;
+  return child_num;
+}
+
+/**
+ * Creates a file or directory at the given path with the given mode.
+ * 
+ * @param path of the new file to make
+ * @param mode mode of the new file to make
+ * 
+ * @returns the status of creating the file.
+*/
+static int mknod_path(const char *path, int mode) {
+  if(tree_lookup(path) != -1) {
+    return -EEXIST;
+  }
+  // Get parent location
+  char parent[strlen(path) + 1];
+  path_parent(path, parent);
+  // Find the inum
+  int parent_num = tree_lookup(parent);
+  // If not found error out
+  if(parent_num == -1) {
+    return -ENOENT;
+  }
+  int rv = mknod_at(parent_num, path_child(path), mode);
+  if(rv < 0) {
+    return rv;
+  }
+  // Forget that the path was missing (and for directories, what was
+  // missing below it).
+  dcache_invalidate_path(path, mode / 010000 == 4);
   return 0;
 }
 
+/**
+ * Removes the name child from the given directory. Caller holds the tree
+ * lock exclusively.
+ * 
+ * @param inum the directory to remove it from
+ * @param child the name to remove
+ * 
+ * @returns the status of the unlink
+*/
+static int unlink_at(int inum, const char *child) {
+  // Get parent inode
+  inode_t* node = get_inode(inum);
+  // Ensure it is a directory
+  if(node->mode / 010000 != 4) {
+    return -ENOTDIR;
+  }
+  // Ensure write perms
+  if((((node->mode - 040000) / 0100) & 02) != 02) {
+    return -EACCES;
+  }
+  // Delete it from the directory.
+  return directory_delete(node, child);
+}
+
 /**
  * Unlinks the file at that path from the directory.
  * 
@@ -274,35 +1221,53 @@ int storage_mknod(const char *path, int mode) {
  * 
  * @returns the status of the unlink
 */ 
-int storage_unlink(const char *path) {
-  printf("Unlinking %s\n", path);
-  char* parent = get_parent(path);
-  printf("Found parent directory %s\n", parent);
+static int unlink_path(const char *path) {
+  char parent[strlen(path) + 1];
+  path_parent(path, parent);
   int inum = tree_lookup(parent);
-  printf("Found parent inum %d\n", inum);
-  // Get child
-  char child[strlen(path) - strlen(parent) + 1];
-  // to ignore the /, + 1
-  strcpy(child, path + strlen(parent));
-  printf("Found childs name %s\n", child);
-  free(parent);
   // Ensure parent exists
   if(inum == -1) {
     return -ENOENT;
   }
-  // Get parent inode
-  inode_t* node = get_inode(inum);
-  // Ensure it is a directory
-  if(node->mode / 010000 != 4) {
+  // Paths below a directory go away with it.
+  int victim = tree_lookup(path);
+  int subtree = victim != -1 && is_directory(get_inode(victim));
+  int rv = unlink_at(inum, path_child(path));
+  if(rv == 0) {
+    dcache_invalidate_path(path, subtree);
+  }
+  return rv;
+}
+
+/**
+ * Adds the name child for a file to the given directory. Caller holds
+ * the tree lock exclusively.
+ * 
+ * @param from_inum the existing file
+ * @param to_parent_inum the directory to add the name to
+ * @param child the new name
+ * 
+ * @returns the status of the link.
+*/
+static int link_at(int from_inum, int to_parent_inum, const char *child) {
+  // Get parent not
+  inode_t* parent_node = get_inode(to_parent_inum);
+  // Ensure parent is directory
+  if(parent_node->mode / 010000 != 4) {
     return -ENOTDIR;
   }
-  // Ensure write perms
-  if((((node->mode - 040000) / 0100) & 02) != 02) {
+  // Ensure write permissions to parent
+  if((((parent_node->mode - 040000) / 0100) & 02) != 02) {
     return -EACCES;
   }
-  // Delete it from the directory.
-  directory_delete(get_inode(inum), child);
+  // Make sure to doesn't exist
+  if(directory_lookup(parent_node, child) != -1) {
+    return -EEXIST;
+  }
+  // Add froms inode to the parent of to.
+  return directory_put(parent_node, child, from_inum);
 }
+
 /**
  * Links a file from the old "from" path to a new "to" path.
  * From is the source of the file, to is the new file.
@@ -312,16 +1277,11 @@ int storage_unlink(const char *path) {
  * 
  * @returns the status of the link.
 */
-int storage_link(const char *from, const char *to) {
-  printf("Linking from %s to %s", from, to);
+static int link_path(const char *from, const char *to) {
   int from_inum = tree_lookup(from);
-  char* to_parent = get_parent(to);
+  char to_parent[strlen(to) + 1];
+  path_parent(to, to_parent);
   int to_parent_inum = tree_lookup(to_parent);
-  // Get childs name
-  char child[strlen(to) - strlen(to_parent) + 1];
-  // to ignore the /, + 1
-  strcpy(child, to + strlen(to_parent));
-  free(to_parent);
   // Make sure from exists
   if(from_inum == -1) {
     return -ENOENT;
@@ -334,26 +1294,105 @@ int storage_link(const char *from, const char *to) {
   if(to_parent_inum == -1) {
     return -ENOENT;
   }
-  // Get parent not
-  inode_t* parent_node = get_inode(to_parent_inum);
-  // Ensure parent is directory
-  if(parent_node->mode / 010000 != 4) {
-    return -ENOTDIR;
+  int rv = link_at(from_inum, to_parent_inum, path_child(to));
+  if(rv == 0) {
+    dcache_invalidate_path(to, is_directory(get_inode(from_inum)));
   }
-  // Ensure parent  has space
-  if(parent_node->size == BLOCK_SIZE) {
-    return -ENOSPC;
+  return rv;
+}
+/**
+ * Creates a file or directory, see mknod_path.
+*/
+int storage_mknod(const char *path, int mode) {
+  journal_start();
+  pthread_rwlock_wrlock(&tree_lock);
+  int rv = mknod_path(path, mode);
+  pthread_rwlock_unlock(&tree_lock);
+  journal_stop();
+  return rv;
+}
+/**
+ * Removes a name for a file, see unlink_path.
+*/
+int storage_unlink(const char *path) {
+  journal_start();
+  pthread_rwlock_wrlock(&tree_lock);
+  int rv = unlink_path(path);
+  pthread_rwlock_unlock(&tree_lock);
+  journal_stop();
+  return rv;
+}
+/**
+ * Adds another name for a file, see link_path.
+*/
+int storage_link(const char *from, const char *to) {
+  journal_start();
+  pthread_rwlock_wrlock(&tree_lock);
+  int rv = link_path(from, to);
+  pthread_rwlock_unlock(&tree_lock);
+  journal_stop();
+  return rv;
+}
+/**
+ * Moves the name child of dir to new_child in new_dir, replacing whatever
+ * new_child named there. As with rename(2), a directory can only replace
+ * an empty directory and anything else only a non-directory, and moving
+ * a name onto another name for the same file does nothing. Caller holds
+ * the tree lock exclusively.
+ * 
+ * @param dir the directory the name is in
+ * @param child the name to move
+ * @param new_dir the directory to move it to
+ * @param new_child the name to give it there
+ * @param replace whether new_child may already be there, -EEXIST if not
+ * 
+ * @returns the status of the rename.
+*/
+static int rename_at(int dir, const char *child, int new_dir, const char *new_child,
+                     int replace) {
+  int inum = is_directory(get_inode(dir)) ? tree_lookup_at(dir, child) : -1;
+  if(inum == -1) {
+    return -ENOENT;
   }
-  // Ensure write permissions to parent
-  if((((parent_node->mode - 040000) / 0100) & 02) != 02) {
-    return -EACCES;
+  inode_t* parent_node = get_inode(new_dir);
+  int old = is_directory(parent_node) ? tree_lookup_at(new_dir, new_child) : -1;
+  if(old == -1) {
+    int rv = link_at(inum, new_dir, new_child);
+    return rv == 0 ? unlink_at(dir, child) : rv;
   }
-  // Add froms inode to the parent of to.
-  directory_put(parent_node, child, from_inum);
+  if(!replace) {
+    return -EEXIST;
+  }
+  if(old == inum) {
+    return 0;
+  }
+  inode_t* old_node = get_inode(old);
+  if(is_directory(get_inode(inum)) != is_directory(old_node)) {
+    return is_directory(old_node) ? -EISDIR : -ENOTDIR;
+  }
+  if(is_directory(old_node) && directory_count(old_node) > 2) {
+    return -ENOTEMPTY;
+  }
+  // Check everything rmdir and unlink would up front, since what comes
+  // after can't fail.
+  inode_t* nodes[] = { get_inode(dir), parent_node, old_node };
+  for(int i = 0; i < 3; ++i) {
+    if(is_directory(nodes[i]) && (((nodes[i]->mode - 040000) / 0100) & 02) != 02) {
+      return -EACCES;
+    }
+  }
+  if(is_directory(old_node)) {
+    directory_delete(old_node, ".");
+    directory_delete(old_node, "..");
+  }
+  directory_set(parent_node, new_child, inum);
+  return unlink_at(dir, child);
 }
 /**
  * Renames a file in the storage system. From is the source of the file
- * and to is the new name for the file
+ * and to is the new name for the file, replacing whatever was there (see
+ * rename_at). Both paths are dropped from the dcache, along with
+ * everything below them when a directory is moved.
  * 
  * @param from the current filepath the file has
  * @param to the file path to move the file to.
@@ -361,70 +1400,238 @@ int storage_link(const char *from, const char *to) {
  * @returns the status of the rename.
 */
 int storage_rename(const char *from, const char *to) {
-  printf("Renaming %s to %s\n", from, to);
-  int rv = storage_link(from, to);
-  if(rv < 0) {
-    return rv;
+  journal_start();
+  pthread_rwlock_wrlock(&tree_lock);
+  char from_parent[strlen(from) + 1];
+  char to_parent[strlen(to) + 1];
+  path_parent(from, from_parent);
+  path_parent(to, to_parent);
+  int dir = tree_lookup(from_parent);
+  int new_dir = tree_lookup(to_parent);
+  int inum = tree_lookup(from);
+  int subtree = inum != -1 && is_directory(get_inode(inum));
+  int rv = -ENOENT;
+  if(dir != -1 && new_dir != -1) {
+    rv = rename_at(dir, path_child(from), new_dir, path_child(to), 1);
   }
-  else {
-    return storage_unlink(from);
+  if(rv == 0) {
+    dcache_invalidate_path(from, subtree);
+    dcache_invalidate_path(to, subtree);
   }
+  pthread_rwlock_unlock(&tree_lock);
+  journal_stop();
+  return rv;
 }
 /**
- * Removes an entire path from storage. Errors if 
- * they lack permissions to do so or the path given
- * is not a directory
+ * Removes the empty directory named child from the given directory.
+ * Errors if they lack permissions to do so or the name given is not a
+ * directory. Caller holds the tree lock exclusively.
  * 
- * @param path is the path to the directory
+ * @param parent_num the directory holding it
+ * @param child the name of the directory to remove
  * 
  * @returns status of the rmdir.
 */
-int storage_rmdir(const char* path) {
-  printf("Removing path at %s\n", path);
-  if(path == "/") {
-    // You can't delete your whole file system!
-    return -EPERM;
+static int rmdir_at(int parent_num, const char* child) {
+  if(strcmp(child, ".") == 0 || strcmp(child, "..") == 0) {
+    return -EINVAL;
   }
+  inode_t* parent_node = get_inode(parent_num);
   // Get inode and confirm it is a directory
-  int inum = tree_lookup(path);
+  int inum = directory_lookup(parent_node, child);
+  if(inum == -1) {
+    return -ENOENT;
+  }
   inode_t* node = get_inode(inum);
   // confirm directory
   if(!is_directory(node)) {
     return -ENOTDIR;
   }
   // confirm empty (only . and ..)
-  if(node->size > (2 * SIZE_DIRENT)) {
+  if(directory_count(node) > 2) {
     return -ENOTEMPTY;
   }
   // Confirm we can edit
   if((((node->mode - 040000) / 0100) & 02) == 02) {
-    // Remove it from the parent
-    char* parent = get_parent(path);
-    // We know parent exists
-    inode_t* parent_node = get_inode(tree_lookup(parent));
-    char child[strlen(path) - strlen(parent) + 1];
-    // Copy over child name
-    strcpy(child, path + strlen(parent));
     // Free . and .. in the directory
     directory_delete(node, ".");
     directory_delete(node, "..");
     // Delete directory from parent
     directory_delete(parent_node, child);
-    free(parent);
-
     return 0;
   }
   else {
     return -EACCES;
   }
 }
+/**
+ * Removes an entire path from storage, see rmdir_at.
+ * 
+ * @param path is the path to the directory
+ * 
+ * @returns status of the rmdir.
+*/
+static int rmdir_path(const char* path) {
+  if(strcmp(path, "/") == 0) {
+    // You can't delete your whole file system!
+    return -EPERM;
+  }
+  // Get the parent, which has to be a directory if path exists
+  char parent[strlen(path) + 1];
+  path_parent(path, parent);
+  int parent_num = tree_lookup(parent);
+  if(parent_num == -1 || !is_directory(get_inode(parent_num))) {
+    return -ENOENT;
+  }
+  int rv = rmdir_at(parent_num, path_child(path));
+  if(rv == 0) {
+    dcache_invalidate_path(path, 1);
+  }
+  return rv;
+}
+/**
+ * Removes an empty directory, see rmdir_path.
+*/
+int storage_rmdir(const char* path) {
+  journal_start();
+  pthread_rwlock_wrlock(&tree_lock);
+  int rv = rmdir_path(path);
+  pthread_rwlock_unlock(&tree_lock);
+  journal_stop();
+  return rv;
+}
 
 
 /**
- * Unimplemented as we don't use time.
+ * Sets the atime and mtime of an inode, caller holds its lock for writing.
+ * Either may be UTIME_NOW or UTIME_OMIT, like utimensat(2), and the ctime
+ * moves to now unless both are omitted.
+ */
+static void set_times(inode_t* node, const struct timespec ts[2]) {
+  if(ts[0].tv_nsec == UTIME_OMIT && ts[1].tv_nsec == UTIME_OMIT) {
+    return;
+  }
+  // Drops a waiting atime, an explicit one wins over it.
+  inode_touch(node, 0);
+  int64_t* times[2] = { &node->atime, &node->mtime };
+  for(int i = 0; i < 2; ++i) {
+    if(ts[i].tv_nsec == UTIME_NOW) {
+      *times[i] = node->ctime;
+    }
+    else if(ts[i].tv_nsec != UTIME_OMIT) {
+      *times[i] = (int64_t)ts[i].tv_sec * 1000000000 + ts[i].tv_nsec;
+    }
+  }
+}
+
+/**
+ * Sets the access and modification times of a file or directory.
+ * 
+ * @param path the path of the file to change
+ * @param ts the new atime and mtime, either may be UTIME_NOW or UTIME_OMIT.
+ * 
+ * @returns 0 on success, -ENOENT if there is no such file.
 */
 int storage_set_time(const char *path, const struct timespec ts[2]) {
-  return -EAFNOSUPPORT;
+  journal_start();
+  pthread_rwlock_rdlock(&tree_lock);
+  int inum = tree_lookup(path);
+  int rv = -ENOENT;
+  if(inum != -1) {
+    inode_lock(inum, 1);
+    set_times(get_inode(inum), ts);
+    inode_unlock(inum);
+    rv = 0;
+  }
+  pthread_rwlock_unlock(&tree_lock);
+  journal_stop();
+  return rv;
+}
+
+/**
+ * Opens a directory inode if it can be read. Caller holds the tree lock.
+ */
+static int opendir_checked(int inum, uint64_t* fh) {
+  inode_lock(inum, 1);
+  inode_t* node = get_inode(inum);
+  int rv;
+  if(!is_directory(node)) {
+    rv = -ENOTDIR;
+  }
+  else if((((node->mode - 040000) / 0100) & 04) != 04) {
+    rv = -EACCES;
+  }
+  else {
+    rv = open_inode(node, HANDLE_READ, fh);
+  }
+  inode_unlock(inum);
+  return rv;
+}
+
+/**
+ * Opens a directory for storage_readdir.
+ * 
+ * @param path the path of the directory to open
+ * @param fh where to put the new handle
+ * 
+ * @returns 0 on success, -ENOENT if there is no such directory, -ENOTDIR
+ *          if it isn't one, -EACCES if it can't be read.
+*/
+int storage_opendir(const char *path, uint64_t *fh) {
+  journal_start();
+  pthread_rwlock_rdlock(&tree_lock);
+  int inum = tree_lookup(path);
+  int rv = inum == -1 ? -ENOENT : opendir_checked(inum, fh);
+  pthread_rwlock_unlock(&tree_lock);
+  journal_stop();
+  return rv;
+}
+
+// Where storage_readdir is sending entries.
+typedef struct readdir_state {
+  storage_filler_t fill;
+  void* buf;
+} readdir_state_t;
+
+// Hands an entry to the storage_readdir caller with what stat it can give
+// without reading the inode.
+static int readdir_entry(void* arg, const char* name, int inum, int type, off_t next) {
+  readdir_state_t* state = arg;
+  struct stat st;
+  memset(&st, 0, sizeof(st));
+  st.st_ino = inum;
+  st.st_mode = type << 12;
+  return state->fill(state->buf, name, &st, next);
+}
+
+/**
+ * Lists an open directory straight from its blocks, passing each entry to
+ * fill with its inode number and file type filled in, and no other stat
+ * fields. Stops early when fill returns nonzero, the next call picks up at
+ * the offset that was passed with the last entry taken.
+ * 
+ * @param fh the handle from storage_opendir
+ * @param offset 0, or where the last call left off
+ * @param fill gets each entry
+ * @param buf passed on to fill
+ * 
+ * @returns 0, or -ENOMEM.
+*/
+int storage_readdir(uint64_t fh, off_t offset, storage_filler_t fill, void *buf) {
+  handle_t* handle = handle_get(fh);
+  TRACE_INUM(handle->inum);
+  readdir_state_t state = { fill, buf };
+  // Entries only change under the exclusive lock.
+  pthread_rwlock_rdlock(&tree_lock);
+  int rv = directory_read(handle->node, offset, readdir_entry, &state);
+  inode_lock(handle->inum, 0);
+  int atimes = note_read(handle->inum, handle->node);
+  inode_unlock(handle->inum);
+  pthread_rwlock_unlock(&tree_lock);
+  if(atimes) {
+    write_atimes();
+  }
+  return rv < 0 ? rv : 0;
 }
 
 /**
@@ -436,14 +1643,431 @@ int storage_set_time(const char *path, const struct timespec ts[2]) {
  * @returns the list of all entries in that directory.
 */
 slist_t *storage_list(const char *path) {
-  printf("Getting entries from %s\n", path);
+  pthread_rwlock_rdlock(&tree_lock);
   // Get inode at path
   int inum = tree_lookup(path);
+  slist_t* entries = NULL;
+  // Only directories have entries
+  if(inum != -1 && is_directory(get_inode(inum))) {
+    entries = directory_list(get_inode(inum));
+  }
+  pthread_rwlock_unlock(&tree_lock);
+  return entries;
+}
+
+/**
+ * Reports the size of the file system and how much of it is free, straight
+ * from the counts kept in the superblock.
+ * A growable image with a size limit counts the room it may still grow into
+ * as free, one without a limit only reports what it has now.
+ * 
+ * @param st where to put the totals.
+ * 
+ * @returns 0, this can't fail.
+*/
+int storage_statfs(struct statvfs *st) {
+  memset(st, 0, sizeof(struct statvfs));
+  alloc_lock();
+  superblock_t* sb = get_superblock();
+  fsblkcnt_t blocks = sb->block_count;
+  fsblkcnt_t free = sb->free_blocks;
+  if(sb->grow_blocks > 0 && sb->max_block_count > sb->block_count) {
+    free += sb->max_block_count - sb->block_count;
+    blocks = sb->max_block_count;
+  }
+  st->f_bsize = sb->block_size;
+  st->f_frsize = sb->block_size;
+  st->f_blocks = blocks;
+  st->f_bfree = free;
+  st->f_bavail = free;
+  st->f_files = sb->inode_count;
+  st->f_ffree = sb->free_inodes;
+  st->f_favail = sb->free_inodes;
+  alloc_unlock();
+  st->f_namemax = DIR_NAME_LENGTH - 1;
+  if(read_only) {
+    st->f_flag = ST_RDONLY;
+  }
+  return 0;
+}
+
+/**
+ * Takes or deletes a snapshot with every inode held still, and makes it
+ * durable before returning.
+ */
+static int snapshot_locked(int (*op)(const char *), const char *name) {
+  if(read_only) {
+    return -EROFS;
+  }
+  journal_start();
+  pthread_rwlock_wrlock(&tree_lock);
+  inode_lock_all();
+  int rv = op(name);
+  inode_unlock_all();
+  pthread_rwlock_unlock(&tree_lock);
+  journal_stop();
+  if(rv == 0) {
+    journal_flush();
+  }
+  return rv;
+}
+
+/**
+ * Gets the live counters, along with how much of the file system is free.
+ *
+ * @param stats where to put them.
+ */
+static void storage_stats(nufs_stats_t *stats) {
+  stats_collect(stats);
+  alloc_lock();
+  superblock_t* sb = get_superblock();
+  stats->free_blocks = sb->free_blocks;
+  stats->total_blocks = sb->block_count;
+  stats->free_inodes = sb->free_inodes;
+  stats->total_inodes = sb->inode_count;
+  alloc_unlock();
+}
+
+/**
+ * Reads the text of /.nufs/stats, made afresh from the counters on every
+ * call, so a reader should take it all in one read.
+ *
+ * @param buf where to put it
+ * @param size the most to read
+ * @param offset where in the text to start.
+ *
+ * @returns the number of bytes read, or -ENOMEM.
+ */
+int storage_read_stats(char *buf, size_t size, off_t offset) {
+  nufs_stats_t *stats = malloc(sizeof(nufs_stats_t));
+  char *text = malloc(STATS_TEXT_MAX);
+  if(stats == NULL || text == NULL) {
+    free(stats);
+    free(text);
+    return -ENOMEM;
+  }
+  storage_stats(stats);
+  off_t length = stats_format(stats, text, STATS_TEXT_MAX);
+  int rv = 0;
+  if(offset < length) {
+    rv = length - offset < (off_t) size ? length - offset : (off_t) size;
+    memcpy(buf, text + offset, rv);
+  }
+  free(stats);
+  free(text);
+  return rv;
+}
+
+/**
+ * Carries out one of the nufs ioctls (see snapshot.h and stats.h), which
+ * can be sent to any open file or directory.
+ * 
+ * @param cmd the ioctl
+ * @param data its argument, as big as the ioctl says, and where to put
+ *             what it gives back.
+ * 
+ * @returns 0 on success, -ENOTTY if cmd isn't a nufs ioctl, otherwise
+ *          what snapshot_create or snapshot_delete returned.
+*/
+int storage_ioctl(unsigned int cmd, void *data) {
+  switch(cmd) {
+  case NUFS_IOC_SNAP_CREATE:
+    return snapshot_locked(snapshot_create, ((snap_name_t*)data)->name);
+  case NUFS_IOC_SNAP_DELETE:
+    return snapshot_locked(snapshot_delete, ((snap_name_t*)data)->name);
+  case NUFS_IOC_SNAP_LIST:
+    pthread_rwlock_rdlock(&tree_lock);
+    snapshot_list(data);
+    pthread_rwlock_unlock(&tree_lock);
+    return 0;
+  case NUFS_IOC_STATS:
+    storage_stats(data);
+    return 0;
+  default:
+    return -ENOTTY;
+  }
+}
+
+/**
+ * Serves a snapshot read only instead of the live file system. Call it
+ * right after storage_init.
+ * 
+ * @param name the snapshot to mount.
+ * 
+ * @returns 0 on success, -ENOENT if there is no such snapshot.
+*/
+int storage_mount_snapshot(const char *name) {
+  int rv = snapshot_mount(name);
+  if(rv == 0) {
+    read_only = 1;
+    dcache_clear();
+  }
+  return rv;
+}
+
+/**
+ * Inode number interface.
+ *
+ * These do the same as the path functions above, for front ends that
+ * resolve one name at a time and then refer to inodes by number. Every
+ * inum handed out this way (with a stat) is pinned like an open file, so
+ * that it stays valid after its last name is gone, until storage_forget
+ * drops the pin. Changes made by inum don't know their paths, so they drop
+ * every cached path.
+*/
+
+/**
+ * Pins an inode being handed to a front end and fills in its stat.
+ * Caller holds the tree lock.
+*/
+static void pin_entry(int inum, struct stat* st) {
+  inode_lock(inum, 1);
   inode_t* node = get_inode(inum);
-  // Return error if not a directory
-  if(!is_directory(node)) {
-    return NULL;
+  node->opens += 1;
+  stat_inode(inum, node, st);
+  inode_unlock(inum);
+}
+
+/**
+ * Looks up a name in a directory, pinning what it finds.
+ * 
+ * @param dir the inum of the directory
+ * @param name the name to look for
+ * @param st filled in with the stat of what was found
+ * 
+ * @returns 0 on success, -ENOENT if there is no such name, -ENOTDIR if
+ *          dir isn't a directory.
+*/
+int storage_lookup_at(int dir, const char *name, struct stat *st) {
+  journal_start();
+  pthread_rwlock_rdlock(&tree_lock);
+  inode_lock(dir, 0);
+  int rv = is_directory(get_inode(dir)) ? 0 : -ENOTDIR;
+  inode_unlock(dir);
+  if(rv == 0) {
+    int inum = strlen(name) < DIR_NAME_LENGTH ? tree_lookup_at(dir, name) : -1;
+    rv = -ENOENT;
+    if(inum != -1) {
+      pin_entry(inum, st);
+      rv = 0;
+    }
+  }
+  pthread_rwlock_unlock(&tree_lock);
+  journal_stop();
+  return rv;
+}
+
+/**
+ * Drops pins taken by the functions below.
+ * 
+ * @param inum the inode to unpin
+ * @param count how many pins to drop
+*/
+void storage_forget(int inum, int count) {
+  journal_start();
+  pthread_rwlock_rdlock(&tree_lock);
+  unpin(inum, get_inode(inum), count);
+  pthread_rwlock_unlock(&tree_lock);
+  journal_stop();
+}
+
+/**
+ * Gets the stat of an inode, see storage_stat.
+*/
+int storage_stat_inum(int inum, struct stat *st) {
+  pthread_rwlock_rdlock(&tree_lock);
+  inode_lock(inum, 0);
+  stat_inode(inum, get_inode(inum), st);
+  inode_unlock(inum);
+  pthread_rwlock_unlock(&tree_lock);
+  return 0;
+}
+
+/**
+ * Resizes a file, see storage_truncate.
+*/
+int storage_truncate_inum(int inum, off_t size) {
+  if(size < 0) {
+    return -EINVAL;
+  }
+  int rv;
+  int tries = 0;
+  do {
+    journal_start();
+    pthread_rwlock_rdlock(&tree_lock);
+    inode_lock(inum, 1);
+    rv = truncate_inode(get_inode(inum), size);
+    inode_unlock(inum);
+    pthread_rwlock_unlock(&tree_lock);
+    journal_stop();
+  } while(tries++ == 0 && retry_nospc(rv));
+  return rv;
+}
+
+/**
+ * Sets the times of a file or directory, see storage_set_time.
+*/
+int storage_set_time_inum(int inum, const struct timespec ts[2]) {
+  journal_start();
+  pthread_rwlock_rdlock(&tree_lock);
+  inode_lock(inum, 1);
+  set_times(get_inode(inum), ts);
+  inode_unlock(inum);
+  pthread_rwlock_unlock(&tree_lock);
+  journal_stop();
+  return 0;
+}
+
+/**
+ * Changes the permissions of a file or directory, see storage_chmod.
+*/
+int storage_chmod_inum(int inum, int mode) {
+  journal_start();
+  pthread_rwlock_rdlock(&tree_lock);
+  inode_lock(inum, 1);
+  get_inode(inum)->mode = mode;
+  inode_touch(get_inode(inum), 0);
+  inode_unlock(inum);
+  pthread_rwlock_unlock(&tree_lock);
+  journal_stop();
+  return 0;
+}
+
+/**
+ * Opens a file, see storage_open.
+*/
+int storage_open_inum(int inum, int flags, uint64_t *fh) {
+  journal_start();
+  pthread_rwlock_rdlock(&tree_lock);
+  int rv = open_checked(inum, flags, fh);
+  pthread_rwlock_unlock(&tree_lock);
+  journal_stop();
+  return rv;
+}
+
+/**
+ * Opens a directory, see storage_opendir.
+*/
+int storage_opendir_inum(int inum, uint64_t *fh) {
+  journal_start();
+  pthread_rwlock_rdlock(&tree_lock);
+  int rv = opendir_checked(inum, fh);
+  pthread_rwlock_unlock(&tree_lock);
+  journal_stop();
+  return rv;
+}
+
+/**
+ * Creates a file or directory in a directory and pins it, see
+ * storage_mknod.
+ * 
+ * @param st filled in with the stat of the new file
+*/
+int storage_mknod_at(int dir, const char *name, int mode, struct stat *st) {
+  journal_start();
+  pthread_rwlock_wrlock(&tree_lock);
+  int rv = mknod_at(dir, name, mode);
+  if(rv >= 0) {
+    pin_entry(rv, st);
+    dcache_invalidate_paths();
+    rv = 0;
+  }
+  pthread_rwlock_unlock(&tree_lock);
+  journal_stop();
+  return rv;
+}
+
+/**
+ * Creates a file in a directory, pins it and opens it, see storage_create.
+ * 
+ * @param st filled in with the stat of the new file
+*/
+int storage_create_at(int dir, const char *name, int mode, int flags,
+                      struct stat *st, uint64_t *fh) {
+  journal_start();
+  pthread_rwlock_wrlock(&tree_lock);
+  int rv = mknod_at(dir, name, mode);
+  if(rv >= 0) {
+    int inum = rv;
+    inode_lock(inum, 1);
+    rv = open_inode(get_inode(inum), handle_flags(flags), fh);
+    inode_unlock(inum);
+    if(rv == 0) {
+      pin_entry(inum, st);
+    }
+    else {
+      unlink_at(dir, name);
+    }
+    dcache_invalidate_paths();
+  }
+  pthread_rwlock_unlock(&tree_lock);
+  journal_stop();
+  return rv;
+}
+
+/**
+ * Adds another name for a file and pins it, see storage_link.
+ * 
+ * @param inum the file to link
+ * @param dir the directory for the new name
+ * @param name the new name
+ * @param st filled in with the stat of the file
+*/
+int storage_link_at(int inum, int dir, const char *name, struct stat *st) {
+  journal_start();
+  pthread_rwlock_wrlock(&tree_lock);
+  int rv = link_at(inum, dir, name);
+  if(rv == 0) {
+    pin_entry(inum, st);
+    dcache_invalidate_paths();
+  }
+  pthread_rwlock_unlock(&tree_lock);
+  journal_stop();
+  return rv;
+}
+
+/**
+ * Removes a name from a directory, see storage_unlink.
+*/
+int storage_unlink_at(int dir, const char *name) {
+  journal_start();
+  pthread_rwlock_wrlock(&tree_lock);
+  int rv = unlink_at(dir, name);
+  if(rv == 0) {
+    dcache_invalidate_paths();
+  }
+  pthread_rwlock_unlock(&tree_lock);
+  journal_stop();
+  return rv;
+}
+
+/**
+ * Removes an empty directory, see storage_rmdir.
+*/
+int storage_rmdir_at(int dir, const char *name) {
+  journal_start();
+  pthread_rwlock_wrlock(&tree_lock);
+  int rv = rmdir_at(dir, name);
+  if(rv == 0) {
+    dcache_invalidate_paths();
+  }
+  pthread_rwlock_unlock(&tree_lock);
+  journal_stop();
+  return rv;
+}
+
+/**
+ * Moves a name from one directory to another, see rename_at.
+*/
+int storage_rename_at(int dir, const char *name, int new_dir, const char *new_name,
+                      int replace) {
+  journal_start();
+  pthread_rwlock_wrlock(&tree_lock);
+  int rv = rename_at(dir, name, new_dir, new_name, replace);
+  if(rv == 0) {
+    dcache_invalidate_paths();
   }
-  // Get all entries
-  return directory_list(node);
+  pthread_rwlock_unlock(&tree_lock);
+  journal_stop();
+  return rv;
 }
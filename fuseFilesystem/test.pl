@@ -2,11 +2,12 @@
 use 5.16.0;
 use warnings FATAL => 'all';
 
-use Test::Simple tests => 31;
+use Test::Simple tests => 63;
 use IO::Handle;
 
 sub mount {
-    system("(make mount 2>&1) >> test.log &");
+    my $target = $ENV{NUFS_LL} ? "mount_ll" : "mount";
+    system("(make $target 2>&1) >> test.log &");
     sleep 1;
 }
 
@@ -103,6 +104,12 @@ system("rm -f mnt/one.txt");
 $files = `ls mnt`;
 ok($files !~ /one\.txt/, "deleted one.txt");
 
+say "# Testing rename...";
+
+write_text("three.txt", "three");
+ok(rename("mnt/three.txt", "mnt/two.txt") && read_text("two.txt") eq "three" &&
+   !-e "mnt/three.txt", "Rename over an existing file");
+
 unmount();
 
 system("rm -f data.nufs test.log");
@@ -171,5 +178,294 @@ ok(($listed and $exists and $has_size), "Larger file exists and has the correct
 $back = read_text("larger.txt");
 ok($content eq $back, "Read back data from larger file correctly");
 
-unmount()
+say "# -> 50 blocks";
+$chunks = 50 * 256;
+$content = "1_2_3_4_5_6_7_8_" x $chunks; # $chunks * 16 bytes of data
+write_text("largest.txt", $content);
+$size = -s "mnt/largest.txt";
+$size or $size = 0;
+say "# Actual size: $size";
+ok($size eq 16 * $chunks + 1, "Largest file has the correct size");
+$back = read_text("largest.txt");
+ok($content eq $back, "Read back data from largest file correctly");
+
+unmount();
+
+system("rm -f data.nufs test.log");
+system("(./mkfs.nufs -b 1K data.nufs 4M 2>&1) >> test.log");
+
+mount();
+
+say "# Custom geometry";
+
+$content = "1_2_3_4_5_6_7_8_" x (128 * 64); # 128K over 1K blocks
+write_text("geometry.txt", $content);
+$back = read_text("geometry.txt");
+ok($content eq $back, "Read back data from an image with 1K blocks");
+
+say "# Big directories";
+
+mkdir("mnt/many");
+for my $ii (1..200) {
+    open my $fh, ">", "mnt/many/file$ii.txt" or last;
+    close $fh;
+}
+my @many = split /\n/, `ls mnt/many`;
+ok(scalar(@many) == 200, "Directory spanning many blocks lists every file");
+unlink(map { "mnt/many/file$_.txt" } (1..100));
+@many = split /\n/, `ls mnt/many`;
+ok((scalar(@many) == 100 and -e "mnt/many/file150.txt" and !-e "mnt/many/file50.txt"),
+   "Remove half of a big directory");
+mkdir("mnt/many/sub$_") for (1..5);
+my $subdirs = `find mnt/many -mindepth 1 -maxdepth 1 -type d | wc -l`;
+ok($subdirs == 5, "Listing tells directories from files");
+
+# Like rm -r: delete each entry as it is read. Long names so that it takes
+# more than one readdir buffer.
+mkdir("mnt/emptied");
+for my $ii (1..120) {
+    open my $fh, ">", sprintf("mnt/emptied/deleted_while_reading_%03d", $ii) or last;
+    close $fh;
+}
+opendir(my $emptied, "mnt/emptied") or die;
+while (defined(my $name = readdir($emptied))) {
+    unlink("mnt/emptied/$name") unless $name eq "." or $name eq "..";
+}
+closedir($emptied);
+ok(rmdir("mnt/emptied"), "Delete a big directory's entries while reading it");
+
+say "# Tiny files";
+
+mkdir("mnt/tiny");
+for my $ii (1..100) {
+    write_text("tiny/lock$ii", "pid $ii");
+}
+my $tiny_back = 1;
+for my $ii (1..100) {
+    $tiny_back = 0 unless read_text("tiny/lock$ii") eq "pid $ii";
+}
+ok($tiny_back, "Read back files small enough to live in their inodes");
+
+say "# Free space";
+
+my $free_before = `stat -f -c %f mnt`;
+write_text("free.txt", "x" x 65536);
+my $free_after = `stat -f -c %f mnt`;
+ok($free_before - $free_after >= 64, "statfs counts the blocks a new file takes");
+
+say "# Open files";
+
+write_text("open.txt", "still here" x 1000);
+open(my $open_fh, "<", "mnt/open.txt") or die;
+unlink("mnt/open.txt");
+my $open_data = do { local $/; <$open_fh> };
+close($open_fh);
+ok(!-e "mnt/open.txt" && $open_data eq "still here" x 1000,
+   "Read a file after its last name is gone");
+
+say "# Concurrent writers";
+
+my @kids;
+for my $ii (1..8) {
+    my $pid = fork();
+    if ($pid == 0) {
+        mkdir("mnt/par$ii");
+        write_text("par$ii/data.txt", "$ii" x 20000);
+        exit(0);
+    }
+    push @kids, $pid;
+}
+waitpid($_, 0) for @kids;
+my $all_back = 1;
+for my $ii (1..8) {
+    $all_back = 0 unless read_text("par$ii/data.txt") eq "$ii" x 20000;
+}
+ok($all_back, "Files written in parallel read back correctly");
+
+say "# Sparse files";
+
+$free_before = `stat -f -c %f mnt`;
+open(my $sparse_fh, ">", "mnt/sparse.img") or die;
+seek($sparse_fh, 1 << 30, 0);
+print $sparse_fh "end";
+close($sparse_fh);
+$free_after = `stat -f -c %f mnt`;
+ok(-s "mnt/sparse.img" == (1 << 30) + 3 && $free_before - $free_after < 16 &&
+   read_text_slice("sparse.img", 4, 1 << 29) eq "\0" x 4,
+   "Write far past the end, leaving a hole");
+
+system("fallocate -l 1M mnt/prealloc.bin");
+$free_after = `stat -f -c %f mnt`;
+ok(-s "mnt/prealloc.bin" == 1 << 20 && $free_before - $free_after >= 1024,
+   "fallocate reserves blocks");
+
+system("fallocate -p -o 0 -l 1M mnt/prealloc.bin");
+unmount();
+mount();
+$free_after = `stat -f -c %f mnt`;
+ok(-s "mnt/prealloc.bin" == 1 << 20 && $free_before - $free_after < 16 &&
+   read_text_slice("prealloc.bin", 4, 4096) eq "\0" x 4,
+   "Punching a hole gives the blocks back");
+
+say "# Snapshots";
+
+write_text("snap.txt", "before");
+ok(system("./nufs_snap create mnt first >> test.log 2>&1") == 0, "Take a snapshot");
+write_text("snap.txt", "after");
+ok(`./nufs_snap list mnt` =~ /first/, "List snapshots");
+unmount();
+
+$ENV{NUFS_SNAPSHOT} = "first";
+mount();
+ok(read_text("snap.txt") eq "before" && !open(my $ro_fh, ">", "mnt/snap.txt"),
+   "Mount a snapshot read only");
+unmount();
+delete $ENV{NUFS_SNAPSHOT};
+
+mount();
+system("./nufs_snap delete mnt first >> test.log 2>&1");
+ok(read_text("snap.txt") eq "after" && `./nufs_snap list mnt` eq "",
+   "Delete a snapshot, keeping the live files");
+
+say "# Stats";
+
+my $stats = read_text(".nufs/stats");
+ok($stats =~ /^nufs_op_seconds_count\{op="write"\} [1-9]/m &&
+   $stats =~ /^nufs_free_blocks \d+$/m && `ls -a mnt` !~ /\.nufs/,
+   "Read the counters from /.nufs/stats");
+ok(!open(my $stats_fh, ">", "mnt/.nufs/stats") && !mkdir("mnt/.nufs/more"),
+   "The counters can't be changed");
+my @stats_names;
+if(opendir(my $stats_dir, "mnt/.nufs")) {
+    @stats_names = sort(readdir($stats_dir));
+    closedir($stats_dir);
+}
+ok("@stats_names" eq ". .. stats", "List /.nufs");
+
+say "# Kernel caching";
+
+# Reads nufs served from a fresh mount while a file is read twice.
+sub count_reads {
+    my $count = sub {
+        read_text(".nufs/stats") =~ /^nufs_op_seconds_count\{op="read"\} (\d+)/m;
+        return $1 || 0;
+    };
+    unmount();
+    mount();
+    my $before = $count->();
+    read_text("cached.txt");
+    my $first = $count->() - $before;
+    read_text("cached.txt");
+    return ($first, $count->() - $before - $first);
+}
+
+write_text("cached.txt", "c" x (1 << 20));
+my ($first_reads, $second_reads) = count_reads();
+ok($second_reads + 4 < $first_reads,
+   "A file read twice comes from the page cache the second time");
+$ENV{NUFS_PROFILE} = "direct";
+($first_reads, $second_reads) = count_reads();
+ok($second_reads + 4 > $first_reads && $second_reads > 4,
+   "The direct profile reads from nufs every time");
+delete $ENV{NUFS_PROFILE};
+
+say "# Timestamps";
+
+write_text("times.txt", "tick");
+utime(1000000000, 1200000000, "mnt/times.txt");
+my @times = (stat("mnt/times.txt"))[8, 9];
+my $started = time();
+open(my $times_fh, ">>", "mnt/times.txt") or die;
+print $times_fh "tock";
+close($times_fh);
+ok($times[0] == 1000000000 && $times[1] == 1200000000 &&
+   (stat("mnt/times.txt"))[9] >= $started,
+   "Set the times of a file, and a write moves its mtime");
+utime(1000000000, 1200000000, "mnt/times.txt");
+unmount();
+mount();
+read_text("times.txt");
+unmount();
+mount();
+@times = (stat("mnt/times.txt"))[8, 9];
+ok($times[0] >= $started && $times[1] == 1200000000,
+   "A read moves the atime, and unmounting writes it back");
+
+write_text("gone.txt", "soon gone");
+open(my $gone_fh, "<", "mnt/gone.txt") or die;
+unlink("mnt/gone.txt");
+my $gone = <$gone_fh>;
+close($gone_fh);
+unmount();
+mount();
+ok($gone eq "soon gone" && read_text("times.txt") eq "ticktock",
+   "Unmount right after reading an unlinked file");
+
+unmount();
+
+system("rm -f data.nufs");
+system("(./mkfs.nufs -z data.nufs 4M 2>&1) >> test.log");
+
+mount();
+
+say "# Compression";
+
+$free_before = `stat -f -c %f mnt`;
+$content = "1_2_3_4_5_6_7_8_" x 65536; # 1M
+write_text("packed.txt", $content);
+$free_after = `stat -f -c %f mnt`;
+ok($free_before - $free_after < 64 && -s "mnt/packed.txt" == (1 << 20) + 1,
+   "A file that compresses well takes few blocks");
+open(my $packed_fh, "+<", "mnt/packed.txt") or die;
+seek($packed_fh, 100000, 0);
+print $packed_fh "changed";
+close($packed_fh);
+unmount();
+mount();
+substr($content, 100000, 7) = "changed";
+ok(read_text("packed.txt") eq $content &&
+   read_text_slice("packed.txt", 9, 99998) eq "8_changed",
+   "Change part of a compressed file and read it back");
 
+unmount();
+
+system("rm -f data.nufs");
+system("(./mkfs.nufs -d data.nufs 4M 2>&1) >> test.log");
+
+mount();
+
+say "# Deduplication";
+
+$free_before = `stat -f -c %f mnt`;
+$content = join("", map { sprintf("%08d", $_) } 0 .. 131071); # 1M, no block repeats
+write_text("one.txt", $content);
+write_text("two.txt", $content);
+$free_after = `stat -f -c %f mnt`;
+ok($free_before - $free_after < 300 && read_text("two.txt") eq $content,
+   "Two files with the same contents share their blocks");
+open(my $dedup_fh, "+<", "mnt/two.txt") or die;
+seek($dedup_fh, 100000, 0);
+print $dedup_fh "changed";
+close($dedup_fh);
+unmount();
+mount();
+my $changed = $content;
+substr($changed, 100000, 7) = "changed";
+ok(read_text("one.txt") eq $content && read_text("two.txt") eq $changed,
+   "Change one of two deduplicated files, leaving the other");
+
+unmount();
+
+system("rm -f data.nufs");
+system("(./mkfs.nufs -d data.nufs 64M 2>&1) >> test.log");
+
+mount();
+
+$content = "0123456789abcdef" x 256 x 4096; # 16M of one 4K block over and over
+write_text("same.txt", $content);
+unmount();
+mount();
+ok(-s "mnt/same.txt" == (16 << 20) + 1 && read_text("same.txt") eq $content,
+   "Write a long run of identical blocks on a deduplicating image");
+
+unmount();
@@ -0,0 +1,201 @@
+/**
+ * @file trace.c
+ *
+ * Per-thread event rings. A thread's first event allocates its ring and
+ * pushes it onto a global list with a compare and swap. After that only the
+ * owning thread writes to the ring, so recording is a plain store plus a
+ * release store of the head.
+ *
+ * Rings are never freed, trace_dump walks the list without a lock. When a
+ * thread exits, a thread key's destructor gives its ring up, and the next
+ * new thread takes it over (keeping the events already in it) instead of
+ * allocating another. FUSE starts and stops worker threads as the load
+ * changes, so this keeps the list as long as the most threads ever
+ * tracing at once.
+ */
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "helpers/trace.h"
+
+typedef struct trace_ring {
+  struct trace_ring *next;
+  atomic_int owned; // whether a live thread records into it
+  int thread;
+  _Atomic uint64_t head; // events ever recorded, the next goes at head % size
+  trace_event_t events[TRACE_RING_SIZE];
+} trace_ring_t;
+
+static const char *op_names[TRACE_OP_COUNT] = {
+    [TRACE_ACCESS] = "access",
+    [TRACE_GETATTR] = "getattr",
+    [TRACE_READDIR] = "readdir",
+    [TRACE_MKNOD] = "mknod",
+    [TRACE_MKDIR] = "mkdir",
+    [TRACE_UNLINK] = "unlink",
+    [TRACE_LINK] = "link",
+    [TRACE_RMDIR] = "rmdir",
+    [TRACE_RENAME] = "rename",
+    [TRACE_CHMOD] = "chmod",
+    [TRACE_TRUNCATE] = "truncate",
+    [TRACE_OPEN] = "open",
+    [TRACE_READ] = "read",
+    [TRACE_WRITE] = "write",
+    [TRACE_UTIMENS] = "utimens",
+    [TRACE_IOCTL] = "ioctl",
+    [TRACE_STATFS] = "statfs",
+    [TRACE_CREATE] = "create",
+    [TRACE_RELEASE] = "release",
+    [TRACE_OPENDIR] = "opendir",
+    [TRACE_RELEASEDIR] = "releasedir",
+    [TRACE_LL_LOOKUP] = "lookup",
+    [TRACE_FORGET] = "forget",
+    [TRACE_SETATTR] = "setattr",
+    [TRACE_FSYNC] = "fsync",
+    [TRACE_FSYNCDIR] = "fsyncdir",
+    [TRACE_FLUSH] = "flush",
+    [TRACE_FALLOCATE] = "fallocate",
+    [TRACE_LOOKUP] = "+lookup",
+    [TRACE_DIR_PUT] = "+dir_put",
+    [TRACE_DIR_DELETE] = "+dir_delete",
+    [TRACE_ALLOC_INODE] = "+alloc_inode",
+    [TRACE_FREE_INODE] = "+free_inode",
+    [TRACE_RESIZE] = "+resize",
+    [TRACE_ALLOC_BLOCK] = "+alloc_block",
+    [TRACE_FREE_BLOCK] = "+free_block",
+    [TRACE_GROW_IMAGE] = "+grow_image",
+};
+
+__thread int trace_inum = -1;
+
+static _Atomic(trace_ring_t *) rings;
+static atomic_int thread_count;
+static __thread trace_ring_t *ring;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+// Give up an exiting thread's ring for the next new thread.
+static void ring_release(void *old) {
+  ring = NULL;
+  atomic_store(&((trace_ring_t *) old)->owned, 0);
+}
+
+static void make_ring_key() { pthread_key_create(&ring_key, ring_release); }
+
+// Take over a ring an exited thread gave up, or NULL if none is free.
+static trace_ring_t *ring_reuse() {
+  for (trace_ring_t *r = atomic_load(&rings); r != NULL; r = r->next) {
+    int unowned = 0;
+    if (atomic_compare_exchange_strong(&r->owned, &unowned, 1)) {
+      return r;
+    }
+  }
+  return NULL;
+}
+
+// Set up the calling thread's ring, or return NULL if there's no memory.
+static trace_ring_t *ring_create() {
+  pthread_once(&ring_key_once, make_ring_key);
+  trace_ring_t *new_ring = ring_reuse();
+  if (new_ring == NULL) {
+    new_ring = calloc(1, sizeof(trace_ring_t));
+    if (new_ring == NULL) {
+      return NULL;
+    }
+    new_ring->owned = 1;
+    trace_ring_t *head = atomic_load(&rings);
+    do {
+      new_ring->next = head;
+    } while (!atomic_compare_exchange_weak(&rings, &head, new_ring));
+  }
+  // Events already in a reused ring keep the thread number they had.
+  new_ring->thread = atomic_fetch_add(&thread_count, 1);
+  pthread_setspecific(ring_key, new_ring);
+  return new_ring;
+}
+
+void trace_record(int op, int inum, int64_t offset, int64_t size,
+                  int64_t result) {
+  if (ring == NULL && (ring = ring_create()) == NULL) {
+    return;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  trace_event_t *event = &ring->events[head % TRACE_RING_SIZE];
+  event->time = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+  event->op = op;
+  event->thread = ring->thread;
+  event->inum = inum;
+  event->offset = offset;
+  event->size = size;
+  event->result = result;
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// Write all of buf, retrying short writes.
+static int write_all(int fd, const void *buf, size_t size) {
+  const char *next = buf;
+  while (size > 0) {
+    ssize_t written = write(fd, next, size);
+    if (written <= 0) {
+      return -1;
+    }
+    next += written;
+    size -= written;
+  }
+  return 0;
+}
+
+int trace_dump(const char *path) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    return -1;
+  }
+
+  // Threads that start tracing from here on are pushed in front of the
+  // rings we see now, so this list and its length stay fixed. Snapshot the
+  // heads first so the header count matches what follows.
+  trace_ring_t *all = atomic_load(&rings);
+  int rings_seen = 0;
+  for (trace_ring_t *r = all; r != NULL; r = r->next) {
+    ++rings_seen;
+  }
+  trace_header_t header = {TRACE_MAGIC, TRACE_VERSION, sizeof(trace_event_t),
+                           0};
+  uint64_t heads[rings_seen + 1];
+  int n = 0;
+  for (trace_ring_t *r = all; r != NULL; r = r->next, ++n) {
+    heads[n] = atomic_load_explicit(&r->head, memory_order_acquire);
+    header.count += heads[n] < TRACE_RING_SIZE ? heads[n] : TRACE_RING_SIZE;
+  }
+
+  int rv = write_all(fd, &header, sizeof(header));
+  n = 0;
+  for (trace_ring_t *r = all; r != NULL && rv == 0;
+       r = r->next, ++n) {
+    uint64_t first = heads[n] < TRACE_RING_SIZE ? 0 : heads[n] - TRACE_RING_SIZE;
+    // The ring wraps, so write it as (up to) two runs.
+    size_t start = first % TRACE_RING_SIZE;
+    size_t count = heads[n] - first;
+    size_t run = count < TRACE_RING_SIZE - start ? count : TRACE_RING_SIZE - start;
+    rv = write_all(fd, &r->events[start], run * sizeof(trace_event_t));
+    if (rv == 0 && count > run) {
+      rv = write_all(fd, r->events, (count - run) * sizeof(trace_event_t));
+    }
+  }
+  close(fd);
+  return rv;
+}
+
+const char *trace_op_name(int op) {
+  if (op < 0 || op >= TRACE_OP_COUNT || op_names[op] == NULL) {
+    return "?";
+  }
+  return op_names[op];
+}
@@ -1,58 +1,97 @@
 #include "helpers/utilities.h"
-#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 
 /**
- * Appends two paths in a new path.
- * Returned value needs to be freed.
+ * Starts iterating over the components of the given path. The path isn't
+ * copied, so it needs to outlive the iterator.
  * 
- * @param path1 the front of the path to append
- * @param path2 the back of the path to append
+ * @param iter the iterator to set up
+ * @param path the path to walk, leading /s are skipped
+ */
+void path_iter_init(path_iter_t* iter, const char* path) {
+  iter->rest = path;
+  iter->length = 0;
+  iter->name[0] = 0;
+}
+
+/**
+ * Moves the iterator on to the next component of the path. Empty
+ * components (from doubled or trailing /s) are skipped. Components too
+ * long for name are cut short, but length still says how long they were.
+ * 
+ * @param iter the iterator to advance
  * 
- * @returns a new path that is the combined path of both, must be freed.
+ * @returns 1 if name holds the next component, 0 at the end of the path.
  */
-char* append(const char* path1, const char* path2){
-  assert(strlen(path1) > 0);
-  assert(strlen(path2) > 0);
-  // Extra space added for /
-  char* new = malloc(strlen(path1) + strlen(path2) + 2);
-  for(int i = 0; *(path1 + i) != 0; ++i) {
-    new[i] = *(path1 + i);
+int path_iter_next(path_iter_t* iter) {
+  const char* start = iter->rest;
+  while(*start == '/') {
+    ++start;
   }
-  int offset = strlen(path1);
-  // Add the slash to the path if needed
-  if(new[offset - 1] != '/') {
-    new[offset] = '/';
-    ++offset;
+  if(*start == 0) {
+    iter->rest = start;
+    return 0;
   }
-  for(int i = 0; *(path2 + i) != 0; ++i) {
-    new[offset + i] = *(path2 + i);
+  const char* end = start;
+  while(*end != 0 && *end != '/') {
+    ++end;
   }
-  new[offset + strlen(path2)] = 0;
-  return new; 
+  iter->length = end - start;
+  int copy = iter->length > PATH_NAME_MAX ? PATH_NAME_MAX : iter->length;
+  memcpy(iter->name, start, copy);
+  iter->name[copy] = 0;
+  iter->rest = end;
+  return 1;
+}
+
+/**
+ * Gets the name of the file the path describes.
+ * 
+ * @param path the path to get the child from
+ * 
+ * @returns everything after the last "/", pointing into path.
+ */
+const char* path_child(const char* path) {
+  const char* slash = strrchr(path, '/');
+  assert(slash != NULL);
+  return slash + 1;
 }
 
 /**
  * Gets the path to the parent of the described path.
- * Returned path needs to be freed.
  * 
  * @param path the path to get the parent from
- * 
- * @returns a new path representing the parent to the original path.
- *          This has been malloc'd and needs to be freed.
+ * @param parent where to write the parent, needs strlen(path) + 1 bytes.
+ *               The root is its own parent, "/".
 */
-char* get_parent(const char* path) {
-    int child_length = 0;
-    // Loop backwards until first "/" is found.
-    for(int i = strlen(path) - 1; *(path + i) != '/'; --i) {
-        ++child_length;
-    }
+void path_parent(const char* path, char* parent) {
+  size_t length = path_child(path) - path;
+  // Drop the "/" before the child, unless it is the root
+  if(length > 1) {
+    --length;
+  }
+  memcpy(parent, path, length);
+  parent[length] = 0;
+}
 
-    // Copy path over to new locations
-    char* parent = malloc(strlen(path) + 1);
-    strcpy(parent, path);
-    // Replace the last "/" before the child with a terminator.
-    *(parent + strlen(path) - child_length) = 0;
-    return parent;
+/**
+ * Appends a name to a directory path.
+ * 
+ * @param out where to write the combined path, needs
+ *            strlen(dir) + strlen(name) + 2 bytes.
+ * @param dir the front of the path to append
+ * @param name the back of the path to append
+ */
+void path_join(char* out, const char* dir, const char* name) {
+  assert(strlen(dir) > 0);
+  assert(strlen(name) > 0);
+  size_t offset = strlen(dir);
+  memcpy(out, dir, offset);
+  // Add the slash to the path if needed
+  if(out[offset - 1] != '/') {
+    out[offset] = '/';
+    ++offset;
+  }
+  strcpy(out + offset, name);
 }